@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+
+#include "BALFormat.h"
+#include "BundleAdjuster.h"
+#include "ConfigLoader.h"
+#include "Optimizer.h"
+
+using std::cout;
+using std::endl;
+
+void ShowUsage();
+
+namespace {
+  // Cost of every engine is evaluated by the same kernel, so the numbers are comparable.
+  double EvaluateCost(const TS_SfM::BAProblem& problem, const TS_SfM::Optimizer::OptimizerConfig& config) {
+    TS_SfM::BundleAdjuster::BAConfig ba_config = TS_SfM::BundleAdjuster::DefaultConfig();
+    ba_config.huber_delta = config.huber_delta;
+    const TS_SfM::BundleAdjuster bundle_adjuster(ba_config);
+    double rms_error;
+    return bundle_adjuster.EvaluateCost(problem, rms_error);
+  }
+
+  // peak resident set size in MB
+  double PeakMemory() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if(argc >= 4 && std::string(argv[1]) == "--convert") {
+    const bool b_binary = argc == 5 && std::string(argv[4]) == "--binary";
+    TS_SfM::BAProblem problem;
+    if(!TS_SfM::BALFormat::Import(argv[2], problem) || !TS_SfM::BALFormat::Export(problem, argv[3], b_binary)) {
+      return -1;
+    }
+    return 0;
+  }
+  if(argc < 3 || argc > 4) {
+    ShowUsage();
+    return -1;
+  }
+
+  const std::string str_problem_file = argv[1];
+  TS_SfM::Optimizer::OptimizerConfig config = TS_SfM::ConfigLoader::LoadOptimizerConfig(argv[2]);
+  if(argc == 4) {
+    const std::string str_engine = argv[3];
+    if(str_engine == "g2o")
+      config.engine = TS_SfM::Optimizer::G2O;
+    else if(str_engine == "native")
+      config.engine = TS_SfM::Optimizer::Native;
+    else if(str_engine == "submap")
+      config.engine = TS_SfM::Optimizer::Submap;
+    else {
+      ShowUsage();
+      return -1;
+    }
+  }
+
+  TS_SfM::BAProblem problem;
+  if(!TS_SfM::BALFormat::Import(str_problem_file, problem)) {
+    return -1;
+  }
+  cout << "[LOG] " << str_problem_file << " : " << problem.v_cameras.size() << " cameras, "
+       << problem.v_points.size() << " points, " << problem.v_observations.size() << " observations" << endl;
+
+  const double initial_cost = EvaluateCost(problem, config);
+  const double loaded_memory = PeakMemory();
+
+  const auto start = std::chrono::steady_clock::now();
+  const TS_SfM::BAResult result = config.engine == TS_SfM::Optimizer::G2O
+                                  ? TS_SfM::BundleAdjustmentG2O(problem, config)
+                                  : TS_SfM::BundleAdjustmentNative(problem, config);
+  const double elapsed_ms
+    = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  const double final_cost = EvaluateCost(problem, config);
+  cout << "[LOG] engine        : " << (config.engine == TS_SfM::Optimizer::G2O ? "g2o" :
+                                       config.engine == TS_SfM::Optimizer::Native ? "native" : "submap") << endl;
+  cout << "[LOG] iterations    : " << result.num_iterations << endl;
+  cout << "[LOG] total time    : " << elapsed_ms << " ms" << endl;
+  cout << "[LOG] time/iteration: " << elapsed_ms / std::max(result.num_iterations, 1) << " ms" << endl;
+  cout << "[LOG] peak memory   : " << PeakMemory() << " MB (" << loaded_memory << " MB after loading)" << endl;
+  cout << "[LOG] cost          : " << initial_cost << " -> " << final_cost << endl;
+  cout << "[LOG] RMS error     : " << result.initial_rms_error << " -> " << result.final_rms_error << " pixel" << endl;
+
+  return 0;
+}
+
+
+void ShowUsage() {
+  cout << "Usage : ba_bench [/path/to/problem.bal] [/path/to/config_params.yaml] [g2o|native|submap]" << endl
+       << "        ba_bench --convert [/path/to/input.bal] [/path/to/output.bal] [--binary]" << endl;
+  return;
+}
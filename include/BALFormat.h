@@ -0,0 +1,22 @@
+#pragma once
+
+#include "BundleAdjuster.h"
+
+#include <string>
+
+namespace TS_SfM {
+
+  // Bundle Adjustment in the Large (BAL) files of BAProblem.
+  // BAL cameras look down -z with y up, observations are relative to the principal point and
+  // a camera has one focal length and two radial distortion coefficients:
+  //   R_bal = diag(1,-1,-1) R, t_bal = diag(1,-1,-1) t, (u_bal, v_bal) = (u - cx, (cy - v) fx / fy).
+  // Fixed cameras and points are listed after the points, where BAL readers stop reading.
+  // Binary files have the same content as raw arrays after a versioned header.
+  namespace BALFormat {
+    bool Export(const BAProblem& problem, const std::string& str_file, const bool b_binary = false);
+    // Text or binary is detected from the header. Intrinsics become fx = fy = f and cx = cy = 0,
+    // and radial distortion is removed from the observations with the initial camera parameters.
+    bool Import(const std::string& str_file, BAProblem& problem);
+  }
+
+} // namespace
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+
+namespace TS_SfM {
+
+  // Pinhole reprojection problem.
+  // Camera pose is cTw = [R|t] and the update is R <- exp(w)R, t <- exp(w)t + v.
+  struct BAProblem {
+    struct CameraParam {
+      Eigen::Matrix3d R;
+      Eigen::Vector3d t;
+      double fx, fy, cx, cy;
+      bool fixed;
+    };
+
+    struct Observation {
+      int camera_idx;
+      int point_idx;
+      Eigen::Vector2d uv; // undistorted pixel
+    };
+
+    std::vector<CameraParam, Eigen::aligned_allocator<CameraParam>> v_cameras;
+    std::vector<Eigen::Vector3d> v_points;
+    std::vector<char> vb_fixed_points;
+    std::vector<Observation, Eigen::aligned_allocator<Observation>> v_observations;
+
+    int AddCamera(const Eigen::Matrix3d& R, const Eigen::Vector3d& t,
+                  const double fx, const double fy, const double cx, const double cy,
+                  const bool fixed = false);
+    int AddPoint(const Eigen::Vector3d& pt, const bool fixed = false);
+    void AddObservation(const int camera_idx, const int point_idx, const Eigen::Vector2d& uv);
+  };
+
+  // Levenberg-Marquardt with Schur complement on the point blocks.
+  // Observations and intrinsics are packed once into contiguous buffers and evaluated in blocks
+  // by vectorized loops. Residuals and Jacobians are stored in float (pre-weighted by the robust
+  // kernel) and the normal equations are accumulated in double. The reduced camera system is
+  // solved by dense or sparse Cholesky or block Jacobi PCG.
+  class BundleAdjuster {
+    public:
+      enum LinearSolverType {
+        DenseCholesky = 0,
+        SparseCholesky = 1,
+        PCG = 2
+      };
+
+      struct BAConfig {
+        LinearSolverType linear_solver;
+        int max_iteration;
+        double huber_delta; // pixel, <= 0 disables robust kernel
+        double function_tolerance; // relative cost decrease
+        double parameter_tolerance; // relative step size
+        double initial_lambda;
+        int max_cg_iteration;
+        double cg_tolerance;
+        int num_threads; // 0 uses all cores
+        bool verbose;
+      };
+
+      struct BASummary {
+        double initial_cost;
+        double final_cost;
+        double initial_rms_error; // pixel
+        double final_rms_error; // pixel
+        int num_iterations;
+        int num_successful_steps;
+        std::vector<double> v_iteration_time_ms;
+      };
+
+      BundleAdjuster(const BAConfig& config);
+      ~BundleAdjuster(){};
+
+      BASummary Solve(BAProblem& problem);
+      // Cost of the problem as it is, the problem is not modified.
+      double EvaluateCost(const BAProblem& problem, double& rms_error) const;
+
+      static BAConfig DefaultConfig();
+
+    private:
+      // One kernel is shared by every observation. rho(s) and its derivative for a squared error s.
+      struct RobustKernel {
+        double delta; // pixel, <= 0 is squared loss
+        void Evaluate(const double sq_error, double& rho, double& weight) const {
+          if(delta > 0.0 && sq_error > delta*delta) {
+            const double error = std::sqrt(sq_error);
+            rho = 2.0*delta*error - delta*delta;
+            weight = delta/error;
+          }
+          else {
+            rho = sq_error;
+            weight = 1.0;
+          }
+        }
+      };
+
+      typedef Eigen::Matrix<double,6,6> Mat66;
+      typedef Eigen::Matrix<double,6,3> Mat63;
+      typedef Eigen::Matrix<double,2,6> Mat26;
+      typedef Eigen::Matrix<double,2,3> Mat23;
+      typedef Eigen::Matrix<double,6,1> Vec6;
+      typedef Eigen::Matrix<float,2,6> Mat26f;
+      typedef Eigen::Matrix<float,2,3> Mat23f;
+      typedef Eigen::Matrix<float,6,3> Mat63f;
+
+      struct State {
+        std::vector<Eigen::Matrix3d> v_R;
+        std::vector<Eigen::Vector3d> v_t;
+        std::vector<Eigen::Vector3d> v_points;
+      };
+
+      void BuildStructure(const BAProblem& problem);
+      // Returns cost of the state. Residuals, Jacobians and weights are stored if b_linearize.
+      double Evaluate(const BAProblem& problem, const State& state, const bool b_linearize);
+      void BuildNormalEquations(const BAProblem& problem);
+      // Damped reduced camera system is solved, point steps are recovered by back substitution.
+      bool ComputeStep(const double lambda, Eigen::VectorXd& dx_cameras);
+      // Decrease of the linearized cost by the step
+      double PredictedDecrease(const Eigen::VectorXd& dx_cameras, const double lambda) const;
+      void ApplyUpdate(const BAProblem& problem, const Eigen::VectorXd& dx_cameras,
+                       const State& state, State& updated) const;
+
+      bool SolveDense(const Eigen::VectorXd& b, Eigen::VectorXd& x);
+      bool SolveSparse(const Eigen::VectorXd& b, Eigen::VectorXd& x);
+      bool SolvePCG(const Eigen::VectorXd& b, Eigen::VectorXd& x);
+      void MultiplyReduced(const Eigen::VectorXd& x, Eigen::VectorXd& y) const;
+
+      const BAConfig m_config;
+      const RobustKernel m_robust_kernel;
+      double m_last_sq_error;
+
+      // free camera / point index, -1 if fixed
+      std::vector<int> m_v_camera_to_free;
+      std::vector<int> m_v_point_to_free;
+      int m_num_free_cameras;
+      int m_num_free_points;
+
+      // observations grouped by point and by camera (CSR)
+      std::vector<int> m_v_point_obs_ptr, m_v_point_obs;
+      std::vector<int> m_v_camera_obs_ptr, m_v_camera_obs;
+      std::vector<int> m_v_obs_points, m_v_obs_free_cameras;
+
+      // observations and intrinsics (SoA)
+      std::vector<int> m_v_obs_cameras;
+      std::vector<float> m_v_obs_u, m_v_obs_v;
+      std::vector<double> m_v_fx, m_v_fy, m_v_cx, m_v_cy;
+
+      // block sparse reduced camera matrix (CSR over 6x6 blocks, full symmetric)
+      std::vector<int> m_v_row_ptr, m_v_col_idx;
+      std::vector<Mat66, Eigen::aligned_allocator<Mat66>> m_v_reduced_blocks;
+      Eigen::VectorXd m_reduced_rhs;
+      Eigen::MatrixXd m_dense_reduced;
+      Eigen::SparseMatrix<double> m_sparse_reduced;
+      Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> m_sparse_solver;
+      bool m_b_pattern_analyzed;
+
+      // per observation, residuals and Jacobians are scaled by sqrt of the robust weight
+      std::vector<Eigen::Vector2f, Eigen::aligned_allocator<Eigen::Vector2f>> m_v_residuals;
+      std::vector<Mat26f, Eigen::aligned_allocator<Mat26f>> m_v_jac_cameras;
+      std::vector<Mat23f, Eigen::aligned_allocator<Mat23f>> m_v_jac_points;
+      std::vector<Mat63f, Eigen::aligned_allocator<Mat63f>> m_v_W;
+      // cost and squared error per chunk of observations, summed in fixed order
+      std::vector<double> m_v_chunk_costs;
+      std::vector<double> m_v_chunk_sq_errors;
+
+      // normal equations
+      std::vector<Mat66, Eigen::aligned_allocator<Mat66>> m_v_U;
+      std::vector<Vec6, Eigen::aligned_allocator<Vec6>> m_v_g_cameras;
+      std::vector<Eigen::Matrix3d> m_v_V;
+      std::vector<Eigen::Vector3d> m_v_g_points;
+      std::vector<Eigen::Matrix3d> m_v_V_inv;
+      std::vector<Mat66, Eigen::aligned_allocator<Mat66>> m_v_precond;
+      std::vector<Eigen::Vector3d> m_v_dx_points;
+  };
+
+  // Hierarchical BA for large problems.
+  // Cameras are partitioned into overlapping submaps by covisibility, submaps are solved in parallel
+  // and aligned back to the global frame by Sim3, then the overlapping (separator) cameras and their
+  // points are refined in a reduced global problem with the other cameras fixed.
+  class SubmapBundleAdjuster {
+    public:
+      struct SubmapConfig {
+        int submap_size; // cameras owned by a submap
+        int overlap; // cameras borrowed from neighbor submaps
+        BundleAdjuster::BAConfig ba_config;
+      };
+
+      SubmapBundleAdjuster(const SubmapConfig& config) : m_config(config) {};
+      ~SubmapBundleAdjuster(){};
+
+      BundleAdjuster::BASummary Solve(BAProblem& problem);
+
+      // Returns camera indices of each submap. v_owner is the submap owning each camera.
+      static std::vector<std::vector<int>> PartitionCameras(const BAProblem& problem, const int submap_size,
+                                                            const int overlap, std::vector<int>& v_owner);
+
+    private:
+      const SubmapConfig m_config;
+  };
+
+} // namespace
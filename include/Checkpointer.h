@@ -0,0 +1,83 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "KeyFrame.h"
+#include "MapPoint.h"
+
+namespace TS_SfM {
+  struct Camera;
+
+  // Periodic checkpoints of a running reconstruction, written on a background thread.
+  // The pipeline hands over a copy of its state and continues. Only the latest state waits
+  // for the writer, so a slow disk skips checkpoints instead of stalling the pipeline.
+  // A checkpoint is complete once state.yml refers to it, files of older checkpoints are
+  // removed afterwards, so a crash at any point leaves the previous checkpoint usable.
+  class Checkpointer {
+    public:
+      struct CheckpointConfig {
+        std::string directory; // checkpoints are disabled if empty
+        int interval; // registered frames between checkpoints
+      };
+
+      // Features and matches don't change once computed, they are written with the first
+      // checkpoint which refers to them and shared by the following ones.
+      struct Caches {
+        std::vector<std::vector<cv::KeyPoint>> vv_kpts; // original (distorted) keypoints of each frame
+        std::vector<cv::Mat> v_descriptors;
+        std::vector<std::vector<std::vector<cv::DMatch>>> vvv_matches; // [i][j], queryIdx in frame i
+      };
+
+      struct State {
+        // last processed step of the incremental registration
+        int cursor_distance; // from the center frame
+        int cursor_direction; // index of {forward, backward}
+        std::vector<KeyFrame> v_keyframes; // indexed by frame id
+        std::vector<MapPoint> v_mappoints; // indexed by m_id
+        std::shared_ptr<const Caches> p_caches;
+      };
+
+      Checkpointer(const CheckpointConfig& config, const Camera& cam);
+      // The pending state is written before the writer stops.
+      ~Checkpointer();
+
+      bool IsEnabled() const { return !m_config.directory.empty() && m_config.interval > 0; }
+      bool IsDue(const int num_registered_frames) const {
+        return IsEnabled() && num_registered_frames > 0 && num_registered_frames % m_config.interval == 0;
+      }
+
+      // Returns immediately, a pending state which isn't written yet is replaced.
+      void Submit(std::unique_ptr<State> p_state);
+      // Waits until the pending state is written.
+      void Flush();
+
+      // Reads the last complete checkpoint in the directory.
+      static bool Load(const std::string& directory, State& state);
+
+    private:
+      void WriterLoop();
+      bool Write(const State& state);
+
+      const CheckpointConfig m_config;
+      const std::unique_ptr<const Camera> m_p_camera;
+
+      std::mutex m_mtx;
+      std::condition_variable m_cv;
+      std::unique_ptr<State> m_p_pending;
+      bool m_b_writing;
+      bool m_b_stop;
+      std::thread m_writer_thread;
+
+      // writer thread only
+      int m_sequence;
+      std::shared_ptr<const Caches> m_p_written_caches;
+      std::string m_str_features_file, m_str_matches_file, m_str_map_file;
+  };
+
+} // namespace
@@ -10,11 +10,16 @@
 #include "LoopClosure.h"
 #include "KPExtractor.h"
 #include "Matcher.h"
+#include "Solver.h"
+#include "Optimizer.h"
+#include "Checkpointer.h"
 
 namespace TS_SfM {
 
   struct SystemConfig {
     std::string str_path_to_images; 
+    std::string str_map_file; // the map is saved here if not empty
+    bool b_pack_keyframes; // unmatched keypoints are dropped from keyframes once the map is built
   };
 
   struct Camera {
@@ -39,5 +44,8 @@ namespace TS_SfM {
     KPExtractor::ExtractorConfig LoadExtractorConfig(const std::string str_config_file);
     Matcher::MatcherConfig LoadMatcherConfig(const std::string str_config_file);
     void LoadInitializerConfig(int& num_frames, int& connect_distance, const std::string str_config_file);
+    Solver::TriangulatorConfig LoadTriangulatorConfig(const std::string str_config_file);
+    Optimizer::OptimizerConfig LoadOptimizerConfig(const std::string str_config_file);
+    Checkpointer::CheckpointConfig LoadCheckpointConfig(const std::string str_config_file);
   }
 }
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+namespace TS_SfM {
+
+  // Keyframes are connected by the number of mappoints they both observe.
+  // Weights are updated per observation, so the cost of an update depends only on the
+  // number of keyframes observing the point, not on the size of the map.
+  class CovisibilityGraph {
+    public:
+      struct Edge {
+        int kf_id_0;
+        int kf_id_1; // kf_id_0 < kf_id_1
+        int weight;
+      };
+
+      CovisibilityGraph(){};
+      ~CovisibilityGraph(){};
+
+      // v_observing_kf_ids are the other keyframes which observe the same mappoint.
+      void AddObservation(const std::vector<int>& v_observing_kf_ids, const int kf_id);
+      void RemoveObservation(const std::vector<int>& v_observing_kf_ids, const int kf_id);
+      // all pairs of keyframes observing a mappoint
+      void AddMapPoint(const std::vector<int>& v_kf_ids);
+      void RemoveMapPoint(const std::vector<int>& v_kf_ids);
+      // Adds the weight of the edge, for restoring a graph from GetEdges().
+      void AddEdge(const Edge& edge) { UpdateEdge(edge.kf_id_0, edge.kf_id_1, edge.weight); }
+      void Clear() { m_v_adjacency.clear(); }
+
+      int GetWeight(const int kf_id_0, const int kf_id_1) const;
+      // At most num_keyframes neighbors in descending order of weight.
+      std::vector<int> GetBestCovisibleKeyFrames(const int kf_id, const int num_keyframes) const;
+      std::vector<int> GetCovisibleKeyFrames(const int kf_id, const int min_weight = 1) const;
+      std::vector<Edge> GetEdges(const int min_weight = 1) const;
+
+      // Maximum spanning tree (forest) grown from the smallest keyframe id of each component.
+      // Returns the parent of each keyframe id, -1 for roots and keyframes without edges.
+      std::vector<int> ComputeSpanningTree() const;
+
+    private:
+      void UpdateEdge(const int kf_id_0, const int kf_id_1, const int delta);
+
+      // keyframe id -> (neighbor keyframe id -> shared mappoints)
+      std::vector<std::unordered_map<int, int>> m_v_adjacency;
+  };
+
+} // namespace
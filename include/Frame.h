@@ -6,6 +6,7 @@
 
 namespace TS_SfM {
   class KPExtractor;
+  class Undistorter;
 
   class Frame{
     struct Match {
@@ -27,6 +28,8 @@ namespace TS_SfM {
 
       cv::Mat GetDescriptors() const; 
       std::vector<cv::KeyPoint> GetKeyPoints() const;
+      std::vector<cv::KeyPoint> GetUndistortedKeyPoints() const;
+      std::vector<cv::Point2f> GetNormalizedPoints() const;
       cv::Mat GetImage() const;
       cv::Mat GetPose() const;
       std::vector<std::vector<std::vector<cv::KeyPoint>>> GetGridKeyPoints() const;
@@ -36,6 +39,10 @@ namespace TS_SfM {
       unsigned int GetAssignedKeyPointsNum() const;
 
       std::unique_ptr<KPExtractor> Initialize(std::unique_ptr<KPExtractor> p_extractor, bool& isOK);
+      // Instead of Initialize, with keypoints and descriptors extracted before (e.g. a checkpoint).
+      // Grid structures are not restored.
+      void RestoreFeatures(const std::vector<cv::KeyPoint>& v_kpts, const cv::Mat& descriptors);
+      void UndistortKeyPoints(const Undistorter& undistorter);
 
       void SetPose (const cv::Mat& _cTw) {
         m_m_cTw = _cTw.clone();
@@ -72,6 +79,10 @@ namespace TS_SfM {
       std::vector<cv::KeyPoint> m_v_kpts;
       cv::Mat m_m_descriptors;
 
+      // undistorted data aligned with m_v_kpts
+      std::vector<cv::KeyPoint> m_v_undist_kpts;
+      std::vector<cv::Point2f> m_v_normalized_pts;
+
       // data assigned to grids
       std::vector<std::vector<std::vector<cv::KeyPoint>>> m_vvv_grid_kpts;
       std::vector<std::vector<cv::Mat>> m_vvm_grid_descs;
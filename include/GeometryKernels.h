@@ -0,0 +1,136 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <cmath>
+#include <limits>
+
+namespace TS_SfM {
+namespace Solver {
+  // Geometric kernels templated over the scalar type with fixed sizes.
+  // float is used in RANSAC inner loops and double in final refinement.
+  template<typename T> using Mat33 = Eigen::Matrix<T,3,3>;
+  template<typename T> using Mat34 = Eigen::Matrix<T,3,4>;
+  template<typename T> using Mat44 = Eigen::Matrix<T,4,4>;
+  template<typename T> using Vec2 = Eigen::Matrix<T,2,1>;
+  template<typename T> using Vec3 = Eigen::Matrix<T,3,1>;
+  template<typename T> using Vec4 = Eigen::Matrix<T,4,1>;
+
+  // F from 8 pixel correspondences, x1^T * F * x0 = 0 and rank 2 is enforced.
+  template<typename T>
+  inline Mat33<T> EightPoint(const Vec2<T> x0[8], const Vec2<T> x1[8]) {
+    Eigen::Matrix<T,8,9> A;
+    for(int i = 0; i < 8; ++i) {
+      A.row(i) << x1[i].x()*x0[i].x(), x1[i].x()*x0[i].y(), x1[i].x(),
+                  x1[i].y()*x0[i].x(), x1[i].y()*x0[i].y(), x1[i].y(),
+                  x0[i].x(), x0[i].y(), T(1);
+    }
+
+    Eigen::JacobiSVD<Eigen::Matrix<T,8,9>, Eigen::ColPivHouseholderQRPreconditioner> svd_1st(A, Eigen::ComputeFullV);
+    const Eigen::Matrix<T,9,1> f = svd_1st.matrixV().col(8);
+    Mat33<T> m;
+    m << f(0), f(1), f(2),
+         f(3), f(4), f(5),
+         f(6), f(7), f(8);
+
+    Eigen::JacobiSVD<Mat33<T>, Eigen::ColPivHouseholderQRPreconditioner> svd_2nd(m, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Vec3<T> diag = svd_2nd.singularValues();
+    diag(2) = T(0);
+    return svd_2nd.matrixU() * diag.asDiagonal() * svd_2nd.matrixV().transpose();
+  }
+
+  // Distance from x1 to the epipolar line F*x0
+  template<typename T>
+  inline T EpipolarDistance(const Mat33<T>& F, const Vec2<T>& x0, const Vec2<T>& x1) {
+    const Vec3<T> l = F.template leftCols<2>() * x0 + F.col(2);
+    return std::abs(l(0)*x1.x() + l(1)*x1.y() + l(2)) / std::sqrt(l(0)*l(0) + l(1)*l(1));
+  }
+
+  // 4 candidates of [R|t] from E, |t| = 1
+  template<typename T>
+  inline void DecomposeEssential(const Mat33<T>& E, Mat34<T> v_T[4]) {
+    Eigen::JacobiSVD<Mat33<T>, Eigen::ColPivHouseholderQRPreconditioner> svd(E, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    const Mat33<T> U = svd.matrixU();
+    const Mat33<T> Vt = svd.matrixV().transpose();
+
+    Mat33<T> W;
+    W << T(0), T(-1), T(0),
+         T(1),  T(0), T(0),
+         T(0),  T(0), T(1);
+
+    const Vec3<T> t = U.col(2)/U.col(2).norm();
+    for(int i = 0; i < 4; ++i) {
+      Mat33<T> R = (i < 2) ? Mat33<T>(U * W * Vt) : Mat33<T>(U * W.transpose() * Vt);
+      if(R.determinant() < T(0)) {
+        R *= T(-1);
+      }
+      v_T[i].template block<3,3>(0,0) = R;
+      v_T[i].col(3) = (i % 2 == 0) ? t : Vec3<T>(-t);
+    }
+    return;
+  }
+
+  // Depths of a correspondence of normalized points from x1 x (d0*R*x0 + t) = 0.
+  template<typename T>
+  inline bool DepthsByCrossProduct(const Mat33<T>& R, const Vec3<T>& t,
+                                   const Vec3<T>& x0, const Vec3<T>& x1,
+                                   T& d0, T& d1) {
+    const Vec3<T> Rx0 = R * x0;
+    const Vec3<T> a = x1.cross(Rx0);
+    const Vec3<T> b = x1.cross(t);
+    const T aa = a.squaredNorm();
+    if(aa < T(1e-12)) {
+      return false;
+    }
+    d0 = -a.dot(b)/aa;
+    d1 = d0*Rx0(2) + t(2);
+    return true;
+  }
+
+  // Linear triangulation of 2 views by 4x4 SVD. P0, P1 are projection matrices.
+  template<typename T>
+  inline bool TriangulateDLT(const Mat34<T>& P0, const Mat34<T>& P1,
+                             const Vec2<T>& x0, const Vec2<T>& x1,
+                             Vec3<T>& pt_3d) {
+    Mat44<T> A;
+    A.row(0) = x0.x()*P0.row(2) - P0.row(0);
+    A.row(1) = x0.y()*P0.row(2) - P0.row(1);
+    A.row(2) = x1.x()*P1.row(2) - P1.row(0);
+    A.row(3) = x1.y()*P1.row(2) - P1.row(1);
+
+    Eigen::JacobiSVD<Mat44<T>, Eigen::ColPivHouseholderQRPreconditioner> svd(A, Eigen::ComputeFullV);
+    const Vec4<T> X = svd.matrixV().col(3);
+    if(std::abs(X(3)) < std::numeric_limits<T>::epsilon()) {
+      return false;
+    }
+    pt_3d = X.template head<3>()/X(3);
+    return true;
+  }
+
+  // Adds a ray (unit bearing in world and camera center) to the normal equations
+  // of the midpoint triangulation, sum_i (I - f_i*f_i^T) X = sum_i (I - f_i*f_i^T) C_i.
+  template<typename T>
+  inline void AccumulateRay(const Vec3<T>& bearing_w, const Vec3<T>& center,
+                            Mat33<T>& A, Vec3<T>& b) {
+    const Mat33<T> P = Mat33<T>::Identity() - bearing_w * bearing_w.transpose();
+    A += P;
+    b += P * center;
+    return;
+  }
+
+  // Pinhole projection, returns false if the point is behind the camera.
+  template<typename T>
+  inline bool Project(const Mat33<T>& K, const Mat33<T>& R, const Vec3<T>& t,
+                      const Vec3<T>& pt_w, Vec2<T>& uv) {
+    const Vec3<T> pt_c = R * pt_w + t;
+    if(pt_c(2) <= T(0)) {
+      return false;
+    }
+    const T inv_z = T(1)/pt_c(2);
+    uv(0) = K(0,0)*pt_c(0)*inv_z + K(0,1)*pt_c(1)*inv_z + K(0,2);
+    uv(1) = K(1,1)*pt_c(1)*inv_z + K(1,2);
+    return true;
+  }
+
+}; // Solver namespace
+}; // TS_SfM
@@ -9,40 +9,70 @@ namespace TS_SfM {
 
   struct MatchInfo;
 
+  // Keypoints are kept flat with one descriptor block, the spatial lookup is a cell index over
+  // them (offsets of cells into keypoint indices) instead of per-cell copies. The image isn't kept.
   class KeyFrame{
     public:
       KeyFrame(const Frame& f);
-      KeyFrame(){m_b_activated=false;};
+      // Restored keyframe (e.g. from a map file), keypoints are undistorted.
+      KeyFrame(const int id, const cv::Mat& cTw, const std::vector<cv::KeyPoint>& v_kpts,
+               const std::vector<cv::Point2f>& v_normalized_pts, const cv::Mat& descriptors);
+      // Placeholder of a frame without pose, m_id is -1.
+      KeyFrame() : m_id(-1), m_cTw(cv::Matx34f::eye()), m_num_kpts(0), m_b_activated(false), m_b_packed(false) {};
       ~KeyFrame(){};
 
       int m_id;
 
-      cv::Mat GetDescriptors() const; 
+      // Aligned with the keypoint ids, or with GetKeyPointId() of a packed keyframe.
+      cv::Mat GetDescriptors() const;
       std::vector<cv::KeyPoint> GetKeyPoints() const;
-      cv::Mat GetImage() const;
-      cv::Mat GetPose() {return m_m_cTw;};
-      cv::Mat GetPoseTrans() {return m_m_cTw.rowRange(0,3).col(3);};
-      cv::Mat GetPoseRot() {return m_m_cTw.rowRange(0,3).colRange(0,3);};
-      cv::Point2f GetObs(const int& kp_id) { return m_v_kpts[kp_id].pt; }
+      std::vector<cv::Point2f> GetNormalizedPoints() const { return m_v_normalized_pts; };
+      cv::Mat GetPose() const {return cv::Mat(m_cTw);};
+      void SetPose(const cv::Mat& cTw);
+      cv::Mat GetPoseTrans() const {return cv::Mat(m_cTw.col(3));};
+      cv::Mat GetPoseRot() const {return cv::Mat(m_cTw.get_minor<3,3>(0,0));};
+      // Observation is undistorted pixel coordinate, the keypoint must be kept (see Pack)
+      cv::Point2f GetObs(const int& kp_id) const;
+      // Number of keypoint ids, including the ones dropped by Pack
+      int GetNumKeyPoints() const { return m_num_kpts; }
+
+      // Index into GetKeyPoints() / GetDescriptors() of the keypoint, -1 if it is dropped by Pack
+      int GetKeyPointIndex(const int kp_id) const;
+      int GetKeyPointId(const int index) const { return m_b_packed ? m_v_kept_kp_ids[index] : index; }
+      bool HasKeyPoint(const int kp_id) const { return GetKeyPointIndex(kp_id) >= 0; }
+      // Ids of keypoints within radius of pt, looked up by the cell index
+      std::vector<int> GetKeyPointsInArea(const cv::Point2f& pt, const float radius) const;
+
+      // Drops all keypoints except v_kept_kp_ids (e.g. the ones observing mappoints).
+      // Ids of the kept keypoints stay valid, GetKeyPoints() and GetDescriptors() become
+      // aligned with GetKeyPointId().
+      void Pack(std::vector<int> v_kept_kp_ids);
+      bool IsPacked() const { return m_b_packed; }
 
       // KeyFrame is activated if only it has pose
       bool IsActivated() const {return m_b_activated;};
 
     private:
-      cv::Mat m_m_image;
-      cv::Mat m_m_cTw; // (3 x 4, CV_F32C1)
+      void BuildCellIndex();
+
+      cv::Matx34f m_cTw;
 
       std::vector<cv::KeyPoint> m_v_kpts;
+      std::vector<cv::Point2f> m_v_normalized_pts;
       cv::Mat m_m_descriptors;
+      int m_num_kpts;
 
       bool m_b_activated;
 
-      std::vector<std::vector<std::vector<cv::KeyPoint>>> m_vvv_grid_kpts;
-      std::vector<std::vector<cv::Mat>> m_vvm_grid_descs;
-      std::vector<std::vector<std::vector<int>>> m_vvv_grid_kp_idx;
-      std::vector<std::vector<unsigned int>> m_vv_num_grid_kpts;
-      unsigned int m_num_assigned_kps;
+      // packed keyframes only, sorted ids of m_v_kpts
+      bool m_b_packed;
+      std::vector<int> m_v_kept_kp_ids;
 
+      // keypoints of cell (row, col) are m_v_cell_kp_idx[m_v_cell_offsets[c]] to [m_v_cell_offsets[c+1]],
+      // with c = row * m_num_cell_cols + col, over the bounding box of the keypoints
+      cv::Point2f m_cell_origin;
+      int m_num_cell_cols, m_num_cell_rows;
+      std::vector<int> m_v_cell_offsets;
+      std::vector<int> m_v_cell_kp_idx;
   };
 };
-
@@ -1,18 +1,66 @@
 #pragma once
 
+#include <opencv2/opencv.hpp>
+#include <Eigen/Core>
+#include <vector>
+
 namespace TS_SfM {
+  class KeyFrame;
+  class MapPoint;
+  class CovisibilityGraph;
+  class Map;
+  struct Camera;
+
+  // Corrects drift (including scale) accumulated along a loop.
+  // Sim3 between the loop and current keyframes is estimated from matched mappoints, then the
+  // essential graph (spanning tree + strong covisibility + loop edge) is optimized over Sim3 poses
+  // and mappoints follow the correction of their reference keyframe.
   class LoopClosure {
     public:
       struct LoopConfig {
+        // Keyframe ids of a known loop, -1 disables. There is no place recognition,
+        // only this loop is closed when its second keyframe is registered.
         int start_id;
         int end_id;
+        int min_inliers; // Sim3 is rejected with fewer inliers
+        int ransac_iteration;
+        float inlier_threshold; // chi2 (2 DoF) on squared reprojection error with 1 pixel sigma, checked in both keyframes
+        int min_covisibility; // shared mappoints for an essential graph edge
+        int max_iteration; // pose graph
+        bool fix_scale; // SE3 correction if scale is observable
+      };
+
+      // X_dst = s * R * X_src + t
+      struct Similarity {
+        Eigen::Matrix3d R;
+        Eigen::Vector3d t;
+        double s;
       };
 
-      LoopClosure(const LoopConfig& _config);
+      LoopClosure(const LoopConfig& config, const Camera& cam);
       ~LoopClosure();
 
+      // Returns false if Sim3 between the keyframes is not found, poses and mappoints are not changed then.
+      // map holds the keyframes and mappoints (ids are indices of v_mappoints), its keypoint index
+      // and covisibility graph are used.
+      bool Close(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints,
+                 const Map& map, const int loop_kf_id, const int current_kf_id);
+
+      // Sim3 from loop camera to current camera by RANSAC on matched points in each camera frame.
+      bool ComputeSim3(const std::vector<Eigen::Vector3d>& v_pts_loop, const std::vector<Eigen::Vector3d>& v_pts_cur,
+                       const std::vector<cv::Point2f>& v_uv_loop, const std::vector<cv::Point2f>& v_uv_cur,
+                       Similarity& S_cl, std::vector<bool>& vb_inliers) const;
+
+      // Loop edge S_cl is distributed over the essential graph with the loop keyframe fixed.
+      // Returns the number of corrected keyframes.
+      int OptimizeEssentialGraph(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints,
+                                 const CovisibilityGraph& covisibility_graph, const int loop_kf_id, const int current_kf_id, const Similarity& S_cl) const;
+
+      const LoopConfig& GetConfig() const { return m_config; }
+
     private:
-      LoopConfig m_config;
+      const LoopConfig m_config;
+      const double m_fx, m_fy, m_cx, m_cy;
 
   };
 };
@@ -3,30 +3,140 @@
 #include <iostream>
 #include <vector>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <string>
 
+#include "CovisibilityGraph.h"
 #include "KeyFrame.h"
 #include "MapPoint.h"
+#include "MapPointArena.h"
+#include "VoxelHashIndex.h"
 
 namespace TS_SfM {
+  struct Camera;
+
+  // Immutable state of the map at one version.
+  // Parts which didn't change since the previous version are shared with it.
+  struct MapSnapshot {
+    struct KeyFrameState {
+      int id;
+      cv::Matx34f cTw;
+    };
+    struct MapPointState {
+      uint32_t id;
+      cv::Point3f pos;
+      int num_obs;
+    };
+
+    // mappoints of arena slots [i * MAPPOINT_CHUNK_SIZE, (i+1) * MAPPOINT_CHUNK_SIZE) are
+    // v_mappoint_chunks[i], only chunks with a changed slot are rebuilt by a new version
+    static const int MAPPOINT_CHUNK_SIZE = 4096;
+
+    uint64_t version;
+    std::shared_ptr<const std::vector<KeyFrameState>> p_keyframes; // activated keyframes
+    std::vector<std::shared_ptr<const std::vector<MapPointState>>> v_mappoint_chunks;
+    int num_mappoints;
+  };
 
   class Map {
     public:
-      Map(){};
+      // voxel_size is the cell size of the spatial index of mappoints
+      Map(const float voxel_size = 1.0f);
       ~Map(){};
 
       void Initialize(std::vector<KeyFrame> v_keyframes, std::vector<MapPoint> v_mappoints);
 
+      // Binary map file (MapFile.h) with keyframe poses, keypoints, descriptors, mappoints,
+      // observations and the covisibility graph. Keyframe images are not stored, packed keyframes
+      // are restored packed with the same kept keypoint ids.
+      bool Save(const std::string& file, const Camera& cam) const;
+      // Replaces the content of the map and sets cam to the intrinsics of the file.
+      // A snapshot has to be published afterwards as after Initialize.
+      // The records are copied out of the mapping (MapFileView) since keyframes, mappoints and
+      // indices keep changing after the load. Read-only users can open a MapFileView instead.
+      bool Load(const std::string& file, Camera& cam);
+
+      // Serializes writers only. Readers (viewer, exporters, loop detection) never take it,
+      // they work on snapshots.
       std::mutex m_update_mtx;
 
-      KeyFrame& GetKeyFrameObservingMapPoint(const int& map_id);
+      // Latest published snapshot, never null. Lock free for readers.
+      std::shared_ptr<const MapSnapshot> GetSnapshot() const { return std::atomic_load(&m_p_snapshot); }
+      // Called by the writer after a batch of changes. Unchanged parts are shared with the
+      // previous snapshot. Returns the new version.
+      uint64_t PublishSnapshot();
 
-    private:
-      std::vector<MapPoint> m_v_mappoints;
-      std::vector<KeyFrame> m_v_keyframes;
+      // Keyframes are indexed by id. The keypoint index of the keyframe is created or resized.
+      // Returns false for a keyframe without id.
+      bool AddKeyFrame(const KeyFrame& keyframe);
+      KeyFrame& GetKeyFrame(const int keyframe_id) { return m_v_keyframes[keyframe_id]; }
+      // Pose changes have to go through the map to be published.
+      void SetKeyFramePose(const int keyframe_id, const cv::Mat& cTw);
+      int GetNumKeyFrames() const { return (int)m_v_keyframes.size(); }
+      // Drops keypoints which don't observe a mappoint from every keyframe (KeyFrame::Pack).
+      // Dropped keypoints can't observe mappoints afterwards. Returns the number of dropped keypoints.
+      int PackKeyFrames();
+      // Reference (first observing) keyframe of the mappoint, nullptr if the mappoint is removed
+      // or has no observation in a keyframe of the map.
+      KeyFrame* GetKeyFrameObservingMapPoint(const int& map_id);
+      // MapPointArena::INVALID_ID if the keypoint has no mappoint
+      uint32_t GetMapPointObservedBy(const int keyframe_id, const int kpt_id) const {
+        return keyframe_id < (int)m_vv_kpt_to_mappoint.size() && kpt_id < (int)m_vv_kpt_to_mappoint[keyframe_id].size()
+               ? m_vv_kpt_to_mappoint[keyframe_id][kpt_id] : MapPointArena::INVALID_ID;
+      }
+
+      // Mappoints are referred by stable ids, m_id of the given mappoint is kept if possible.
+      uint32_t AddMapPoint(const MapPoint& mappoint);
+      // Slots are compacted once enough tombstones are accumulated.
+      bool RemoveMapPoint(const uint32_t mappoint_id);
+      MapPoint GetMapPoint(const uint32_t mappoint_id) const { return m_mappoints.GetMapPoint(mappoint_id); }
+      void SetMapPointPosition(const uint32_t mappoint_id, const cv::Point3f& pos);
+      // for linear scans over all mappoints
+      const MapPointArena& GetMapPoints() const { return m_mappoints; }
+      int GetNumMapPoints() const { return m_mappoints.GetNumMapPoints(); }
+
+      // Mappoints projected into the image from pose cTw (3x4) within max_depth, with their pixel positions.
+      // Only voxels intersecting the frustum are visited. Returns the number of mappoints.
+      int GetMapPointsInFrustum(const cv::Mat& cTw, const Camera& cam, const int width, const int height,
+                                const float max_depth, std::vector<uint32_t>& v_mappoint_ids,
+                                std::vector<cv::Point2f>& v_uvs) const;
+      std::vector<uint32_t> GetMapPointsInRadius(const cv::Point3f& center, const float radius) const;
 
+      // Ids of mappoints added or changed since the last call (may include removed ones), for
+      // incremental maintenance.
+      std::vector<uint32_t> TakeRecentMapPoints();
 
+      // Covisibility graph and keypoint index follow every observation change.
+      // A keypoint observes at most one mappoint, AddObservation fails if it is taken by another one.
+      bool AddObservation(const uint32_t mappoint_id, const MatchInfo& match_info);
+      // A mappoint may be observed by several keypoints of one keyframe, the one of kpt_id is removed.
+      bool RemoveObservation(const uint32_t mappoint_id, const int keyframe_id, const int kpt_id);
+      // Observations of drop_id are moved to keep_id (except keyframes both observe) and drop_id is removed.
+      bool MergeMapPoints(const uint32_t keep_id, const uint32_t drop_id);
+      const CovisibilityGraph& GetCovisibilityGraph() const { return m_covisibility_graph; }
 
+    private:
+      // Returns false if the keypoint already observes a mappoint.
+      bool LinkKeyPoint(const uint32_t mappoint_id, const MatchInfo& match_info);
+      // distinct keyframes observing the mappoint
+      std::vector<int> GetObservingKeyFrameIds(const uint32_t mappoint_id) const;
+      // The snapshot chunk of the slot of the mappoint is rebuilt on the next publish.
+      void MarkMapPointDirty(const uint32_t mappoint_id);
+
+      MapPointArena m_mappoints;
+      CovisibilityGraph m_covisibility_graph;
+      VoxelHashIndex m_spatial_index;
+      std::vector<uint32_t> m_v_recent_mappoint_ids;
+      // keyframe id -> keypoint id -> mappoint id, inverse of the observations in m_mappoints
+      std::vector<std::vector<uint32_t>> m_vv_kpt_to_mappoint;
 
+      std::shared_ptr<const MapSnapshot> m_p_snapshot; // accessed by std::atomic_load/store only
+      // changed since the last published snapshot
+      bool m_b_keyframes_dirty;
+      // every chunk (e.g. slots moved by compaction), or the ones flagged in m_vb_dirty_chunks
+      bool m_b_mappoints_dirty;
+      std::vector<char> m_vb_dirty_chunks;
+      std::vector<KeyFrame> m_v_keyframes;
   };
 } // namespace
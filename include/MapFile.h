@@ -0,0 +1,159 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "CovisibilityGraph.h"
+#include "Matcher.h"
+
+namespace TS_SfM {
+  struct Camera;
+
+  // Binary map file, written by Map::Save.
+  // Fixed-size records in sections aligned to SECTION_ALIGNMENT, addressed by the section table
+  // of the header, so a mapping of the file is used in place (see MapFileView).
+  // Host byte order, a file of the other order is rejected by its endian tag.
+  namespace MapFile {
+    const char MAGIC[8] = {'T','S','S','F','M','M','A','P'};
+    const uint32_t VERSION = 2;
+    const uint32_t ENDIAN_TAG = 0x01020304;
+    const uint64_t SECTION_ALIGNMENT = 64;
+
+    enum Section {
+      KEYFRAMES = 0,            // KeyFrameRecord per keyframe id
+      KEYPOINTS,                // KeyPointRecord, ranges of keyframes
+      KEYPOINT_DESCRIPTORS,     // descriptor_size bytes per keypoint
+      KEYPOINT_FLAGS,           // uint8_t KeyPointFlags per keypoint
+      MAPPOINTS,                // MapPointRecord
+      MAPPOINT_DESCRIPTORS,     // descriptor_size bytes per mappoint
+      OBSERVATIONS,             // MatchInfo, ranges of mappoints
+      COVISIBILITY_EDGES,       // CovisibilityGraph::Edge
+      NUM_SECTIONS
+    };
+
+    struct SectionEntry {
+      uint64_t offset; // bytes from the beginning of the file
+      uint64_t size; // bytes
+    };
+
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t endian_tag;
+      uint64_t file_size;
+      float camera[9]; // fx, fy, cx, cy, k1, k2, p1, p2, k3
+      uint32_t num_keyframes; // including ids without keyframe
+      uint32_t num_mappoints;
+      uint64_t num_keypoints;
+      uint64_t num_observations;
+      uint64_t num_covisibility_edges;
+      int32_t descriptor_type; // cv type of a descriptor row, -1 without descriptors
+      uint32_t descriptor_size; // bytes
+      SectionEntry sections[NUM_SECTIONS];
+    };
+
+    enum Flags {
+      ACTIVATED = 1,
+      PACKED = 2 // keyframe only, keypoints without KEPT are dropped (see KeyFrame::Pack)
+    };
+
+    enum KeyPointFlags {
+      KEPT = 1
+    };
+
+    struct KeyFrameRecord {
+      int32_t id;
+      uint32_t flags;
+      float cTw[12]; // row major 3x4
+      uint64_t kpt_begin; // index into KEYPOINTS and KEYPOINT_DESCRIPTORS
+      uint32_t num_kpts;
+      uint32_t reserved;
+    };
+
+    // undistorted keypoint
+    struct KeyPointRecord {
+      float x, y;
+      float size;
+      float angle;
+      float response;
+      int32_t octave;
+    };
+
+    struct MapPointRecord {
+      uint32_t id;
+      uint32_t flags;
+      float x, y, z;
+      uint32_t num_obs;
+      uint64_t obs_begin; // index into OBSERVATIONS
+    };
+
+    static_assert(sizeof(KeyFrameRecord) == 72, "KeyFrameRecord layout");
+    static_assert(sizeof(KeyPointRecord) == 24, "KeyPointRecord layout");
+    static_assert(sizeof(MapPointRecord) == 32, "MapPointRecord layout");
+    static_assert(sizeof(MatchInfo) == 8, "MatchInfo layout");
+    static_assert(sizeof(CovisibilityGraph::Edge) == 12, "Edge layout");
+
+    // Lays out the sections after the header and writes the file. Magic, version, endian tag,
+    // file size and section table of the header are filled here. The file is written next to
+    // the destination and renamed, so an existing file is replaced only by a complete one.
+    bool Write(const std::string& file, Header header,
+               const void* const p_sections[NUM_SECTIONS], const uint64_t section_sizes[NUM_SECTIONS]);
+  }
+
+  // Read-only memory mapping of a map file. Records are accessed in place without parsing,
+  // so opening costs the same for any map size. Pointers and cv::Mat headers returned here
+  // refer to the mapping and are valid until Close(). They must not be written.
+  class MapFileView {
+    public:
+      MapFileView();
+      ~MapFileView();
+      MapFileView(const MapFileView&) = delete;
+      MapFileView& operator=(const MapFileView&) = delete;
+
+      // Checks magic, version, byte order, that every section lies in the file and that
+      // keyframe, keypoint and observation ids of the records are in range.
+      bool Open(const std::string& file);
+      void Close();
+      bool IsOpen() const { return m_p_data != nullptr; }
+
+      const MapFile::Header& GetHeader() const { return *reinterpret_cast<const MapFile::Header*>(m_p_data); }
+      Camera GetCamera() const;
+
+      int GetNumKeyFrames() const { return (int)GetHeader().num_keyframes; }
+      const MapFile::KeyFrameRecord* GetKeyFrames() const { return GetSection<MapFile::KeyFrameRecord>(MapFile::KEYFRAMES); }
+      const MapFile::KeyPointRecord* GetKeyPoints(const int keyframe_id) const {
+        return GetSection<MapFile::KeyPointRecord>(MapFile::KEYPOINTS) + GetKeyFrames()[keyframe_id].kpt_begin;
+      }
+      // num_kpts rows, empty without descriptors
+      cv::Mat GetKeyPointDescriptors(const int keyframe_id) const;
+      const uint8_t* GetKeyPointFlags(const int keyframe_id) const {
+        return GetSection<uint8_t>(MapFile::KEYPOINT_FLAGS) + GetKeyFrames()[keyframe_id].kpt_begin;
+      }
+
+      int GetNumMapPoints() const { return (int)GetHeader().num_mappoints; }
+      const MapFile::MapPointRecord* GetMapPoints() const { return GetSection<MapFile::MapPointRecord>(MapFile::MAPPOINTS); }
+      const MatchInfo* GetObservations(const int mappoint_idx) const {
+        return GetSection<MatchInfo>(MapFile::OBSERVATIONS) + GetMapPoints()[mappoint_idx].obs_begin;
+      }
+      // one row per mappoint record, empty without descriptors
+      cv::Mat GetMapPointDescriptors() const;
+
+      int GetNumCovisibilityEdges() const { return (int)GetHeader().num_covisibility_edges; }
+      const CovisibilityGraph::Edge* GetCovisibilityEdges() const {
+        return GetSection<CovisibilityGraph::Edge>(MapFile::COVISIBILITY_EDGES);
+      }
+
+    private:
+      template<typename T>
+      const T* GetSection(const MapFile::Section section) const {
+        return reinterpret_cast<const T*>(m_p_data + GetHeader().sections[section].offset);
+      }
+      bool Validate() const;
+
+      const unsigned char* m_p_data;
+      size_t m_size;
+  };
+
+} // namespace
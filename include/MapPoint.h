@@ -6,14 +6,14 @@ namespace TS_SfM {
 
   class MapPoint {
     public:
-      MapPoint(){};
-      MapPoint(cv::Point3f pt) {
+      MapPoint() : m_id(-1) {};
+      MapPoint(cv::Point3f pt) : m_id(-1) {
         m_pos.x = pt.x;
         m_pos.y = pt.y;
         m_pos.z = pt.z;
         m_is_activated = false;
       };
-      MapPoint(const float& x, const float& y, const float& z) {
+      MapPoint(const float& x, const float& y, const float& z) : m_id(-1) {
         m_pos.x = x;
         m_pos.y = y;
         m_pos.z = z;
@@ -21,6 +21,9 @@ namespace TS_SfM {
       };
       ~MapPoint(){};
 
+      // index in the map, -1 until the point is inserted
+      int m_id;
+
       void SetMatchInfo(std::vector<MatchInfo> _v_match_info) {
         for(auto match_info : _v_match_info)
           m_v_match_info.push_back(match_info);
@@ -34,6 +37,10 @@ namespace TS_SfM {
         m_m_descriptor = _desc.clone();
       }
 
+      const cv::Mat& GetDescriptor() const {
+        return m_m_descriptor;
+      }
+
       void SetPosition(const float x, const float y, const float z) {
         m_pos = cv::Point3f(x,y,z);
       }
@@ -42,7 +49,7 @@ namespace TS_SfM {
         return m_pos;
       }
 
-      bool IsActivated() {
+      bool IsActivated() const {
         return m_is_activated;
       }
 
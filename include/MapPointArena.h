@@ -0,0 +1,91 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <vector>
+
+#include "Matcher.h"
+
+namespace TS_SfM {
+  class MapPoint;
+
+  // Structure-of-arrays storage of mappoints.
+  // Positions are contiguous float arrays, descriptors are rows of one continuous (aligned) cv::Mat and
+  // observations live in a single pool where each point owns a range. A point keeps its 32-bit id
+  // for its lifetime while its slot may move: removal leaves a tombstone and Compact() closes the gaps.
+  // Scans over slots [0, GetNumSlots()) must skip tombstones with IsAlive().
+  class MapPointArena {
+    public:
+      static const uint32_t INVALID_ID = 0xffffffff;
+
+      MapPointArena() : m_num_tombstones(0) {};
+      ~MapPointArena(){};
+
+      // id of the mappoint is kept if it is set and not used yet, otherwise a new id is given
+      uint32_t Add(const MapPoint& mappoint);
+      // Same without an intermediate MapPoint (e.g. loading a map). desc is one row or empty.
+      uint32_t Add(const uint32_t id, const cv::Point3f& pos, const cv::Mat& desc,
+                   const MatchInfo* p_obs, const int num_obs, const bool b_activated);
+      void ReserveMapPoints(const int num_mappoints, const int num_observations);
+      bool Remove(const uint32_t id);
+      void Clear();
+
+      // Slots of alive points are packed in their current order, ids don't change.
+      void Compact();
+      // true if at least the given ratio of slots are tombstones
+      bool NeedsCompaction(const float tombstone_ratio = 0.25f) const;
+
+      bool Contains(const uint32_t id) const {
+        return id < m_v_id_to_slot.size() && m_v_id_to_slot[id] >= 0;
+      }
+      // -1 if the id is removed
+      int GetSlot(const uint32_t id) const {
+        return id < m_v_id_to_slot.size() ? m_v_id_to_slot[id] : -1;
+      }
+      int GetNumSlots() const { return (int)m_v_slot_to_id.size(); }
+      int GetNumMapPoints() const { return GetNumSlots() - m_num_tombstones; }
+
+      // slot accessors
+      bool IsAlive(const int slot) const { return m_v_slot_to_id[slot] != INVALID_ID; }
+      uint32_t GetId(const int slot) const { return m_v_slot_to_id[slot]; }
+      bool IsActivated(const int slot) const { return m_vb_activated[slot] != 0; }
+      const float* GetX() const { return m_v_x.data(); }
+      const float* GetY() const { return m_v_y.data(); }
+      const float* GetZ() const { return m_v_z.data(); }
+      // one row per slot (CV_8U), rows of tombstones are undefined
+      const cv::Mat& GetDescriptors() const { return m_m_descriptors; }
+      int GetObsNum(const int slot) const { return m_v_obs_size[slot]; }
+      const MatchInfo* GetObservations(const int slot) const { return m_v_obs_pool.data() + m_v_obs_begin[slot]; }
+
+      // id accessors, removed ids are ignored (GetPosition gives the origin and GetMapPoint
+      // a MapPoint with m_id -1)
+      cv::Point3f GetPosition(const uint32_t id) const;
+      void SetPosition(const uint32_t id, const float x, const float y, const float z);
+      void AddObservation(const uint32_t id, const MatchInfo& match_info);
+      // Removes the observation in the keyframe (of the keypoint if kpt_id >= 0).
+      // Returns false if there is no such observation.
+      bool RemoveObservation(const uint32_t id, const int frame_id, const int kpt_id = -1);
+      // Copy as an independent MapPoint (e.g. for the vector based pipeline).
+      MapPoint GetMapPoint(const uint32_t id) const;
+
+    private:
+      void Reserve(const int slot, const int num_obs);
+
+      // slot -> id (INVALID_ID for tombstones), id -> slot (-1 for removed ids)
+      std::vector<uint32_t> m_v_slot_to_id;
+      std::vector<int> m_v_id_to_slot;
+      int m_num_tombstones;
+
+      std::vector<float> m_v_x, m_v_y, m_v_z;
+      std::vector<char> m_vb_activated;
+      cv::Mat m_m_descriptors;
+
+      // observations of a slot are m_v_obs_pool[begin, begin + size), a range is moved
+      // to the end of the pool with doubled capacity when it is full
+      std::vector<MatchInfo> m_v_obs_pool;
+      std::vector<int> m_v_obs_begin;
+      std::vector<int> m_v_obs_size;
+      std::vector<int> m_v_obs_capacity;
+  };
+
+} // namespace
@@ -1,18 +1,44 @@
 #pragma once
 
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <cstdint>
+#include <vector>
+
 namespace TS_SfM {
+  class Map;
+  struct Camera;
 
   class Mapper {
     public:
       struct MapperConfig{
         int skip;
+        // map maintenance
+        int min_observations; // mappoints observed by fewer keyframes are culled
+        float min_parallax; // degree, largest angle between observing rays
+        float max_reprojection_error; // pixel, worse observations are removed
+        float fusion_radius; // pixel, duplicates are searched within this radius (at the reference depth)
+        int max_descriptor_distance; // hamming distance of duplicates
       };
 
       Mapper(){};
       Mapper(MapperConfig _config);
       ~Mapper(){};
 
+      // Fuses duplicates among the recently touched mappoints of the map, then removes their
+      // bad observations and weak mappoints. Returns the number of removed mappoints.
+      // v_changed_ids are the ids which may have changed or been removed, sorted.
+      int MaintainMap(Map& map, const Camera& cam, std::vector<uint32_t>& v_changed_ids) const;
+
     private:
+      typedef std::vector<Eigen::Matrix<float,3,4>, Eigen::aligned_allocator<Eigen::Matrix<float,3,4>>> Poses;
+
+      // Kept mappoints of merges are appended to v_keep_ids.
+      int FuseMapPoints(Map& map, const std::vector<uint32_t>& v_mappoint_ids,
+                        const Poses& v_poses, const Camera& cam, std::vector<uint32_t>& v_keep_ids) const;
+      int CullMapPoints(Map& map, const std::vector<uint32_t>& v_mappoint_ids,
+                        const Poses& v_poses, const Camera& cam) const;
+
       MapperConfig m_config;
   };
 
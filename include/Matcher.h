@@ -10,6 +10,8 @@ namespace TS_SfM {
 
   class MapPoint;
   class Frame;
+  class KeyFrame;
+  class MapPointArena;
 
   struct MatchObsAndLdmk {
     int obs_id;
@@ -40,6 +42,9 @@ namespace TS_SfM {
         CheckType check_type;
         SearchType search_type;
         int search_range;
+        float projection_radius; // pixel, mappoints are searched around their projection
+        int projection_max_distance; // hamming distance of a match by projection
+        float projection_max_depth; // farther mappoints are not searched, bounds the frustum query
       };
 
       Matcher(const MatcherConfig _config);
@@ -48,6 +53,14 @@ namespace TS_SfM {
       std::vector<cv::DMatch>
         GetMatches(const Frame& frame0, const Frame& frame1);
 
+      // Mappoints projected at v_uvs are matched to the closest descriptor among the keypoints of
+      // the keyframe within projection_radius. Keypoints of vb_assigned are skipped and the matched
+      // ones are set. obs_id is the keypoint id and ldmk_id the mappoint id.
+      std::vector<MatchObsAndLdmk>
+        SearchByProjection(const MapPointArena& mappoints, const KeyFrame& keyframe,
+                           const std::vector<uint32_t>& v_mappoint_ids, const std::vector<cv::Point2f>& v_uvs,
+                           std::vector<bool>& vb_assigned) const;
+
       std::vector<cv::DMatch> Inverse(const std::vector<cv::DMatch>& v_matches) {
         std::vector<cv::DMatch> v_matches_inv = v_matches; 
         v_matches_inv.reserve(v_matches.size());
@@ -35,6 +35,11 @@
 #include <iostream>
 #include <stdint.h>
 
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "g2o/core/sparse_optimizer.h"
@@ -44,10 +49,14 @@
 #include "g2o/core/optimization_algorithm_levenberg.h"
 #include "g2o/solvers/cholmod/linear_solver_cholmod.h"
 #include "g2o/solvers/dense/linear_solver_dense.h"
+#include "g2o/solvers/eigen/linear_solver_eigen.h"
+#include "g2o/solvers/pcg/linear_solver_pcg.h"
 #include "g2o/types/sba/types_six_dof_expmap.h"
 //#include "g2o/math_groups/se3quat.h"
 #include "g2o/solvers/structure_only/structure_only_solver.h"
 
+#include "BundleAdjuster.h"
+
 
 
 namespace TS_SfM {
@@ -56,26 +65,131 @@ namespace TS_SfM {
   class Map;
   struct Camera;
 
+   // Estimates are written back to the given keyframes and mappoints,
+   // only the statistics are returned.
    struct BAResult {
-    std::vector<KeyFrame> v_keyframes;
-    std::vector<MapPoint> v_mappoints;
-    float repro_error;
+    double initial_rms_error; // pixel
+    double final_rms_error; // pixel
+    int num_iterations;
+    int num_observations;
    };
 
+  struct MatchInfo;
+  class LinearSolverSelector;
+
+  // Local bundle adjustment on a persistent graph.
+  // Vertices and edges are inserted/removed incrementally, and only a window of keyframes
+  // (the latest ones or the one given by SetWindow) with their points is optimized on Run().
   class Optimizer {
       public:
-        Optimizer(){};
-        ~Optimizer(){};
-        void Run();
-        bool SetData();
+        enum Engine {
+          G2O = 0,
+          Native = 1, // BundleAdjuster
+          Submap = 2 // SubmapBundleAdjuster
+        };
+
+        // linear solver of g2o
+        enum LinearSolverType {
+          Cholmod = 0,
+          EigenSparse = 1,
+          Dense = 2,
+          PCG = 3,
+          Auto = 4 // fastest one is measured per problem size
+        };
+
+        struct OptimizerConfig {
+          int window_size; // number of latest keyframes to be optimized
+          int max_iteration;
+          float huber_delta; // pixel
+          float chi2_threshold; // stop if relative decrease of chi2 is smaller
+          float step_threshold; // stop if relative update of params is smaller
+          bool verbose;
+          Engine engine; // used for global BA
+          BundleAdjuster::LinearSolverType native_linear_solver;
+          int num_threads; // 0 uses all cores
+          LinearSolverType linear_solver;
+          int submap_size; // keyframes per submap of Submap engine
+          int submap_overlap; // keyframes shared with neighbor submaps
+          std::string export_bal_file; // problem of global BA is written in BAL format if not empty
+        };
+
+        Optimizer(const OptimizerConfig& config, const Camera& cam);
+        ~Optimizer();
+
+        // Insert keyframes, mappoints and observations which are not in the graph yet.
+        bool SetData(std::vector<std::reference_wrapper<KeyFrame>> v_keyframes,
+                     std::vector<std::reference_wrapper<MapPoint>> v_mappoints);
+        void AddKeyFrame(KeyFrame& keyframe);
+        void AddMapPoint(const MapPoint& mappoint, std::vector<KeyFrame>& v_keyframes);
+        void AddObservation(const int mappoint_id, KeyFrame& keyframe, const int kpt_id);
+        void RemoveKeyFrame(const int keyframe_id);
+        void RemoveMapPoint(const int mappoint_id);
+        // Vertices take positions refined outside of the graph (e.g. RefineStructure).
+        void SetMapPointEstimates(const std::vector<MapPoint>& v_mappoints, const std::vector<int>& v_mappoint_ids);
+        // Every keyframe vertex takes the pose of its keyframe (e.g. after loop correction).
+        void SetKeyFrameEstimates(std::vector<KeyFrame>& v_keyframes);
+
+        // Keyframes optimized by the following Run() calls (e.g. a keyframe and its best covisible ones),
+        // an empty window falls back to the latest window_size keyframes.
+        void SetWindow(const std::vector<int>& v_keyframe_ids);
+        BAResult Run();
+        // Estimates optimized in the last Run() are written back. Containers are indexed by id.
+        void UpdateData(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints) const;
 
+        int GetNumKeyFrames() const { return (int)m_dq_kf_ids.size(); }
+        // ids optimized (written back by UpdateData) in the last Run()
+        const std::vector<int>& GetLocalKeyFrameIds() const { return m_v_local_kf_ids; }
+        const std::vector<int>& GetLocalMapPointIds() const { return m_v_local_mp_ids; }
 
       private:
-    
+        // keyframes and mappoints share the vertex id space
+        static int KeyFrameVertexId(const int keyframe_id) { return 2*keyframe_id; }
+        static int MapPointVertexId(const int mappoint_id) { return 2*mappoint_id + 1; }
 
+        bool AddEdge(g2o::VertexSBAPointXYZ* v_point, g2o::VertexSE3Expmap* v_keyframe, const Eigen::Vector2d& obs);
+        void EraseEdgesOf(g2o::HyperGraph::Vertex* vertex);
+
+        OptimizerConfig m_config;
+        double m_fx, m_fy, m_cx, m_cy;
+
+        g2o::SparseOptimizer m_optimizer;
+        // must be destroyed before m_optimizer
+        std::unique_ptr<LinearSolverSelector> m_p_solver_selector;
+        // graph or window changed since the last Run(), the optimization is initialized again if true
+        bool m_b_structure_changed;
+        // log2 of the number of free keyframes -> fastest solver (Auto)
+        std::map<int, LinearSolverType> m_map_size_to_solver;
+        // keyframe ids in insertion order, the last ones make the local window
+        std::deque<int> m_dq_kf_ids;
+        // given by SetWindow
+        std::vector<int> m_v_window_kf_ids;
+        // the first two keyframes are fixed to remove gauge freedom
+        std::vector<int> m_v_gauge_kf_ids;
+        // (mappoint_id << 32 | keyframe_id) -> edge
+        std::unordered_map<long long, g2o::EdgeSE3ProjectXYZ*> m_map_edges;
+
+        std::vector<int> m_v_local_kf_ids;
+        std::vector<int> m_v_local_mp_ids;
   };
 
   BAResult BundleAdjustmentBeta(std::vector<std::reference_wrapper<KeyFrame>> v_keyframes,
-                                std::vector<std::reference_wrapper<MapPoint>> v_mappoints, const Camera& cam);
+                                std::vector<std::reference_wrapper<MapPoint>> v_mappoints, const Camera& cam,
+                                const Optimizer::OptimizerConfig& config);
+
+  // Points are refined independently in parallel with all keyframes fixed (3x3 Levenberg-Marquardt each).
+  // Keyframes are indexed by id, repeated mappoint ids are refined once. Returns the number of updated points.
+  int RefineStructure(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints,
+                      const std::vector<int>& v_mappoint_ids, const Camera& cam,
+                      const Optimizer::OptimizerConfig& config, const int max_iteration = 5);
+
+  // Same problem as BundleAdjustmentBeta solved by the native BundleAdjuster,
+  // or by the hierarchical SubmapBundleAdjuster if the engine is Submap.
+  BAResult BundleAdjustmentNative(std::vector<std::reference_wrapper<KeyFrame>> v_keyframes,
+                                  std::vector<std::reference_wrapper<MapPoint>> v_mappoints, const Camera& cam,
+                                  const Optimizer::OptimizerConfig& config);
+
+  // Solvers on a prepared problem (e.g. imported BAL file), estimates are written back to the problem.
+  BAResult BundleAdjustmentNative(BAProblem& problem, const Optimizer::OptimizerConfig& config);
+  BAResult BundleAdjustmentG2O(BAProblem& problem, const Optimizer::OptimizerConfig& config);
 
 };
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <Eigen/Core>
+
+namespace TS_SfM {
+  class Frame;
+  class MapPoint;
+  struct Camera;
+  struct MatchObsAndLdmk;
+
+  // Motion only optimization of a single cTw against fixed points.
+  // Normal equations are accumulated into a dense 6x6 system, nothing is allocated
+  // while iterating. Outliers are re-classified after every round as ORB-SLAM does.
+  class PoseOptimizer {
+    public:
+      struct PoseOptimizerConfig {
+        int num_rounds;
+        int max_iteration; // per round
+        float chi2_threshold; // pixel^2, also used for the Huber kernel
+        float min_step; // stop if the update is smaller
+      };
+
+      PoseOptimizer(const PoseOptimizerConfig& config) : m_config(config) {};
+      ~PoseOptimizer(){};
+
+      static PoseOptimizerConfig DefaultConfig();
+
+      // pb_inliers (num) is read as initial classification and overwritten.
+      // R, t are cTw in/out. Returns the number of inliers.
+      int Optimize(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs, const int num,
+                   const double fx, const double fy, const double cx, const double cy,
+                   Eigen::Matrix3d& R, Eigen::Vector3d& t, char* pb_inliers) const;
+
+      // Pose of the frame is the initial guess and is updated.
+      // v_matches are undistorted keypoints to mappoints.
+      int Optimize(Frame& frame, const std::vector<MapPoint>& v_mappoints,
+                   const std::vector<MatchObsAndLdmk>& v_matches, const Camera& cam,
+                   std::vector<bool>& vb_inliers) const;
+
+    private:
+      const PoseOptimizerConfig m_config;
+  };
+
+} // namespace
@@ -9,6 +9,7 @@
 #include "Map.h"
 
 namespace TS_SfM {
+  struct Camera;
 
   class Reconstructor {
     public:
@@ -16,6 +17,9 @@ namespace TS_SfM {
       ~Reconstructor(){};
 
       void SetMap(std::shared_ptr<Map> p_map);
+      // Fusion and culling of recently changed mappoints, a snapshot is published afterwards.
+      // Returns the ids which may have changed or been removed (Mapper::MaintainMap).
+      std::vector<uint32_t> MaintainMap(const Camera& cam);
 
       // This is main.
       void Run();
@@ -6,29 +6,56 @@
 #include <Eigen/Core>
 
 #include <Eigen/Dense>
+#include <Eigen/StdVector>
 // #include <Open3D/Open3D.h>
 
+#include "GeometryKernels.h"
+
 using Matrix33f = Eigen::Matrix<float,3,3>;
 using Matrix34f = Eigen::Matrix<float,3,4>;
 using Matrix44f = Eigen::Matrix<float,4,4>;
 
 namespace TS_SfM {
+  // Row-major Eigen type to map cv::Mat data (column vectors must be col-major in Eigen)
+  template<typename _Tp, int _rows, int _cols>
+  using CvMappedMatrix = Eigen::Matrix<_Tp, _rows, _cols,
+                                       (_cols == 1 && _rows != 1) ? Eigen::ColMajor : Eigen::RowMajor>;
+
+  // Continuous cv::Mat of the same depth is mapped and copied at once.
+  // Views (rowRange, col, ...) and float <-> double are copied element-wise.
   template<typename _Tp, int _rows, int _cols>
   void cv2eigen(const cv::Mat& src,
                  Eigen::Matrix<_Tp, _rows, _cols>& dst )
   {
+    if(src.isContinuous() && src.depth() == cv::DataType<_Tp>::depth) {
+      dst = Eigen::Map<const CvMappedMatrix<_Tp,_rows,_cols>>(src.ptr<_Tp>(), src.rows, src.cols);
+      return;
+    }
+
+    dst.resize(src.rows, src.cols);
     for(int i = 0; i < src.rows; ++i) {
       for(int j = 0; j < src.cols; ++j) {
-        dst(i,j) = src.at<_Tp>(i,j);
+        dst(i,j) = (src.depth() == CV_64F) ? static_cast<_Tp>(src.at<double>(i,j))
+                                           : static_cast<_Tp>(src.at<float>(i,j));
       }
     }
     return;
   }
 
+  // dst is (re)allocated with the type of _Tp if its size or type doesn't match.
   template<typename _Tp, int _rows, int _cols>
   void eigen2cv(const Eigen::Matrix<_Tp, _rows, _cols>& src,
                 cv::Mat& dst )
   {
+    if(dst.rows != src.rows() || dst.cols != src.cols() || dst.type() != cv::DataType<_Tp>::type) {
+      dst.create(src.rows(), src.cols(), cv::DataType<_Tp>::type);
+    }
+
+    if(dst.isContinuous()) {
+      Eigen::Map<CvMappedMatrix<_Tp,_rows,_cols>>(dst.ptr<_Tp>(), dst.rows, dst.cols) = src;
+      return;
+    }
+
     for(int i = 0; i < src.rows(); ++i) {
       for(int j = 0; j < src.cols(); ++j) {
         dst.at<_Tp>(i,j) = src(i,j);
@@ -39,18 +66,35 @@ namespace TS_SfM {
 
   class MapPoint;
   struct MatchObsAndLdmk;
+  struct MatchInfo;
 
 namespace Solver {
 
-    using SvdInEight1st = Eigen::JacobiSVD< Eigen::Matrix<float,8,9>,Eigen::ColPivHouseholderQRPreconditioner>;
-    using SvdInEight2nd = Eigen::JacobiSVD< Eigen::Matrix<float,3,3>,Eigen::ColPivHouseholderQRPreconditioner>;
-    using SvdInTri = Eigen::JacobiSVD< Eigen::Matrix<float,4,4>,Eigen::ColPivHouseholderQRPreconditioner>;
+  enum CheiralityCheck {
+    FullCheck = 0, // triangulate all matches for each candidate by SVD
+    FastCheck = 1  // closed-form depths on a random subset, stops early
+  };
 
   cv::Mat DecomposeE(const std::vector<cv::KeyPoint>& pts0,
                      const std::vector<cv::KeyPoint>& pts1,
                      const std::vector<cv::DMatch>& v_matches,
                      const cv::Mat& K,
-                     const cv::Mat& E);
+                     const cv::Mat& E,
+                     const CheiralityCheck check_type = FastCheck);
+
+  // Return the index of [R|t] candidate which has the most points in front of both cameras.
+  int SelectPoseByFullCheirality(const std::vector<cv::KeyPoint>& pts0,
+                                 const std::vector<cv::KeyPoint>& pts1,
+                                 const std::vector<cv::DMatch>& v_matches,
+                                 const Matrix33f& K,
+                                 const Matrix34f v_T[4]);
+
+  int SelectPoseByFastCheirality(const std::vector<cv::KeyPoint>& pts0,
+                                 const std::vector<cv::KeyPoint>& pts1,
+                                 const std::vector<cv::DMatch>& v_matches,
+                                 const Matrix33f& K,
+                                 const Matrix34f v_T[4],
+                                 const int max_samples = 64, const int min_samples = 16);
 
   // Given intrinsic params and matchings nad kpts, Compute E and F matrix 
   bool SolveEpipolarConstraintRANSAC(
@@ -89,15 +133,72 @@ namespace Solver {
                                 const std::vector<cv::Point2f>& pts1,
                                 cv::Mat& F);
 
+  struct TriangulatorConfig {
+    float min_parallax_deg;
+    float max_reproj_error; // pixel
+    int num_threads;        // <= 0 : hardware concurrency
+  };
+
+  // All arrays are aligned with the input tracks.
+  struct TriangulationResult {
+    std::vector<cv::Point3f> v_pts_3d;
+    std::vector<char> vb_valid; // not vector<bool> since it is written from several threads
+    std::vector<float> v_parallax_deg;
+    std::vector<float> v_reproj_error;
+  };
+
+  // Multi-view triangulation by closed-form normal equations of the ray midpoint.
+  // MatchInfo::frame_id indexes vv_kpts and v_poses(cTw, 3x4).
+  TriangulationResult TriangulateTracks(const std::vector<std::vector<MatchInfo>>& vv_tracks,
+                                        const std::vector<std::vector<cv::KeyPoint>>& vv_kpts,
+                                        const std::vector<cv::Mat>& v_poses,
+                                        const cv::Mat& K,
+                                        const TriangulatorConfig& config);
+
+  bool TriangulateTrack(const MatchInfo* p_obs, const int num_obs,
+                        const std::vector<std::vector<cv::KeyPoint>>& vv_kpts,
+                        const std::vector<Eigen::Matrix3d>& v_R,
+                        const std::vector<Eigen::Vector3d>& v_t,
+                        const Eigen::Matrix3d& K, const Eigen::Matrix3d& K_inv,
+                        const TriangulatorConfig& config,
+                        Eigen::Vector3d& pt_3d, float& parallax_deg, float& reproj_error);
+
+  // Absolute pose (cTw, 3x4 CV_32F) from 2D-3D matches. P3P in RANSAC, DLT on inliers
+  // and Gauss-Newton refinement. Returns empty cv::Mat if it failed.
   cv::Mat SolvePnPRANSAC(const std::vector<cv::KeyPoint>& v_keypoints,
                          const std::vector<MapPoint>& v_mappoints,
                          const std::vector<MatchObsAndLdmk>& v_matches,
-                         std::vector<bool> vb_inliers);
+                         const cv::Mat& K,
+                         std::vector<bool>& vb_inliers,
+                         int max_iteration = 300, float threshold = 4.0);
 
   cv::Mat SolvePnP(const std::vector<cv::Point3f>& v_landmarks_w,
                    const std::vector<cv::Point2f>& v_obs_pts_c,
                    const cv::Mat& K);
 
+  // Minimal solver (Grunert). Columns of F are bearings, columns of P_w are points.
+  // Returns the number of solutions (<= 4).
+  int SolveP3P(const Eigen::Matrix3d& F, const Eigen::Matrix3d& P_w,
+               Eigen::Matrix3d v_R[4], Eigen::Vector3d v_t[4]);
+
+  // p_c = R * p_w + t for 3 points
+  void AlignPoints3(const Eigen::Matrix3d& P_w, const Eigen::Matrix3d& P_c,
+                    Eigen::Matrix3d& R, Eigen::Vector3d& t);
+
+  // p_idx selects the correspondences to use. Observations are normalized coordinates.
+  bool SolvePnPDLT(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs_n,
+                   const int* p_idx, const int num,
+                   Eigen::Matrix3d& R, Eigen::Vector3d& t);
+
+  void RefinePoseGaussNewton(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs_n,
+                             const int* p_idx, const int num,
+                             Eigen::Matrix3d& R, Eigen::Vector3d& t, const int max_iteration = 10);
+
+  int CountPnPInliers(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs_n, const int num,
+                      const Eigen::Matrix3d& R, const Eigen::Vector3d& t,
+                      const double fx, const double fy, const double sq_threshold,
+                      std::vector<bool>* p_vb_inliers = nullptr);
+
 }; // Solver namespace
 
   inline std::vector<float> Solver::ComputeEpipolarDistances(const std::vector<cv::KeyPoint>& pts0,
@@ -106,16 +207,14 @@ namespace Solver {
                                                              const cv::Mat& F)
   {
     std::vector<float> vf_distances(v_matches.size(), -1.0);
+    Matrix33f eF;
+    cv2eigen(F, eF);
 
     int idx = 0;
     for(auto m : v_matches) {
-      cv::Mat pt0 = (cv::Mat_<float>(3,1) << pts0[m.queryIdx].pt.x, pts0[m.queryIdx].pt.y, 1.0);
-      cv::Mat l = F * cv::Mat(pt0);
-      cv::Point2f pt1(pts1[m.trainIdx].pt.x, pts1[m.trainIdx].pt.y);
-      cv::Vec3f line(l.reshape(3).at<cv::Vec3f>());
-      float _d = fabsf(line(0)*pt1.x + line(1)*pt1.y + line(2)) / sqrt(line(0)*line(0)+line(1)*line(1));
-
-      vf_distances[idx] = _d;
+      vf_distances[idx] = EpipolarDistance<float>(eF,
+                                                  Eigen::Vector2f(pts0[m.queryIdx].pt.x, pts0[m.queryIdx].pt.y),
+                                                  Eigen::Vector2f(pts1[m.trainIdx].pt.x, pts1[m.trainIdx].pt.y));
       ++idx;
     }
 
@@ -126,14 +225,13 @@ namespace Solver {
                                         const std::vector<cv::Point2f>& pts1,
                                         const cv::Mat& F) {
     float distance = 0.0;
+    Matrix33f eF;
+    cv2eigen(F, eF);
 
     for(int i = 0; i < 8; ++i) {
-      cv::Mat pt = (cv::Mat_<float>(3,1) << pts0[i].x, pts0[i].y, 1.0);
-      cv::Mat l = F * cv::Mat(pt);
-      cv::Vec3f line(l.reshape(3).at<cv::Vec3f>());
-      float _d = fabsf(line(0)*pts1[i].x + line(1)*pts1[i].y + line(2)) / sqrt(line(0)*line(0)+line(1)*line(1));
-
-      distance += _d; 
+      distance += EpipolarDistance<float>(eF,
+                                          Eigen::Vector2f(pts0[i].x, pts0[i].y),
+                                          Eigen::Vector2f(pts1[i].x, pts1[i].y));
     }
 
     return distance/8.0;
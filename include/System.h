@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ConfigLoader.h"
+#include "TrackBuilder.h"
 #include <memory>
 #include <vector>
 #include <string>
@@ -10,11 +11,14 @@ namespace TS_SfM {
   class Frame;
   class KeyFrame;
   class KPExtractor;
+  class Undistorter;
   class Reconstructor;
   class Map;
   class MapPoint;
 
   class Matcher;
+  class Optimizer;
+  class LoopClosure;
 
   class Viewer;
 
@@ -31,14 +35,25 @@ namespace TS_SfM {
         std::vector<MapPoint> v_mappoints;
       };
 
+      // Tracks of the initial frames, mappoints are triangulated from them.
+      struct FeatureTracks {
+        TrackBuilder::Tracks tracks;
+        // frame id -> keypoint id -> track id, -1 if the keypoint is on no track
+        std::vector<std::vector<int>> vv_track_of_kpt;
+        // undistorted keypoints indexed by frame id as MatchInfo::frame_id of the tracks
+        std::vector<std::vector<cv::KeyPoint>> vv_kpts;
+      };
+
     public:
-      System(const std::string& str_config_file);
+      // The last checkpoint is continued if b_resume is set.
+      System(const std::string& str_config_file, const bool b_resume = false);
       ~System();
       void Run();
 
     private:
       void ShowConfig();
       const std::string m_config_file;
+      const bool m_b_resume;
       SystemConfig m_config;
       Camera m_camera;
       unsigned int m_image_width, m_image_height;
@@ -47,6 +62,10 @@ namespace TS_SfM {
       std::vector<Frame> m_v_frames; 
   
       std::unique_ptr<KPExtractor> m_p_extractor;
+      std::unique_ptr<Undistorter> m_p_undistorter;
+      std::unique_ptr<Optimizer> m_p_optimizer;
+      std::unique_ptr<LoopClosure> m_p_loop_closure;
+      std::unique_ptr<Checkpointer> m_p_checkpointer;
 
       // Those pointers are used globally in TS_SfM::System
       std::unique_ptr<Reconstructor> m_p_reconstructor;
@@ -54,14 +73,25 @@ namespace TS_SfM {
       std::unique_ptr<Viewer> m_p_viewer;
 
       InitializerConfig m_initializer_config;
+      Matcher::MatcherConfig m_matcher_config;
+      Solver::TriangulatorConfig m_triangulator_config;
+      Optimizer::OptimizerConfig m_optimizer_config;
+      LoopClosure::LoopConfig m_loop_config;
+      Checkpointer::CheckpointConfig m_checkpoint_config;
 
       void InitializeFrames(std::vector<Frame>& v_frames, const int num_frames_in_initial_map = 6);
+      // Features of the checkpoint instead of extraction.
+      void RestoreFrames(std::vector<Frame>& v_frames, const Checkpointer::Caches& caches);
       int InitializeGlobalMap(std::vector<std::reference_wrapper<Frame>>& v_frames);
-      InitialReconstruction FlexibleInitializeGlobalMap(std::vector<std::reference_wrapper<Frame>>& v_frames);
+      // Matching and the 2-view initialization are skipped if a checkpoint is given, registration
+      // continues after its cursor.
+      InitialReconstruction FlexibleInitializeGlobalMap(std::vector<std::reference_wrapper<Frame>>& v_frames,
+                                                        const Checkpointer::State* p_resume_state = nullptr);
       int IncrementalSfM(std::vector<KeyFrame>& v_keyframes, 
                          std::vector<MapPoint>& v_mappoints,
                          Frame& f,
                          const std::vector<std::vector<cv::DMatch>>& v_matches,
+                         const FeatureTracks& feature_tracks,
                          const InitializerConfig _config);
 
       void DrawEpiLines(const Frame& f0, const Frame& f1, 
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Matcher.h"
+
+namespace TS_SfM {
+
+  // Feature tracks as connected components of pairwise matches.
+  // Every keypoint (frame_id, kpt_id) is a node with a dense index (offset of the frame + kpt_id),
+  // matches are merged by a lock-free union-find, so AddMatches may be called from several threads.
+  // A component observed twice in one frame is inconsistent and is not emitted.
+  class TrackBuilder {
+    public:
+      // Track i is v_observations[v_offsets[i], v_offsets[i+1]) in ascending order of frame_id.
+      struct Tracks {
+        std::vector<int> v_offsets;
+        std::vector<MatchInfo> v_observations;
+        int num_rejected = 0; // inconsistent tracks
+
+        int GetNumTracks() const { return v_offsets.empty() ? 0 : (int)v_offsets.size() - 1; }
+        int GetTrackLength(const int track_id) const { return v_offsets[track_id+1] - v_offsets[track_id]; }
+        const MatchInfo* GetTrack(const int track_id) const { return v_observations.data() + v_offsets[track_id]; }
+        // For Solver::TriangulateTracks
+        std::vector<std::vector<MatchInfo>> ToVectors() const;
+      };
+
+      // v_num_keypoints[frame_id] is the number of keypoints of the frame.
+      TrackBuilder(const std::vector<int>& v_num_keypoints, const int num_threads = 0);
+      ~TrackBuilder(){};
+
+      // queryIdx is a keypoint of frame_id_0 and trainIdx of frame_id_1. Thread-safe.
+      void AddMatches(const int frame_id_0, const int frame_id_1, const std::vector<cv::DMatch>& v_matches);
+      // vvv_matches[i][j] are the matches of frame i to frame j, pairs are processed in parallel.
+      void AddMatches(const std::vector<std::vector<std::vector<cv::DMatch>>>& vvv_matches);
+
+      int GetNumFrames() const { return (int)m_v_offsets.size() - 1; }
+      int GetNumNodes() const { return (int)m_v_offsets.back(); }
+
+      // Components with at least min_track_length observations. Must not run concurrently with AddMatches.
+      Tracks Build(const int min_track_length = 2);
+
+    private:
+      uint32_t Find(uint32_t node);
+      void Union(uint32_t node_0, uint32_t node_1);
+
+      // frame_id -> index of its first node, the last element is the number of nodes
+      std::vector<uint32_t> m_v_offsets;
+      // A root is its own parent and a parent always has a smaller index than the child,
+      // so concurrent linking and path halving cannot make a cycle.
+      std::unique_ptr<std::atomic<uint32_t>[]> m_p_parents;
+      const int m_num_threads;
+  };
+
+} // namespace
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "ConfigLoader.h"
+
+namespace TS_SfM {
+
+  // Keypoints are undistorted once after extraction by bilinear lookup into
+  // a table of normalized coordinates. The table is sampled every m_step pixels
+  // and built at startup with the iterative undistortion.
+  class Undistorter {
+    public:
+      Undistorter(const Camera& cam,
+                  const unsigned int image_width,
+                  const unsigned int image_height,
+                  const int step = 4);
+      ~Undistorter(){};
+
+      // pixel -> normalized coordinates (x/z, y/z) without distortion
+      cv::Point2f UndistortToNormalized(const cv::Point2f& pt) const;
+
+      // v_undist_kpts are the same keypoints with undistorted pixel coordinates.
+      void UndistortKeyPoints(const std::vector<cv::KeyPoint>& v_kpts,
+                              std::vector<cv::Point2f>& v_normalized_pts,
+                              std::vector<cv::KeyPoint>& v_undist_kpts) const;
+
+      bool HasDistortion() const { return m_has_distortion; };
+
+      static cv::Point2f UndistortIteratively(const Camera& cam, const cv::Point2f& pt,
+                                              const int max_iteration = 20);
+
+    private:
+      const Camera m_camera;
+      const int m_step;
+      int m_lut_width, m_lut_height;
+      bool m_has_distortion;
+
+      std::vector<float> m_v_lut_x;
+      std::vector<float> m_v_lut_y;
+  };
+
+} // namespace
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <vector>
+#include <thread>
+#include <algorithm>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Core>
 
@@ -15,6 +17,56 @@ namespace TS_SfM{
 
   Eigen::Vector2d ProjectToImage(const cv::Mat& K, const cv::Mat& cTw, const cv::Point3f& pt);
 
+  // Projection of points given as separate coordinate arrays (pinhole, no distortion).
+  // pb_visible[i] is 1 if the depth is in (min_depth, max_depth] and the point is inside the image.
+  // Returns the number of visible points.
+  int ProjectPoints(const Eigen::Matrix<float,3,4>& cTw, const float fx, const float fy, const float cx, const float cy,
+                    const int width, const int height, const float min_depth, const float max_depth,
+                    const int num_points,
+                    const float* p_x, const float* p_y, const float* p_z,
+                    float* p_u, float* p_v, unsigned char* pb_visible);
+
   cv::Mat Inverse3x4(const cv::Mat& _pose);
   cv::Mat AppendRow(const cv::Mat& _pose);
+
+  // Run func(i) for i in [begin, end) on contiguous chunks over num_threads threads.
+  // num_threads <= 0 means std::thread::hardware_concurrency().
+  template<typename Func>
+  void ParallelFor(const int begin, const int end, Func func, int num_threads = 0) {
+    const int length = end - begin;
+    if(length <= 0) {
+      return;
+    }
+    if(num_threads <= 0) {
+      num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    num_threads = std::min(num_threads, length);
+
+    if(num_threads == 1) {
+      for(int i = begin; i < end; ++i) {
+        func(i);
+      }
+      return;
+    }
+
+    const int chunk = (length + num_threads - 1)/num_threads;
+    std::vector<std::thread> v_threads;
+    v_threads.reserve(num_threads);
+    for(int th = 0; th < num_threads; ++th) {
+      const int chunk_begin = begin + th*chunk;
+      const int chunk_end = std::min(end, chunk_begin + chunk);
+      if(chunk_begin >= chunk_end) {
+        break;
+      }
+      v_threads.emplace_back([chunk_begin, chunk_end, &func]() {
+        for(int i = chunk_begin; i < chunk_end; ++i) {
+          func(i);
+        }
+      });
+    }
+    for(auto& th : v_threads) {
+      th.join();
+    }
+    return;
+  }
 }
@@ -8,14 +8,21 @@
 #include <GL/gl3w.h>            // Initialize with gl3wInit()
 #include <GLFW/glfw3.h>
 
+#include <memory>
+
 namespace TS_SfM {
+class Map;
+
 class Viewer {
   public:
     Viewer(){};
     ~Viewer(){};
 
+    // Map is read through its snapshots, the viewer never blocks the writer.
+    void SetMap(std::shared_ptr<const Map> p_map) { m_p_map = p_map; }
     int Run();
   private:
+    std::shared_ptr<const Map> m_p_map;
 
 };
 };
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace TS_SfM {
+
+  // Spatial hash of points on a regular voxel grid.
+  // Each occupied voxel keeps its points (id and position) contiguously, so a query touches only
+  // the voxels overlapping the query volume, or every occupied voxel if that is fewer.
+  // Ids are small non-negative integers (mappoint ids).
+  class VoxelHashIndex {
+    public:
+      struct Entry {
+        uint32_t id;
+        float x, y, z;
+      };
+
+      // Pinhole frustum in world coordinates, cTw maps world to camera.
+      struct Frustum {
+        Eigen::Matrix3f R;
+        Eigen::Vector3f t;
+        float fx, fy, cx, cy;
+        int width, height; // pixel
+        float min_depth, max_depth;
+      };
+
+      VoxelHashIndex(const float voxel_size = 1.0f);
+      ~VoxelHashIndex(){};
+
+      void Insert(const uint32_t id, const float x, const float y, const float z);
+      // Replaces the content by the given points (distinct ids). Each voxel is allocated once,
+      // so it is much cheaper than inserting them one by one (e.g. loading a map).
+      void Build(const std::vector<Entry>& v_entries);
+      bool Remove(const uint32_t id);
+      // Moves the point to its new voxel if needed.
+      void Update(const uint32_t id, const float x, const float y, const float z);
+      void Clear();
+
+      int GetNumPoints() const { return m_num_points; }
+      int GetNumVoxels() const { return (int)m_map_voxels.size(); }
+
+      // Points within radius of the center.
+      void QueryRadius(const Eigen::Vector3f& center, const float radius, std::vector<Entry>& v_entries) const;
+      // Points of voxels intersecting the frustum. The test is conservative per voxel, so points
+      // slightly outside are returned too and have to be checked by projection.
+      void QueryFrustum(const Frustum& frustum, std::vector<Entry>& v_entries) const;
+
+    private:
+      typedef long long VoxelKey;
+      VoxelKey ToKey(const int ix, const int iy, const int iz) const;
+      VoxelKey ToKey(const float x, const float y, const float z) const;
+      Eigen::Vector3i ToCoord(const VoxelKey key) const;
+      int ToIndex(const float v) const;
+
+      // Calls func(key, entries) for occupied voxels in the inclusive coordinate box.
+      template<typename Func>
+      void ForEachVoxel(const Eigen::Vector3i& min_coord, const Eigen::Vector3i& max_coord, Func func) const;
+
+      const float m_voxel_size;
+      int m_num_points;
+      std::unordered_map<VoxelKey, std::vector<Entry>> m_map_voxels;
+      // id -> voxel of the point, INVALID_KEY if the id is not inserted
+      std::vector<VoxelKey> m_v_id_to_key;
+      static const VoxelKey INVALID_KEY = -1;
+  };
+
+} // namespace
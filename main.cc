@@ -8,13 +8,14 @@ using std::endl;
 void ShowUsage();
 
 int main(int argc, char* argv[]) {
-  if(argc != 2) {
+  if(argc != 2 && !(argc == 3 && std::string(argv[2]) == "--resume")) {
     ShowUsage();
     return -1;
   }
 
   const std::string str_config_file = argv[1];
-  TS_SfM::System _sfm(str_config_file);
+  const bool b_resume = argc == 3;
+  TS_SfM::System _sfm(str_config_file, b_resume);
 
   _sfm.Run();
 
@@ -23,7 +24,9 @@ int main(int argc, char* argv[]) {
 
 
 void ShowUsage() {
-  cout << "Usage : this.out [/path/to/config_params.yaml] "
+  cout << "Usage : this.out [/path/to/config_params.yaml] [--resume]"
+       << endl;
+  cout << "  --resume : continue from the last checkpoint in Checkpoint.directory"
        << endl;
   return;
 }
@@ -0,0 +1,305 @@
+#include "BALFormat.h"
+
+#include <Eigen/Geometry>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace TS_SfM {
+
+namespace {
+  const char BINARY_MAGIC[5] = {'T', 'S', 'B', 'A', 'L'};
+  const uint32_t BINARY_VERSION = 1;
+
+  // Camera and problem in BAL convention
+  struct BALCamera {
+    double params[9]; // angle axis, translation, f, k1, k2
+  };
+
+  struct BALObservation {
+    int32_t camera_idx;
+    int32_t point_idx;
+    double u, v;
+  };
+
+  const Eigen::Matrix3d& FlipYZ() {
+    static const Eigen::Matrix3d F = Eigen::Vector3d(1.0, -1.0, -1.0).asDiagonal();
+    return F;
+  }
+
+  BALCamera ToBALCamera(const BAProblem::CameraParam& cam) {
+    BALCamera bal_cam;
+    const Eigen::AngleAxisd angle_axis(Eigen::Matrix3d(FlipYZ() * cam.R));
+    const Eigen::Vector3d w = angle_axis.angle() * angle_axis.axis();
+    const Eigen::Vector3d t = FlipYZ() * cam.t;
+    for(int k = 0; k < 3; ++k) {
+      bal_cam.params[k] = w(k);
+      bal_cam.params[3+k] = t(k);
+    }
+    bal_cam.params[6] = cam.fx;
+    bal_cam.params[7] = 0.0;
+    bal_cam.params[8] = 0.0;
+    return bal_cam;
+  }
+
+  void FromBALCamera(const BALCamera& bal_cam, Eigen::Matrix3d& R, Eigen::Vector3d& t) {
+    const Eigen::Vector3d w(bal_cam.params[0], bal_cam.params[1], bal_cam.params[2]);
+    const double angle = w.norm();
+    const Eigen::Matrix3d R_bal = angle > 1e-15 ? Eigen::AngleAxisd(angle, w/angle).toRotationMatrix()
+                                                : Eigen::Matrix3d::Identity();
+    R = FlipYZ() * R_bal;
+    t = FlipYZ() * Eigen::Vector3d(bal_cam.params[3], bal_cam.params[4], bal_cam.params[5]);
+  }
+
+  // Observation with radial distortion of the camera removed, in BAL convention.
+  Eigen::Vector2d Undistort(const BALCamera& bal_cam, const double u, const double v) {
+    const double f = bal_cam.params[6], k1 = bal_cam.params[7], k2 = bal_cam.params[8];
+    const Eigen::Vector2d distorted(u/f, v/f);
+    Eigen::Vector2d p = distorted;
+    for(int it = 0; it < 20 && (k1 != 0.0 || k2 != 0.0); ++it) {
+      const double r2 = p.squaredNorm();
+      p = distorted / (1.0 + r2*(k1 + k2*r2));
+    }
+    return f * p;
+  }
+
+  bool BuildProblem(const std::vector<BALCamera>& v_bal_cameras, const std::vector<double>& v_bal_points,
+                    const std::vector<BALObservation>& v_bal_observations,
+                    const std::vector<char>& vb_fixed_cameras, const std::vector<char>& vb_fixed_points,
+                    BAProblem& problem)
+  {
+    problem = BAProblem();
+    for(size_t i = 0; i < v_bal_cameras.size(); ++i) {
+      Eigen::Matrix3d R;
+      Eigen::Vector3d t;
+      FromBALCamera(v_bal_cameras[i], R, t);
+      const double f = v_bal_cameras[i].params[6];
+      problem.AddCamera(R, t, f, f, 0.0, 0.0, vb_fixed_cameras[i] != 0);
+    }
+    for(size_t j = 0; j < vb_fixed_points.size(); ++j) {
+      problem.AddPoint(Eigen::Vector3d(v_bal_points[3*j], v_bal_points[3*j+1], v_bal_points[3*j+2]),
+                       vb_fixed_points[j] != 0);
+    }
+    for(const BALObservation& obs : v_bal_observations) {
+      if(obs.camera_idx < 0 || obs.camera_idx >= (int)problem.v_cameras.size() ||
+         obs.point_idx < 0 || obs.point_idx >= (int)problem.v_points.size()) {
+        std::cerr << "[FAILED]: Observation refers to camera " << obs.camera_idx
+                  << " / point " << obs.point_idx << " out of range" << std::endl;
+        return false;
+      }
+      const Eigen::Vector2d uv = Undistort(v_bal_cameras[obs.camera_idx], obs.u, obs.v);
+      problem.AddObservation(obs.camera_idx, obs.point_idx, Eigen::Vector2d(uv.x(), -uv.y()));
+    }
+    return true;
+  }
+
+  template<typename T>
+  void WriteBinary(std::ofstream& ofs, const T* p_data, const size_t num) {
+    ofs.write(reinterpret_cast<const char*>(p_data), sizeof(T)*num);
+  }
+
+  template<typename T>
+  bool ReadBinary(std::ifstream& ifs, T* p_data, const size_t num) {
+    return (bool)ifs.read(reinterpret_cast<char*>(p_data), sizeof(T)*num);
+  }
+}
+
+  bool BALFormat::Export(const BAProblem& problem, const std::string& str_file, const bool b_binary) {
+    std::ofstream ofs(str_file, b_binary ? std::ios::out | std::ios::binary : std::ios::out);
+    if(!ofs.is_open()) {
+      std::cerr << "[FAILED]: Cannot open " << str_file << std::endl;
+      return false;
+    }
+
+    const int32_t num_cameras = (int32_t)problem.v_cameras.size();
+    const int32_t num_points = (int32_t)problem.v_points.size();
+    const int32_t num_observations = (int32_t)problem.v_observations.size();
+    std::vector<BALObservation> v_bal_observations(num_observations);
+    for(int o = 0; o < num_observations; ++o) {
+      const BAProblem::Observation& obs = problem.v_observations[o];
+      const BAProblem::CameraParam& cam = problem.v_cameras[obs.camera_idx];
+      v_bal_observations[o] = BALObservation{obs.camera_idx, obs.point_idx,
+                                             obs.uv.x() - cam.cx, (cam.cy - obs.uv.y()) * cam.fx / cam.fy};
+    }
+    std::vector<char> vb_fixed_cameras(num_cameras);
+    for(int i = 0; i < num_cameras; ++i) {
+      vb_fixed_cameras[i] = problem.v_cameras[i].fixed ? 1 : 0;
+    }
+
+    if(b_binary) {
+      const int32_t v_counts[3] = {num_cameras, num_points, num_observations};
+      WriteBinary(ofs, BINARY_MAGIC, 5);
+      WriteBinary(ofs, &BINARY_VERSION, 1);
+      WriteBinary(ofs, v_counts, 3);
+      for(const BALObservation& obs : v_bal_observations) {
+        WriteBinary(ofs, &obs.camera_idx, 1);
+        WriteBinary(ofs, &obs.point_idx, 1);
+        WriteBinary(ofs, &obs.u, 1);
+        WriteBinary(ofs, &obs.v, 1);
+      }
+      for(const BAProblem::CameraParam& cam : problem.v_cameras) {
+        WriteBinary(ofs, ToBALCamera(cam).params, 9);
+      }
+      for(const Eigen::Vector3d& pt : problem.v_points) {
+        WriteBinary(ofs, pt.data(), 3);
+      }
+      WriteBinary(ofs, vb_fixed_cameras.data(), vb_fixed_cameras.size());
+      WriteBinary(ofs, problem.vb_fixed_points.data(), problem.vb_fixed_points.size());
+      return (bool)ofs;
+    }
+
+    ofs << num_cameras << " " << num_points << " " << num_observations << "\n";
+    ofs << std::scientific << std::setprecision(16);
+    for(const BALObservation& obs : v_bal_observations) {
+      ofs << obs.camera_idx << " " << obs.point_idx << " " << obs.u << " " << obs.v << "\n";
+    }
+    for(const BAProblem::CameraParam& cam : problem.v_cameras) {
+      const BALCamera bal_cam = ToBALCamera(cam);
+      for(int k = 0; k < 9; ++k) {
+        ofs << bal_cam.params[k] << "\n";
+      }
+    }
+    for(const Eigen::Vector3d& pt : problem.v_points) {
+      ofs << pt.x() << "\n" << pt.y() << "\n" << pt.z() << "\n";
+    }
+
+    // fixed parameters
+    int num_fixed_cameras = 0, num_fixed_points = 0;
+    for(const char b_fixed : vb_fixed_cameras) {
+      num_fixed_cameras += b_fixed;
+    }
+    for(const char b_fixed : problem.vb_fixed_points) {
+      num_fixed_points += b_fixed ? 1 : 0;
+    }
+    ofs << num_fixed_cameras << " " << num_fixed_points << "\n";
+    for(int i = 0; i < num_cameras; ++i) {
+      if(vb_fixed_cameras[i]) {
+        ofs << i << "\n";
+      }
+    }
+    for(int j = 0; j < num_points; ++j) {
+      if(problem.vb_fixed_points[j]) {
+        ofs << j << "\n";
+      }
+    }
+    return (bool)ofs;
+  }
+
+  bool BALFormat::Import(const std::string& str_file, BAProblem& problem) {
+    std::ifstream ifs(str_file, std::ios::in | std::ios::binary);
+    if(!ifs.is_open()) {
+      std::cerr << "[FAILED]: Cannot open " << str_file << std::endl;
+      return false;
+    }
+    // counts of the header are checked against the file size before allocating
+    ifs.seekg(0, std::ios::end);
+    const uint64_t file_size = (uint64_t)ifs.tellg();
+    ifs.seekg(0);
+
+    char magic[5] = {0};
+    ifs.read(magic, 5);
+    const bool b_binary = ifs.gcount() == 5 && std::memcmp(magic, BINARY_MAGIC, 5) == 0;
+    if(!b_binary) {
+      ifs.clear();
+      ifs.seekg(0);
+    }
+
+    int32_t num_cameras = 0, num_points = 0, num_observations = 0;
+    std::vector<BALCamera> v_bal_cameras;
+    std::vector<double> v_bal_points;
+    std::vector<BALObservation> v_bal_observations;
+    std::vector<char> vb_fixed_cameras, vb_fixed_points;
+    if(b_binary) {
+      uint32_t version = 0;
+      int32_t v_counts[3];
+      if(!ReadBinary(ifs, &version, 1) || version != BINARY_VERSION || !ReadBinary(ifs, v_counts, 3)) {
+        std::cerr << "[FAILED]: Unsupported binary BAL file " << str_file << std::endl;
+        return false;
+      }
+      num_cameras = v_counts[0];
+      num_points = v_counts[1];
+      num_observations = v_counts[2];
+      const uint64_t header_size = sizeof(BINARY_MAGIC) + sizeof(uint32_t) + sizeof(v_counts);
+      if(num_cameras < 0 || num_points < 0 || num_observations < 0 ||
+         (uint64_t)num_observations * (2*sizeof(int32_t) + 2*sizeof(double)) +
+         (uint64_t)num_cameras * (9*sizeof(double) + 1) + (uint64_t)num_points * (3*sizeof(double) + 1)
+         > file_size - header_size)
+      {
+        std::cerr << "[FAILED]: Invalid counts in binary BAL file " << str_file << std::endl;
+        return false;
+      }
+      v_bal_observations.resize(num_observations);
+      v_bal_cameras.resize(num_cameras);
+      v_bal_points.resize(3*(size_t)num_points);
+      vb_fixed_cameras.resize(num_cameras);
+      vb_fixed_points.resize(num_points);
+      bool b_read = true;
+      for(BALObservation& obs : v_bal_observations) {
+        b_read = b_read && ReadBinary(ifs, &obs.camera_idx, 1) && ReadBinary(ifs, &obs.point_idx, 1) &&
+                 ReadBinary(ifs, &obs.u, 1) && ReadBinary(ifs, &obs.v, 1);
+      }
+      for(BALCamera& bal_cam : v_bal_cameras) {
+        b_read = b_read && ReadBinary(ifs, bal_cam.params, 9);
+      }
+      b_read = b_read && ReadBinary(ifs, v_bal_points.data(), v_bal_points.size())
+                      && ReadBinary(ifs, vb_fixed_cameras.data(), vb_fixed_cameras.size())
+                      && ReadBinary(ifs, vb_fixed_points.data(), vb_fixed_points.size());
+      if(!b_read) {
+        std::cerr << "[FAILED]: Truncated binary BAL file " << str_file << std::endl;
+        return false;
+      }
+    }
+    else {
+      // every value takes at least a digit and a separator
+      if(!(ifs >> num_cameras >> num_points >> num_observations) ||
+         num_cameras < 0 || num_points < 0 || num_observations < 0 ||
+         2*(4*(uint64_t)num_observations + 9*(uint64_t)num_cameras + 3*(uint64_t)num_points) > file_size + 1) {
+        std::cerr << "[FAILED]: Cannot read BAL header of " << str_file << std::endl;
+        return false;
+      }
+      v_bal_observations.resize(num_observations);
+      v_bal_cameras.resize(num_cameras);
+      v_bal_points.resize(3*(size_t)num_points);
+      bool b_read = true;
+      for(BALObservation& obs : v_bal_observations) {
+        b_read = b_read && (ifs >> obs.camera_idx >> obs.point_idx >> obs.u >> obs.v);
+      }
+      for(BALCamera& bal_cam : v_bal_cameras) {
+        for(int k = 0; k < 9; ++k) {
+          b_read = b_read && (ifs >> bal_cam.params[k]);
+        }
+      }
+      for(double& value : v_bal_points) {
+        b_read = b_read && (ifs >> value);
+      }
+      if(!b_read) {
+        std::cerr << "[FAILED]: Truncated BAL file " << str_file << std::endl;
+        return false;
+      }
+
+      // optional fixed parameters
+      vb_fixed_cameras.assign(num_cameras, 0);
+      vb_fixed_points.assign(num_points, 0);
+      int num_fixed_cameras = 0, num_fixed_points = 0;
+      if(ifs >> num_fixed_cameras >> num_fixed_points) {
+        int idx;
+        for(int i = 0; i < num_fixed_cameras && (ifs >> idx); ++i) {
+          if(idx >= 0 && idx < num_cameras) {
+            vb_fixed_cameras[idx] = 1;
+          }
+        }
+        for(int j = 0; j < num_fixed_points && (ifs >> idx); ++j) {
+          if(idx >= 0 && idx < num_points) {
+            vb_fixed_points[idx] = 1;
+          }
+        }
+      }
+    }
+
+    return BuildProblem(v_bal_cameras, v_bal_points, v_bal_observations, vb_fixed_cameras, vb_fixed_points, problem);
+  }
+
+} // namespace
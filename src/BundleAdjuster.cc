@@ -0,0 +1,1109 @@
+#include "BundleAdjuster.h"
+#include "Utils.h"
+
+#include <Eigen/Cholesky>
+#include <Eigen/Geometry>
+#include <Eigen/SVD>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+namespace TS_SfM {
+
+  int BAProblem::AddCamera(const Eigen::Matrix3d& R, const Eigen::Vector3d& t,
+                           const double fx, const double fy, const double cx, const double cy,
+                           const bool fixed)
+  {
+    CameraParam cam;
+    cam.R = R;
+    cam.t = t;
+    cam.fx = fx;
+    cam.fy = fy;
+    cam.cx = cx;
+    cam.cy = cy;
+    cam.fixed = fixed;
+    v_cameras.push_back(cam);
+    return (int)v_cameras.size() - 1;
+  }
+
+  int BAProblem::AddPoint(const Eigen::Vector3d& pt, const bool fixed) {
+    v_points.push_back(pt);
+    vb_fixed_points.push_back(fixed ? 1 : 0);
+    return (int)v_points.size() - 1;
+  }
+
+  void BAProblem::AddObservation(const int camera_idx, const int point_idx, const Eigen::Vector2d& uv) {
+    Observation obs;
+    obs.camera_idx = camera_idx;
+    obs.point_idx = point_idx;
+    obs.uv = uv;
+    v_observations.push_back(obs);
+  }
+
+  BundleAdjuster::BAConfig BundleAdjuster::DefaultConfig() {
+    BAConfig config;
+    config.linear_solver = SparseCholesky;
+    config.max_iteration = 50;
+    config.huber_delta = 4.0;
+    config.function_tolerance = 1e-6;
+    config.parameter_tolerance = 1e-8;
+    config.initial_lambda = 1e-4;
+    config.max_cg_iteration = 100;
+    config.cg_tolerance = 1e-6;
+    config.num_threads = 0;
+    config.verbose = false;
+    return config;
+  }
+
+  BundleAdjuster::BundleAdjuster(const BAConfig& config)
+    : m_config(config), m_robust_kernel(RobustKernel{config.huber_delta}), m_last_sq_error(0.0), m_num_free_cameras(0), m_num_free_points(0),
+      m_b_pattern_analyzed(false)
+  {
+  }
+
+  static Eigen::Matrix3d Skew(const Eigen::Vector3d& v) {
+    Eigen::Matrix3d m;
+    m <<     0.0, -v.z(),  v.y(),
+           v.z(),    0.0, -v.x(),
+          -v.y(),  v.x(),    0.0;
+    return m;
+  }
+
+  // Observations evaluated by a task, partial sums are reduced in fixed order.
+  static const int EVALUATE_CHUNK_SIZE = 512;
+  // Observations gathered into SoA arrays for the vectorized kernel, divides EVALUATE_CHUNK_SIZE.
+  static const int EVALUATE_BLOCK_SIZE = 64;
+
+  // Marquardt scaling, clamped to keep the damped system positive definite.
+  static double DampingDiagonal(const double d) {
+    return std::min(std::max(d, 1e-6), 1e32);
+  }
+
+  void BundleAdjuster::BuildStructure(const BAProblem& problem) {
+    const int num_cameras = (int)problem.v_cameras.size();
+    const int num_points = (int)problem.v_points.size();
+    const int num_obs = (int)problem.v_observations.size();
+
+    m_num_free_cameras = 0;
+    m_v_camera_to_free.assign(num_cameras, -1);
+    for(int i = 0; i < num_cameras; ++i) {
+      if(!problem.v_cameras[i].fixed) {
+        m_v_camera_to_free[i] = m_num_free_cameras++;
+      }
+    }
+    m_num_free_points = 0;
+    m_v_point_to_free.assign(num_points, -1);
+    for(int j = 0; j < num_points; ++j) {
+      if(!problem.vb_fixed_points[j]) {
+        m_v_point_to_free[j] = m_num_free_points++;
+      }
+    }
+
+    m_v_obs_points.resize(num_obs);
+    m_v_obs_free_cameras.resize(num_obs);
+    m_v_obs_cameras.resize(num_obs);
+    m_v_obs_u.resize(num_obs);
+    m_v_obs_v.resize(num_obs);
+    for(int o = 0; o < num_obs; ++o) {
+      const BAProblem::Observation& obs = problem.v_observations[o];
+      m_v_obs_points[o] = obs.point_idx;
+      m_v_obs_cameras[o] = obs.camera_idx;
+      m_v_obs_free_cameras[o] = m_v_camera_to_free[obs.camera_idx];
+      m_v_obs_u[o] = (float)obs.uv.x();
+      m_v_obs_v[o] = (float)obs.uv.y();
+    }
+    m_v_fx.resize(num_cameras);
+    m_v_fy.resize(num_cameras);
+    m_v_cx.resize(num_cameras);
+    m_v_cy.resize(num_cameras);
+    for(int i = 0; i < num_cameras; ++i) {
+      m_v_fx[i] = problem.v_cameras[i].fx;
+      m_v_fy[i] = problem.v_cameras[i].fy;
+      m_v_cx[i] = problem.v_cameras[i].cx;
+      m_v_cy[i] = problem.v_cameras[i].cy;
+    }
+
+    // observations grouped by point and by free camera
+    m_v_point_obs_ptr.assign(num_points + 1, 0);
+    m_v_camera_obs_ptr.assign(m_num_free_cameras + 1, 0);
+    for(const BAProblem::Observation& obs : problem.v_observations) {
+      ++m_v_point_obs_ptr[obs.point_idx + 1];
+      if(m_v_camera_to_free[obs.camera_idx] >= 0) {
+        ++m_v_camera_obs_ptr[m_v_camera_to_free[obs.camera_idx] + 1];
+      }
+    }
+    for(int j = 0; j < num_points; ++j) {
+      m_v_point_obs_ptr[j+1] += m_v_point_obs_ptr[j];
+    }
+    for(int i = 0; i < m_num_free_cameras; ++i) {
+      m_v_camera_obs_ptr[i+1] += m_v_camera_obs_ptr[i];
+    }
+    m_v_point_obs.resize(m_v_point_obs_ptr.back());
+    m_v_camera_obs.resize(m_v_camera_obs_ptr.back());
+    {
+      std::vector<int> v_point_fill(m_v_point_obs_ptr.begin(), m_v_point_obs_ptr.end() - 1);
+      std::vector<int> v_camera_fill(m_v_camera_obs_ptr.begin(), m_v_camera_obs_ptr.end() - 1);
+      for(int o = 0; o < num_obs; ++o) {
+        const BAProblem::Observation& obs = problem.v_observations[o];
+        m_v_point_obs[v_point_fill[obs.point_idx]++] = o;
+        const int free_cam = m_v_camera_to_free[obs.camera_idx];
+        if(free_cam >= 0) {
+          m_v_camera_obs[v_camera_fill[free_cam]++] = o;
+        }
+      }
+    }
+
+    // Block pattern of the reduced camera system. Cameras are connected if they share a free point.
+    std::vector<std::vector<int>> vv_neighbors(m_num_free_cameras);
+    for(int i = 0; i < m_num_free_cameras; ++i) {
+      vv_neighbors[i].push_back(i);
+    }
+    for(int j = 0; j < num_points; ++j) {
+      if(m_v_point_to_free[j] < 0) {
+        continue;
+      }
+      for(int a = m_v_point_obs_ptr[j]; a < m_v_point_obs_ptr[j+1]; ++a) {
+        const int ci = m_v_camera_to_free[problem.v_observations[m_v_point_obs[a]].camera_idx];
+        if(ci < 0) {
+          continue;
+        }
+        for(int b = m_v_point_obs_ptr[j]; b < m_v_point_obs_ptr[j+1]; ++b) {
+          const int ck = m_v_camera_to_free[problem.v_observations[m_v_point_obs[b]].camera_idx];
+          if(ck >= 0 && ck != ci) {
+            vv_neighbors[ci].push_back(ck);
+          }
+        }
+      }
+    }
+    m_v_row_ptr.assign(m_num_free_cameras + 1, 0);
+    m_v_col_idx.clear();
+    for(int i = 0; i < m_num_free_cameras; ++i) {
+      std::vector<int>& v_cols = vv_neighbors[i];
+      std::sort(v_cols.begin(), v_cols.end());
+      v_cols.erase(std::unique(v_cols.begin(), v_cols.end()), v_cols.end());
+      m_v_col_idx.insert(m_v_col_idx.end(), v_cols.begin(), v_cols.end());
+      m_v_row_ptr[i+1] = (int)m_v_col_idx.size();
+    }
+    m_v_reduced_blocks.resize(m_v_col_idx.size());
+    m_b_pattern_analyzed = false;
+
+    m_v_residuals.resize(num_obs);
+    m_v_jac_cameras.resize(num_obs);
+    m_v_jac_points.resize(num_obs);
+    m_v_W.resize(num_obs);
+    const int num_chunks = (num_obs + EVALUATE_CHUNK_SIZE - 1)/EVALUATE_CHUNK_SIZE;
+    m_v_chunk_costs.resize(num_chunks);
+    m_v_chunk_sq_errors.resize(num_chunks);
+
+    m_v_U.resize(m_num_free_cameras);
+    m_v_g_cameras.resize(m_num_free_cameras);
+    m_v_precond.resize(m_num_free_cameras);
+    m_v_V.resize(m_num_free_points);
+    m_v_g_points.resize(m_num_free_points);
+    m_v_V_inv.resize(m_num_free_points);
+    m_v_dx_points.resize(m_num_free_points);
+  }
+
+  double BundleAdjuster::Evaluate(const BAProblem& problem, const State& state, const bool b_linearize) {
+    const int num_obs = (int)m_v_obs_points.size();
+    const double delta = m_robust_kernel.delta;
+    ParallelFor(0, (int)m_v_chunk_costs.size(), [&](const int chunk) {
+      const int begin = chunk*EVALUATE_CHUNK_SIZE;
+      const int end = std::min(begin + EVALUATE_CHUNK_SIZE, num_obs);
+      const int B = EVALUATE_BLOCK_SIZE;
+      // camera frame points, intrinsics and measurements of a block (SoA)
+      double x[B], y[B], z[B], z_safe[B], fx[B], fy[B], cx[B], cy[B], u[B], v[B];
+      float r[9][B];
+      // per observation results
+      double inv_z[B], ru[B], rv[B], sq_errors[B], rhos[B];
+      float sqrt_w[B], jc[10][B], jp[6][B];
+      double chunk_cost = 0.0, chunk_sq_error = 0.0;
+      for(int block = begin; block < end; block += B) {
+        const int n = std::min(B, end - block);
+        // Gather. The tail of the last block is padded with a point in front of a unit camera.
+        for(int i = 0; i < B; ++i) {
+          if(i >= n) {
+            x[i] = 0.0; y[i] = 0.0; z[i] = 1.0; z_safe[i] = 1.0;
+            fx[i] = 1.0; fy[i] = 1.0; cx[i] = 0.0; cy[i] = 0.0; u[i] = 0.0; v[i] = 0.0;
+            for(int k = 0; k < 9; ++k) {
+              r[k][i] = 0.0f;
+            }
+            continue;
+          }
+          const int o = block + i;
+          const int c = m_v_obs_cameras[o];
+          const Eigen::Matrix3d& R = state.v_R[c];
+          // projection in double, world coordinates can be large
+          const Eigen::Vector3d pt_c = R * state.v_points[m_v_obs_points[o]] + state.v_t[c];
+          x[i] = pt_c.x(); y[i] = pt_c.y(); z[i] = pt_c.z();
+          // selected here, a division after a select is not vectorized (trapping math)
+          z_safe[i] = std::abs(pt_c.z()) > 1e-10 ? pt_c.z() : 1e-10;
+          fx[i] = m_v_fx[c]; fy[i] = m_v_fy[c]; cx[i] = m_v_cx[c]; cy[i] = m_v_cy[c];
+          u[i] = m_v_obs_u[o]; v[i] = m_v_obs_v[o];
+          if(b_linearize) {
+            for(int k = 0; k < 9; ++k) {
+              r[k][i] = (float)R(k/3, k%3);
+            }
+          }
+        }
+
+        // Projection over the fixed block length, branch free so that the compiler vectorizes it.
+        for(int i = 0; i < B; ++i) {
+          inv_z[i] = 1.0/z_safe[i];
+          ru[i] = fx[i]*x[i]*inv_z[i] + cx[i] - u[i];
+          rv[i] = fy[i]*y[i]*inv_z[i] + cy[i] - v[i];
+          sq_errors[i] = ru[i]*ru[i] + rv[i]*rv[i];
+          rhos[i] = sq_errors[i];
+          sqrt_w[i] = 1.0f;
+        }
+        // robust kernel, only the few outliers need sqrt
+        for(int i = 0; i < n; ++i) {
+          if(delta > 0.0 && sq_errors[i] > delta*delta) {
+            double weight;
+            m_robust_kernel.Evaluate(sq_errors[i], rhos[i], weight);
+            sqrt_w[i] = (float)std::sqrt(weight);
+          }
+          chunk_cost += 0.5*rhos[i];
+          chunk_sq_error += sq_errors[i];
+        }
+        if(!b_linearize) {
+          continue;
+        }
+
+        // Jacobians in float, scaled so that J^T J and J^T r carry the robust weight.
+        // d_proj = [fx/z 0 -fx x/z^2; 0 fy/z -fy y/z^2], camera part -d_proj * [p]x | d_proj,
+        // point part d_proj * R.
+        for(int i = 0; i < B; ++i) {
+          const float fx_z = (float)(fx[i]*inv_z[i]) * sqrt_w[i];
+          const float fy_z = (float)(fy[i]*inv_z[i]) * sqrt_w[i];
+          const float x_z = (float)(x[i]*inv_z[i]);
+          const float y_z = (float)(y[i]*inv_z[i]);
+          const float d02 = -fx_z*x_z;
+          const float d12 = -fy_z*y_z;
+          const float px = (float)x[i], py = (float)y[i], pz = (float)z[i];
+          jc[0][i] = d02*py;
+          jc[1][i] = fx_z*pz - d02*px;
+          jc[2][i] = -fx_z*py;
+          jc[3][i] = d12*py - fy_z*pz;
+          jc[4][i] = -d12*px;
+          jc[5][i] = fy_z*px;
+          jc[6][i] = fx_z;
+          jc[7][i] = d02;
+          jc[8][i] = fy_z;
+          jc[9][i] = d12;
+          jp[0][i] = fx_z*r[0][i] + d02*r[6][i];
+          jp[1][i] = fx_z*r[1][i] + d02*r[7][i];
+          jp[2][i] = fx_z*r[2][i] + d02*r[8][i];
+          jp[3][i] = fy_z*r[3][i] + d12*r[6][i];
+          jp[4][i] = fy_z*r[4][i] + d12*r[7][i];
+          jp[5][i] = fy_z*r[5][i] + d12*r[8][i];
+        }
+
+        // scatter to the per observation blocks
+        for(int i = 0; i < n; ++i) {
+          const int o = block + i;
+          Mat26f& Jc = m_v_jac_cameras[o];
+          Jc << jc[0][i], jc[1][i], jc[2][i], jc[6][i], 0.0f, jc[7][i],
+                jc[3][i], jc[4][i], jc[5][i], 0.0f, jc[8][i], jc[9][i];
+          Mat23f& Jp = m_v_jac_points[o];
+          Jp << jp[0][i], jp[1][i], jp[2][i],
+                jp[3][i], jp[4][i], jp[5][i];
+          m_v_residuals[o] = Eigen::Vector2f((float)ru[i] * sqrt_w[i], (float)rv[i] * sqrt_w[i]);
+        }
+      }
+      m_v_chunk_costs[chunk] = chunk_cost;
+      m_v_chunk_sq_errors[chunk] = chunk_sq_error;
+    }, m_config.num_threads);
+
+    // sum in fixed order to be deterministic
+    double cost = 0.0, sq_error = 0.0;
+    for(size_t chunk = 0; chunk < m_v_chunk_costs.size(); ++chunk) {
+      cost += m_v_chunk_costs[chunk];
+      sq_error += m_v_chunk_sq_errors[chunk];
+    }
+    m_last_sq_error = sq_error;
+    return cost;
+  }
+
+  void BundleAdjuster::BuildNormalEquations(const BAProblem& problem) {
+    // point blocks and camera-point blocks W, each point writes only its own observations
+    ParallelFor(0, (int)problem.v_points.size(), [&](const int j) {
+      const int free_pt = m_v_point_to_free[j];
+      if(free_pt < 0) {
+        return;
+      }
+      Eigen::Matrix3d V = Eigen::Matrix3d::Zero();
+      Eigen::Vector3d g = Eigen::Vector3d::Zero();
+      for(int a = m_v_point_obs_ptr[j]; a < m_v_point_obs_ptr[j+1]; ++a) {
+        const int o = m_v_point_obs[a];
+        const Mat23 Jp = m_v_jac_points[o].cast<double>();
+        V.noalias() += Jp.transpose() * Jp;
+        g.noalias() += Jp.transpose() * m_v_residuals[o].cast<double>();
+        if(m_v_obs_free_cameras[o] >= 0) {
+          m_v_W[o] = (m_v_jac_cameras[o].cast<double>().transpose() * Jp).cast<float>();
+        }
+      }
+      m_v_V[free_pt] = V;
+      m_v_g_points[free_pt] = g;
+    }, m_config.num_threads);
+
+    // camera blocks
+    ParallelFor(0, m_num_free_cameras, [&](const int i) {
+      Mat66 U = Mat66::Zero();
+      Vec6 g = Vec6::Zero();
+      for(int a = m_v_camera_obs_ptr[i]; a < m_v_camera_obs_ptr[i+1]; ++a) {
+        const int o = m_v_camera_obs[a];
+        const Mat26 Jc = m_v_jac_cameras[o].cast<double>();
+        U.noalias() += Jc.transpose() * Jc;
+        g.noalias() += Jc.transpose() * m_v_residuals[o].cast<double>();
+      }
+      m_v_U[i] = U;
+      m_v_g_cameras[i] = g;
+    }, m_config.num_threads);
+  }
+
+  bool BundleAdjuster::ComputeStep(const double lambda, Eigen::VectorXd& dx_cameras) {
+    // damped inverse of point blocks
+    ParallelFor(0, m_num_free_points, [&](const int p) {
+      Eigen::Matrix3d V = m_v_V[p];
+      for(int k = 0; k < 3; ++k) {
+        V(k,k) += lambda * DampingDiagonal(m_v_V[p](k,k));
+      }
+      m_v_V_inv[p] = V.inverse();
+    }, m_config.num_threads);
+
+    // Schur complement S = U - sum W V^-1 W^T, b = -g_c + sum W V^-1 g_p.
+    // Each thread owns block rows, so no synchronization is needed. Upper blocks are computed first.
+    m_reduced_rhs.resize(6*m_num_free_cameras);
+    ParallelFor(0, m_num_free_cameras, [&](const int i) {
+      const int row_begin = m_v_row_ptr[i];
+      const int row_end = m_v_row_ptr[i+1];
+      for(int b = row_begin; b < row_end; ++b) {
+        m_v_reduced_blocks[b].setZero();
+      }
+      const int diag = (int)(std::lower_bound(m_v_col_idx.begin() + row_begin, m_v_col_idx.begin() + row_end, i)
+                             - m_v_col_idx.begin());
+      Mat66& S_ii = m_v_reduced_blocks[diag];
+      S_ii = m_v_U[i];
+      for(int k = 0; k < 6; ++k) {
+        S_ii(k,k) += lambda * DampingDiagonal(m_v_U[i](k,k));
+      }
+      Vec6 b_i = -m_v_g_cameras[i];
+
+      for(int a = m_v_camera_obs_ptr[i]; a < m_v_camera_obs_ptr[i+1]; ++a) {
+        const int o = m_v_camera_obs[a];
+        const int j = m_v_obs_points[o];
+        const int free_pt = m_v_point_to_free[j];
+        if(free_pt < 0) {
+          continue;
+        }
+        const Mat63 W = m_v_W[o].cast<double>();
+        const Mat63 WV = W * m_v_V_inv[free_pt];
+        b_i.noalias() += WV * m_v_g_points[free_pt];
+        for(int c = m_v_point_obs_ptr[j]; c < m_v_point_obs_ptr[j+1]; ++c) {
+          const int o2 = m_v_point_obs[c];
+          const int k = m_v_obs_free_cameras[o2];
+          if(k < i) {
+            continue;
+          }
+          const int pos = (int)(std::lower_bound(m_v_col_idx.begin() + row_begin, m_v_col_idx.begin() + row_end, k)
+                                - m_v_col_idx.begin());
+          const Mat63 W2 = m_v_W[o2].cast<double>();
+          m_v_reduced_blocks[pos].noalias() -= WV * W2.transpose();
+        }
+      }
+      m_reduced_rhs.segment<6>(6*i) = b_i;
+    }, m_config.num_threads);
+
+    // lower blocks by symmetry
+    ParallelFor(0, m_num_free_cameras, [&](const int i) {
+      for(int a = m_v_row_ptr[i]; a < m_v_row_ptr[i+1] && m_v_col_idx[a] < i; ++a) {
+        const int k = m_v_col_idx[a];
+        const int pos = (int)(std::lower_bound(m_v_col_idx.begin() + m_v_row_ptr[k], m_v_col_idx.begin() + m_v_row_ptr[k+1], i)
+                              - m_v_col_idx.begin());
+        m_v_reduced_blocks[a] = m_v_reduced_blocks[pos].transpose();
+      }
+    }, m_config.num_threads);
+
+    bool b_solved = false;
+    if(m_num_free_cameras == 0) {
+      dx_cameras.resize(0);
+      b_solved = true;
+    }
+    else if(m_config.linear_solver == DenseCholesky) {
+      b_solved = SolveDense(m_reduced_rhs, dx_cameras);
+    }
+    else if(m_config.linear_solver == SparseCholesky) {
+      b_solved = SolveSparse(m_reduced_rhs, dx_cameras);
+    }
+    else {
+      b_solved = SolvePCG(m_reduced_rhs, dx_cameras);
+    }
+    if(!b_solved || !dx_cameras.allFinite()) {
+      return false;
+    }
+
+    // back substitution dx_p = V^-1 (-g_p - W^T dx_c)
+    ParallelFor(0, (int)m_v_point_to_free.size(), [&](const int j) {
+      const int free_pt = m_v_point_to_free[j];
+      if(free_pt < 0) {
+        return;
+      }
+      Eigen::Vector3d rhs = -m_v_g_points[free_pt];
+      for(int c = m_v_point_obs_ptr[j]; c < m_v_point_obs_ptr[j+1]; ++c) {
+        const int o = m_v_point_obs[c];
+        const int k = m_v_obs_free_cameras[o];
+        if(k >= 0) {
+          rhs.noalias() -= m_v_W[o].cast<double>().transpose() * dx_cameras.segment<6>(6*k);
+        }
+      }
+      m_v_dx_points[free_pt] = m_v_V_inv[free_pt] * rhs;
+    }, m_config.num_threads);
+
+    return true;
+  }
+
+  bool BundleAdjuster::SolveDense(const Eigen::VectorXd& b, Eigen::VectorXd& x) {
+    const int n = 6*m_num_free_cameras;
+    m_dense_reduced.setZero(n, n);
+    for(int i = 0; i < m_num_free_cameras; ++i) {
+      for(int a = m_v_row_ptr[i]; a < m_v_row_ptr[i+1]; ++a) {
+        m_dense_reduced.block<6,6>(6*i, 6*m_v_col_idx[a]) = m_v_reduced_blocks[a];
+      }
+    }
+    Eigen::LLT<Eigen::MatrixXd> llt(m_dense_reduced);
+    if(llt.info() != Eigen::Success) {
+      return false;
+    }
+    x = llt.solve(b);
+    return true;
+  }
+
+  bool BundleAdjuster::SolveSparse(const Eigen::VectorXd& b, Eigen::VectorXd& x) {
+    const int n = 6*m_num_free_cameras;
+    // lower triangle only, the pattern is the same over iterations
+    std::vector<Eigen::Triplet<double>> v_triplets;
+    v_triplets.reserve(m_v_col_idx.size()*21);
+    for(int i = 0; i < m_num_free_cameras; ++i) {
+      for(int a = m_v_row_ptr[i]; a < m_v_row_ptr[i+1]; ++a) {
+        const int k = m_v_col_idx[a];
+        if(k > i) {
+          break;
+        }
+        const Mat66& block = m_v_reduced_blocks[a];
+        for(int c = 0; c < 6; ++c) {
+          for(int r = (k == i ? c : 0); r < 6; ++r) {
+            v_triplets.emplace_back(6*i + r, 6*k + c, block(r,c));
+          }
+        }
+      }
+    }
+    m_sparse_reduced.resize(n, n);
+    m_sparse_reduced.setFromTriplets(v_triplets.begin(), v_triplets.end());
+
+    if(!m_b_pattern_analyzed) {
+      m_sparse_solver.analyzePattern(m_sparse_reduced);
+      m_b_pattern_analyzed = true;
+    }
+    m_sparse_solver.factorize(m_sparse_reduced);
+    if(m_sparse_solver.info() != Eigen::Success) {
+      return false;
+    }
+    x = m_sparse_solver.solve(b);
+    return m_sparse_solver.info() == Eigen::Success;
+  }
+
+  void BundleAdjuster::MultiplyReduced(const Eigen::VectorXd& x, Eigen::VectorXd& y) const {
+    y.resize(x.size());
+    ParallelFor(0, m_num_free_cameras, [&](const int i) {
+      Vec6 sum = Vec6::Zero();
+      for(int a = m_v_row_ptr[i]; a < m_v_row_ptr[i+1]; ++a) {
+        sum.noalias() += m_v_reduced_blocks[a] * x.segment<6>(6*m_v_col_idx[a]);
+      }
+      y.segment<6>(6*i) = sum;
+    }, m_config.num_threads);
+  }
+
+  bool BundleAdjuster::SolvePCG(const Eigen::VectorXd& b, Eigen::VectorXd& x) {
+    // block Jacobi preconditioner
+    for(int i = 0; i < m_num_free_cameras; ++i) {
+      const int diag = (int)(std::lower_bound(m_v_col_idx.begin() + m_v_row_ptr[i], m_v_col_idx.begin() + m_v_row_ptr[i+1], i)
+                             - m_v_col_idx.begin());
+      m_v_precond[i] = m_v_reduced_blocks[diag].ldlt().solve(Mat66::Identity());
+    }
+    auto precondition = [&](const Eigen::VectorXd& r, Eigen::VectorXd& z) {
+      z.resize(r.size());
+      for(int i = 0; i < m_num_free_cameras; ++i) {
+        z.segment<6>(6*i).noalias() = m_v_precond[i] * r.segment<6>(6*i);
+      }
+    };
+
+    x.setZero(b.size());
+    Eigen::VectorXd r = b, z, p, q;
+    precondition(r, z);
+    p = z;
+    double rz = r.dot(z);
+    const double b_norm = b.norm();
+    if(b_norm == 0.0) {
+      return true;
+    }
+    for(int it = 0; it < m_config.max_cg_iteration; ++it) {
+      MultiplyReduced(p, q);
+      const double pq = p.dot(q);
+      if(pq <= 0.0) {
+        break;
+      }
+      const double alpha = rz/pq;
+      x.noalias() += alpha*p;
+      r.noalias() -= alpha*q;
+      if(r.norm() < m_config.cg_tolerance * b_norm) {
+        break;
+      }
+      precondition(r, z);
+      const double rz_new = r.dot(z);
+      p = z + (rz_new/rz)*p;
+      rz = rz_new;
+    }
+    return true;
+  }
+
+  double BundleAdjuster::PredictedDecrease(const Eigen::VectorXd& dx_cameras, const double lambda) const {
+    // 0.5 * dx^T (lambda D dx - g)
+    double decrease = 0.0;
+    for(int i = 0; i < m_num_free_cameras; ++i) {
+      const Vec6 dx = dx_cameras.segment<6>(6*i);
+      for(int k = 0; k < 6; ++k) {
+        decrease += lambda * DampingDiagonal(m_v_U[i](k,k)) * dx(k) * dx(k);
+      }
+      decrease -= dx.dot(m_v_g_cameras[i]);
+    }
+    for(int p = 0; p < m_num_free_points; ++p) {
+      const Eigen::Vector3d& dx = m_v_dx_points[p];
+      for(int k = 0; k < 3; ++k) {
+        decrease += lambda * DampingDiagonal(m_v_V[p](k,k)) * dx(k) * dx(k);
+      }
+      decrease -= dx.dot(m_v_g_points[p]);
+    }
+    return 0.5*decrease;
+  }
+
+  void BundleAdjuster::ApplyUpdate(const BAProblem& problem, const Eigen::VectorXd& dx_cameras,
+                                   const State& state, State& updated) const
+  {
+    updated = state;
+    for(size_t c = 0; c < problem.v_cameras.size(); ++c) {
+      const int i = m_v_camera_to_free[c];
+      if(i < 0) {
+        continue;
+      }
+      const Eigen::Vector3d w = dx_cameras.segment<3>(6*i);
+      const Eigen::Vector3d v = dx_cameras.segment<3>(6*i + 3);
+      const double angle = w.norm();
+      const Eigen::Matrix3d dR = angle > 1e-12 ? Eigen::AngleAxisd(angle, w/angle).toRotationMatrix()
+                                               : Eigen::Matrix3d(Eigen::Matrix3d::Identity() + Skew(w));
+      updated.v_R[c] = dR * state.v_R[c];
+      updated.v_t[c] = dR * state.v_t[c] + v;
+    }
+    for(size_t j = 0; j < problem.v_points.size(); ++j) {
+      const int p = m_v_point_to_free[j];
+      if(p >= 0) {
+        updated.v_points[j] = state.v_points[j] + m_v_dx_points[p];
+      }
+    }
+  }
+
+  BundleAdjuster::BASummary BundleAdjuster::Solve(BAProblem& problem) {
+    BASummary summary;
+    summary.num_iterations = 0;
+    summary.num_successful_steps = 0;
+
+    BuildStructure(problem);
+
+    State state, candidate;
+    state.v_R.reserve(problem.v_cameras.size());
+    state.v_t.reserve(problem.v_cameras.size());
+    for(const BAProblem::CameraParam& cam : problem.v_cameras) {
+      state.v_R.push_back(cam.R);
+      state.v_t.push_back(cam.t);
+    }
+    state.v_points = problem.v_points;
+
+    const double num_obs = std::max<double>(1.0, (double)problem.v_observations.size());
+    double cost = Evaluate(problem, state, true);
+    summary.initial_cost = cost;
+    summary.initial_rms_error = std::sqrt(m_last_sq_error/num_obs);
+    double sq_error = m_last_sq_error;
+    BuildNormalEquations(problem);
+
+    double lambda = m_config.initial_lambda;
+    double nu = 2.0;
+    Eigen::VectorXd dx_cameras;
+    for(int it = 0; it < m_config.max_iteration; ++it) {
+      const auto t_start = std::chrono::steady_clock::now();
+      ++summary.num_iterations;
+
+      bool b_converged = false;
+      if(!ComputeStep(lambda, dx_cameras)) {
+        lambda *= nu;
+        nu *= 2.0;
+      }
+      else {
+        // relative step size
+        double sq_step = dx_cameras.squaredNorm(), sq_param = 0.0;
+        for(const Eigen::Vector3d& dx : m_v_dx_points) {
+          sq_step += dx.squaredNorm();
+        }
+        for(size_t c = 0; c < state.v_t.size(); ++c) {
+          sq_param += state.v_t[c].squaredNorm();
+        }
+        for(const Eigen::Vector3d& pt : state.v_points) {
+          sq_param += pt.squaredNorm();
+        }
+        const double tol = m_config.parameter_tolerance;
+        if(std::sqrt(sq_step) <= tol * (std::sqrt(sq_param) + tol)) {
+          b_converged = true;
+        }
+        else {
+          ApplyUpdate(problem, dx_cameras, state, candidate);
+          const double predicted = PredictedDecrease(dx_cameras, lambda);
+          // Normal equations of the current state are kept even if the step is rejected.
+          const double new_cost = Evaluate(problem, candidate, true);
+          const double rho = predicted > 0.0 ? (cost - new_cost)/predicted : -1.0;
+          if(std::isfinite(new_cost) && rho > 0.0) {
+            const double relative_decrease = (cost - new_cost)/std::max(cost, std::numeric_limits<double>::min());
+            std::swap(state, candidate);
+            cost = new_cost;
+            sq_error = m_last_sq_error;
+            BuildNormalEquations(problem);
+            lambda *= std::max(1.0/3.0, 1.0 - std::pow(2.0*rho - 1.0, 3));
+            nu = 2.0;
+            ++summary.num_successful_steps;
+            b_converged = relative_decrease < m_config.function_tolerance;
+          }
+          else {
+            lambda *= nu;
+            nu *= 2.0;
+          }
+        }
+      }
+
+      const auto t_end = std::chrono::steady_clock::now();
+      summary.v_iteration_time_ms.push_back(std::chrono::duration<double, std::milli>(t_end - t_start).count());
+      if(m_config.verbose) {
+        std::cout << "[LOG] BA iteration " << it << " : cost " << cost << ", lambda " << lambda
+                  << ", " << summary.v_iteration_time_ms.back() << " ms" << std::endl;
+      }
+      if(b_converged || lambda > 1e16) {
+        break;
+      }
+    }
+
+    summary.final_cost = cost;
+    summary.final_rms_error = std::sqrt(sq_error/num_obs);
+
+    for(size_t c = 0; c < problem.v_cameras.size(); ++c) {
+      problem.v_cameras[c].R = state.v_R[c];
+      problem.v_cameras[c].t = state.v_t[c];
+    }
+    problem.v_points = state.v_points;
+
+    return summary;
+  }
+
+  double BundleAdjuster::EvaluateCost(const BAProblem& problem, double& rms_error) const {
+    double cost = 0.0, sq_error_sum = 0.0;
+    for(const BAProblem::Observation& obs : problem.v_observations) {
+      const BAProblem::CameraParam& cam = problem.v_cameras[obs.camera_idx];
+      const Eigen::Vector3d pt_c = cam.R * problem.v_points[obs.point_idx] + cam.t;
+      const double inv_z = 1.0/(std::abs(pt_c.z()) > 1e-10 ? pt_c.z() : 1e-10);
+      const double ru = cam.fx*pt_c.x()*inv_z + cam.cx - obs.uv.x();
+      const double rv = cam.fy*pt_c.y()*inv_z + cam.cy - obs.uv.y();
+      const double sq_error = ru*ru + rv*rv;
+      double rho, weight;
+      m_robust_kernel.Evaluate(sq_error, rho, weight);
+      cost += 0.5*rho;
+      sq_error_sum += sq_error;
+    }
+    const double num_obs = std::max<double>(1.0, (double)problem.v_observations.size());
+    rms_error = std::sqrt(sq_error_sum/num_obs);
+    return cost;
+  }
+
+  // Covisibility weight (number of shared points) of each camera pair.
+  static std::vector<std::unordered_map<int, int>> ComputeCovisibility(const BAProblem& problem) {
+    const int num_cameras = (int)problem.v_cameras.size();
+    const int num_points = (int)problem.v_points.size();
+    std::vector<std::vector<int>> vv_point_cameras(num_points);
+    for(const BAProblem::Observation& obs : problem.v_observations) {
+      vv_point_cameras[obs.point_idx].push_back(obs.camera_idx);
+    }
+
+    std::vector<std::unordered_map<int, int>> v_covisibility(num_cameras);
+    for(std::vector<int>& v_cameras : vv_point_cameras) {
+      std::sort(v_cameras.begin(), v_cameras.end());
+      v_cameras.erase(std::unique(v_cameras.begin(), v_cameras.end()), v_cameras.end());
+      for(size_t i = 0; i < v_cameras.size(); ++i) {
+        for(size_t k = i + 1; k < v_cameras.size(); ++k) {
+          ++v_covisibility[v_cameras[i]][v_cameras[k]];
+          ++v_covisibility[v_cameras[k]][v_cameras[i]];
+        }
+      }
+    }
+    return v_covisibility;
+  }
+
+  // Camera with the largest weight to the submap, -1 if none.
+  static int SelectBestCandidate(const std::unordered_map<int, int>& map_scores) {
+    int best = -1, best_score = 0;
+    for(const auto& score : map_scores) {
+      if(score.second > best_score || (score.second == best_score && best >= 0 && score.first < best)) {
+        best = score.first;
+        best_score = score.second;
+      }
+    }
+    return best;
+  }
+
+  std::vector<std::vector<int>> SubmapBundleAdjuster::PartitionCameras(const BAProblem& problem, const int submap_size,
+                                                                       const int overlap, std::vector<int>& v_owner)
+  {
+    const int num_cameras = (int)problem.v_cameras.size();
+    const std::vector<std::unordered_map<int, int>> v_covisibility = ComputeCovisibility(problem);
+
+    // Submaps grow greedily from the first unassigned camera along the strongest covisibility.
+    std::vector<std::vector<int>> vv_submaps;
+    v_owner.assign(num_cameras, -1);
+    for(int seed = 0; seed < num_cameras; ++seed) {
+      if(v_owner[seed] >= 0) {
+        continue;
+      }
+      const int submap_id = (int)vv_submaps.size();
+      std::vector<int> v_submap{seed};
+      v_owner[seed] = submap_id;
+      std::unordered_map<int, int> map_scores;
+      int added = seed;
+      while(true) {
+        for(const auto& neighbor : v_covisibility[added]) {
+          if(v_owner[neighbor.first] < 0) {
+            map_scores[neighbor.first] += neighbor.second;
+          }
+        }
+        if((int)v_submap.size() >= submap_size) {
+          break;
+        }
+        added = SelectBestCandidate(map_scores);
+        if(added < 0) {
+          break;
+        }
+        map_scores.erase(added);
+        v_owner[added] = submap_id;
+        v_submap.push_back(added);
+      }
+      vv_submaps.push_back(v_submap);
+    }
+
+    // Each submap borrows the most covisible cameras of other submaps, they become separators.
+    for(std::vector<int>& v_submap : vv_submaps) {
+      const int submap_id = v_owner[v_submap.front()];
+      std::unordered_map<int, int> map_scores;
+      for(const int c : v_submap) {
+        for(const auto& neighbor : v_covisibility[c]) {
+          if(v_owner[neighbor.first] != submap_id) {
+            map_scores[neighbor.first] += neighbor.second;
+          }
+        }
+      }
+      for(int i = 0; i < overlap; ++i) {
+        const int best = SelectBestCandidate(map_scores);
+        if(best < 0) {
+          break;
+        }
+        map_scores.erase(best);
+        v_submap.push_back(best);
+      }
+    }
+
+    return vv_submaps;
+  }
+
+  // Subproblem of the given cameras and the points seen at least twice by them.
+  // v_points maps subproblem point index to problem point index.
+  static BAProblem ExtractSubproblem(const BAProblem& problem, const std::vector<int>& v_cameras,
+                                     const std::vector<std::vector<int>>& vv_camera_obs,
+                                     std::vector<int>& v_points)
+  {
+    BAProblem subproblem;
+    std::unordered_map<int, int> map_point_count;
+    for(const int c : v_cameras) {
+      const BAProblem::CameraParam& cam = problem.v_cameras[c];
+      subproblem.AddCamera(cam.R, cam.t, cam.fx, cam.fy, cam.cx, cam.cy, cam.fixed);
+      for(const int o : vv_camera_obs[c]) {
+        ++map_point_count[problem.v_observations[o].point_idx];
+      }
+    }
+
+    v_points.clear();
+    std::unordered_map<int, int> map_point_to_local;
+    for(int local_c = 0; local_c < (int)v_cameras.size(); ++local_c) {
+      for(const int o : vv_camera_obs[v_cameras[local_c]]) {
+        const BAProblem::Observation& obs = problem.v_observations[o];
+        if(map_point_count[obs.point_idx] < 2) {
+          continue;
+        }
+        auto itr = map_point_to_local.find(obs.point_idx);
+        if(itr == map_point_to_local.end()) {
+          const int local_p = subproblem.AddPoint(problem.v_points[obs.point_idx], problem.vb_fixed_points[obs.point_idx]);
+          itr = map_point_to_local.insert(std::make_pair(obs.point_idx, local_p)).first;
+          v_points.push_back(obs.point_idx);
+        }
+        subproblem.AddObservation(local_c, itr->second, obs.uv);
+      }
+    }
+
+    return subproblem;
+  }
+
+  // Similarity X_dst = scale * Rs * X_src + ts from the given submap cameras to the target cameras.
+  // Rotation is the chordal mean of the camera orientations since camera centers of a submap are
+  // often nearly collinear, scale and translation are the least squares fit of the centers.
+  static void AlignCameras(const BAProblem& subproblem, const std::vector<int>& v_local_cameras,
+                           const std::vector<int>& v_submap, const BAProblem& target,
+                           double& scale, Eigen::Matrix3d& Rs, Eigen::Vector3d& ts)
+  {
+    const int num_cameras = (int)v_local_cameras.size();
+    Eigen::Matrix3d sum_R = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d mean_src = Eigen::Vector3d::Zero(), mean_dst = Eigen::Vector3d::Zero();
+    std::vector<Eigen::Vector3d> v_src(num_cameras), v_dst(num_cameras);
+    for(int c = 0; c < num_cameras; ++c) {
+      const BAProblem::CameraParam& src = subproblem.v_cameras[v_local_cameras[c]];
+      const BAProblem::CameraParam& dst = target.v_cameras[v_submap[v_local_cameras[c]]];
+      sum_R += dst.R.transpose() * src.R;
+      v_src[c] = -src.R.transpose() * src.t;
+      v_dst[c] = -dst.R.transpose() * dst.t;
+      mean_src += v_src[c];
+      mean_dst += v_dst[c];
+    }
+    mean_src /= num_cameras;
+    mean_dst /= num_cameras;
+
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(sum_R, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3d S = Eigen::Matrix3d::Identity();
+    if((svd.matrixU() * svd.matrixV().transpose()).determinant() < 0.0) {
+      S(2,2) = -1.0;
+    }
+    Rs = svd.matrixU() * S * svd.matrixV().transpose();
+
+    double num = 0.0, den = 0.0;
+    for(int c = 0; c < num_cameras; ++c) {
+      const Eigen::Vector3d src = Rs * (v_src[c] - mean_src);
+      num += src.dot(v_dst[c] - mean_dst);
+      den += src.squaredNorm();
+    }
+    scale = (den > 1e-12 && num > 0.0) ? num / den : 1.0;
+    ts = mean_dst - scale * Rs * mean_src;
+  }
+
+  BundleAdjuster::BASummary SubmapBundleAdjuster::Solve(BAProblem& problem) {
+    const int num_cameras = (int)problem.v_cameras.size();
+    const int num_points = (int)problem.v_points.size();
+
+    std::vector<int> v_owner;
+    const std::vector<std::vector<int>> vv_submaps
+      = PartitionCameras(problem, std::max(2, m_config.submap_size), std::max(0, m_config.overlap), v_owner);
+    const int num_submaps = (int)vv_submaps.size();
+
+    // A single submap is the whole problem.
+    if(num_submaps <= 1) {
+      BundleAdjuster ba(m_config.ba_config);
+      return ba.Solve(problem);
+    }
+
+    std::vector<std::vector<int>> vv_camera_obs(num_cameras);
+    for(int o = 0; o < (int)problem.v_observations.size(); ++o) {
+      vv_camera_obs[problem.v_observations[o].camera_idx].push_back(o);
+    }
+
+    // Initial cost of the whole problem
+    const BundleAdjuster evaluator(m_config.ba_config);
+    BundleAdjuster::BASummary summary;
+    summary.num_iterations = 0;
+    summary.initial_cost = evaluator.EvaluateCost(problem, summary.initial_rms_error);
+
+    // Submaps are solved independently, one thread each.
+    std::vector<BAProblem> v_subproblems(num_submaps);
+    std::vector<std::vector<int>> vv_submap_points(num_submaps);
+    std::vector<BundleAdjuster::BASummary> v_submap_summaries(num_submaps);
+    std::vector<char> vb_anchored(num_submaps, 0);
+    BundleAdjuster::BAConfig submap_config = m_config.ba_config;
+    submap_config.num_threads = 1;
+    submap_config.verbose = false;
+    ParallelFor(0, num_submaps, [&](const int s) {
+      const std::vector<int>& v_submap = vv_submaps[s];
+      v_subproblems[s] = ExtractSubproblem(problem, v_submap, vv_camera_obs, vv_submap_points[s]);
+      BAProblem& subproblem = v_subproblems[s];
+
+      // The most observed camera holds the gauge unless the submap already has fixed cameras.
+      int gauge = 0;
+      for(int c = 0; c < (int)v_submap.size(); ++c) {
+        vb_anchored[s] = vb_anchored[s] || subproblem.v_cameras[c].fixed;
+        if(vv_camera_obs[v_submap[c]].size() > vv_camera_obs[v_submap[gauge]].size()) {
+          gauge = c;
+        }
+      }
+      if(!vb_anchored[s]) {
+        subproblem.v_cameras[gauge].fixed = true;
+      }
+
+      BundleAdjuster ba(submap_config);
+      v_submap_summaries[s] = ba.Solve(subproblem);
+    }, m_config.ba_config.num_threads);
+
+    // Submaps are aligned in order by Sim3, to the cameras already placed by previous submaps
+    // where they overlap and to the initial cameras otherwise.
+    BAProblem placed;
+    placed.v_cameras = problem.v_cameras;
+    std::vector<char> vb_placed(num_cameras, 0);
+    for(int s = 0; s < num_submaps; ++s) {
+      const std::vector<int>& v_submap = vv_submaps[s];
+      BAProblem& subproblem = v_subproblems[s];
+      if(!vb_anchored[s]) {
+        std::vector<int> v_local_cameras;
+        for(int c = 0; c < (int)v_submap.size(); ++c) {
+          if(vb_placed[v_submap[c]]) {
+            v_local_cameras.push_back(c);
+          }
+        }
+        if(v_local_cameras.size() < 2) {
+          v_local_cameras.resize(v_submap.size());
+          for(int c = 0; c < (int)v_submap.size(); ++c) {
+            v_local_cameras[c] = c;
+          }
+        }
+
+        double scale;
+        Eigen::Matrix3d Rs;
+        Eigen::Vector3d ts;
+        AlignCameras(subproblem, v_local_cameras, v_submap, placed, scale, Rs, ts);
+        for(BAProblem::CameraParam& cam : subproblem.v_cameras) {
+          cam.R = cam.R * Rs.transpose();
+          cam.t = scale * cam.t - cam.R * ts;
+        }
+        for(Eigen::Vector3d& pt : subproblem.v_points) {
+          pt = scale * Rs * pt + ts;
+        }
+      }
+      for(int c = 0; c < (int)v_submap.size(); ++c) {
+        if(!vb_placed[v_submap[c]]) {
+          placed.v_cameras[v_submap[c]] = subproblem.v_cameras[c];
+          vb_placed[v_submap[c]] = 1;
+        }
+      }
+    }
+
+    // Merge : cameras from their owner submap, points from the submap observing them most.
+    std::vector<int> v_point_source(num_points, -1), v_point_local(num_points, -1), v_point_obs(num_points, 0);
+    for(int s = 0; s < num_submaps; ++s) {
+      const BAProblem& subproblem = v_subproblems[s];
+      std::vector<int> v_local_obs(subproblem.v_points.size(), 0);
+      for(const BAProblem::Observation& obs : subproblem.v_observations) {
+        ++v_local_obs[obs.point_idx];
+      }
+      for(int p = 0; p < (int)subproblem.v_points.size(); ++p) {
+        const int j = vv_submap_points[s][p];
+        if(v_local_obs[p] > v_point_obs[j]) {
+          v_point_source[j] = s;
+          v_point_local[j] = p;
+          v_point_obs[j] = v_local_obs[p];
+        }
+      }
+      for(int c = 0; c < (int)vv_submaps[s].size(); ++c) {
+        const int global_c = vv_submaps[s][c];
+        if(v_owner[global_c] == s && !problem.v_cameras[global_c].fixed) {
+          problem.v_cameras[global_c].R = subproblem.v_cameras[c].R;
+          problem.v_cameras[global_c].t = subproblem.v_cameras[c].t;
+        }
+      }
+    }
+    for(int j = 0; j < num_points; ++j) {
+      if(v_point_source[j] >= 0 && !problem.vb_fixed_points[j]) {
+        problem.v_points[j] = v_subproblems[v_point_source[j]].v_points[v_point_local[j]];
+      }
+    }
+
+    // Separator problem : borrowed cameras and their points are free, cameras interior to a submap are fixed.
+    std::vector<char> vb_separator(num_cameras, 0);
+    for(int s = 0; s < num_submaps; ++s) {
+      for(const int c : vv_submaps[s]) {
+        if(v_owner[c] != s) {
+          vb_separator[c] = 1;
+        }
+      }
+    }
+    std::vector<int> v_separator_points;
+    std::vector<char> vb_selected(num_points, 0);
+    for(int c = 0; c < num_cameras; ++c) {
+      if(!vb_separator[c]) {
+        continue;
+      }
+      for(const int o : vv_camera_obs[c]) {
+        const int j = problem.v_observations[o].point_idx;
+        if(!vb_selected[j]) {
+          vb_selected[j] = 1;
+          v_separator_points.push_back(j);
+        }
+      }
+    }
+
+    BAProblem separator_problem;
+    std::vector<int> v_point_to_local(num_points, -1);
+    for(const int j : v_separator_points) {
+      v_point_to_local[j] = separator_problem.AddPoint(problem.v_points[j], problem.vb_fixed_points[j]);
+    }
+    std::vector<int> v_camera_to_local(num_cameras, -1), v_local_to_camera;
+    for(const BAProblem::Observation& obs : problem.v_observations) {
+      const int local_p = v_point_to_local[obs.point_idx];
+      if(local_p < 0) {
+        continue;
+      }
+      if(v_camera_to_local[obs.camera_idx] < 0) {
+        const BAProblem::CameraParam& cam = problem.v_cameras[obs.camera_idx];
+        v_camera_to_local[obs.camera_idx]
+          = separator_problem.AddCamera(cam.R, cam.t, cam.fx, cam.fy, cam.cx, cam.cy,
+                                        cam.fixed || !vb_separator[obs.camera_idx]);
+        v_local_to_camera.push_back(obs.camera_idx);
+      }
+      separator_problem.AddObservation(v_camera_to_local[obs.camera_idx], local_p, obs.uv);
+    }
+
+    BundleAdjuster separator_ba(m_config.ba_config);
+    const BundleAdjuster::BASummary separator_summary = separator_ba.Solve(separator_problem);
+    for(int c = 0; c < (int)v_local_to_camera.size(); ++c) {
+      problem.v_cameras[v_local_to_camera[c]].R = separator_problem.v_cameras[c].R;
+      problem.v_cameras[v_local_to_camera[c]].t = separator_problem.v_cameras[c].t;
+    }
+    for(int p = 0; p < (int)v_separator_points.size(); ++p) {
+      problem.v_points[v_separator_points[p]] = separator_problem.v_points[p];
+    }
+
+    // Final cost of the whole problem
+    summary.final_cost = evaluator.EvaluateCost(problem, summary.final_rms_error);
+    for(const BundleAdjuster::BASummary& submap_summary : v_submap_summaries) {
+      summary.num_iterations = std::max(summary.num_iterations, submap_summary.num_iterations);
+    }
+    summary.num_iterations += separator_summary.num_iterations;
+    summary.num_successful_steps = separator_summary.num_successful_steps;
+    summary.v_iteration_time_ms = separator_summary.v_iteration_time_ms;
+
+    if(m_config.ba_config.verbose) {
+      std::cout << "[LOG] Submap BA : " << num_submaps << " submaps, " << v_local_to_camera.size()
+                << " cameras / " << v_separator_points.size() << " points in separator problem" << std::endl;
+    }
+
+    return summary;
+  }
+
+} // namespace
@@ -0,0 +1,405 @@
+#include "Checkpointer.h"
+#include "ConfigLoader.h"
+#include "Map.h"
+#include "MapFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+namespace TS_SfM {
+
+namespace {
+  const char FEATURES_MAGIC[8] = {'T','S','F','E','A','T','S','\0'};
+  const char MATCHES_MAGIC[8] = {'T','S','M','A','T','C','H','\0'};
+  const int CHECKPOINT_VERSION = 1;
+  const std::string STATE_FILE = "state.yml";
+
+  struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_frames;
+  };
+
+  struct MatchRecord {
+    int32_t query_idx;
+    int32_t train_idx;
+    float distance;
+  };
+
+  std::string JoinPath(const std::string& directory, const std::string& file) {
+    return directory + "/" + file;
+  }
+
+  // The file is written next to the destination and renamed.
+  bool WriteFile(const std::string& file, const std::function<void(std::ofstream&)>& write) {
+    const std::string tmp_file = file + ".tmp";
+    std::ofstream ofs(tmp_file, std::ios::binary | std::ios::trunc);
+    if(!ofs.is_open()) {
+      std::cerr << "[FAILED]: " << "Cannot open " << tmp_file << std::endl;
+      return false;
+    }
+    write(ofs);
+    ofs.close();
+    if(!ofs || std::rename(tmp_file.c_str(), file.c_str()) != 0) {
+      std::cerr << "[FAILED]: " << "Cannot write " << file << std::endl;
+      std::remove(tmp_file.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  bool ReadHeader(std::ifstream& ifs, const char* magic, uint32_t& num_frames) {
+    CacheHeader header;
+    if(!ifs.read(reinterpret_cast<char*>(&header), sizeof(CacheHeader)) ||
+       std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION)
+    {
+      return false;
+    }
+    num_frames = header.num_frames;
+    return true;
+  }
+
+  bool WriteFeatures(const std::string& file, const Checkpointer::Caches& caches) {
+    return WriteFile(file, [&](std::ofstream& ofs) {
+      CacheHeader header{{0}, CHECKPOINT_VERSION, (uint32_t)caches.vv_kpts.size()};
+      std::memcpy(header.magic, FEATURES_MAGIC, sizeof(header.magic));
+      ofs.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+      for(size_t i = 0; i < caches.vv_kpts.size(); ++i) {
+        const std::vector<cv::KeyPoint>& v_kpts = caches.vv_kpts[i];
+        const cv::Mat descs = caches.v_descriptors[i].isContinuous() ? caches.v_descriptors[i]
+                                                                     : caches.v_descriptors[i].clone();
+        // num_kpts, descriptor rows, cols, type
+        const int32_t v_sizes[4] = {(int32_t)v_kpts.size(), descs.rows, descs.cols, descs.empty() ? -1 : descs.type()};
+        ofs.write(reinterpret_cast<const char*>(v_sizes), sizeof(v_sizes));
+        std::vector<MapFile::KeyPointRecord> v_records;
+        v_records.reserve(v_kpts.size());
+        for(const cv::KeyPoint& kpt : v_kpts) {
+          v_records.push_back(MapFile::KeyPointRecord{kpt.pt.x, kpt.pt.y, kpt.size, kpt.angle, kpt.response, kpt.octave});
+        }
+        ofs.write(reinterpret_cast<const char*>(v_records.data()), v_records.size() * sizeof(MapFile::KeyPointRecord));
+        if(!descs.empty()) {
+          ofs.write(reinterpret_cast<const char*>(descs.data), descs.total() * descs.elemSize());
+        }
+      }
+    });
+  }
+
+  bool ReadFeatures(const std::string& file, Checkpointer::Caches& caches) {
+    std::ifstream ifs(file, std::ios::binary);
+    uint32_t num_frames = 0;
+    if(!ReadHeader(ifs, FEATURES_MAGIC, num_frames)) {
+      return false;
+    }
+    caches.vv_kpts.resize(num_frames);
+    caches.v_descriptors.resize(num_frames);
+    for(uint32_t i = 0; i < num_frames; ++i) {
+      int32_t v_sizes[4];
+      if(!ifs.read(reinterpret_cast<char*>(v_sizes), sizeof(v_sizes)) || v_sizes[0] < 0 || v_sizes[1] < 0 || v_sizes[2] < 0) {
+        return false;
+      }
+      // one descriptor row per keypoint, the type must be a valid cv type
+      if(v_sizes[3] >= 0 && (v_sizes[1] != v_sizes[0] || CV_MAT_TYPE(v_sizes[3]) != v_sizes[3] ||
+                             CV_MAT_DEPTH(v_sizes[3]) > CV_64F))
+      {
+        return false;
+      }
+      std::vector<MapFile::KeyPointRecord> v_records(v_sizes[0]);
+      ifs.read(reinterpret_cast<char*>(v_records.data()), v_records.size() * sizeof(MapFile::KeyPointRecord));
+      caches.vv_kpts[i].clear();
+      caches.vv_kpts[i].reserve(v_records.size());
+      for(const MapFile::KeyPointRecord& record : v_records) {
+        caches.vv_kpts[i].push_back(cv::KeyPoint(record.x, record.y, record.size, record.angle, record.response, record.octave));
+      }
+      caches.v_descriptors[i].release();
+      if(v_sizes[3] >= 0) {
+        caches.v_descriptors[i].create(v_sizes[1], v_sizes[2], v_sizes[3]);
+        ifs.read(reinterpret_cast<char*>(caches.v_descriptors[i].data),
+                 caches.v_descriptors[i].total() * caches.v_descriptors[i].elemSize());
+      }
+    }
+    return (bool)ifs;
+  }
+
+  bool WriteMatches(const std::string& file, const Checkpointer::Caches& caches) {
+    return WriteFile(file, [&](std::ofstream& ofs) {
+      CacheHeader header{{0}, CHECKPOINT_VERSION, (uint32_t)caches.vvv_matches.size()};
+      std::memcpy(header.magic, MATCHES_MAGIC, sizeof(header.magic));
+      ofs.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+      // (i, j, num_matches) per non-empty pair, terminated by i = -1
+      std::vector<MatchRecord> v_records;
+      for(size_t i = 0; i < caches.vvv_matches.size(); ++i) {
+        for(size_t j = 0; j < caches.vvv_matches[i].size(); ++j) {
+          const std::vector<cv::DMatch>& v_matches = caches.vvv_matches[i][j];
+          if(v_matches.empty()) {
+            continue;
+          }
+          const int32_t v_pair[3] = {(int32_t)i, (int32_t)j, (int32_t)v_matches.size()};
+          ofs.write(reinterpret_cast<const char*>(v_pair), sizeof(v_pair));
+          v_records.clear();
+          for(const cv::DMatch& match : v_matches) {
+            v_records.push_back(MatchRecord{match.queryIdx, match.trainIdx, match.distance});
+          }
+          ofs.write(reinterpret_cast<const char*>(v_records.data()), v_records.size() * sizeof(MatchRecord));
+        }
+      }
+      const int32_t v_end[3] = {-1, -1, 0};
+      ofs.write(reinterpret_cast<const char*>(v_end), sizeof(v_end));
+    });
+  }
+
+  bool ReadMatches(const std::string& file, Checkpointer::Caches& caches) {
+    std::ifstream ifs(file, std::ios::binary);
+    uint32_t num_frames = 0;
+    if(!ReadHeader(ifs, MATCHES_MAGIC, num_frames)) {
+      return false;
+    }
+    caches.vvv_matches.assign(num_frames, std::vector<std::vector<cv::DMatch>>(num_frames));
+    std::vector<MatchRecord> v_records;
+    while(true) {
+      int32_t v_pair[3];
+      if(!ifs.read(reinterpret_cast<char*>(v_pair), sizeof(v_pair))) {
+        return false;
+      }
+      if(v_pair[0] < 0) {
+        return true;
+      }
+      if(v_pair[0] >= (int32_t)num_frames || v_pair[1] < 0 || v_pair[1] >= (int32_t)num_frames || v_pair[2] < 0) {
+        return false;
+      }
+      v_records.resize(v_pair[2]);
+      ifs.read(reinterpret_cast<char*>(v_records.data()), v_records.size() * sizeof(MatchRecord));
+      std::vector<cv::DMatch>& v_matches = caches.vvv_matches[v_pair[0]][v_pair[1]];
+      v_matches.reserve(v_records.size());
+      for(const MatchRecord& record : v_records) {
+        v_matches.push_back(cv::DMatch(record.query_idx, record.train_idx, record.distance));
+      }
+    }
+  }
+}
+
+  Checkpointer::Checkpointer(const CheckpointConfig& config, const Camera& cam)
+    : m_config(config), m_p_camera(new Camera(cam)), m_b_writing(false), m_b_stop(false), m_sequence(0)
+  {
+    if(!IsEnabled()) {
+      return;
+    }
+    // Numbering continues after an existing checkpoint, so its files are not overwritten
+    // before a newer one is complete.
+    cv::FileStorage fs_state(JoinPath(m_config.directory, STATE_FILE), cv::FileStorage::READ);
+    if(fs_state.isOpened() && !fs_state["sequence"].empty()) {
+      m_sequence = (int)fs_state["sequence"];
+    }
+    m_writer_thread = std::thread(&Checkpointer::WriterLoop, this);
+  }
+
+  Checkpointer::~Checkpointer() {
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      m_b_stop = true;
+    }
+    m_cv.notify_all();
+    if(m_writer_thread.joinable()) {
+      m_writer_thread.join();
+    }
+  }
+
+  void Checkpointer::Submit(std::unique_ptr<State> p_state) {
+    if(!IsEnabled()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      if(m_p_pending) {
+        std::cout << "[Warning] " << "Checkpoint is skipped, the previous one is still being written" << std::endl;
+      }
+      m_p_pending = std::move(p_state);
+    }
+    m_cv.notify_all();
+  }
+
+  void Checkpointer::Flush() {
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cv.wait(lock, [&]{ return !m_p_pending && !m_b_writing; });
+  }
+
+  void Checkpointer::WriterLoop() {
+    while(true) {
+      std::unique_ptr<State> p_state;
+      {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [&]{ return m_p_pending || m_b_stop; });
+        if(!m_p_pending) {
+          return;
+        }
+        p_state = std::move(m_p_pending);
+        m_b_writing = true;
+      }
+
+      Write(*p_state);
+
+      {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_b_writing = false;
+      }
+      m_cv.notify_all();
+    }
+  }
+
+  bool Checkpointer::Write(const State& state) {
+    if(!state.p_caches) {
+      std::cerr << "[FAILED]: " << "Checkpoint without feature and match caches" << std::endl;
+      return false;
+    }
+    const int sequence = m_sequence + 1;
+    std::vector<std::string> v_obsolete_files;
+
+    if(state.p_caches != m_p_written_caches) {
+      const std::string features_file = "features_" + std::to_string(sequence) + ".bin";
+      const std::string matches_file = "matches_" + std::to_string(sequence) + ".bin";
+      if(!WriteFeatures(JoinPath(m_config.directory, features_file), *state.p_caches) ||
+         !WriteMatches(JoinPath(m_config.directory, matches_file), *state.p_caches))
+      {
+        return false;
+      }
+      if(!m_str_features_file.empty()) {
+        v_obsolete_files.push_back(m_str_features_file);
+        v_obsolete_files.push_back(m_str_matches_file);
+      }
+      m_str_features_file = features_file;
+      m_str_matches_file = matches_file;
+      m_p_written_caches = state.p_caches;
+    }
+
+    // Only registered keyframes are kept by the map.
+    std::vector<KeyFrame> v_keyframes;
+    for(const KeyFrame& keyframe : state.v_keyframes) {
+      if(keyframe.IsActivated()) {
+        v_keyframes.push_back(keyframe);
+      }
+    }
+    Map map;
+    map.Initialize(v_keyframes, state.v_mappoints);
+    const std::string map_file = "map_" + std::to_string(sequence) + ".bin";
+    if(!map.Save(JoinPath(m_config.directory, map_file), *m_p_camera)) {
+      return false;
+    }
+    if(!m_str_map_file.empty()) {
+      v_obsolete_files.push_back(m_str_map_file);
+    }
+    m_str_map_file = map_file;
+
+    // state.yml commits the checkpoint
+    const std::string state_file = JoinPath(m_config.directory, STATE_FILE);
+    const std::string tmp_state_file = JoinPath(m_config.directory, "state.tmp.yml");
+    {
+      cv::FileStorage fs_state(tmp_state_file, cv::FileStorage::WRITE);
+      if(!fs_state.isOpened()) {
+        std::cerr << "[FAILED]: " << "Cannot open " << tmp_state_file << std::endl;
+        return false;
+      }
+      fs_state << "version" << CHECKPOINT_VERSION;
+      fs_state << "sequence" << sequence;
+      fs_state << "num_frames" << (int)state.v_keyframes.size();
+      fs_state << "cursor_distance" << state.cursor_distance;
+      fs_state << "cursor_direction" << state.cursor_direction;
+      fs_state << "map_file" << m_str_map_file;
+      fs_state << "features_file" << m_str_features_file;
+      fs_state << "matches_file" << m_str_matches_file;
+    }
+    if(std::rename(tmp_state_file.c_str(), state_file.c_str()) != 0) {
+      std::cerr << "[FAILED]: " << "Cannot write " << state_file << std::endl;
+      return false;
+    }
+    m_sequence = sequence;
+
+    for(const std::string& file : v_obsolete_files) {
+      std::remove(JoinPath(m_config.directory, file).c_str());
+    }
+    std::cout << "[LOG] " << "Checkpoint " << sequence << " is written to " << m_config.directory << std::endl;
+    return true;
+  }
+
+  bool Checkpointer::Load(const std::string& directory, State& state) {
+    cv::FileStorage fs_state(JoinPath(directory, STATE_FILE), cv::FileStorage::READ);
+    if(!fs_state.isOpened() || fs_state["version"].empty() || (int)fs_state["version"] != CHECKPOINT_VERSION) {
+      std::cerr << "[FAILED]: " << "No checkpoint in " << directory << std::endl;
+      return false;
+    }
+    const int num_frames = fs_state["num_frames"].empty() ? -1 : (int)fs_state["num_frames"];
+    state.cursor_distance = (int)fs_state["cursor_distance"];
+    state.cursor_direction = (int)fs_state["cursor_direction"];
+
+    std::shared_ptr<Caches> p_caches = std::make_shared<Caches>();
+    if(!ReadFeatures(JoinPath(directory, (std::string)fs_state["features_file"]), *p_caches) ||
+       !ReadMatches(JoinPath(directory, (std::string)fs_state["matches_file"]), *p_caches))
+    {
+      std::cerr << "[FAILED]: " << "Feature or match cache of the checkpoint is broken" << std::endl;
+      return false;
+    }
+    // caches and map belong to the same frames, matches refer to their keypoints
+    if(num_frames <= 0 || (int)p_caches->vv_kpts.size() != num_frames || (int)p_caches->vvv_matches.size() != num_frames) {
+      std::cerr << "[FAILED]: " << "Number of frames of the checkpoint is inconsistent" << std::endl;
+      return false;
+    }
+    for(int i = 0; i < num_frames; ++i) {
+      for(int j = 0; j < num_frames; ++j) {
+        for(const cv::DMatch& match : p_caches->vvv_matches[i][j]) {
+          if(match.queryIdx < 0 || match.queryIdx >= (int)p_caches->vv_kpts[i].size() ||
+             match.trainIdx < 0 || match.trainIdx >= (int)p_caches->vv_kpts[j].size())
+          {
+            std::cerr << "[FAILED]: " << "Match cache of the checkpoint refers to missing keypoints" << std::endl;
+            return false;
+          }
+        }
+      }
+    }
+    state.p_caches = p_caches;
+
+    Map map;
+    Camera cam;
+    if(!map.Load(JoinPath(directory, (std::string)fs_state["map_file"]), cam)) {
+      return false;
+    }
+    if(map.GetNumKeyFrames() > num_frames) {
+      std::cerr << "[FAILED]: " << "Map of the checkpoint has more keyframes than frames" << std::endl;
+      return false;
+    }
+    state.v_keyframes.assign(num_frames, KeyFrame());
+    for(int kf_id = 0; kf_id < map.GetNumKeyFrames(); ++kf_id) {
+      if(map.GetKeyFrame(kf_id).IsActivated()) {
+        state.v_keyframes[kf_id] = map.GetKeyFrame(kf_id);
+      }
+    }
+
+    // ids are kept by the map, so mappoints return to their index
+    const MapPointArena& mappoints = map.GetMapPoints();
+    state.v_mappoints.clear();
+    for(int slot = 0; slot < mappoints.GetNumSlots(); ++slot) {
+      if(!mappoints.IsAlive(slot)) {
+        continue;
+      }
+      const uint32_t id = mappoints.GetId(slot);
+      while(state.v_mappoints.size() < id) {
+        // a removed id stays as an inactive point
+        MapPoint hole(cv::Point3f(0.0f, 0.0f, 0.0f));
+        hole.m_id = (int)state.v_mappoints.size();
+        state.v_mappoints.push_back(hole);
+      }
+      if(state.v_mappoints.size() == id) {
+        state.v_mappoints.push_back(mappoints.GetMapPoint(id));
+      }
+      else {
+        state.v_mappoints[id] = mappoints.GetMapPoint(id);
+      }
+    }
+
+    std::cout << "[LOG] "
+              << "Checkpoint " << (int)fs_state["sequence"] << " is loaded, "
+              << state.v_mappoints.size() << " mappoints" << std::endl;
+    return true;
+  }
+
+} // namespace
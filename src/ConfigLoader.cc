@@ -8,6 +8,7 @@ using namespace TS_SfM;
 
 std::pair<SystemConfig, Camera> ConfigLoader::LoadConfig(const std::string str_config_file) {
   SystemConfig config_params;
+  config_params.b_pack_keyframes = false;
   Camera camera_params{-1.0,-1.0,-1.0,-1.0};
   cv::FileStorage fs_settings(str_config_file, cv::FileStorage::READ);
   if(!fs_settings.isOpened())
@@ -18,6 +19,10 @@ std::pair<SystemConfig, Camera> ConfigLoader::LoadConfig(const std::string str_c
   }
 
   config_params.str_path_to_images = static_cast<std::string>(fs_settings["Config.path2images"]);
+  if(!fs_settings["Config.map_file"].empty())
+    config_params.str_map_file = static_cast<std::string>(fs_settings["Config.map_file"]);
+  if(!fs_settings["Config.pack_keyframes"].empty())
+    config_params.b_pack_keyframes = (int)fs_settings["Config.pack_keyframes"] != 0;
 
   camera_params.f_cx = fs_settings["Camera.cx"];
   camera_params.f_fx = fs_settings["Camera.fx"];
@@ -72,8 +77,19 @@ Tracker::TrackerConfig ConfigLoader::LoadTrackerConfig(const std::string str_con
 
 Mapper::MapperConfig ConfigLoader::LoadMapperConfig(const std::string str_config_file) {
   cv::FileStorage fs_settings(str_config_file, cv::FileStorage::READ);
-  Mapper::MapperConfig mapper_config;
+  // default values are used if params are not given
+  Mapper::MapperConfig mapper_config{0, 2, 1.0f, 4.0f, 3.0f, 50};
   mapper_config.skip = fs_settings["MapperConfig.skip"];
+  if(!fs_settings["Mapper.min_observations"].empty())
+    mapper_config.min_observations = static_cast<int>(fs_settings["Mapper.min_observations"]);
+  if(!fs_settings["Mapper.min_parallax"].empty())
+    mapper_config.min_parallax = static_cast<float>(fs_settings["Mapper.min_parallax"]);
+  if(!fs_settings["Mapper.max_reprojection_error"].empty())
+    mapper_config.max_reprojection_error = static_cast<float>(fs_settings["Mapper.max_reprojection_error"]);
+  if(!fs_settings["Mapper.fusion_radius"].empty())
+    mapper_config.fusion_radius = static_cast<float>(fs_settings["Mapper.fusion_radius"]);
+  if(!fs_settings["Mapper.max_descriptor_distance"].empty())
+    mapper_config.max_descriptor_distance = static_cast<int>(fs_settings["Mapper.max_descriptor_distance"]);
 
   return mapper_config;
 }
@@ -88,11 +104,94 @@ void ConfigLoader::LoadInitializerConfig(int& num_frames, int& connect_distance,
   return;
 }
 
+Solver::TriangulatorConfig ConfigLoader::LoadTriangulatorConfig(const std::string str_config_file) {
+  cv::FileStorage fs_settings(str_config_file, cv::FileStorage::READ);
+  // default values are used if params are not given
+  Solver::TriangulatorConfig triangulator_config{1.0, 4.0, 0};
+
+  if(!fs_settings["Triangulator.min_parallax_deg"].empty())
+    triangulator_config.min_parallax_deg = static_cast<float>(fs_settings["Triangulator.min_parallax_deg"]);
+  if(!fs_settings["Triangulator.max_reproj_error"].empty())
+    triangulator_config.max_reproj_error = static_cast<float>(fs_settings["Triangulator.max_reproj_error"]);
+  if(!fs_settings["Triangulator.num_threads"].empty())
+    triangulator_config.num_threads = static_cast<int>(fs_settings["Triangulator.num_threads"]);
+
+  return triangulator_config;
+}
+
+Optimizer::OptimizerConfig ConfigLoader::LoadOptimizerConfig(const std::string str_config_file) {
+  cv::FileStorage fs_settings(str_config_file, cv::FileStorage::READ);
+  // default values are used if params are not given
+  Optimizer::OptimizerConfig optimizer_config{5, 10, 4.0, 1e-4, 1e-6, false,
+                                              Optimizer::G2O, BundleAdjuster::SparseCholesky, 0,
+                                              Optimizer::Cholmod, 40, 5, ""};
+
+  if(!fs_settings["Optimizer.window_size"].empty())
+    optimizer_config.window_size = static_cast<int>(fs_settings["Optimizer.window_size"]);
+  if(!fs_settings["Optimizer.max_iteration"].empty())
+    optimizer_config.max_iteration = static_cast<int>(fs_settings["Optimizer.max_iteration"]);
+  if(!fs_settings["Optimizer.huber_delta"].empty())
+    optimizer_config.huber_delta = static_cast<float>(fs_settings["Optimizer.huber_delta"]);
+  if(!fs_settings["Optimizer.chi2_threshold"].empty())
+    optimizer_config.chi2_threshold = static_cast<float>(fs_settings["Optimizer.chi2_threshold"]);
+  if(!fs_settings["Optimizer.step_threshold"].empty())
+    optimizer_config.step_threshold = static_cast<float>(fs_settings["Optimizer.step_threshold"]);
+  if(!fs_settings["Optimizer.verbose"].empty())
+    optimizer_config.verbose = static_cast<int>(fs_settings["Optimizer.verbose"]) != 0;
+  if(!fs_settings["Optimizer.num_threads"].empty())
+    optimizer_config.num_threads = static_cast<int>(fs_settings["Optimizer.num_threads"]);
+  if(!fs_settings["Optimizer.submap_size"].empty())
+    optimizer_config.submap_size = static_cast<int>(fs_settings["Optimizer.submap_size"]);
+  if(!fs_settings["Optimizer.submap_overlap"].empty())
+    optimizer_config.submap_overlap = static_cast<int>(fs_settings["Optimizer.submap_overlap"]);
+  if(!fs_settings["Optimizer.export_bal_file"].empty())
+    optimizer_config.export_bal_file = static_cast<std::string>(fs_settings["Optimizer.export_bal_file"]);
+
+  std::string _engine = static_cast<std::string>(fs_settings["Optimizer.engine"]);
+  if(_engine == "native")
+    optimizer_config.engine = Optimizer::Native;
+  else if(_engine == "submap")
+    optimizer_config.engine = Optimizer::Submap;
+
+  std::string _linear_solver = static_cast<std::string>(fs_settings["Optimizer.linear_solver"]);
+  if(_linear_solver == "eigen")
+    optimizer_config.linear_solver = Optimizer::EigenSparse;
+  else if(_linear_solver == "dense")
+    optimizer_config.linear_solver = Optimizer::Dense;
+  else if(_linear_solver == "pcg")
+    optimizer_config.linear_solver = Optimizer::PCG;
+  else if(_linear_solver == "auto")
+    optimizer_config.linear_solver = Optimizer::Auto;
+
+  std::string _native_linear_solver = static_cast<std::string>(fs_settings["Optimizer.native_linear_solver"]);
+  if(_native_linear_solver == "dense")
+    optimizer_config.native_linear_solver = BundleAdjuster::DenseCholesky;
+  else if(_native_linear_solver == "pcg")
+    optimizer_config.native_linear_solver = BundleAdjuster::PCG;
+
+  return optimizer_config;
+}
+
 LoopClosure::LoopConfig ConfigLoader::LoadLoopConfig(const std::string str_config_file) {
   cv::FileStorage fs_settings(str_config_file, cv::FileStorage::READ);
-  LoopClosure::LoopConfig lc_config;
-  lc_config.start_id = fs_settings["LoopConfig.start"];
-  lc_config.end_id = fs_settings["LoopConfig.end"];
+  // default values are used if params are not given
+  LoopClosure::LoopConfig lc_config{-1, -1, 20, 200, 5.991f, 15, 20, false};
+  if(!fs_settings["LoopClosure.start"].empty())
+    lc_config.start_id = static_cast<int>(fs_settings["LoopClosure.start"]);
+  if(!fs_settings["LoopClosure.end"].empty())
+    lc_config.end_id = static_cast<int>(fs_settings["LoopClosure.end"]);
+  if(!fs_settings["LoopClosure.min_inliers"].empty())
+    lc_config.min_inliers = static_cast<int>(fs_settings["LoopClosure.min_inliers"]);
+  if(!fs_settings["LoopClosure.ransac_iteration"].empty())
+    lc_config.ransac_iteration = static_cast<int>(fs_settings["LoopClosure.ransac_iteration"]);
+  if(!fs_settings["LoopClosure.inlier_threshold"].empty())
+    lc_config.inlier_threshold = static_cast<float>(fs_settings["LoopClosure.inlier_threshold"]);
+  if(!fs_settings["LoopClosure.min_covisibility"].empty())
+    lc_config.min_covisibility = static_cast<int>(fs_settings["LoopClosure.min_covisibility"]);
+  if(!fs_settings["LoopClosure.max_iteration"].empty())
+    lc_config.max_iteration = static_cast<int>(fs_settings["LoopClosure.max_iteration"]);
+  if(!fs_settings["LoopClosure.fix_scale"].empty())
+    lc_config.fix_scale = static_cast<int>(fs_settings["LoopClosure.fix_scale"]) != 0;
 
   return lc_config;
 }
@@ -138,6 +237,29 @@ Matcher::MatcherConfig ConfigLoader::LoadMatcherConfig(const std::string str_con
       matcher_config.search_type = Matcher::Whole;
 
   matcher_config.search_range = static_cast<int>(fs_settings["Matcher.search_range"]);
+  matcher_config.projection_radius = 10.0;
+  matcher_config.projection_max_distance = 100;
+  matcher_config.projection_max_depth = 100.0;
+  if(!fs_settings["Matcher.projection_radius"].empty()) {
+    matcher_config.projection_radius = static_cast<float>(fs_settings["Matcher.projection_radius"]);
+  }
+  if(!fs_settings["Matcher.projection_max_distance"].empty()) {
+    matcher_config.projection_max_distance = static_cast<int>(fs_settings["Matcher.projection_max_distance"]);
+  }
+  if(!fs_settings["Matcher.projection_max_depth"].empty()) {
+    matcher_config.projection_max_depth = static_cast<float>(fs_settings["Matcher.projection_max_depth"]);
+  }
 
   return matcher_config;
 }
+
+Checkpointer::CheckpointConfig ConfigLoader::LoadCheckpointConfig(const std::string str_config_file) {
+  cv::FileStorage fs_settings(str_config_file, cv::FileStorage::READ);
+  // default values are used if params are not given
+  Checkpointer::CheckpointConfig checkpoint_config{"", 10};
+  if(!fs_settings["Checkpoint.directory"].empty())
+    checkpoint_config.directory = static_cast<std::string>(fs_settings["Checkpoint.directory"]);
+  if(!fs_settings["Checkpoint.interval"].empty())
+    checkpoint_config.interval = static_cast<int>(fs_settings["Checkpoint.interval"]);
+  return checkpoint_config;
+}
@@ -0,0 +1,147 @@
+#include "CovisibilityGraph.h"
+
+#include <algorithm>
+#include <queue>
+#include <utility>
+
+namespace TS_SfM {
+
+  void CovisibilityGraph::AddObservation(const std::vector<int>& v_observing_kf_ids, const int kf_id) {
+    for(const int observing_kf_id : v_observing_kf_ids) {
+      UpdateEdge(observing_kf_id, kf_id, 1);
+    }
+  }
+
+  void CovisibilityGraph::RemoveObservation(const std::vector<int>& v_observing_kf_ids, const int kf_id) {
+    for(const int observing_kf_id : v_observing_kf_ids) {
+      UpdateEdge(observing_kf_id, kf_id, -1);
+    }
+  }
+
+  void CovisibilityGraph::AddMapPoint(const std::vector<int>& v_kf_ids) {
+    for(size_t i = 0; i < v_kf_ids.size(); ++i) {
+      for(size_t j = i + 1; j < v_kf_ids.size(); ++j) {
+        UpdateEdge(v_kf_ids[i], v_kf_ids[j], 1);
+      }
+    }
+  }
+
+  void CovisibilityGraph::RemoveMapPoint(const std::vector<int>& v_kf_ids) {
+    for(size_t i = 0; i < v_kf_ids.size(); ++i) {
+      for(size_t j = i + 1; j < v_kf_ids.size(); ++j) {
+        UpdateEdge(v_kf_ids[i], v_kf_ids[j], -1);
+      }
+    }
+  }
+
+  int CovisibilityGraph::GetWeight(const int kf_id_0, const int kf_id_1) const {
+    if(kf_id_0 < 0 || kf_id_0 >= (int)m_v_adjacency.size()) {
+      return 0;
+    }
+    auto itr = m_v_adjacency[kf_id_0].find(kf_id_1);
+    return itr == m_v_adjacency[kf_id_0].end() ? 0 : itr->second;
+  }
+
+  std::vector<int> CovisibilityGraph::GetBestCovisibleKeyFrames(const int kf_id, const int num_keyframes) const {
+    std::vector<int> v_kf_ids;
+    if(kf_id < 0 || kf_id >= (int)m_v_adjacency.size() || num_keyframes <= 0) {
+      return v_kf_ids;
+    }
+
+    std::vector<std::pair<int, int>> v_neighbors(m_v_adjacency[kf_id].begin(), m_v_adjacency[kf_id].end());
+    const int num_best = std::min(num_keyframes, (int)v_neighbors.size());
+    // heavier first, smaller id first for the same weight
+    std::partial_sort(v_neighbors.begin(), v_neighbors.begin() + num_best, v_neighbors.end(),
+                      [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+                        return a.second > b.second || (a.second == b.second && a.first < b.first);
+                      });
+    v_kf_ids.reserve(num_best);
+    for(int i = 0; i < num_best; ++i) {
+      v_kf_ids.push_back(v_neighbors[i].first);
+    }
+    return v_kf_ids;
+  }
+
+  std::vector<int> CovisibilityGraph::GetCovisibleKeyFrames(const int kf_id, const int min_weight) const {
+    std::vector<int> v_kf_ids;
+    if(kf_id < 0 || kf_id >= (int)m_v_adjacency.size()) {
+      return v_kf_ids;
+    }
+    for(const auto& neighbor : m_v_adjacency[kf_id]) {
+      if(neighbor.second >= min_weight) {
+        v_kf_ids.push_back(neighbor.first);
+      }
+    }
+    std::sort(v_kf_ids.begin(), v_kf_ids.end());
+    return v_kf_ids;
+  }
+
+  std::vector<CovisibilityGraph::Edge> CovisibilityGraph::GetEdges(const int min_weight) const {
+    std::vector<Edge> v_edges;
+    for(int kf_id = 0; kf_id < (int)m_v_adjacency.size(); ++kf_id) {
+      for(const auto& neighbor : m_v_adjacency[kf_id]) {
+        if(kf_id < neighbor.first && neighbor.second >= min_weight) {
+          v_edges.push_back(Edge{kf_id, neighbor.first, neighbor.second});
+        }
+      }
+    }
+    return v_edges;
+  }
+
+  std::vector<int> CovisibilityGraph::ComputeSpanningTree() const {
+    const int num_keyframes = (int)m_v_adjacency.size();
+    std::vector<int> v_parents(num_keyframes, -1);
+    std::vector<char> vb_in_tree(num_keyframes, 0);
+
+    // Prim's algorithm, (weight, (keyframe, parent)) with the heaviest edge on top
+    typedef std::pair<int, std::pair<int, int>> WeightedEdge;
+    std::priority_queue<WeightedEdge> pq_edges;
+    for(int root_id = 0; root_id < num_keyframes; ++root_id) {
+      if(vb_in_tree[root_id]) {
+        continue;
+      }
+      vb_in_tree[root_id] = 1;
+      for(const auto& neighbor : m_v_adjacency[root_id]) {
+        pq_edges.push(std::make_pair(neighbor.second, std::make_pair(neighbor.first, root_id)));
+      }
+      while(!pq_edges.empty()) {
+        const WeightedEdge edge = pq_edges.top();
+        pq_edges.pop();
+        const int kf_id = edge.second.first;
+        if(vb_in_tree[kf_id]) {
+          continue;
+        }
+        vb_in_tree[kf_id] = 1;
+        v_parents[kf_id] = edge.second.second;
+        for(const auto& neighbor : m_v_adjacency[kf_id]) {
+          if(!vb_in_tree[neighbor.first]) {
+            pq_edges.push(std::make_pair(neighbor.second, std::make_pair(neighbor.first, kf_id)));
+          }
+        }
+      }
+    }
+    return v_parents;
+  }
+
+  void CovisibilityGraph::UpdateEdge(const int kf_id_0, const int kf_id_1, const int delta) {
+    if(kf_id_0 == kf_id_1 || kf_id_0 < 0 || kf_id_1 < 0) {
+      return;
+    }
+    const int max_id = std::max(kf_id_0, kf_id_1);
+    if(max_id >= (int)m_v_adjacency.size()) {
+      m_v_adjacency.resize(max_id + 1);
+    }
+
+    // both directions are kept, an edge is erased when no mappoint is shared anymore
+    for(int k = 0; k < 2; ++k) {
+      const int from = k == 0 ? kf_id_0 : kf_id_1;
+      const int to = k == 0 ? kf_id_1 : kf_id_0;
+      int& weight = m_v_adjacency[from][to];
+      weight += delta;
+      if(weight <= 0) {
+        m_v_adjacency[from].erase(to);
+      }
+    }
+  }
+
+} // namespace
@@ -1,5 +1,6 @@
 #include "Frame.h"
 #include "KPExtractor.h"
+#include "Undistorter.h"
 
 namespace TS_SfM {
   Frame::Frame(const int id, const std::string str_path)
@@ -91,6 +92,17 @@ namespace TS_SfM {
   }
 
 
+  std::vector<cv::KeyPoint> Frame::GetUndistortedKeyPoints() const { 
+    if(m_v_undist_kpts.empty()) {
+      return m_v_kpts;
+    }
+    return m_v_undist_kpts; 
+  }
+
+  std::vector<cv::Point2f> Frame::GetNormalizedPoints() const { 
+    return m_v_normalized_pts; 
+  }
+
   cv::Mat Frame::GetImage() const {
     cv::Mat m_output = m_m_image.clone();
     return m_output; 
@@ -201,6 +213,19 @@ namespace TS_SfM {
     return std::move(p_extractor);
   }
 
+  void Frame::RestoreFeatures(const std::vector<cv::KeyPoint>& v_kpts, const cv::Mat& descriptors) {
+    m_m_image = cv::imread(m_str_path, 1);
+    m_v_kpts = v_kpts;
+    m_m_descriptors = descriptors.clone();
+    m_num_assigned_kps = (unsigned int)m_v_kpts.size();
+    return;
+  }
+
+  void Frame::UndistortKeyPoints(const Undistorter& undistorter) {
+    undistorter.UndistortKeyPoints(m_v_kpts, m_v_normalized_pts, m_v_undist_kpts);
+    return;
+  }
+
   void Frame::ShowFeaturePoints() {
     cv::Mat output;
     cv::drawKeypoints(m_m_image, m_v_kpts, output);
@@ -1,16 +1,177 @@
 #include "KeyFrame.h"
 #include "Frame.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
 namespace TS_SfM {
 
-  KeyFrame::KeyFrame(const Frame& f) 
-  : m_id(f.m_id), m_m_image(f.GetImage()), m_m_cTw(f.GetPose()),
-    m_v_kpts(f.GetKeyPoints()), m_m_descriptors(f.GetDescriptors()),
-    m_vvv_grid_kpts(f.GetGridKeyPoints()), m_vvm_grid_descs(f.GetGridDescs()),
-    m_vv_num_grid_kpts(f.GetGridKeyPointsNum()), m_num_assigned_kps(f.GetAssignedKeyPointsNum()),
-    m_vvv_grid_kp_idx(f.GetGridKpIdx()), m_b_activated(true)
+namespace {
+  // pixels, cells of the keypoint index
+  const float CELL_SIZE = 32.0f;
+  // bounds the index for keypoints spread far beyond the image, the last cells take the rest
+  const int MAX_CELLS_PER_AXIS = 256;
+}
+
+  KeyFrame::KeyFrame(const Frame& f)
+  : m_id(f.m_id), m_cTw(cv::Matx34f::eye()),
+    m_v_kpts(f.GetUndistortedKeyPoints()), m_v_normalized_pts(f.GetNormalizedPoints()),
+    m_m_descriptors(f.GetDescriptors()), m_num_kpts((int)m_v_kpts.size()),
+    m_b_activated(true), m_b_packed(false)
   {
-  
+    SetPose(f.GetPose());
+    BuildCellIndex();
+  }
+
+  KeyFrame::KeyFrame(const int id, const cv::Mat& cTw, const std::vector<cv::KeyPoint>& v_kpts,
+                     const std::vector<cv::Point2f>& v_normalized_pts, const cv::Mat& descriptors)
+  : m_id(id), m_cTw(cv::Matx34f::eye()), m_v_kpts(v_kpts), m_v_normalized_pts(v_normalized_pts),
+    m_m_descriptors(descriptors.clone()), m_num_kpts((int)m_v_kpts.size()),
+    m_b_activated(true), m_b_packed(false)
+  {
+    SetPose(cTw);
+    BuildCellIndex();
+  }
+
+  cv::Mat KeyFrame::GetDescriptors() const {
+    return m_m_descriptors;
+  }
+
+  std::vector<cv::KeyPoint> KeyFrame::GetKeyPoints() const {
+    return m_v_kpts;
+  }
+
+  void KeyFrame::SetPose(const cv::Mat& cTw) {
+    if(cTw.rows != 3 || cTw.cols != 4) {
+      return;
+    }
+    // converted from CV_64F as well
+    m_cTw = cTw;
+  }
+
+  cv::Point2f KeyFrame::GetObs(const int& kp_id) const {
+    const int idx = GetKeyPointIndex(kp_id);
+    assert(idx >= 0);
+    return m_v_kpts[idx].pt;
+  }
+
+  int KeyFrame::GetKeyPointIndex(const int kp_id) const {
+    if(kp_id < 0 || kp_id >= m_num_kpts) {
+      return -1;
+    }
+    if(!m_b_packed) {
+      return kp_id;
+    }
+    const auto itr = std::lower_bound(m_v_kept_kp_ids.begin(), m_v_kept_kp_ids.end(), kp_id);
+    return itr != m_v_kept_kp_ids.end() && *itr == kp_id ? (int)(itr - m_v_kept_kp_ids.begin()) : -1;
+  }
+
+  std::vector<int> KeyFrame::GetKeyPointsInArea(const cv::Point2f& pt, const float radius) const {
+    std::vector<int> v_kp_ids;
+    if(m_v_cell_offsets.empty()) {
+      return v_kp_ids;
+    }
+    // points beyond the last cell are in it (see BuildCellIndex)
+    const int min_col = std::min(m_num_cell_cols - 1, std::max(0, (int)std::floor((pt.x - radius - m_cell_origin.x) / CELL_SIZE)));
+    const int max_col = std::min(m_num_cell_cols - 1, std::max(0, (int)std::floor((pt.x + radius - m_cell_origin.x) / CELL_SIZE)));
+    const int min_row = std::min(m_num_cell_rows - 1, std::max(0, (int)std::floor((pt.y - radius - m_cell_origin.y) / CELL_SIZE)));
+    const int max_row = std::min(m_num_cell_rows - 1, std::max(0, (int)std::floor((pt.y + radius - m_cell_origin.y) / CELL_SIZE)));
+    const float radius_sq = radius * radius;
+    for(int row = min_row; row <= max_row; ++row) {
+      for(int col = min_col; col <= max_col; ++col) {
+        const int cell = row * m_num_cell_cols + col;
+        for(int i = m_v_cell_offsets[cell]; i < m_v_cell_offsets[cell+1]; ++i) {
+          const int kp_idx = m_v_cell_kp_idx[i];
+          const float dx = m_v_kpts[kp_idx].pt.x - pt.x;
+          const float dy = m_v_kpts[kp_idx].pt.y - pt.y;
+          if(dx * dx + dy * dy <= radius_sq) {
+            v_kp_ids.push_back(GetKeyPointId(kp_idx));
+          }
+        }
+      }
+    }
+    return v_kp_ids;
+  }
+
+  void KeyFrame::Pack(std::vector<int> v_kept_kp_ids) {
+    // ids not held (e.g. dropped by an earlier Pack) are ignored
+    std::sort(v_kept_kp_ids.begin(), v_kept_kp_ids.end());
+    v_kept_kp_ids.erase(std::unique(v_kept_kp_ids.begin(), v_kept_kp_ids.end()), v_kept_kp_ids.end());
+
+    std::vector<int> v_ids;
+    std::vector<int> v_src_idx;
+    v_ids.reserve(v_kept_kp_ids.size());
+    v_src_idx.reserve(v_kept_kp_ids.size());
+    for(const int kp_id : v_kept_kp_ids) {
+      const int idx = GetKeyPointIndex(kp_id);
+      if(idx >= 0) {
+        v_ids.push_back(kp_id);
+        v_src_idx.push_back(idx);
+      }
+    }
+
+    std::vector<cv::KeyPoint> v_kpts(v_src_idx.size());
+    std::vector<cv::Point2f> v_normalized_pts;
+    cv::Mat descriptors;
+    if(!m_m_descriptors.empty()) {
+      descriptors.create((int)v_src_idx.size(), m_m_descriptors.cols, m_m_descriptors.type());
+    }
+    for(size_t i = 0; i < v_src_idx.size(); ++i) {
+      v_kpts[i] = m_v_kpts[v_src_idx[i]];
+      if(v_src_idx[i] < (int)m_v_normalized_pts.size()) {
+        v_normalized_pts.push_back(m_v_normalized_pts[v_src_idx[i]]);
+      }
+      if(!descriptors.empty()) {
+        m_m_descriptors.row(v_src_idx[i]).copyTo(descriptors.row((int)i));
+      }
+    }
+
+    m_v_kpts.swap(v_kpts);
+    m_v_normalized_pts.swap(v_normalized_pts);
+    m_m_descriptors = descriptors;
+    m_v_kept_kp_ids.swap(v_ids);
+    m_b_packed = true;
+    BuildCellIndex();
+  }
+
+  void KeyFrame::BuildCellIndex() {
+    m_v_cell_offsets.clear();
+    m_v_cell_kp_idx.clear();
+    m_num_cell_cols = 0;
+    m_num_cell_rows = 0;
+    if(m_v_kpts.empty()) {
+      return;
+    }
+
+    cv::Point2f min_pt = m_v_kpts[0].pt, max_pt = m_v_kpts[0].pt;
+    for(const cv::KeyPoint& kpt : m_v_kpts) {
+      min_pt.x = std::min(min_pt.x, kpt.pt.x);
+      min_pt.y = std::min(min_pt.y, kpt.pt.y);
+      max_pt.x = std::max(max_pt.x, kpt.pt.x);
+      max_pt.y = std::max(max_pt.y, kpt.pt.y);
+    }
+    m_cell_origin = min_pt;
+    m_num_cell_cols = std::min(MAX_CELLS_PER_AXIS, (int)((max_pt.x - min_pt.x) / CELL_SIZE) + 1);
+    m_num_cell_rows = std::min(MAX_CELLS_PER_AXIS, (int)((max_pt.y - min_pt.y) / CELL_SIZE) + 1);
+
+    // counting sort of keypoint indices by cell
+    std::vector<int> v_cells(m_v_kpts.size());
+    m_v_cell_offsets.assign(m_num_cell_cols * m_num_cell_rows + 1, 0);
+    for(size_t i = 0; i < m_v_kpts.size(); ++i) {
+      const int col = std::min(m_num_cell_cols - 1, (int)((m_v_kpts[i].pt.x - min_pt.x) / CELL_SIZE));
+      const int row = std::min(m_num_cell_rows - 1, (int)((m_v_kpts[i].pt.y - min_pt.y) / CELL_SIZE));
+      v_cells[i] = row * m_num_cell_cols + col;
+      ++m_v_cell_offsets[v_cells[i] + 1];
+    }
+    for(size_t c = 1; c < m_v_cell_offsets.size(); ++c) {
+      m_v_cell_offsets[c] += m_v_cell_offsets[c-1];
+    }
+    m_v_cell_kp_idx.resize(m_v_kpts.size());
+    std::vector<int> v_write_pos(m_v_cell_offsets.begin(), m_v_cell_offsets.end() - 1);
+    for(size_t i = 0; i < m_v_kpts.size(); ++i) {
+      m_v_cell_kp_idx[v_write_pos[v_cells[i]]++] = (int)i;
+    }
   }
 
-}; // namespace 
+}; // namespace
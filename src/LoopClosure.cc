@@ -1,8 +1,318 @@
 #include "LoopClosure.h"
+#include "ConfigLoader.h"
+#include "CovisibilityGraph.h"
+#include "KeyFrame.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "Solver.h"
+
+#include "g2o/core/sparse_optimizer.h"
+#include "g2o/core/block_solver.h"
+#include "g2o/core/optimization_algorithm_levenberg.h"
+#include "g2o/solvers/eigen/linear_solver_eigen.h"
+#include "g2o/types/sim3/types_seven_dof_expmap.h"
+
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
 
 namespace TS_SfM {
-  LoopClosure::LoopClosure(const LoopConfig& _config) {
-    LoopConfig m_config{12,12}; 
+
+namespace {
+  long long PairKey(const int a, const int b) {
+    return ((long long)a << 32) | (unsigned int)b;
+  }
+
+  // Umeyama alignment with scale, X_dst = s * R * X_src + t.
+  LoopClosure::Similarity AlignPoints(const std::vector<Eigen::Vector3d>& v_src, const std::vector<Eigen::Vector3d>& v_dst,
+                                      const std::vector<int>& v_indices)
+  {
+    Eigen::Matrix3Xd src(3, v_indices.size()), dst(3, v_indices.size());
+    for(size_t i = 0; i < v_indices.size(); ++i) {
+      src.col(i) = v_src[v_indices[i]];
+      dst.col(i) = v_dst[v_indices[i]];
+    }
+    const Eigen::Matrix4d T = Eigen::umeyama(src, dst, true);
+    LoopClosure::Similarity S;
+    S.s = T.block<3,1>(0,0).norm();
+    S.R = T.block<3,3>(0,0) / S.s;
+    S.t = T.block<3,1>(0,3);
+    return S;
+  }
+}
+
+  LoopClosure::LoopClosure(const LoopConfig& config, const Camera& cam)
+    : m_config(config), m_fx(cam.f_fx), m_fy(cam.f_fy), m_cx(cam.f_cx), m_cy(cam.f_cy)
+  {
+  }
+
+  LoopClosure::~LoopClosure() {
+  }
+
+  bool LoopClosure::ComputeSim3(const std::vector<Eigen::Vector3d>& v_pts_loop, const std::vector<Eigen::Vector3d>& v_pts_cur,
+                                const std::vector<cv::Point2f>& v_uv_loop, const std::vector<cv::Point2f>& v_uv_cur,
+                                Similarity& S_cl, std::vector<bool>& vb_inliers) const
+  {
+    const int num = (int)v_pts_loop.size();
+    vb_inliers.assign(num, false);
+    if(num < std::max(3, m_config.min_inliers)) {
+      return false;
+    }
+
+    // squared reprojection error with 1 pixel sigma against chi2 (2 DoF)
+    const double chi2_threshold = m_config.inlier_threshold;
+    auto is_projected = [&](const Eigen::Vector3d& pt, const cv::Point2f& uv) {
+      if(pt.z() <= 0.0) {
+        return false;
+      }
+      const double du = m_fx * pt.x() / pt.z() + m_cx - uv.x;
+      const double dv = m_fy * pt.y() / pt.z() + m_cy - uv.y;
+      return du*du + dv*dv < chi2_threshold;
+    };
+    // Inliers are reprojected within the threshold in both keyframes.
+    auto count_inliers = [&](const Similarity& S, std::vector<bool>& vb_mask) {
+      int num_inliers = 0;
+      const Eigen::Matrix3d R_inv = S.R.transpose() / S.s;
+      for(int i = 0; i < num; ++i) {
+        const Eigen::Vector3d pt_in_cur = S.s * S.R * v_pts_loop[i] + S.t;
+        const Eigen::Vector3d pt_in_loop = R_inv * (v_pts_cur[i] - S.t);
+        vb_mask[i] = is_projected(pt_in_cur, v_uv_cur[i]) && is_projected(pt_in_loop, v_uv_loop[i]);
+        num_inliers += vb_mask[i] ? 1 : 0;
+      }
+      return num_inliers;
+    };
+
+    std::mt19937 mt(std::random_device{}());
+    std::uniform_int_distribution<int> dist(0, num-1);
+    std::vector<bool> vb_mask(num);
+    int max_inliers = 0;
+    for(int it = 0; it < m_config.ransac_iteration; ++it) {
+      std::vector<int> v_sample;
+      while(v_sample.size() < 3) {
+        const int idx = dist(mt);
+        if(std::find(v_sample.begin(), v_sample.end(), idx) == v_sample.end()) {
+          v_sample.push_back(idx);
+        }
+      }
+      const Similarity S = AlignPoints(v_pts_loop, v_pts_cur, v_sample);
+      if(!std::isfinite(S.s) || S.s <= 0.0) {
+        continue;
+      }
+      const int num_inliers = count_inliers(S, vb_mask);
+      if(num_inliers > max_inliers) {
+        max_inliers = num_inliers;
+        vb_inliers = vb_mask;
+      }
+    }
+
+    if(max_inliers < std::max(3, m_config.min_inliers)) {
+      return false;
+    }
+
+    // Refit with all inliers
+    std::vector<int> v_inlier_indices;
+    for(int i = 0; i < num; ++i) {
+      if(vb_inliers[i]) {
+        v_inlier_indices.push_back(i);
+      }
+    }
+    S_cl = AlignPoints(v_pts_loop, v_pts_cur, v_inlier_indices);
+    const int num_inliers = count_inliers(S_cl, vb_mask);
+    if(num_inliers >= max_inliers) {
+      vb_inliers = vb_mask;
+    }
+    return std::count(vb_inliers.begin(), vb_inliers.end(), true) >= std::max(3, m_config.min_inliers);
+  }
+
+  bool LoopClosure::Close(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints,
+                          const Map& map, const int loop_kf_id, const int current_kf_id)
+  {
+    if(loop_kf_id < 0 || current_kf_id < 0 || loop_kf_id == current_kf_id ||
+       loop_kf_id >= (int)v_keyframes.size() || current_kf_id >= (int)v_keyframes.size() ||
+       !v_keyframes[loop_kf_id].IsActivated() || !v_keyframes[current_kf_id].IsActivated()) {
+      return false;
+    }
+    KeyFrame& loop_kf = v_keyframes[loop_kf_id];
+    KeyFrame& current_kf = v_keyframes[current_kf_id];
+
+    // Mappoints of both keyframes are associated by descriptor matching of their keypoints.
+    const cv::Mat m_desc_loop = loop_kf.GetDescriptors();
+    const cv::Mat m_desc_cur = current_kf.GetDescriptors();
+    if(m_desc_loop.empty() || m_desc_cur.empty()) {
+      return false;
+    }
+    cv::BFMatcher matcher(m_desc_cur.depth() == CV_8U ? cv::NORM_HAMMING : cv::NORM_L2, true);
+    std::vector<cv::DMatch> v_matches;
+    matcher.match(m_desc_cur, m_desc_loop, v_matches);
+
+    Eigen::Matrix3d R_lw, R_cw;
+    Eigen::Vector3d t_lw, t_cw;
+    cv2eigen(loop_kf.GetPoseRot(), R_lw);
+    cv2eigen(loop_kf.GetPoseTrans(), t_lw);
+    cv2eigen(current_kf.GetPoseRot(), R_cw);
+    cv2eigen(current_kf.GetPoseTrans(), t_cw);
+
+    std::vector<Eigen::Vector3d> v_pts_loop, v_pts_cur;
+    std::vector<cv::Point2f> v_uv_loop, v_uv_cur;
+    for(const cv::DMatch& m : v_matches) {
+      // descriptor rows of packed keyframes aren't keypoint ids
+      const int kpt_id_cur = current_kf.GetKeyPointId(m.queryIdx);
+      const int kpt_id_loop = loop_kf.GetKeyPointId(m.trainIdx);
+      const uint32_t mappoint_id_cur = map.GetMapPointObservedBy(current_kf_id, kpt_id_cur);
+      const uint32_t mappoint_id_loop = map.GetMapPointObservedBy(loop_kf_id, kpt_id_loop);
+      if(mappoint_id_cur >= v_mappoints.size() || mappoint_id_loop >= v_mappoints.size()) {
+        continue;
+      }
+      const cv::Point3f pos_loop = v_mappoints[mappoint_id_loop].GetPosition();
+      const cv::Point3f pos_cur = v_mappoints[mappoint_id_cur].GetPosition();
+      v_pts_loop.push_back(R_lw * Eigen::Vector3d(pos_loop.x, pos_loop.y, pos_loop.z) + t_lw);
+      v_pts_cur.push_back(R_cw * Eigen::Vector3d(pos_cur.x, pos_cur.y, pos_cur.z) + t_cw);
+      v_uv_loop.push_back(loop_kf.GetObs(kpt_id_loop));
+      v_uv_cur.push_back(current_kf.GetObs(kpt_id_cur));
+    }
+
+    Similarity S_cl;
+    std::vector<bool> vb_inliers;
+    if(!ComputeSim3(v_pts_loop, v_pts_cur, v_uv_loop, v_uv_cur, S_cl, vb_inliers)) {
+      std::cout << "[Warning] Sim3 between keyframe " << loop_kf_id << " and " << current_kf_id
+                << " couldn't be estimated (" << v_pts_loop.size() << " matches).\n";
+      return false;
+    }
+    if(m_config.fix_scale) {
+      S_cl.s = 1.0;
+    }
+    std::cout << "[LOG] Loop " << loop_kf_id << " - " << current_kf_id << " : Sim3 with "
+              << std::count(vb_inliers.begin(), vb_inliers.end(), true) << " / " << v_pts_loop.size()
+              << " inliers, scale " << S_cl.s << std::endl;
+
+    OptimizeEssentialGraph(v_keyframes, v_mappoints, map.GetCovisibilityGraph(), loop_kf_id, current_kf_id, S_cl);
+    return true;
+  }
+
+  int LoopClosure::OptimizeEssentialGraph(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints,
+                                          const CovisibilityGraph& covisibility_graph, const int loop_kf_id, const int current_kf_id, const Similarity& S_cl) const
+  {
+    const auto t_start = std::chrono::steady_clock::now();
+    const int num_keyframes = (int)v_keyframes.size();
+
+    // 1. Essential graph : maximum spanning tree of covisibility and strong covisibility edges.
+    // Edge between loop and current keyframes is replaced by the loop edge.
+    const std::vector<int> v_parents = covisibility_graph.ComputeSpanningTree();
+    auto is_valid_edge = [&](const int id_i, const int id_j) {
+      return id_i < num_keyframes && id_j < num_keyframes &&
+             v_keyframes[id_i].IsActivated() && v_keyframes[id_j].IsActivated() &&
+             !(std::min(id_i, id_j) == std::min(loop_kf_id, current_kf_id) &&
+               std::max(id_i, id_j) == std::max(loop_kf_id, current_kf_id));
+    };
+    std::vector<long long> v_edges;
+    for(int id_j = 0; id_j < (int)v_parents.size(); ++id_j) {
+      if(v_parents[id_j] >= 0 && is_valid_edge(v_parents[id_j], id_j)) {
+        v_edges.push_back(PairKey(v_parents[id_j], id_j));
+      }
+    }
+    for(int id_i = 0; id_i < num_keyframes; ++id_i) {
+      for(const int id_j : covisibility_graph.GetCovisibleKeyFrames(id_i, m_config.min_covisibility)) {
+        const bool b_tree_edge = (id_j < (int)v_parents.size() && v_parents[id_j] == id_i) ||
+                                 (id_i < (int)v_parents.size() && v_parents[id_i] == id_j);
+        if(id_i < id_j && !b_tree_edge && is_valid_edge(id_i, id_j)) {
+          v_edges.push_back(PairKey(id_i, id_j));
+        }
+      }
+    }
+
+    // 2. Pose graph over Sim3, keyframe poses are drifted estimates with unit scale.
+    g2o::SparseOptimizer optimizer;
+    typedef g2o::BlockSolver_7_3::PoseMatrixType PoseMatrixType;
+    optimizer.setAlgorithm(new g2o::OptimizationAlgorithmLevenberg(
+      g2o::make_unique<g2o::BlockSolver_7_3>(g2o::make_unique<g2o::LinearSolverEigen<PoseMatrixType>>())));
+    optimizer.setVerbose(false);
+
+    std::vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3>> v_initial_Siw(num_keyframes);
+    std::vector<g2o::VertexSim3Expmap*> v_vertices(num_keyframes, nullptr);
+    for(KeyFrame& keyframe : v_keyframes) {
+      if(!keyframe.IsActivated()) {
+        continue;
+      }
+      Eigen::Matrix3d R;
+      Eigen::Vector3d t;
+      cv2eigen(keyframe.GetPoseRot(), R);
+      cv2eigen(keyframe.GetPoseTrans(), t);
+      v_initial_Siw[keyframe.m_id] = g2o::Sim3(R, t, 1.0);
+
+      g2o::VertexSim3Expmap* v_sim3 = new g2o::VertexSim3Expmap();
+      v_sim3->setId(keyframe.m_id);
+      v_sim3->setEstimate(v_initial_Siw[keyframe.m_id]);
+      v_sim3->setFixed(keyframe.m_id == loop_kf_id);
+      v_sim3->_fix_scale = m_config.fix_scale;
+      optimizer.addVertex(v_sim3);
+      v_vertices[keyframe.m_id] = v_sim3;
+    }
+
+    // EdgeSim3 measures S_ji = S_jw * S_iw^-1 between vertex(0) = i and vertex(1) = j.
+    const Eigen::Matrix<double,7,7> information = Eigen::Matrix<double,7,7>::Identity();
+    auto add_edge = [&](const int id_i, const int id_j, const g2o::Sim3& S_ji) {
+      g2o::EdgeSim3* e = new g2o::EdgeSim3();
+      e->setVertex(0, v_vertices[id_i]);
+      e->setVertex(1, v_vertices[id_j]);
+      e->setMeasurement(S_ji);
+      e->setInformation(information);
+      optimizer.addEdge(e);
+    };
+    for(const long long edge : v_edges) {
+      const int id_i = (int)(edge >> 32);
+      const int id_j = (int)(edge & 0xffffffff);
+      add_edge(id_i, id_j, v_initial_Siw[id_j] * v_initial_Siw[id_i].inverse());
+    }
+    add_edge(loop_kf_id, current_kf_id, g2o::Sim3(S_cl.R, S_cl.t, S_cl.s));
+
+    optimizer.initializeOptimization();
+    optimizer.optimize(m_config.max_iteration);
+
+    // 3. Keyframes take corrected poses, mappoints follow their reference (first observing) keyframe.
+    std::vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3>> v_corrected_Swi(num_keyframes);
+    int num_corrected = 0;
+    for(KeyFrame& keyframe : v_keyframes) {
+      if(!keyframe.IsActivated()) {
+        continue;
+      }
+      const g2o::Sim3 S_iw = v_vertices[keyframe.m_id]->estimate();
+      v_corrected_Swi[keyframe.m_id] = S_iw.inverse();
+      Eigen::Matrix<double,3,4> m_cTw;
+      m_cTw.leftCols<3>() = S_iw.rotation();
+      m_cTw.col(3) = S_iw.translation() / S_iw.scale();
+      cv::Mat pose(3, 4, CV_32FC1);
+      eigen2cv(m_cTw, pose);
+      keyframe.SetPose(pose);
+      ++num_corrected;
+    }
+
+    for(MapPoint& mappoint : v_mappoints) {
+      int ref_id = -1;
+      for(int i = 0; i < mappoint.GetObsNum() && ref_id < 0; ++i) {
+        const int id = mappoint.GetMatchInfo(i).frame_id;
+        if(id < num_keyframes && v_vertices[id] != nullptr) {
+          ref_id = id;
+        }
+      }
+      if(ref_id < 0) {
+        continue;
+      }
+      const cv::Point3f pos = mappoint.GetPosition();
+      const Eigen::Vector3d corrected
+        = v_corrected_Swi[ref_id].map(v_initial_Siw[ref_id].map(Eigen::Vector3d(pos.x, pos.y, pos.z)));
+      mappoint.SetPosition(corrected.x(), corrected.y(), corrected.z());
+    }
+
+    const auto t_end = std::chrono::steady_clock::now();
+    std::cout << "[LOG] Essential graph : " << num_corrected << " keyframes, " << v_edges.size() + 1
+              << " edges optimized in "
+              << std::chrono::duration<double, std::milli>(t_end - t_start).count() << " ms" << std::endl;
+
+    return num_corrected;
   }
 
 }
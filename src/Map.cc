@@ -1,10 +1,560 @@
 #include "Map.h"
+#include "ConfigLoader.h"
+#include "MapFile.h"
+#include "Solver.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <cstring>
 
 namespace TS_SfM {
+
+namespace {
+  // Appends the row of descs as row_size bytes, zeros if the row is missing or of another layout.
+  void AppendDescriptor(const cv::Mat& descs, const int row, const int type, const size_t row_size,
+                        std::vector<unsigned char>& v_bytes)
+  {
+    const size_t begin = v_bytes.size();
+    v_bytes.resize(begin + row_size, 0);
+    if(row < descs.rows && descs.type() == type && descs.cols * descs.elemSize() == row_size) {
+      std::memcpy(v_bytes.data() + begin, descs.ptr(row), row_size);
+    }
+  }
+}
+
+  Map::Map(const float voxel_size)
+    : m_spatial_index(voxel_size), m_b_keyframes_dirty(false), m_b_mappoints_dirty(false)
+  {
+    std::shared_ptr<MapSnapshot> p_snapshot = std::make_shared<MapSnapshot>();
+    p_snapshot->version = 0;
+    p_snapshot->p_keyframes = std::make_shared<const std::vector<MapSnapshot::KeyFrameState>>();
+    p_snapshot->num_mappoints = 0;
+    m_p_snapshot = p_snapshot;
+  }
+
   void Map::Initialize(std::vector<KeyFrame> v_keyframes, std::vector<MapPoint> v_mappoints) {
-    m_v_keyframes = v_keyframes;
-    m_v_mappoints = v_mappoints;
+    m_v_keyframes.clear();
+    m_vv_kpt_to_mappoint.clear();
+    // placeholders of frames which couldn't be registered are skipped
+    for(const KeyFrame& keyframe : v_keyframes) {
+      if(keyframe.IsActivated()) {
+        AddKeyFrame(keyframe);
+      }
+    }
+    m_mappoints.Clear();
+    m_covisibility_graph.Clear();
+    m_spatial_index.Clear();
+    m_v_recent_mappoint_ids.clear();
+    m_b_mappoints_dirty = true;
+    // inactive points only hold the index of a removed mappoint
+    for(const MapPoint& mappoint : v_mappoints) {
+      if(mappoint.IsActivated()) {
+        AddMapPoint(mappoint);
+      }
+    }
     return;
   }
 
+  bool Map::Save(const std::string& file, const Camera& cam) const {
+    MapFile::Header header;
+    std::memset(&header, 0, sizeof(MapFile::Header));
+    const float v_cam[9] = {cam.f_fx, cam.f_fy, cam.f_cx, cam.f_cy, cam.f_k1, cam.f_k2, cam.f_p1, cam.f_p2, cam.f_k3};
+    std::copy(v_cam, v_cam + 9, header.camera);
+
+    // descriptor layout of the mappoints, or of the first keyframe with descriptors
+    cv::Mat ref_descs = m_mappoints.GetDescriptors();
+    for(size_t i = 0; i < m_v_keyframes.size() && ref_descs.empty(); ++i) {
+      if(m_v_keyframes[i].IsActivated()) {
+        ref_descs = m_v_keyframes[i].GetDescriptors();
+      }
+    }
+    const int desc_type = ref_descs.empty() ? -1 : ref_descs.type();
+    const size_t desc_size = ref_descs.empty() ? 0 : ref_descs.cols * ref_descs.elemSize();
+    header.descriptor_type = desc_type;
+    header.descriptor_size = (uint32_t)desc_size;
+
+    std::vector<MapFile::KeyFrameRecord> v_keyframes(m_v_keyframes.size());
+    std::vector<MapFile::KeyPointRecord> v_kpts;
+    std::vector<unsigned char> v_kpt_descs;
+    std::vector<uint8_t> v_kpt_flags;
+    for(size_t kf_id = 0; kf_id < m_v_keyframes.size(); ++kf_id) {
+      const KeyFrame& keyframe = m_v_keyframes[kf_id];
+      MapFile::KeyFrameRecord& record = v_keyframes[kf_id];
+      std::memset(&record, 0, sizeof(MapFile::KeyFrameRecord));
+      record.id = (int32_t)kf_id;
+      record.kpt_begin = v_kpts.size();
+      if(!keyframe.IsActivated()) {
+        continue;
+      }
+      record.flags = MapFile::ACTIVATED | (keyframe.IsPacked() ? (uint32_t)MapFile::PACKED : 0u);
+      const cv::Matx34f cTw = keyframe.GetPose();
+      std::copy(cTw.val, cTw.val + 12, record.cTw);
+
+      // Records are indexed by keypoint id, keypoints dropped from a packed keyframe are left zero
+      // and aren't flagged KEPT.
+      const std::vector<cv::KeyPoint> v_kf_kpts = keyframe.GetKeyPoints();
+      const cv::Mat descs = keyframe.GetDescriptors();
+      record.num_kpts = (uint32_t)keyframe.GetNumKeyPoints();
+      for(int kpt_id = 0; kpt_id < keyframe.GetNumKeyPoints(); ++kpt_id) {
+        const int idx = keyframe.GetKeyPointIndex(kpt_id);
+        if(idx < 0) {
+          v_kpts.push_back(MapFile::KeyPointRecord{0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0});
+          v_kpt_flags.push_back(0);
+        }
+        else {
+          const cv::KeyPoint& kpt = v_kf_kpts[idx];
+          v_kpts.push_back(MapFile::KeyPointRecord{kpt.pt.x, kpt.pt.y, kpt.size, kpt.angle, kpt.response, kpt.octave});
+          v_kpt_flags.push_back(MapFile::KEPT);
+        }
+        if(desc_type >= 0) {
+          AppendDescriptor(descs, idx < 0 ? descs.rows : idx, desc_type, desc_size, v_kpt_descs);
+        }
+      }
+    }
+
+    std::vector<MapFile::MapPointRecord> v_mappoints;
+    std::vector<MatchInfo> v_obs;
+    std::vector<unsigned char> v_mappoint_descs;
+    v_mappoints.reserve(m_mappoints.GetNumMapPoints());
+    const float* p_x = m_mappoints.GetX();
+    const float* p_y = m_mappoints.GetY();
+    const float* p_z = m_mappoints.GetZ();
+    for(int slot = 0; slot < m_mappoints.GetNumSlots(); ++slot) {
+      if(!m_mappoints.IsAlive(slot)) {
+        continue;
+      }
+      const int num_obs = m_mappoints.GetObsNum(slot);
+      v_mappoints.push_back(MapFile::MapPointRecord{m_mappoints.GetId(slot),
+                                                    m_mappoints.IsActivated(slot) ? (uint32_t)MapFile::ACTIVATED : 0u,
+                                                    p_x[slot], p_y[slot], p_z[slot],
+                                                    (uint32_t)num_obs, (uint64_t)v_obs.size()});
+      v_obs.insert(v_obs.end(), m_mappoints.GetObservations(slot), m_mappoints.GetObservations(slot) + num_obs);
+      if(desc_type >= 0) {
+        AppendDescriptor(m_mappoints.GetDescriptors(), slot, desc_type, desc_size, v_mappoint_descs);
+      }
+    }
+
+    const std::vector<CovisibilityGraph::Edge> v_edges = m_covisibility_graph.GetEdges();
+
+    header.num_keyframes = (uint32_t)v_keyframes.size();
+    header.num_keypoints = v_kpts.size();
+    header.num_mappoints = (uint32_t)v_mappoints.size();
+    header.num_observations = v_obs.size();
+    header.num_covisibility_edges = v_edges.size();
+    const void* const p_sections[MapFile::NUM_SECTIONS] = {
+      v_keyframes.data(), v_kpts.data(), v_kpt_descs.data(), v_kpt_flags.data(),
+      v_mappoints.data(), v_mappoint_descs.data(), v_obs.data(), v_edges.data()
+    };
+    const uint64_t section_sizes[MapFile::NUM_SECTIONS] = {
+      v_keyframes.size() * sizeof(MapFile::KeyFrameRecord),
+      v_kpts.size() * sizeof(MapFile::KeyPointRecord),
+      v_kpt_descs.size(),
+      v_kpt_flags.size(),
+      v_mappoints.size() * sizeof(MapFile::MapPointRecord),
+      v_mappoint_descs.size(),
+      v_obs.size() * sizeof(MatchInfo),
+      v_edges.size() * sizeof(CovisibilityGraph::Edge)
+    };
+    return MapFile::Write(file, header, p_sections, section_sizes);
+  }
+
+  bool Map::Load(const std::string& file, Camera& cam) {
+    MapFileView view;
+    if(!view.Open(file)) {
+      return false;
+    }
+    cam = view.GetCamera();
+
+    m_v_keyframes.clear();
+    m_vv_kpt_to_mappoint.clear();
+    m_mappoints.Clear();
+    m_covisibility_graph.Clear();
+    m_spatial_index.Clear();
+    m_v_recent_mappoint_ids.clear();
+
+    const MapFile::KeyFrameRecord* p_keyframes = view.GetKeyFrames();
+    m_v_keyframes.reserve(view.GetNumKeyFrames());
+    for(int kf_id = 0; kf_id < view.GetNumKeyFrames(); ++kf_id) {
+      const MapFile::KeyFrameRecord& record = p_keyframes[kf_id];
+      if(!(record.flags & MapFile::ACTIVATED)) {
+        continue;
+      }
+      const MapFile::KeyPointRecord* p_kpts = view.GetKeyPoints(kf_id);
+      std::vector<cv::KeyPoint> v_kpts(record.num_kpts);
+      std::vector<cv::Point2f> v_normalized_pts(record.num_kpts);
+      for(uint32_t i = 0; i < record.num_kpts; ++i) {
+        const MapFile::KeyPointRecord& kpt = p_kpts[i];
+        v_kpts[i] = cv::KeyPoint(kpt.x, kpt.y, kpt.size, kpt.angle, kpt.response, kpt.octave);
+        v_normalized_pts[i] = cv::Point2f((kpt.x - cam.f_cx) / cam.f_fx, (kpt.y - cam.f_cy) / cam.f_fy);
+      }
+      const cv::Mat cTw(3, 4, CV_32FC1, const_cast<float*>(record.cTw));
+      KeyFrame keyframe(record.id, cTw, v_kpts, v_normalized_pts, view.GetKeyPointDescriptors(kf_id));
+      if(record.flags & MapFile::PACKED) {
+        // ids of the kept keypoints are restored, the zero records of dropped ones are discarded
+        const uint8_t* p_kpt_flags = view.GetKeyPointFlags(kf_id);
+        std::vector<int> v_kept_kp_ids;
+        for(uint32_t i = 0; i < record.num_kpts; ++i) {
+          if(p_kpt_flags[i] & MapFile::KEPT) {
+            v_kept_kp_ids.push_back((int)i);
+          }
+        }
+        keyframe.Pack(v_kept_kp_ids);
+      }
+      AddKeyFrame(keyframe);
+    }
+
+    const MapFile::MapPointRecord* p_mappoints = view.GetMapPoints();
+    const cv::Mat descs = view.GetMapPointDescriptors();
+    m_mappoints.ReserveMapPoints(view.GetNumMapPoints(), (int)view.GetHeader().num_observations);
+    std::vector<VoxelHashIndex::Entry> v_index_entries;
+    v_index_entries.reserve(view.GetNumMapPoints());
+    for(int i = 0; i < view.GetNumMapPoints(); ++i) {
+      const MapFile::MapPointRecord& record = p_mappoints[i];
+      const MatchInfo* p_obs = view.GetObservations(i);
+      const uint32_t mappoint_id = m_mappoints.Add(record.id, cv::Point3f(record.x, record.y, record.z),
+                                                   descs.empty() ? cv::Mat() : descs.row(i),
+                                                   p_obs, (int)record.num_obs, (record.flags & MapFile::ACTIVATED) != 0);
+      v_index_entries.push_back(VoxelHashIndex::Entry{mappoint_id, record.x, record.y, record.z});
+      for(uint32_t j = 0; j < record.num_obs; ++j) {
+        if(!LinkKeyPoint(mappoint_id, p_obs[j])) {
+          m_mappoints.RemoveObservation(mappoint_id, p_obs[j].frame_id, p_obs[j].kpt_id);
+        }
+      }
+    }
+
+    m_spatial_index.Build(v_index_entries);
+
+    // the graph is stored, recounting it from the observations is the slow part of a load
+    const CovisibilityGraph::Edge* p_edges = view.GetCovisibilityEdges();
+    for(int i = 0; i < view.GetNumCovisibilityEdges(); ++i) {
+      m_covisibility_graph.AddEdge(p_edges[i]);
+    }
+
+    m_b_keyframes_dirty = true;
+    m_b_mappoints_dirty = true;
+    std::cout << "[LOG] "
+              << "Loaded " << file << ": " << view.GetNumKeyFrames() << " keyframes, "
+              << m_mappoints.GetNumMapPoints() << " mappoints" << std::endl;
+    return true;
+  }
+
+  bool Map::AddKeyFrame(const KeyFrame& keyframe) {
+    const int keyframe_id = keyframe.m_id;
+    if(keyframe_id < 0) {
+      return false;
+    }
+    if(keyframe_id >= (int)m_v_keyframes.size()) {
+      m_v_keyframes.resize(keyframe_id + 1);
+    }
+    m_v_keyframes[keyframe_id] = keyframe;
+    m_b_keyframes_dirty = true;
+    if(keyframe_id >= (int)m_vv_kpt_to_mappoint.size()) {
+      m_vv_kpt_to_mappoint.resize(keyframe_id + 1);
+    }
+    if((int)m_vv_kpt_to_mappoint[keyframe_id].size() < keyframe.GetNumKeyPoints()) {
+      m_vv_kpt_to_mappoint[keyframe_id].resize(keyframe.GetNumKeyPoints(), MapPointArena::INVALID_ID);
+    }
+    return true;
+  }
+
+  void Map::SetKeyFramePose(const int keyframe_id, const cv::Mat& cTw) {
+    if(keyframe_id < 0 || keyframe_id >= (int)m_v_keyframes.size() || !m_v_keyframes[keyframe_id].IsActivated()) {
+      return;
+    }
+    m_v_keyframes[keyframe_id].SetPose(cTw);
+    m_b_keyframes_dirty = true;
+  }
+
+  int Map::PackKeyFrames() {
+    int num_dropped = 0;
+    for(KeyFrame& keyframe : m_v_keyframes) {
+      if(!keyframe.IsActivated() || keyframe.m_id >= (int)m_vv_kpt_to_mappoint.size()) {
+        continue;
+      }
+      const std::vector<uint32_t>& v_kpt_to_mappoint = m_vv_kpt_to_mappoint[keyframe.m_id];
+      std::vector<int> v_kept_kpt_ids;
+      for(int kpt_id = 0; kpt_id < (int)v_kpt_to_mappoint.size(); ++kpt_id) {
+        if(v_kpt_to_mappoint[kpt_id] != MapPointArena::INVALID_ID) {
+          v_kept_kpt_ids.push_back(kpt_id);
+        }
+      }
+      const int num_held = (int)keyframe.GetKeyPoints().size();
+      keyframe.Pack(v_kept_kpt_ids);
+      num_dropped += num_held - (int)keyframe.GetKeyPoints().size();
+    }
+    std::cout << "[LOG] "
+              << "Packed keyframes, " << num_dropped << " unmatched keypoints are dropped" << std::endl;
+    return num_dropped;
+  }
+
+  KeyFrame* Map::GetKeyFrameObservingMapPoint(const int& map_id) {
+    const int slot = map_id < 0 ? -1 : m_mappoints.GetSlot((uint32_t)map_id);
+    if(slot < 0 || m_mappoints.GetObsNum(slot) == 0) {
+      return nullptr;
+    }
+    const int keyframe_id = m_mappoints.GetObservations(slot)[0].frame_id;
+    if(keyframe_id < 0 || keyframe_id >= (int)m_v_keyframes.size() || !m_v_keyframes[keyframe_id].IsActivated()) {
+      return nullptr;
+    }
+    return &m_v_keyframes[keyframe_id];
+  }
+
+  uint32_t Map::AddMapPoint(const MapPoint& mappoint) {
+    const uint32_t mappoint_id = m_mappoints.Add(mappoint);
+    const cv::Point3f pos = mappoint.GetPosition();
+    m_spatial_index.Insert(mappoint_id, pos.x, pos.y, pos.z);
+    m_v_recent_mappoint_ids.push_back(mappoint_id);
+    MarkMapPointDirty(mappoint_id);
+    // observations of keypoints which already have a mappoint are dropped
+    for(int i = 0; i < mappoint.GetObsNum(); ++i) {
+      const MatchInfo m = mappoint.GetMatchInfo(i);
+      if(!LinkKeyPoint(mappoint_id, m)) {
+        m_mappoints.RemoveObservation(mappoint_id, m.frame_id, m.kpt_id);
+      }
+    }
+    m_covisibility_graph.AddMapPoint(GetObservingKeyFrameIds(mappoint_id));
+    return mappoint_id;
+  }
+
+  bool Map::RemoveMapPoint(const uint32_t mappoint_id) {
+    const int slot = m_mappoints.GetSlot(mappoint_id);
+    if(slot < 0) {
+      return false;
+    }
+    m_covisibility_graph.RemoveMapPoint(GetObservingKeyFrameIds(mappoint_id));
+    const MatchInfo* p_obs = m_mappoints.GetObservations(slot);
+    for(int i = 0; i < m_mappoints.GetObsNum(slot); ++i) {
+      m_vv_kpt_to_mappoint[p_obs[i].frame_id][p_obs[i].kpt_id] = MapPointArena::INVALID_ID;
+    }
+    MarkMapPointDirty(mappoint_id);
+    m_mappoints.Remove(mappoint_id);
+    m_spatial_index.Remove(mappoint_id);
+    if(m_mappoints.NeedsCompaction()) {
+      m_mappoints.Compact();
+      m_b_mappoints_dirty = true;
+    }
+    return true;
+  }
+
+  void Map::SetMapPointPosition(const uint32_t mappoint_id, const cv::Point3f& pos) {
+    m_mappoints.SetPosition(mappoint_id, pos.x, pos.y, pos.z);
+    m_spatial_index.Update(mappoint_id, pos.x, pos.y, pos.z);
+    m_v_recent_mappoint_ids.push_back(mappoint_id);
+    MarkMapPointDirty(mappoint_id);
+  }
+
+  int Map::GetMapPointsInFrustum(const cv::Mat& cTw, const Camera& cam, const int width, const int height,
+                                 const float max_depth, std::vector<uint32_t>& v_mappoint_ids,
+                                 std::vector<cv::Point2f>& v_uvs) const
+  {
+    // points closer than this are not projected
+    static const float MIN_DEPTH = 1e-3f;
+
+    v_mappoint_ids.clear();
+    v_uvs.clear();
+    Eigen::Matrix<float,3,4> m_cTw;
+    cv2eigen(cTw.rowRange(0,3), m_cTw);
+
+    VoxelHashIndex::Frustum frustum{m_cTw.leftCols<3>(), m_cTw.col(3), cam.f_fx, cam.f_fy, cam.f_cx, cam.f_cy,
+                                    width, height, MIN_DEPTH, max_depth};
+    std::vector<VoxelHashIndex::Entry> v_entries;
+    m_spatial_index.QueryFrustum(frustum, v_entries);
+
+    const int num_candidates = (int)v_entries.size();
+    std::vector<float> v_x(num_candidates), v_y(num_candidates), v_z(num_candidates);
+    for(int i = 0; i < num_candidates; ++i) {
+      v_x[i] = v_entries[i].x;
+      v_y[i] = v_entries[i].y;
+      v_z[i] = v_entries[i].z;
+    }
+    std::vector<float> v_u(num_candidates), v_v(num_candidates);
+    std::vector<unsigned char> vb_visible(num_candidates);
+    const int num_visible = ProjectPoints(m_cTw, cam.f_fx, cam.f_fy, cam.f_cx, cam.f_cy, width, height, MIN_DEPTH, max_depth,
+                                          num_candidates, v_x.data(), v_y.data(), v_z.data(),
+                                          v_u.data(), v_v.data(), vb_visible.data());
+
+    v_mappoint_ids.reserve(num_visible);
+    v_uvs.reserve(num_visible);
+    for(int i = 0; i < num_candidates; ++i) {
+      if(vb_visible[i]) {
+        v_mappoint_ids.push_back(v_entries[i].id);
+        v_uvs.push_back(cv::Point2f(v_u[i], v_v[i]));
+      }
+    }
+    return (int)v_mappoint_ids.size();
+  }
+
+  std::vector<uint32_t> Map::GetMapPointsInRadius(const cv::Point3f& center, const float radius) const {
+    std::vector<VoxelHashIndex::Entry> v_entries;
+    m_spatial_index.QueryRadius(Eigen::Vector3f(center.x, center.y, center.z), radius, v_entries);
+    std::vector<uint32_t> v_mappoint_ids;
+    v_mappoint_ids.reserve(v_entries.size());
+    for(const VoxelHashIndex::Entry& entry : v_entries) {
+      v_mappoint_ids.push_back(entry.id);
+    }
+    return v_mappoint_ids;
+  }
+
+  std::vector<uint32_t> Map::TakeRecentMapPoints() {
+    std::vector<uint32_t> v_mappoint_ids;
+    v_mappoint_ids.swap(m_v_recent_mappoint_ids);
+    std::sort(v_mappoint_ids.begin(), v_mappoint_ids.end());
+    v_mappoint_ids.erase(std::unique(v_mappoint_ids.begin(), v_mappoint_ids.end()), v_mappoint_ids.end());
+    return v_mappoint_ids;
+  }
+
+  bool Map::AddObservation(const uint32_t mappoint_id, const MatchInfo& match_info) {
+    if(!m_mappoints.Contains(mappoint_id) || !LinkKeyPoint(mappoint_id, match_info)) {
+      return false;
+    }
+    const std::vector<int> v_kf_ids = GetObservingKeyFrameIds(mappoint_id);
+    // a second keypoint of the same keyframe doesn't add covisibility
+    if(std::find(v_kf_ids.begin(), v_kf_ids.end(), match_info.frame_id) == v_kf_ids.end()) {
+      m_covisibility_graph.AddObservation(v_kf_ids, match_info.frame_id);
+    }
+    m_mappoints.AddObservation(mappoint_id, match_info);
+    m_v_recent_mappoint_ids.push_back(mappoint_id);
+    MarkMapPointDirty(mappoint_id);
+    return true;
+  }
+
+  bool Map::RemoveObservation(const uint32_t mappoint_id, const int keyframe_id, const int kpt_id) {
+    if(kpt_id < 0 || !m_mappoints.RemoveObservation(mappoint_id, keyframe_id, kpt_id)) {
+      return false;
+    }
+    m_vv_kpt_to_mappoint[keyframe_id][kpt_id] = MapPointArena::INVALID_ID;
+    m_v_recent_mappoint_ids.push_back(mappoint_id);
+    MarkMapPointDirty(mappoint_id);
+
+    std::vector<int> v_kf_ids = GetObservingKeyFrameIds(mappoint_id);
+    if(std::find(v_kf_ids.begin(), v_kf_ids.end(), keyframe_id) == v_kf_ids.end()) {
+      m_covisibility_graph.RemoveObservation(v_kf_ids, keyframe_id);
+    }
+    return true;
+  }
+
+  bool Map::MergeMapPoints(const uint32_t keep_id, const uint32_t drop_id) {
+    const int drop_slot = m_mappoints.GetSlot(drop_id);
+    if(keep_id == drop_id || drop_slot < 0 || !m_mappoints.Contains(keep_id)) {
+      return false;
+    }
+    const std::vector<int> v_keep_kf_ids = GetObservingKeyFrameIds(keep_id);
+    const MatchInfo* p_obs = m_mappoints.GetObservations(drop_slot);
+    std::vector<MatchInfo> v_moved_obs;
+    for(int i = 0; i < m_mappoints.GetObsNum(drop_slot); ++i) {
+      if(!std::binary_search(v_keep_kf_ids.begin(), v_keep_kf_ids.end(), p_obs[i].frame_id)) {
+        v_moved_obs.push_back(p_obs[i]);
+      }
+    }
+
+    RemoveMapPoint(drop_id);
+    for(const MatchInfo& m : v_moved_obs) {
+      AddObservation(keep_id, m);
+    }
+    return true;
+  }
+
+  uint64_t Map::PublishSnapshot() {
+    const std::shared_ptr<const MapSnapshot> p_previous = std::atomic_load(&m_p_snapshot);
+    std::shared_ptr<MapSnapshot> p_snapshot = std::make_shared<MapSnapshot>(*p_previous);
+    p_snapshot->version = p_previous->version + 1;
+
+    if(m_b_keyframes_dirty) {
+      std::shared_ptr<std::vector<MapSnapshot::KeyFrameState>> p_keyframes
+        = std::make_shared<std::vector<MapSnapshot::KeyFrameState>>();
+      p_keyframes->reserve(m_v_keyframes.size());
+      for(KeyFrame& keyframe : m_v_keyframes) {
+        if(keyframe.IsActivated()) {
+          const cv::Matx34f cTw = keyframe.GetPose();
+          p_keyframes->push_back(MapSnapshot::KeyFrameState{keyframe.m_id, cTw});
+        }
+      }
+      p_snapshot->p_keyframes = p_keyframes;
+      m_b_keyframes_dirty = false;
+    }
+
+    const int chunk_size = MapSnapshot::MAPPOINT_CHUNK_SIZE;
+    const int num_chunks = (m_mappoints.GetNumSlots() + chunk_size - 1) / chunk_size;
+    if(m_b_mappoints_dirty || std::find(m_vb_dirty_chunks.begin(), m_vb_dirty_chunks.end(), 1) != m_vb_dirty_chunks.end()
+       || num_chunks != (int)p_snapshot->v_mappoint_chunks.size()) {
+      p_snapshot->v_mappoint_chunks.resize(num_chunks);
+      m_vb_dirty_chunks.resize(num_chunks, 1);
+      const float* p_x = m_mappoints.GetX();
+      const float* p_y = m_mappoints.GetY();
+      const float* p_z = m_mappoints.GetZ();
+      int num_mappoints = 0;
+      for(int chunk = 0; chunk < num_chunks; ++chunk) {
+        if(m_b_mappoints_dirty || m_vb_dirty_chunks[chunk] || !p_snapshot->v_mappoint_chunks[chunk]) {
+          std::shared_ptr<std::vector<MapSnapshot::MapPointState>> p_mappoints
+            = std::make_shared<std::vector<MapSnapshot::MapPointState>>();
+          const int end_slot = std::min(m_mappoints.GetNumSlots(), (chunk + 1) * chunk_size);
+          p_mappoints->reserve(end_slot - chunk * chunk_size);
+          for(int slot = chunk * chunk_size; slot < end_slot; ++slot) {
+            if(m_mappoints.IsAlive(slot)) {
+              p_mappoints->push_back(MapSnapshot::MapPointState{m_mappoints.GetId(slot),
+                                                                cv::Point3f(p_x[slot], p_y[slot], p_z[slot]),
+                                                                m_mappoints.GetObsNum(slot)});
+            }
+          }
+          p_snapshot->v_mappoint_chunks[chunk] = p_mappoints;
+        }
+        num_mappoints += (int)p_snapshot->v_mappoint_chunks[chunk]->size();
+      }
+      p_snapshot->num_mappoints = num_mappoints;
+      m_b_mappoints_dirty = false;
+      m_vb_dirty_chunks.assign(num_chunks, 0);
+    }
+
+    std::atomic_store(&m_p_snapshot, std::shared_ptr<const MapSnapshot>(p_snapshot));
+    return p_snapshot->version;
+  }
+
+  bool Map::LinkKeyPoint(const uint32_t mappoint_id, const MatchInfo& match_info) {
+    if(match_info.frame_id < 0 || match_info.kpt_id < 0) {
+      return false;
+    }
+    if(match_info.frame_id >= (int)m_vv_kpt_to_mappoint.size()) {
+      m_vv_kpt_to_mappoint.resize(match_info.frame_id + 1);
+    }
+    if(match_info.frame_id < (int)m_v_keyframes.size() && m_v_keyframes[match_info.frame_id].IsPacked() &&
+       !m_v_keyframes[match_info.frame_id].HasKeyPoint(match_info.kpt_id)) {
+      return false;
+    }
+    std::vector<uint32_t>& v_kpt_to_mappoint = m_vv_kpt_to_mappoint[match_info.frame_id];
+    if(match_info.kpt_id >= (int)v_kpt_to_mappoint.size()) {
+      v_kpt_to_mappoint.resize(match_info.kpt_id + 1, MapPointArena::INVALID_ID);
+    }
+    uint32_t& linked_id = v_kpt_to_mappoint[match_info.kpt_id];
+    if(linked_id != MapPointArena::INVALID_ID) {
+      return false;
+    }
+    linked_id = mappoint_id;
+    return true;
+  }
+
+  std::vector<int> Map::GetObservingKeyFrameIds(const uint32_t mappoint_id) const {
+    const int slot = m_mappoints.GetSlot(mappoint_id);
+    const MatchInfo* p_obs = m_mappoints.GetObservations(slot);
+    std::vector<int> v_kf_ids;
+    v_kf_ids.reserve(m_mappoints.GetObsNum(slot));
+    for(int i = 0; i < m_mappoints.GetObsNum(slot); ++i) {
+      v_kf_ids.push_back(p_obs[i].frame_id);
+    }
+    std::sort(v_kf_ids.begin(), v_kf_ids.end());
+    v_kf_ids.erase(std::unique(v_kf_ids.begin(), v_kf_ids.end()), v_kf_ids.end());
+    return v_kf_ids;
+  }
+
+  void Map::MarkMapPointDirty(const uint32_t mappoint_id) {
+    const int slot = m_mappoints.GetSlot(mappoint_id);
+    if(slot < 0) {
+      return;
+    }
+    const int chunk = slot / MapSnapshot::MAPPOINT_CHUNK_SIZE;
+    if(chunk >= (int)m_vb_dirty_chunks.size()) {
+      m_vb_dirty_chunks.resize(chunk + 1, 0);
+    }
+    m_vb_dirty_chunks[chunk] = 1;
+  }
+
 } //TS_SfM
@@ -0,0 +1,227 @@
+#include "MapFile.h"
+#include "ConfigLoader.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace TS_SfM {
+
+namespace {
+  uint64_t Align(const uint64_t offset) {
+    return (offset + MapFile::SECTION_ALIGNMENT - 1) / MapFile::SECTION_ALIGNMENT * MapFile::SECTION_ALIGNMENT;
+  }
+}
+
+namespace MapFile {
+  bool Write(const std::string& file, Header header,
+             const void* const p_sections[NUM_SECTIONS], const uint64_t section_sizes[NUM_SECTIONS])
+  {
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.endian_tag = ENDIAN_TAG;
+    uint64_t offset = Align(sizeof(Header));
+    for(int i = 0; i < NUM_SECTIONS; ++i) {
+      header.sections[i] = SectionEntry{offset, section_sizes[i]};
+      offset = Align(offset + section_sizes[i]);
+    }
+    header.file_size = offset;
+
+    const std::string tmp_file = file + ".tmp";
+    std::ofstream ofs(tmp_file, std::ios::binary | std::ios::trunc);
+    if(!ofs.is_open()) {
+      std::cerr << "[FAILED]: " << "Cannot open " << tmp_file << std::endl;
+      return false;
+    }
+    const char padding[SECTION_ALIGNMENT] = {0};
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    ofs.write(padding, header.sections[0].offset - sizeof(Header));
+    for(int i = 0; i < NUM_SECTIONS; ++i) {
+      if(section_sizes[i] > 0) {
+        ofs.write(static_cast<const char*>(p_sections[i]), section_sizes[i]);
+      }
+      const uint64_t end = header.sections[i].offset + section_sizes[i];
+      const uint64_t next = i + 1 < NUM_SECTIONS ? header.sections[i+1].offset : header.file_size;
+      ofs.write(padding, next - end);
+    }
+    ofs.close();
+    if(!ofs) {
+      std::cerr << "[FAILED]: " << "Cannot write " << tmp_file << std::endl;
+      std::remove(tmp_file.c_str());
+      return false;
+    }
+    if(std::rename(tmp_file.c_str(), file.c_str()) != 0) {
+      std::cerr << "[FAILED]: " << "Cannot rename " << tmp_file << " to " << file << std::endl;
+      std::remove(tmp_file.c_str());
+      return false;
+    }
+    return true;
+  }
+} // namespace MapFile
+
+  MapFileView::MapFileView()
+    : m_p_data(nullptr), m_size(0)
+  {
+  }
+
+  MapFileView::~MapFileView() {
+    Close();
+  }
+
+  bool MapFileView::Open(const std::string& file) {
+    Close();
+    const int fd = open(file.c_str(), O_RDONLY);
+    if(fd < 0) {
+      std::cerr << "[FAILED]: " << "Cannot open " << file << std::endl;
+      return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MapFile::Header)) {
+      std::cerr << "[FAILED]: " << file << " is not a map file" << std::endl;
+      close(fd);
+      return false;
+    }
+    void* p_data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if(p_data == MAP_FAILED) {
+      std::cerr << "[FAILED]: " << "Cannot map " << file << std::endl;
+      return false;
+    }
+    m_p_data = static_cast<const unsigned char*>(p_data);
+    m_size = (size_t)st.st_size;
+
+    if(!Validate()) {
+      std::cerr << "[FAILED]: " << file << " is broken or of another version" << std::endl;
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void MapFileView::Close() {
+    if(m_p_data != nullptr) {
+      munmap(const_cast<unsigned char*>(m_p_data), m_size);
+    }
+    m_p_data = nullptr;
+    m_size = 0;
+  }
+
+  Camera MapFileView::GetCamera() const {
+    const float* p_cam = GetHeader().camera;
+    Camera cam;
+    cam.f_fx = p_cam[0];
+    cam.f_fy = p_cam[1];
+    cam.f_cx = p_cam[2];
+    cam.f_cy = p_cam[3];
+    cam.f_k1 = p_cam[4];
+    cam.f_k2 = p_cam[5];
+    cam.f_p1 = p_cam[6];
+    cam.f_p2 = p_cam[7];
+    cam.f_k3 = p_cam[8];
+    return cam;
+  }
+
+  cv::Mat MapFileView::GetKeyPointDescriptors(const int keyframe_id) const {
+    const MapFile::Header& header = GetHeader();
+    const MapFile::KeyFrameRecord& record = GetKeyFrames()[keyframe_id];
+    if(header.descriptor_type < 0 || record.num_kpts == 0) {
+      return cv::Mat();
+    }
+    const unsigned char* p_desc = GetSection<unsigned char>(MapFile::KEYPOINT_DESCRIPTORS)
+                                  + record.kpt_begin * header.descriptor_size;
+    const int cols = (int)(header.descriptor_size / CV_ELEM_SIZE(header.descriptor_type));
+    return cv::Mat((int)record.num_kpts, cols, header.descriptor_type, const_cast<unsigned char*>(p_desc));
+  }
+
+  cv::Mat MapFileView::GetMapPointDescriptors() const {
+    const MapFile::Header& header = GetHeader();
+    if(header.descriptor_type < 0 || header.num_mappoints == 0) {
+      return cv::Mat();
+    }
+    const unsigned char* p_desc = GetSection<unsigned char>(MapFile::MAPPOINT_DESCRIPTORS);
+    const int cols = (int)(header.descriptor_size / CV_ELEM_SIZE(header.descriptor_type));
+    return cv::Mat((int)header.num_mappoints, cols, header.descriptor_type, const_cast<unsigned char*>(p_desc));
+  }
+
+  bool MapFileView::Validate() const {
+    const MapFile::Header& header = GetHeader();
+    if(std::memcmp(header.magic, MapFile::MAGIC, sizeof(MapFile::MAGIC)) != 0 ||
+       header.version != MapFile::VERSION || header.endian_tag != MapFile::ENDIAN_TAG ||
+       header.file_size != m_size)
+    {
+      return false;
+    }
+
+    // counts come from the file, products and sums are checked against uint64 overflow
+    const uint64_t descriptor_size = header.descriptor_type < 0 ? 0 : header.descriptor_size;
+    const uint64_t v_counts[MapFile::NUM_SECTIONS] = {
+      header.num_keyframes, header.num_keypoints, header.num_keypoints, header.num_keypoints,
+      header.num_mappoints, header.num_mappoints, header.num_observations, header.num_covisibility_edges
+    };
+    const uint64_t v_element_sizes[MapFile::NUM_SECTIONS] = {
+      sizeof(MapFile::KeyFrameRecord), sizeof(MapFile::KeyPointRecord), descriptor_size, sizeof(uint8_t),
+      sizeof(MapFile::MapPointRecord), descriptor_size, sizeof(MatchInfo), sizeof(CovisibilityGraph::Edge)
+    };
+    for(int i = 0; i < MapFile::NUM_SECTIONS; ++i) {
+      const MapFile::SectionEntry& section = header.sections[i];
+      if(v_element_sizes[i] > 0 && v_counts[i] > m_size / v_element_sizes[i]) {
+        return false;
+      }
+      if(section.size != v_counts[i] * v_element_sizes[i] || section.offset % MapFile::SECTION_ALIGNMENT != 0 ||
+         section.offset < sizeof(MapFile::Header) || section.offset > m_size || section.size > m_size - section.offset)
+      {
+        return false;
+      }
+    }
+    if(header.descriptor_type >= 0 &&
+       (descriptor_size == 0 || descriptor_size % CV_ELEM_SIZE(header.descriptor_type) != 0))
+    {
+      return false;
+    }
+
+    // ranges are checked once here, so accessors don't need to
+    const MapFile::KeyFrameRecord* p_keyframes = GetKeyFrames();
+    for(uint32_t i = 0; i < header.num_keyframes; ++i) {
+      const MapFile::KeyFrameRecord& keyframe = p_keyframes[i];
+      if(keyframe.id != (int32_t)i || keyframe.kpt_begin > header.num_keypoints ||
+         keyframe.num_kpts > header.num_keypoints - keyframe.kpt_begin)
+      {
+        return false;
+      }
+    }
+    const MapFile::MapPointRecord* p_mappoints = GetMapPoints();
+    const MatchInfo* p_observations = GetSection<MatchInfo>(MapFile::OBSERVATIONS);
+    for(uint32_t i = 0; i < header.num_mappoints; ++i) {
+      if(p_mappoints[i].obs_begin > header.num_observations ||
+         p_mappoints[i].num_obs > header.num_observations - p_mappoints[i].obs_begin)
+      {
+        return false;
+      }
+    }
+    for(uint64_t i = 0; i < header.num_observations; ++i) {
+      const MatchInfo& obs = p_observations[i];
+      if(obs.frame_id < 0 || (uint32_t)obs.frame_id >= header.num_keyframes ||
+         obs.kpt_id < 0 || (uint32_t)obs.kpt_id >= p_keyframes[obs.frame_id].num_kpts)
+      {
+        return false;
+      }
+    }
+    const CovisibilityGraph::Edge* p_edges = GetCovisibilityEdges();
+    for(uint64_t i = 0; i < header.num_covisibility_edges; ++i) {
+      const CovisibilityGraph::Edge& edge = p_edges[i];
+      if(edge.kf_id_0 < 0 || edge.kf_id_1 < 0 ||
+         (uint32_t)edge.kf_id_0 >= header.num_keyframes || (uint32_t)edge.kf_id_1 >= header.num_keyframes)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+} // namespace
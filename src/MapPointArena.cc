@@ -0,0 +1,236 @@
+#include "MapPointArena.h"
+#include "MapPoint.h"
+
+#include <algorithm>
+
+namespace TS_SfM {
+
+  const uint32_t MapPointArena::INVALID_ID;
+
+  uint32_t MapPointArena::Add(const MapPoint& mappoint) {
+    std::vector<MatchInfo> v_obs(mappoint.GetObsNum());
+    for(int i = 0; i < mappoint.GetObsNum(); ++i) {
+      v_obs[i] = mappoint.GetMatchInfo(i);
+    }
+    return Add(mappoint.m_id < 0 ? INVALID_ID : (uint32_t)mappoint.m_id, mappoint.GetPosition(),
+               mappoint.GetDescriptor(), v_obs.data(), (int)v_obs.size(), mappoint.IsActivated());
+  }
+
+  uint32_t MapPointArena::Add(uint32_t id, const cv::Point3f& pos, const cv::Mat& desc,
+                              const MatchInfo* p_obs, const int num_obs, const bool b_activated)
+  {
+    if(id == INVALID_ID || Contains(id)) {
+      id = (uint32_t)m_v_id_to_slot.size();
+    }
+    if(id >= m_v_id_to_slot.size()) {
+      m_v_id_to_slot.resize(id + 1, -1);
+    }
+
+    const int slot = GetNumSlots();
+    m_v_id_to_slot[id] = slot;
+    m_v_slot_to_id.push_back(id);
+
+    m_v_x.push_back(pos.x);
+    m_v_y.push_back(pos.y);
+    m_v_z.push_back(pos.z);
+    m_vb_activated.push_back(b_activated ? 1 : 0);
+
+    // Descriptor width and type are given by the first descriptor, rows before it are zero.
+    if(m_m_descriptors.empty()) {
+      if(!desc.empty()) {
+        if(slot > 0) {
+          m_m_descriptors = cv::Mat::zeros(slot, desc.cols, desc.type());
+        }
+        m_m_descriptors.push_back(desc.row(0));
+      }
+    }
+    else if(!desc.empty() && desc.cols == m_m_descriptors.cols && desc.type() == m_m_descriptors.type()) {
+      m_m_descriptors.push_back(desc.row(0));
+    }
+    else {
+      m_m_descriptors.push_back(cv::Mat::zeros(1, m_m_descriptors.cols, m_m_descriptors.type()));
+    }
+
+    m_v_obs_begin.push_back((int)m_v_obs_pool.size());
+    m_v_obs_size.push_back(0);
+    m_v_obs_capacity.push_back(0);
+    Reserve(slot, num_obs);
+    std::copy(p_obs, p_obs + num_obs, m_v_obs_pool.begin() + m_v_obs_begin[slot]);
+    m_v_obs_size[slot] = num_obs;
+
+    return id;
+  }
+
+  void MapPointArena::ReserveMapPoints(const int num_mappoints, const int num_observations) {
+    m_v_slot_to_id.reserve(num_mappoints);
+    m_v_x.reserve(num_mappoints);
+    m_v_y.reserve(num_mappoints);
+    m_v_z.reserve(num_mappoints);
+    m_vb_activated.reserve(num_mappoints);
+    m_v_obs_begin.reserve(num_mappoints);
+    m_v_obs_size.reserve(num_mappoints);
+    m_v_obs_capacity.reserve(num_mappoints);
+    m_v_obs_pool.reserve(num_observations);
+    if(!m_m_descriptors.empty()) {
+      m_m_descriptors.reserve(num_mappoints);
+    }
+  }
+
+  bool MapPointArena::Remove(const uint32_t id) {
+    const int slot = GetSlot(id);
+    if(slot < 0) {
+      return false;
+    }
+    m_v_slot_to_id[slot] = INVALID_ID;
+    m_v_id_to_slot[id] = -1;
+    m_v_obs_size[slot] = 0;
+    ++m_num_tombstones;
+    return true;
+  }
+
+  void MapPointArena::Clear() {
+    *this = MapPointArena();
+  }
+
+  bool MapPointArena::NeedsCompaction(const float tombstone_ratio) const {
+    return m_num_tombstones > 0 && m_num_tombstones >= tombstone_ratio * GetNumSlots();
+  }
+
+  void MapPointArena::Compact() {
+    if(m_num_tombstones == 0) {
+      return;
+    }
+
+    const int num_slots = GetNumSlots();
+    const int num_alive = GetNumMapPoints();
+    std::vector<MatchInfo> v_obs_pool;
+    v_obs_pool.reserve(m_v_obs_pool.size());
+    cv::Mat m_descriptors;
+    if(!m_m_descriptors.empty()) {
+      m_descriptors.create(num_alive, m_m_descriptors.cols, m_m_descriptors.type());
+    }
+
+    // Slots only move forward, so the arrays are packed in place.
+    int new_slot = 0;
+    for(int slot = 0; slot < num_slots; ++slot) {
+      const uint32_t id = m_v_slot_to_id[slot];
+      if(id == INVALID_ID) {
+        continue;
+      }
+      m_v_slot_to_id[new_slot] = id;
+      m_v_id_to_slot[id] = new_slot;
+      m_v_x[new_slot] = m_v_x[slot];
+      m_v_y[new_slot] = m_v_y[slot];
+      m_v_z[new_slot] = m_v_z[slot];
+      m_vb_activated[new_slot] = m_vb_activated[slot];
+      if(!m_descriptors.empty()) {
+        m_m_descriptors.row(slot).copyTo(m_descriptors.row(new_slot));
+      }
+
+      const int begin = m_v_obs_begin[slot];
+      const int size = m_v_obs_size[slot];
+      m_v_obs_begin[new_slot] = (int)v_obs_pool.size();
+      m_v_obs_size[new_slot] = size;
+      m_v_obs_capacity[new_slot] = size;
+      v_obs_pool.insert(v_obs_pool.end(), m_v_obs_pool.begin() + begin, m_v_obs_pool.begin() + begin + size);
+      ++new_slot;
+    }
+
+    m_v_slot_to_id.resize(num_alive);
+    m_v_x.resize(num_alive);
+    m_v_y.resize(num_alive);
+    m_v_z.resize(num_alive);
+    m_vb_activated.resize(num_alive);
+    m_v_obs_begin.resize(num_alive);
+    m_v_obs_size.resize(num_alive);
+    m_v_obs_capacity.resize(num_alive);
+    m_m_descriptors = m_descriptors;
+    m_v_obs_pool.swap(v_obs_pool);
+    m_num_tombstones = 0;
+  }
+
+  cv::Point3f MapPointArena::GetPosition(const uint32_t id) const {
+    const int slot = GetSlot(id);
+    if(slot < 0) {
+      return cv::Point3f(0.0, 0.0, 0.0);
+    }
+    return cv::Point3f(m_v_x[slot], m_v_y[slot], m_v_z[slot]);
+  }
+
+  void MapPointArena::SetPosition(const uint32_t id, const float x, const float y, const float z) {
+    const int slot = GetSlot(id);
+    if(slot < 0) {
+      return;
+    }
+    m_v_x[slot] = x;
+    m_v_y[slot] = y;
+    m_v_z[slot] = z;
+  }
+
+  void MapPointArena::AddObservation(const uint32_t id, const MatchInfo& match_info) {
+    const int slot = GetSlot(id);
+    if(slot < 0) {
+      return;
+    }
+    const int size = m_v_obs_size[slot];
+    Reserve(slot, size + 1);
+    m_v_obs_pool[m_v_obs_begin[slot] + size] = match_info;
+    m_v_obs_size[slot] = size + 1;
+  }
+
+  bool MapPointArena::RemoveObservation(const uint32_t id, const int frame_id, const int kpt_id) {
+    const int slot = GetSlot(id);
+    if(slot < 0) {
+      return false;
+    }
+    MatchInfo* p_obs = m_v_obs_pool.data() + m_v_obs_begin[slot];
+    const int size = m_v_obs_size[slot];
+    for(int i = 0; i < size; ++i) {
+      if(p_obs[i].frame_id == frame_id && (kpt_id < 0 || p_obs[i].kpt_id == kpt_id)) {
+        std::copy(p_obs + i + 1, p_obs + size, p_obs + i);
+        m_v_obs_size[slot] = size - 1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  MapPoint MapPointArena::GetMapPoint(const uint32_t id) const {
+    const int slot = GetSlot(id);
+    if(slot < 0) {
+      return MapPoint();
+    }
+    MapPoint mappoint(m_v_x[slot], m_v_y[slot], m_v_z[slot]);
+    mappoint.m_id = (int)id;
+    if(!m_m_descriptors.empty()) {
+      mappoint.SetDescriptor(m_m_descriptors.row(slot));
+    }
+    const MatchInfo* p_obs = GetObservations(slot);
+    mappoint.SetMatchInfo(std::vector<MatchInfo>(p_obs, p_obs + m_v_obs_size[slot]));
+    if(IsActivated(slot)) {
+      mappoint.Activate();
+    }
+    return mappoint;
+  }
+
+  void MapPointArena::Reserve(const int slot, const int num_obs) {
+    if(num_obs <= m_v_obs_capacity[slot]) {
+      return;
+    }
+    const int begin = m_v_obs_begin[slot];
+    const int capacity = std::max(num_obs, 2*m_v_obs_capacity[slot]);
+    // the last range grows in place
+    if(begin + m_v_obs_capacity[slot] == (int)m_v_obs_pool.size()) {
+      m_v_obs_pool.resize(begin + capacity);
+      m_v_obs_capacity[slot] = capacity;
+      return;
+    }
+    const int new_begin = (int)m_v_obs_pool.size();
+    m_v_obs_pool.resize(new_begin + capacity);
+    std::copy(m_v_obs_pool.begin() + begin, m_v_obs_pool.begin() + begin + m_v_obs_size[slot],
+              m_v_obs_pool.begin() + new_begin);
+    m_v_obs_begin[slot] = new_begin;
+    m_v_obs_capacity[slot] = capacity;
+  }
+
+} // namespace
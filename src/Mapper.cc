@@ -1,9 +1,195 @@
 #include "Mapper.h"
+#include "ConfigLoader.h"
+#include "Map.h"
+#include "Solver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
 
 namespace TS_SfM {
+
+namespace {
+  float ReprojectionError(const Eigen::Matrix<float,3,4>& cTw, const Camera& cam,
+                          const Eigen::Vector3f& pt, const cv::Point2f& obs)
+  {
+    const Eigen::Vector3f pt_c = cTw.leftCols<3>() * pt + cTw.col(3);
+    if(pt_c.z() <= 0.0f) {
+      return std::numeric_limits<float>::max();
+    }
+    const float du = cam.f_fx * pt_c.x() / pt_c.z() + cam.f_cx - obs.x;
+    const float dv = cam.f_fy * pt_c.y() / pt_c.z() + cam.f_cy - obs.y;
+    return std::sqrt(du*du + dv*dv);
+  }
+
+  Eigen::Vector3f ToEigen(const cv::Point3f& pt) {
+    return Eigen::Vector3f(pt.x, pt.y, pt.z);
+  }
+
+  // observations of keyframes which are not in the map have neither pose nor keypoints
+  bool HasKeyFrame(Map& map, const int keyframe_id) {
+    return keyframe_id >= 0 && keyframe_id < map.GetNumKeyFrames() && map.GetKeyFrame(keyframe_id).IsActivated();
+  }
+}
+
   Mapper::Mapper(MapperConfig _config)
   : m_config(_config) 
   {
   }
 
+  int Mapper::MaintainMap(Map& map, const Camera& cam, std::vector<uint32_t>& v_changed_ids) const {
+    const std::vector<uint32_t> v_mappoint_ids = map.TakeRecentMapPoints();
+    v_changed_ids = v_mappoint_ids;
+    if(v_mappoint_ids.empty()) {
+      return 0;
+    }
+
+    // poses are converted once, indexed by keyframe id
+    Poses v_poses(map.GetNumKeyFrames(), Eigen::Matrix<float,3,4>::Zero());
+    for(int kf_id = 0; kf_id < map.GetNumKeyFrames(); ++kf_id) {
+      KeyFrame& keyframe = map.GetKeyFrame(kf_id);
+      if(keyframe.IsActivated()) {
+        cv2eigen(keyframe.GetPose(), v_poses[kf_id]);
+      }
+    }
+
+    std::vector<uint32_t> v_keep_ids;
+    const int num_fused = FuseMapPoints(map, v_mappoint_ids, v_poses, cam, v_keep_ids);
+    const int num_culled = CullMapPoints(map, v_mappoint_ids, v_poses, cam);
+    v_changed_ids.insert(v_changed_ids.end(), v_keep_ids.begin(), v_keep_ids.end());
+    std::sort(v_changed_ids.begin(), v_changed_ids.end());
+    v_changed_ids.erase(std::unique(v_changed_ids.begin(), v_changed_ids.end()), v_changed_ids.end());
+    std::cout << "[LOG] Map maintenance : " << num_fused << " fused, " << num_culled << " culled of "
+              << v_mappoint_ids.size() << " recent mappoints, " << map.GetNumMapPoints() << " left" << std::endl;
+    return num_fused + num_culled;
+  }
+
+  int Mapper::FuseMapPoints(Map& map, const std::vector<uint32_t>& v_mappoint_ids,
+                            const Poses& v_poses, const Camera& cam, std::vector<uint32_t>& v_keep_ids) const
+  {
+    const MapPointArena& mappoints = map.GetMapPoints();
+    int num_fused = 0;
+    for(const uint32_t mappoint_id : v_mappoint_ids) {
+      const int slot = mappoints.GetSlot(mappoint_id);
+      if(slot < 0 || mappoints.GetObsNum(slot) == 0 || mappoints.GetDescriptors().empty()) {
+        continue;
+      }
+
+      // search radius is fusion_radius pixel at the depth in the reference keyframe
+      const int ref_kf_id = mappoints.GetObservations(slot)[0].frame_id;
+      if(!HasKeyFrame(map, ref_kf_id)) {
+        continue;
+      }
+      const Eigen::Vector3f pos = ToEigen(mappoints.GetPosition(mappoint_id));
+      const Eigen::Matrix<float,3,4>& ref_cTw = v_poses[ref_kf_id];
+      const float depth = ref_cTw.row(2).head<3>().dot(pos) + ref_cTw(2,3);
+      if(depth <= 0.0f) {
+        continue;
+      }
+      const std::vector<uint32_t> v_candidate_ids
+        = map.GetMapPointsInRadius(mappoints.GetPosition(mappoint_id), m_config.fusion_radius * depth / cam.f_fx);
+
+      for(const uint32_t candidate_id : v_candidate_ids) {
+        // slots move when the map is compacted after a merge
+        const int slot_0 = mappoints.GetSlot(mappoint_id);
+        const int slot_1 = mappoints.GetSlot(candidate_id);
+        if(slot_0 < 0) {
+          break;
+        }
+        if(slot_1 < 0 || candidate_id == mappoint_id ||
+           cv::norm(mappoints.GetDescriptors().row(slot_0), mappoints.GetDescriptors().row(slot_1), cv::NORM_HAMMING)
+             > m_config.max_descriptor_distance) {
+          continue;
+        }
+
+        // The mappoint with more observations is kept, its position must explain the other's observations.
+        const bool b_keep_0 = mappoints.GetObsNum(slot_0) >= mappoints.GetObsNum(slot_1);
+        const uint32_t keep_id = b_keep_0 ? mappoint_id : candidate_id;
+        const uint32_t drop_id = b_keep_0 ? candidate_id : mappoint_id;
+        const int keep_slot = b_keep_0 ? slot_0 : slot_1;
+        const int drop_slot = b_keep_0 ? slot_1 : slot_0;
+        const Eigen::Vector3f keep_pos = ToEigen(mappoints.GetPosition(keep_id));
+        const MatchInfo* p_keep_obs = mappoints.GetObservations(keep_slot);
+        const MatchInfo* p_drop_obs = mappoints.GetObservations(drop_slot);
+        bool b_consistent = true;
+        for(int i = 0; i < mappoints.GetObsNum(drop_slot) && b_consistent; ++i) {
+          const MatchInfo& m = p_drop_obs[i];
+          if(!HasKeyFrame(map, m.frame_id)) {
+            b_consistent = false;
+            break;
+          }
+          // different keypoints of one keyframe are different points
+          for(int j = 0; j < mappoints.GetObsNum(keep_slot); ++j) {
+            if(p_keep_obs[j].frame_id == m.frame_id && p_keep_obs[j].kpt_id != m.kpt_id) {
+              b_consistent = false;
+            }
+          }
+          b_consistent = b_consistent && ReprojectionError(v_poses[m.frame_id], cam, keep_pos,
+                                                           map.GetKeyFrame(m.frame_id).GetObs(m.kpt_id))
+                                           <= m_config.max_reprojection_error;
+        }
+        if(!b_consistent) {
+          continue;
+        }
+
+        map.MergeMapPoints(keep_id, drop_id);
+        v_keep_ids.push_back(keep_id);
+        ++num_fused;
+        if(drop_id == mappoint_id) {
+          break;
+        }
+      }
+    }
+    return num_fused;
+  }
+
+  int Mapper::CullMapPoints(Map& map, const std::vector<uint32_t>& v_mappoint_ids,
+                            const Poses& v_poses, const Camera& cam) const
+  {
+    const MapPointArena& mappoints = map.GetMapPoints();
+    const float min_cos_parallax = std::cos(m_config.min_parallax * (float)M_PI / 180.0f);
+    int num_culled = 0;
+    for(const uint32_t mappoint_id : v_mappoint_ids) {
+      const int slot = mappoints.GetSlot(mappoint_id);
+      if(slot < 0) {
+        continue;
+      }
+
+      // 1. Observations with large reprojection error
+      const Eigen::Vector3f pos = ToEigen(mappoints.GetPosition(mappoint_id));
+      const std::vector<MatchInfo> v_obs(mappoints.GetObservations(slot),
+                                         mappoints.GetObservations(slot) + mappoints.GetObsNum(slot));
+      std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f>> v_rays;
+      for(const MatchInfo& m : v_obs) {
+        if(!HasKeyFrame(map, m.frame_id)) {
+          map.RemoveObservation(mappoint_id, m.frame_id, m.kpt_id);
+          continue;
+        }
+        const Eigen::Matrix<float,3,4>& cTw = v_poses[m.frame_id];
+        if(ReprojectionError(cTw, cam, pos, map.GetKeyFrame(m.frame_id).GetObs(m.kpt_id)) > m_config.max_reprojection_error) {
+          map.RemoveObservation(mappoint_id, m.frame_id, m.kpt_id);
+          continue;
+        }
+        // ray from the camera center
+        v_rays.push_back((pos + cTw.leftCols<3>().transpose() * cTw.col(3)).normalized());
+      }
+
+      // 2. Weak mappoints : few observations or small parallax
+      bool b_cull = (int)v_rays.size() < m_config.min_observations;
+      float min_cos = 1.0f;
+      for(size_t i = 0; i < v_rays.size() && !b_cull; ++i) {
+        for(size_t j = i + 1; j < v_rays.size(); ++j) {
+          min_cos = std::min(min_cos, v_rays[i].dot(v_rays[j]));
+        }
+      }
+      b_cull = b_cull || (v_rays.size() >= 2 && min_cos > min_cos_parallax);
+      if(b_cull) {
+        map.RemoveMapPoint(mappoint_id);
+        ++num_culled;
+      }
+    }
+    return num_culled;
+  }
+
 }
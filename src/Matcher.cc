@@ -1,5 +1,7 @@
 #include "Matcher.h"
 #include "Frame.h"
+#include "KeyFrame.h"
+#include "MapPointArena.h"
 
 
 namespace TS_SfM {
@@ -44,6 +46,45 @@ namespace TS_SfM {
       return v_matches;
     }
 
+  std::vector<MatchObsAndLdmk>
+    Matcher::SearchByProjection(const MapPointArena& mappoints, const KeyFrame& keyframe,
+                                const std::vector<uint32_t>& v_mappoint_ids, const std::vector<cv::Point2f>& v_uvs,
+                                std::vector<bool>& vb_assigned) const
+    {
+      std::vector<MatchObsAndLdmk> v_matches;
+      const cv::Mat& mappoint_descs = mappoints.GetDescriptors();
+      const cv::Mat kpt_descs = keyframe.GetDescriptors();
+      if(mappoint_descs.empty() || kpt_descs.empty()
+         || mappoint_descs.cols != kpt_descs.cols || mappoint_descs.type() != kpt_descs.type()) {
+        return v_matches;
+      }
+
+      for(size_t i = 0; i < v_mappoint_ids.size(); ++i) {
+        const int slot = mappoints.GetSlot(v_mappoint_ids[i]);
+        if(slot < 0) {
+          continue;
+        }
+        const cv::Mat desc = mappoint_descs.row(slot);
+        int best_kpt_id = -1;
+        int best_distance = m_config.projection_max_distance + 1;
+        for(const int kpt_id : keyframe.GetKeyPointsInArea(v_uvs[i], m_config.projection_radius)) {
+          if(vb_assigned[kpt_id]) {
+            continue;
+          }
+          const int distance = (int)cv::norm(desc, kpt_descs.row(keyframe.GetKeyPointIndex(kpt_id)), cv::NORM_HAMMING);
+          if(distance < best_distance) {
+            best_distance = distance;
+            best_kpt_id = kpt_id;
+          }
+        }
+        if(best_kpt_id >= 0) {
+          vb_assigned[best_kpt_id] = true;
+          v_matches.push_back(MatchObsAndLdmk{best_kpt_id, (int)v_mappoint_ids[i]});
+        }
+      }
+      return v_matches;
+    }
+
   std::vector<cv::DMatch> Matcher::GetMatchesByGridSearch(const Frame& frame0, const Frame& frame1, int neighbor)
   {
     std::vector<cv::DMatch> v_matches; 
@@ -1,4 +1,5 @@
 #include "Optimizer.h"
+#include "BALFormat.h"
 #include "ConfigLoader.h"
 #include "KeyFrame.h"
 #include "Map.h"
@@ -6,53 +7,583 @@
 #include "Solver.h"
 #include "Utils.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
 #include <unordered_map>
+#include <unordered_set>
 
 using namespace Eigen;
 
 namespace TS_SfM {
 
 
-void Optimizer::Run() {
+namespace {
+  // Stops g2o iterations when chi2 or the parameters stop changing.
+  class ConvergenceCheck : public g2o::HyperGraphAction {
+    public:
+      ConvergenceCheck(g2o::SparseOptimizer& optimizer, const double chi2_threshold, const double step_threshold)
+        : m_optimizer(optimizer), m_chi2_threshold(chi2_threshold), m_step_threshold(step_threshold),
+          m_b_stop(false)
+      {
+        m_last_chi2 = m_optimizer.activeRobustChi2();
+        GetEstimates(m_v_last_estimates);
+        m_optimizer.setForceStopFlag(&m_b_stop);
+        m_optimizer.addPostIterationAction(this);
+      }
 
-  return;
+      ~ConvergenceCheck() {
+        m_optimizer.removePostIterationAction(this);
+        m_optimizer.setForceStopFlag(nullptr);
+      }
+
+      g2o::HyperGraphAction* operator()(const g2o::HyperGraph* graph, Parameters* parameters = 0) override {
+        const double chi2 = m_optimizer.activeRobustChi2();
+        if(m_last_chi2 > 0.0 && std::abs(m_last_chi2 - chi2) < m_chi2_threshold * m_last_chi2) {
+          m_b_stop = true;
+        }
+        m_last_chi2 = chi2;
+
+        GetEstimates(m_v_estimates);
+        double sq_step = 0.0, sq_norm = 0.0;
+        for(size_t i = 0; i < m_v_estimates.size(); ++i) {
+          const double d = m_v_estimates[i] - m_v_last_estimates[i];
+          sq_step += d*d;
+          sq_norm += m_v_last_estimates[i]*m_v_last_estimates[i];
+        }
+        if(sq_step <= m_step_threshold * m_step_threshold * (sq_norm + 1e-12)) {
+          m_b_stop = true;
+        }
+        m_v_estimates.swap(m_v_last_estimates);
+
+        return this;
+      }
+
+    private:
+      void GetEstimates(std::vector<double>& v_estimates) const {
+        v_estimates.clear();
+        for(const g2o::OptimizableGraph::Vertex* v : m_optimizer.activeVertices()) {
+          if(v->fixed()) {
+            continue;
+          }
+          const size_t offset = v_estimates.size();
+          v_estimates.resize(offset + v->estimateDimension());
+          v->getEstimateData(v_estimates.data() + offset);
+        }
+      }
+
+      g2o::SparseOptimizer& m_optimizer;
+      const double m_chi2_threshold;
+      const double m_step_threshold;
+      bool m_b_stop;
+      double m_last_chi2;
+      std::vector<double> m_v_estimates;
+      std::vector<double> m_v_last_estimates;
+  };
+
+  // Non robust RMS of reprojection errors over the active edges.
+  double ComputeRMSError(g2o::SparseOptimizer& optimizer) {
+    optimizer.computeActiveErrors();
+    if(optimizer.activeEdges().empty()) {
+      return 0.0;
+    }
+    double sum_sq_error = 0.0;
+    for(const g2o::OptimizableGraph::Edge* e : optimizer.activeEdges()) {
+      sum_sq_error += e->chi2();
+    }
+    return std::sqrt(sum_sq_error / (double)optimizer.activeEdges().size());
+  }
+
+  // Optimization must be initialized before.
+  // online keeps the block structure of the previous optimize() call.
+  BAResult Optimize(g2o::SparseOptimizer& optimizer, const int max_iteration,
+                    const Optimizer::OptimizerConfig& config, const bool online = false)
+  {
+    BAResult result;
+    result.num_observations = (int)optimizer.activeEdges().size();
+    result.initial_rms_error = ComputeRMSError(optimizer);
+    {
+      ConvergenceCheck convergence_check(optimizer, config.chi2_threshold, config.step_threshold);
+      result.num_iterations = optimizer.optimize(max_iteration, online);
+    }
+    result.final_rms_error = ComputeRMSError(optimizer);
+    return result;
+  }
+
+  cv::Mat ConvertToPose(const g2o::SE3Quat& cTw) {
+    Eigen::Matrix<double,3,4> m_cTw;
+    m_cTw.leftCols<3>() = cTw.rotation().toRotationMatrix();
+    m_cTw.col(3) = cTw.translation();
+    cv::Mat pose(3, 4, CV_32FC1);
+    eigen2cv(m_cTw, pose);
+    return pose;
+  }
+}
+
+// g2o::SparseOptimizer deletes only the algorithm which is set at destruction,
+// so algorithms of all backends are owned here and detached beforehand.
+class LinearSolverSelector {
+  public:
+    LinearSolverSelector(g2o::SparseOptimizer& optimizer)
+      : m_optimizer(optimizer), m_current(Optimizer::Auto) {}
+
+    ~LinearSolverSelector() {
+      m_optimizer.setAlgorithm(nullptr);
+    }
+
+    // Returns true if the backend is switched.
+    bool Use(const Optimizer::LinearSolverType type) {
+      const Optimizer::LinearSolverType _type = type == Optimizer::Auto ? Optimizer::Cholmod : type;
+      if(_type == m_current) {
+        return false;
+      }
+      std::unique_ptr<g2o::OptimizationAlgorithm>& p_algorithm = m_map_algorithms[_type];
+      if(!p_algorithm) {
+        p_algorithm = CreateAlgorithm(_type);
+      }
+      m_optimizer.setAlgorithm(p_algorithm.get());
+      m_current = _type;
+      return true;
+    }
+
+    // Few iterations are timed for each backend and the estimates are restored.
+    Optimizer::LinearSolverType Benchmark(g2o::HyperGraph::EdgeSet& edge_set, const int num_iteration) {
+      const std::vector<Optimizer::LinearSolverType> v_types
+        = {Optimizer::Cholmod, Optimizer::EigenSparse, Optimizer::Dense, Optimizer::PCG};
+      const char* v_names[] = {"cholmod", "eigen", "dense", "pcg"};
+
+      Optimizer::LinearSolverType best_type = Optimizer::Cholmod;
+      double best_time = std::numeric_limits<double>::max();
+      for(const Optimizer::LinearSolverType type : v_types) {
+        Use(type);
+        m_optimizer.initializeOptimization(edge_set);
+        int num_free_poses = 0;
+        for(const g2o::OptimizableGraph::Vertex* v : m_optimizer.activeVertices()) {
+          num_free_poses += (!v->fixed() && !v->marginalized()) ? 1 : 0;
+        }
+        // dense factorization is not worth trying on large problems
+        if(type == Optimizer::Dense && num_free_poses > 300) {
+          continue;
+        }
+
+        m_optimizer.push();
+        const auto t_start = std::chrono::steady_clock::now();
+        const int iterations = m_optimizer.optimize(num_iteration);
+        const auto t_end = std::chrono::steady_clock::now();
+        m_optimizer.pop();
+
+        const double time = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+        std::cout << "[LOG] Linear solver " << v_names[type] << " : " << time << " ms ("
+                  << num_free_poses << " poses)" << std::endl;
+        if(iterations > 0 && time < best_time) {
+          best_time = time;
+          best_type = type;
+        }
+      }
+      Use(best_type);
+      return best_type;
+    }
+
+  private:
+    std::unique_ptr<g2o::OptimizationAlgorithm> CreateAlgorithm(const Optimizer::LinearSolverType type) {
+      typedef g2o::BlockSolver_6_3::PoseMatrixType PoseMatrixType;
+      std::unique_ptr<g2o::BlockSolver_6_3::LinearSolverType> linearSolver;
+      switch(type) {
+        case Optimizer::EigenSparse:
+          linearSolver = g2o::make_unique<g2o::LinearSolverEigen<PoseMatrixType>>();
+          break;
+        case Optimizer::Dense:
+          linearSolver = g2o::make_unique<g2o::LinearSolverDense<PoseMatrixType>>();
+          break;
+        case Optimizer::PCG:
+          linearSolver = g2o::make_unique<g2o::LinearSolverPCG<PoseMatrixType>>();
+          break;
+        default:
+          linearSolver = g2o::make_unique<g2o::LinearSolverCholmod<PoseMatrixType>>();
+          break;
+      }
+      return std::unique_ptr<g2o::OptimizationAlgorithm>(new g2o::OptimizationAlgorithmLevenberg(
+        g2o::make_unique<g2o::BlockSolver_6_3>(std::move(linearSolver))
+      ));
+    }
+
+    g2o::SparseOptimizer& m_optimizer;
+    Optimizer::LinearSolverType m_current;
+    std::map<Optimizer::LinearSolverType, std::unique_ptr<g2o::OptimizationAlgorithm>> m_map_algorithms;
+};
+
+Optimizer::Optimizer(const OptimizerConfig& config, const Camera& cam)
+  : m_config(config), m_fx(cam.f_fx), m_fy(cam.f_fy), m_cx(cam.f_cx), m_cy(cam.f_cy),
+    m_p_solver_selector(new LinearSolverSelector(m_optimizer)), m_b_structure_changed(true)
+{
+  m_p_solver_selector->Use(m_config.linear_solver);
+  m_optimizer.setVerbose(m_config.verbose);
+}
+
+Optimizer::~Optimizer() {
+}
+
+bool Optimizer::SetData(std::vector<std::reference_wrapper<KeyFrame>> v_keyframes,
+                        std::vector<std::reference_wrapper<MapPoint>> v_mappoints)
+{
+  std::unordered_map<int, KeyFrame*> map_keyframes;
+  for(auto keyframe : v_keyframes) {
+    if(!keyframe.get().IsActivated()) {
+      continue;
+    }
+    map_keyframes[keyframe.get().m_id] = &keyframe.get();
+    AddKeyFrame(keyframe.get());
+  }
+
+  const size_t num_edges = m_map_edges.size();
+  for(auto mappoint : v_mappoints) {
+    const MapPoint& mp = mappoint.get();
+    if(mp.m_id < 0 || !mappoint.get().IsActivated() || mp.GetObsNum() < 2) {
+      continue;
+    }
+    for(int obs_idx = 0; obs_idx < mp.GetObsNum(); ++obs_idx) {
+      const MatchInfo m = mp.GetMatchInfo(obs_idx);
+      auto itr = map_keyframes.find(m.frame_id);
+      if(itr == map_keyframes.end()) {
+        continue;
+      }
+      if(m_optimizer.vertex(MapPointVertexId(mp.m_id)) == nullptr) {
+        g2o::VertexSBAPointXYZ* v_p = new g2o::VertexSBAPointXYZ();
+        v_p->setId(MapPointVertexId(mp.m_id));
+        v_p->setMarginalized(true);
+        v_p->setEstimate(Eigen::Vector3d(mp.GetPosition().x, mp.GetPosition().y, mp.GetPosition().z));
+        m_optimizer.addVertex(v_p);
+      }
+      AddObservation(mp.m_id, *itr->second, m.kpt_id);
+    }
+  }
+
+  return m_map_edges.size() > num_edges;
+}
+
+void Optimizer::AddKeyFrame(KeyFrame& keyframe) {
+  const int vertex_id = KeyFrameVertexId(keyframe.m_id);
+  if(!keyframe.IsActivated() || m_optimizer.vertex(vertex_id) != nullptr) {
+    return;
+  }
+
+  g2o::VertexSE3Expmap* vertex_se3 = new g2o::VertexSE3Expmap();
+  vertex_se3->setId(vertex_id);
+  // Pose is float, it is converted to double while copying.
+  Eigen::Matrix3d rot;
+  Eigen::Vector3d t;
+  cv2eigen(keyframe.GetPoseTrans(), t);
+  cv2eigen(keyframe.GetPoseRot(), rot);
+  vertex_se3->setEstimate(g2o::SE3Quat(Eigen::Quaterniond(rot), t));
+  m_optimizer.addVertex(vertex_se3);
+  m_b_structure_changed = true;
+
+  m_dq_kf_ids.push_back(keyframe.m_id);
+  if(m_v_gauge_kf_ids.size() < 2) {
+    m_v_gauge_kf_ids.push_back(keyframe.m_id);
+  }
+}
+
+void Optimizer::AddMapPoint(const MapPoint& mappoint, std::vector<KeyFrame>& v_keyframes) {
+  if(mappoint.m_id < 0 || mappoint.GetObsNum() < 2 ||
+     m_optimizer.vertex(MapPointVertexId(mappoint.m_id)) != nullptr) {
+    return;
+  }
+
+  g2o::VertexSBAPointXYZ* v_p = new g2o::VertexSBAPointXYZ();
+  v_p->setId(MapPointVertexId(mappoint.m_id));
+  v_p->setMarginalized(true);
+  v_p->setEstimate(Eigen::Vector3d(mappoint.GetPosition().x,
+                                   mappoint.GetPosition().y,
+                                   mappoint.GetPosition().z));
+  m_optimizer.addVertex(v_p);
+
+  for(int obs_idx = 0; obs_idx < mappoint.GetObsNum(); ++obs_idx) {
+    const MatchInfo m = mappoint.GetMatchInfo(obs_idx);
+    if(m.frame_id < 0 || m.frame_id >= (int)v_keyframes.size()) {
+      continue;
+    }
+    AddObservation(mappoint.m_id, v_keyframes[m.frame_id], m.kpt_id);
+  }
+}
+
+void Optimizer::AddObservation(const int mappoint_id, KeyFrame& keyframe, const int kpt_id) {
+  g2o::VertexSBAPointXYZ* v_p
+    = dynamic_cast<g2o::VertexSBAPointXYZ*>(m_optimizer.vertex(MapPointVertexId(mappoint_id)));
+  g2o::VertexSE3Expmap* v_kf
+    = dynamic_cast<g2o::VertexSE3Expmap*>(m_optimizer.vertex(KeyFrameVertexId(keyframe.m_id)));
+  if(v_p == nullptr || v_kf == nullptr) {
+    return;
+  }
+  const cv::Point2f pt = keyframe.GetObs(kpt_id);
+  AddEdge(v_p, v_kf, Eigen::Vector2d(pt.x, pt.y));
+}
+
+bool Optimizer::AddEdge(g2o::VertexSBAPointXYZ* v_point, g2o::VertexSE3Expmap* v_keyframe, const Eigen::Vector2d& obs) {
+  const long long key = ((long long)(v_point->id() / 2) << 32) | (unsigned int)(v_keyframe->id() / 2);
+  if(m_map_edges.count(key) != 0) {
+    return false;
+  }
+
+  g2o::EdgeSE3ProjectXYZ* edge = new g2o::EdgeSE3ProjectXYZ();
+  edge->setVertex(0, v_point);
+  edge->setVertex(1, v_keyframe);
+  edge->setMeasurement(obs);
+  edge->setInformation(Eigen::Matrix2d::Identity());
+
+  g2o::RobustKernelHuber* r_k = new g2o::RobustKernelHuber;
+  edge->setRobustKernel(r_k);
+  r_k->setDelta(m_config.huber_delta);
+
+  edge->fx = m_fx;
+  edge->fy = m_fy;
+  edge->cx = m_cx;
+  edge->cy = m_cy;
+
+  m_optimizer.addEdge(edge);
+  m_map_edges[key] = edge;
+  m_b_structure_changed = true;
+  return true;
+}
+
+void Optimizer::EraseEdgesOf(g2o::HyperGraph::Vertex* vertex) {
+  for(g2o::HyperGraph::Edge* e : vertex->edges()) {
+    const int mappoint_id = e->vertex(0)->id() / 2;
+    const int keyframe_id = e->vertex(1)->id() / 2;
+    m_map_edges.erase(((long long)mappoint_id << 32) | (unsigned int)keyframe_id);
+  }
+}
+
+void Optimizer::RemoveKeyFrame(const int keyframe_id) {
+  g2o::HyperGraph::Vertex* v_kf = m_optimizer.vertex(KeyFrameVertexId(keyframe_id));
+  if(v_kf == nullptr) {
+    return;
+  }
+  // edges attached to the vertex are deleted by g2o
+  EraseEdgesOf(v_kf);
+  m_optimizer.removeVertex(v_kf);
+  m_b_structure_changed = true;
+
+  m_dq_kf_ids.erase(std::remove(m_dq_kf_ids.begin(), m_dq_kf_ids.end(), keyframe_id), m_dq_kf_ids.end());
+  m_v_local_kf_ids.erase(std::remove(m_v_local_kf_ids.begin(), m_v_local_kf_ids.end(), keyframe_id), m_v_local_kf_ids.end());
+}
+
+void Optimizer::RemoveMapPoint(const int mappoint_id) {
+  g2o::HyperGraph::Vertex* v_p = m_optimizer.vertex(MapPointVertexId(mappoint_id));
+  if(v_p == nullptr) {
+    return;
+  }
+  EraseEdgesOf(v_p);
+  m_optimizer.removeVertex(v_p);
+  m_b_structure_changed = true;
+
+  m_v_local_mp_ids.erase(std::remove(m_v_local_mp_ids.begin(), m_v_local_mp_ids.end(), mappoint_id), m_v_local_mp_ids.end());
+}
+
+void Optimizer::SetMapPointEstimates(const std::vector<MapPoint>& v_mappoints, const std::vector<int>& v_mappoint_ids) {
+  for(const int mappoint_id : v_mappoint_ids) {
+    g2o::VertexSBAPointXYZ* v_p
+      = dynamic_cast<g2o::VertexSBAPointXYZ*>(m_optimizer.vertex(MapPointVertexId(mappoint_id)));
+    if(v_p == nullptr || mappoint_id >= (int)v_mappoints.size()) {
+      continue;
+    }
+    const cv::Point3f pos = v_mappoints[mappoint_id].GetPosition();
+    v_p->setEstimate(Eigen::Vector3d(pos.x, pos.y, pos.z));
+  }
+}
+
+void Optimizer::SetKeyFrameEstimates(std::vector<KeyFrame>& v_keyframes) {
+  for(const int keyframe_id : m_dq_kf_ids) {
+    g2o::VertexSE3Expmap* v_kf
+      = dynamic_cast<g2o::VertexSE3Expmap*>(m_optimizer.vertex(KeyFrameVertexId(keyframe_id)));
+    if(v_kf == nullptr || keyframe_id >= (int)v_keyframes.size()) {
+      continue;
+    }
+    Eigen::Matrix3d rot;
+    Eigen::Vector3d t;
+    cv2eigen(v_keyframes[keyframe_id].GetPoseTrans(), t);
+    cv2eigen(v_keyframes[keyframe_id].GetPoseRot(), rot);
+    v_kf->setEstimate(g2o::SE3Quat(Eigen::Quaterniond(rot), t));
+  }
+}
+
+void Optimizer::SetWindow(const std::vector<int>& v_keyframe_ids) {
+  if(v_keyframe_ids != m_v_window_kf_ids) {
+    m_v_window_kf_ids = v_keyframe_ids;
+    m_b_structure_changed = true;
+  }
 }
 
-bool Optimizer::SetData() {
+BAResult Optimizer::Run() {
+  BAResult result{0.0, 0.0, 0, 0};
+  m_v_local_kf_ids.clear();
+  m_v_local_mp_ids.clear();
+  if(m_dq_kf_ids.empty()) {
+    return result;
+  }
 
-  return false;
+  // 1. Local window is the given keyframes or the latest ones.
+  std::vector<int> v_window_kf_ids = m_v_window_kf_ids;
+  if(v_window_kf_ids.empty()) {
+    const int window_size = std::min(m_config.window_size, (int)m_dq_kf_ids.size());
+    v_window_kf_ids.assign(m_dq_kf_ids.end() - window_size, m_dq_kf_ids.end());
+  }
+  std::unordered_set<g2o::HyperGraph::Vertex*> set_local_kfs;
+  for(const int keyframe_id : v_window_kf_ids) {
+    g2o::HyperGraph::Vertex* v_kf = m_optimizer.vertex(KeyFrameVertexId(keyframe_id));
+    if(v_kf != nullptr &&
+       std::find(m_v_gauge_kf_ids.begin(), m_v_gauge_kf_ids.end(), keyframe_id) == m_v_gauge_kf_ids.end()) {
+      set_local_kfs.insert(v_kf);
+      m_v_local_kf_ids.push_back(keyframe_id);
+    }
+  }
+
+  // 2. Points seen from the window and all of their observations.
+  //    Keyframes out of the window observing those points are fixed as boundary.
+  g2o::HyperGraph::EdgeSet edge_set;
+  std::unordered_set<g2o::HyperGraph::Vertex*> set_local_points;
+  for(g2o::HyperGraph::Vertex* v_kf : set_local_kfs) {
+    for(g2o::HyperGraph::Edge* e : v_kf->edges()) {
+      g2o::HyperGraph::Vertex* v_p = e->vertex(0);
+      if(!set_local_points.insert(v_p).second) {
+        continue;
+      }
+      m_v_local_mp_ids.push_back(v_p->id() / 2);
+      for(g2o::HyperGraph::Edge* e_p : v_p->edges()) {
+        edge_set.insert(e_p);
+        static_cast<g2o::OptimizableGraph::Vertex*>(e_p->vertex(1))->setFixed(set_local_kfs.count(e_p->vertex(1)) == 0);
+      }
+    }
+  }
+
+  if(edge_set.empty()) {
+    m_v_local_kf_ids.clear();
+    return result;
+  }
+
+  if(m_config.linear_solver == Auto) {
+    const int size_class = (int)std::log2((double)set_local_kfs.size());
+    auto itr = m_map_size_to_solver.find(size_class);
+    if(itr == m_map_size_to_solver.end()) {
+      m_map_size_to_solver[size_class] = m_p_solver_selector->Benchmark(edge_set, 2);
+      m_b_structure_changed = true;
+    }
+    else if(m_p_solver_selector->Use(itr->second)) {
+      m_b_structure_changed = true;
+    }
+  }
+
+  // Same graph and window as the last call, the active edges and block structure are kept.
+  if(m_b_structure_changed) {
+    m_optimizer.initializeOptimization(edge_set);
+  }
+  result = Optimize(m_optimizer, m_config.max_iteration, m_config, !m_b_structure_changed);
+  m_b_structure_changed = false;
+
+  if(m_config.verbose) {
+    std::cout << "[LOG] Local BA : " << m_v_local_kf_ids.size() << " keyframes, "
+              << m_v_local_mp_ids.size() << " mappoints, "
+              << edge_set.size() << " observations" << std::endl;
+  }
+  return result;
 }
 
+void Optimizer::UpdateData(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints) const {
+  for(const int keyframe_id : m_v_local_kf_ids) {
+    const g2o::VertexSE3Expmap* v_kf
+      = static_cast<const g2o::VertexSE3Expmap*>(m_optimizer.vertex(KeyFrameVertexId(keyframe_id)));
+    if(v_kf == nullptr || keyframe_id >= (int)v_keyframes.size()) {
+      continue;
+    }
+    v_keyframes[keyframe_id].SetPose(ConvertToPose(v_kf->estimate()));
+  }
+
+  for(const int mappoint_id : m_v_local_mp_ids) {
+    const g2o::VertexSBAPointXYZ* v_p
+      = static_cast<const g2o::VertexSBAPointXYZ*>(m_optimizer.vertex(MapPointVertexId(mappoint_id)));
+    if(v_p == nullptr || mappoint_id >= (int)v_mappoints.size()) {
+      continue;
+    }
+    const Eigen::Vector3d& pos = v_p->estimate();
+    v_mappoints[mappoint_id].SetPosition(pos.x(), pos.y(), pos.z());
+  }
+}
+
+
+namespace {
+  // Activated keyframes become cameras (the two center ones fixed) and activated mappoints
+  // observed twice become points, in the order of the returned references.
+  void BuildBAProblem(std::vector<std::reference_wrapper<KeyFrame>>& v_keyframes,
+                      std::vector<std::reference_wrapper<MapPoint>>& v_mappoints, const Camera& cam,
+                      BAProblem& problem,
+                      std::vector<std::reference_wrapper<KeyFrame>>& v_optimized_keyframes,
+                      std::vector<std::reference_wrapper<MapPoint>>& v_optimized_mappoints)
+  {
+    const int center_frame_idx = static_cast<int>(v_keyframes.size() - 1)/2;
+
+    std::unordered_map<int, int> keyframeIdToCameraIdx;
+    for(auto keyframe : v_keyframes) {
+      if(!keyframe.get().IsActivated()) {
+        continue;
+      }
+      Eigen::Matrix3d rot;
+      Eigen::Vector3d t;
+      cv2eigen(keyframe.get().GetPoseTrans(), t);
+      cv2eigen(keyframe.get().GetPoseRot(), rot);
+      const bool fixed = keyframe.get().m_id == center_frame_idx-1 || keyframe.get().m_id == center_frame_idx;
+      keyframeIdToCameraIdx[keyframe.get().m_id]
+        = problem.AddCamera(rot, t, cam.f_fx, cam.f_fy, cam.f_cx, cam.f_cy, fixed);
+      v_optimized_keyframes.push_back(keyframe);
+    }
+
+    for(auto mappoint : v_mappoints) {
+      if(!mappoint.get().IsActivated() || mappoint.get().GetObsNum() < 2) {
+        continue;
+      }
+      const cv::Point3f pos = mappoint.get().GetPosition();
+      const int point_idx = problem.AddPoint(Eigen::Vector3d(pos.x, pos.y, pos.z));
+      for(int obs_idx = 0; obs_idx < mappoint.get().GetObsNum(); ++obs_idx) {
+        const MatchInfo m = mappoint.get().GetMatchInfo(obs_idx);
+        auto itr = keyframeIdToCameraIdx.find(m.frame_id);
+        if(itr == keyframeIdToCameraIdx.end()) {
+          continue;
+        }
+        const cv::Point2f pt = v_keyframes[m.frame_id].get().GetObs(m.kpt_id);
+        problem.AddObservation(itr->second, point_idx, Eigen::Vector2d(pt.x, pt.y));
+      }
+      v_optimized_mappoints.push_back(mappoint);
+    }
+  }
+}
 
 // Firstly i will implement a simple optimizer for verification.
   BAResult BundleAdjustmentBeta(std::vector<std::reference_wrapper<KeyFrame>> v_keyframes,
-                                std::vector<std::reference_wrapper<MapPoint>> v_mappoints, const Camera& cam)
+                                std::vector<std::reference_wrapper<MapPoint>> v_mappoints, const Camera& cam,
+                                const Optimizer::OptimizerConfig& config)
 {
-  BAResult result;
-  double error_prior_optimization = 0.0;
-  double error_after_optimization = 0.0;
-  int total_obs_num = 0;
   const int center_frame_idx = static_cast<int>(v_keyframes.size() - 1)/2;
-  cv::Mat K = (cv::Mat_<double>(3,3) << (double)cam.f_fx, 0.0, (double)cam.f_cx,
-                                        0.0, (double)cam.f_fy, (double)cam.f_cy,
-                                        0.0, 0.0, 1.0);
+
+  if(!config.export_bal_file.empty()) {
+    BAProblem problem;
+    std::vector<std::reference_wrapper<KeyFrame>> v_problem_keyframes;
+    std::vector<std::reference_wrapper<MapPoint>> v_problem_mappoints;
+    BuildBAProblem(v_keyframes, v_mappoints, cam, problem, v_problem_keyframes, v_problem_mappoints);
+    BALFormat::Export(problem, config.export_bal_file);
+  }
 
   /*Optimizer Setup ==================*/
   g2o::SparseOptimizer optimizer;
-  optimizer.setVerbose(true);
-  std::unique_ptr<g2o::BlockSolver_6_3::LinearSolverType> linearSolver;
-
-  linearSolver = g2o::make_unique<g2o::LinearSolverCholmod<g2o::BlockSolver_6_3::PoseMatrixType>>();
-
-  g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(
-    g2o::make_unique<g2o::BlockSolver_6_3>(std::move(linearSolver))
-  );
-  optimizer.setAlgorithm(solver);
+  optimizer.setVerbose(config.verbose);
+  LinearSolverSelector solver_selector(optimizer);
+  solver_selector.Use(config.linear_solver);
   /*================== Optimizer Setup*/
 
   /*Problem Setup ======================*/
   // Set vertex to pose
   std::unordered_map<int, int> keyframeIdToVertexId;
+  std::vector<std::reference_wrapper<KeyFrame>> v_optimized_keyframes;
+  std::vector<std::reference_wrapper<MapPoint>> v_optimized_mappoints;
   int v_camera_id = 0;
   for(auto keyframe : v_keyframes) {
     if(!keyframe.get().IsActivated()) {
@@ -65,9 +596,9 @@ bool Optimizer::SetData() {
       vertex_se3->setFixed(true);
     }
 
+    // Pose is float, it is converted to double while copying.
     Eigen::Matrix3d rot;
     Eigen::Vector3d t;
-    cv::Mat _t = keyframe.get().GetPose();
     cv2eigen(keyframe.get().GetPoseTrans(), t);
     cv2eigen(keyframe.get().GetPoseRot(), rot);
     Eigen::Quaterniond q(rot);
@@ -77,12 +608,11 @@ bool Optimizer::SetData() {
     vertex_se3->setEstimate(pose);
     optimizer.addVertex(vertex_se3);
     keyframeIdToVertexId[keyframe.get().m_id] = v_camera_id;
+    v_optimized_keyframes.push_back(keyframe);
     ++v_camera_id;
   }
 
   int v_point_id = v_camera_id;
-  int point_num = 0;
-  double sum_diff2 = 0;
 
   // Set vertex to point 
   for (auto mappoint : v_mappoints){
@@ -116,7 +646,7 @@ bool Optimizer::SetData() {
 
       g2o::RobustKernelHuber* r_k = new g2o::RobustKernelHuber;
       edge->setRobustKernel(r_k);
-      r_k->setDelta(4.0);
+      r_k->setDelta(config.huber_delta);
 
       edge->fx = (double)cam.f_fx;
       edge->fy = (double)cam.f_fy;
@@ -125,33 +655,283 @@ bool Optimizer::SetData() {
 
       optimizer.addEdge(edge);
     }
+    v_optimized_mappoints.push_back(mappoint);
     ++v_point_id;
   
   }
   /*====================== Problem Setup*/
   /* Optimization ========================*/
+  if(config.linear_solver == Optimizer::Auto) {
+    g2o::HyperGraph::EdgeSet edge_set = optimizer.edges();
+    solver_selector.Benchmark(edge_set, 2);
+  }
   optimizer.initializeOptimization();
-  optimizer.optimize(50);
+  BAResult result = Optimize(optimizer, 50, config);
+  std::cout << "[LOG] BA : RMS error " << result.initial_rms_error
+            << " -> " << result.final_rms_error << " pixel in "
+            << result.num_iterations << " iterations" << std::endl;
   /* ======================== Optimization*/
-  /* Retrieve Desired Params ====================== */
-  std::vector<Eigen::Vector3d> estPoints3d;
-  std::vector<Eigen::Isometry3d> estPoses;
-
+  /* Write Back Estimates ====================== */
   for (int i = 0; i < v_camera_id; i++)
   {
-    g2o::VertexSE3Expmap* VSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(i));
-    g2o::SE3Quat CorrectedSiw = VSE3->estimate();
-    Eigen::Isometry3d pose(Eigen::Isometry3d::Identity());
-    pose.prerotate(CorrectedSiw.rotation());
-    pose.pretranslate(CorrectedSiw.translation());
-    estPoses.push_back(pose); //w2c
+    const g2o::VertexSE3Expmap* VSE3 = static_cast<const g2o::VertexSE3Expmap*>(optimizer.vertex(i));
+    v_optimized_keyframes[i].get().SetPose(ConvertToPose(VSE3->estimate())); //w2c
   }
   for (int i = v_camera_id; i < v_point_id; i++) {
-    g2o::VertexSBAPointXYZ* vPoint = static_cast<g2o::VertexSBAPointXYZ*>(optimizer.vertex(i));
-    estPoints3d.push_back(vPoint->estimate());
+    const g2o::VertexSBAPointXYZ* vPoint = static_cast<const g2o::VertexSBAPointXYZ*>(optimizer.vertex(i));
+    const Eigen::Vector3d& pos = vPoint->estimate();
+    v_optimized_mappoints[i - v_camera_id].get().SetPosition(pos.x(), pos.y(), pos.z());
+  }
+
+  /* ====================== Write Back Estimates */
+  return result;
+}
+
+int RefineStructure(std::vector<KeyFrame>& v_keyframes, std::vector<MapPoint>& v_mappoints,
+                    const std::vector<int>& v_mappoint_ids, const Camera& cam,
+                    const Optimizer::OptimizerConfig& config, const int max_iteration)
+{
+  // poses are converted once, indexed by keyframe id
+  std::vector<Eigen::Matrix3d> v_R(v_keyframes.size());
+  std::vector<Eigen::Vector3d> v_t(v_keyframes.size());
+  for(size_t kf_idx = 0; kf_idx < v_keyframes.size(); ++kf_idx) {
+    if(!v_keyframes[kf_idx].IsActivated()) {
+      continue;
+    }
+    cv2eigen(v_keyframes[kf_idx].GetPoseRot(), v_R[kf_idx]);
+    cv2eigen(v_keyframes[kf_idx].GetPoseTrans(), v_t[kf_idx]);
   }
 
-  /* ====================== Retrieve Desired Params */
+  const double fx = cam.f_fx, fy = cam.f_fy, cx = cam.f_cx, cy = cam.f_cy;
+  const double delta = config.huber_delta;
+  // each point is written by one thread only
+  std::vector<int> v_ids = v_mappoint_ids;
+  std::sort(v_ids.begin(), v_ids.end());
+  v_ids.erase(std::unique(v_ids.begin(), v_ids.end()), v_ids.end());
+  std::vector<char> vb_updated(v_ids.size(), 0);
+
+  // Robust cost of a point, normal equations are filled if p_H is given.
+  // Returns a negative value if the point is behind any camera.
+  auto evaluate = [&](const MapPoint& mappoint, const Eigen::Vector3d& pt_w,
+                      Eigen::Matrix3d* p_H, Eigen::Vector3d* p_b) {
+    double cost = 0.0;
+    if(p_H) {
+      p_H->setZero();
+      p_b->setZero();
+    }
+    for(int obs_idx = 0; obs_idx < mappoint.GetObsNum(); ++obs_idx) {
+      const MatchInfo m = mappoint.GetMatchInfo(obs_idx);
+      if(m.frame_id < 0 || m.frame_id >= (int)v_keyframes.size() || !v_keyframes[m.frame_id].IsActivated()) {
+        continue;
+      }
+      const Eigen::Vector3d pt_c = v_R[m.frame_id] * pt_w + v_t[m.frame_id];
+      if(pt_c.z() <= 1e-10) {
+        return -1.0;
+      }
+      const cv::Point2f obs = v_keyframes[m.frame_id].GetObs(m.kpt_id);
+      const double inv_z = 1.0/pt_c.z();
+      const Eigen::Vector2d r(fx*pt_c.x()*inv_z + cx - obs.x, fy*pt_c.y()*inv_z + cy - obs.y);
+      const double sq_error = r.squaredNorm();
+      double weight = 1.0;
+      if(sq_error > delta*delta) {
+        const double error = std::sqrt(sq_error);
+        weight = delta/error;
+        cost += 2.0*delta*error - delta*delta;
+      }
+      else {
+        cost += sq_error;
+      }
+      if(p_H) {
+        Eigen::Matrix<double,2,3> d_proj;
+        d_proj << fx*inv_z, 0.0, -fx*pt_c.x()*inv_z*inv_z,
+                  0.0, fy*inv_z, -fy*pt_c.y()*inv_z*inv_z;
+        const Eigen::Matrix<double,2,3> J = d_proj * v_R[m.frame_id];
+        p_H->noalias() += weight * J.transpose() * J;
+        p_b->noalias() += weight * J.transpose() * r;
+      }
+    }
+    return cost;
+  };
+
+  ParallelFor(0, (int)v_ids.size(), [&](const int i) {
+    const int mappoint_id = v_ids[i];
+    if(mappoint_id < 0 || mappoint_id >= (int)v_mappoints.size()) {
+      return;
+    }
+    MapPoint& mappoint = v_mappoints[mappoint_id];
+    if(!mappoint.IsActivated() || mappoint.GetObsNum() < 2) {
+      return;
+    }
+    const cv::Point3f pos = mappoint.GetPosition();
+    Eigen::Vector3d pt_w(pos.x, pos.y, pos.z);
+    Eigen::Matrix3d H;
+    Eigen::Vector3d b;
+    double cost = evaluate(mappoint, pt_w, &H, &b);
+    if(cost < 0.0) {
+      return;
+    }
+    // Levenberg-Marquardt, the damping also keeps H invertible for low parallax points
+    double lambda = 1e-3;
+    for(int iter = 0; iter < max_iteration; ++iter) {
+      Eigen::Matrix3d H_damped = H;
+      H_damped.diagonal() *= 1.0 + lambda;
+      const Eigen::Vector3d dx = H_damped.ldlt().solve(-b);
+      if(!dx.allFinite()) {
+        break;
+      }
+      const Eigen::Vector3d pt_w_new = pt_w + dx;
+      Eigen::Matrix3d H_new;
+      Eigen::Vector3d b_new;
+      const double new_cost = evaluate(mappoint, pt_w_new, &H_new, &b_new);
+      if(new_cost < 0.0 || new_cost >= cost) {
+        // rejected, the next step is shorter and closer to gradient descent
+        lambda *= 10.0;
+        continue;
+      }
+      lambda = std::max(lambda * 0.1, 1e-7);
+      pt_w = pt_w_new;
+      cost = new_cost;
+      H = H_new;
+      b = b_new;
+      vb_updated[i] = 1;
+      if(dx.squaredNorm() < 1e-12 * pt_w.squaredNorm()) {
+        break;
+      }
+    }
+    if(vb_updated[i]) {
+      mappoint.SetPosition(pt_w.x(), pt_w.y(), pt_w.z());
+    }
+  }, config.num_threads);
+
+  int num_updated = 0;
+  for(const char b_updated : vb_updated) {
+    num_updated += b_updated;
+  }
+  return num_updated;
+}
+
+BAResult BundleAdjustmentNative(std::vector<std::reference_wrapper<KeyFrame>> v_keyframes,
+                                std::vector<std::reference_wrapper<MapPoint>> v_mappoints, const Camera& cam,
+                                const Optimizer::OptimizerConfig& config)
+{
+  BAProblem problem;
+  std::vector<std::reference_wrapper<KeyFrame>> v_optimized_keyframes;
+  std::vector<std::reference_wrapper<MapPoint>> v_optimized_mappoints;
+  BuildBAProblem(v_keyframes, v_mappoints, cam, problem, v_optimized_keyframes, v_optimized_mappoints);
+  if(!config.export_bal_file.empty()) {
+    BALFormat::Export(problem, config.export_bal_file);
+  }
+
+  BAResult result = BundleAdjustmentNative(problem, config);
+
+  for(size_t i = 0; i < v_optimized_keyframes.size(); ++i) {
+    Eigen::Matrix<double,3,4> m_cTw;
+    m_cTw.leftCols<3>() = problem.v_cameras[i].R;
+    m_cTw.col(3) = problem.v_cameras[i].t;
+    cv::Mat pose(3, 4, CV_32FC1);
+    eigen2cv(m_cTw, pose);
+    v_optimized_keyframes[i].get().SetPose(pose);
+  }
+  for(size_t j = 0; j < v_optimized_mappoints.size(); ++j) {
+    const Eigen::Vector3d& pos = problem.v_points[j];
+    v_optimized_mappoints[j].get().SetPosition(pos.x(), pos.y(), pos.z());
+  }
+
+  return result;
+}
+
+BAResult BundleAdjustmentNative(BAProblem& problem, const Optimizer::OptimizerConfig& config)
+{
+  BundleAdjuster::BAConfig ba_config = BundleAdjuster::DefaultConfig();
+  ba_config.linear_solver = config.native_linear_solver;
+  ba_config.max_iteration = 50;
+  ba_config.huber_delta = config.huber_delta;
+  ba_config.function_tolerance = config.chi2_threshold;
+  ba_config.parameter_tolerance = config.step_threshold;
+  ba_config.num_threads = config.num_threads;
+  ba_config.verbose = config.verbose;
+
+  BundleAdjuster::BASummary summary;
+  if(config.engine == Optimizer::Submap) {
+    SubmapBundleAdjuster::SubmapConfig submap_config{config.submap_size, config.submap_overlap, ba_config};
+    SubmapBundleAdjuster submap_bundle_adjuster(submap_config);
+    summary = submap_bundle_adjuster.Solve(problem);
+  }
+  else {
+    BundleAdjuster bundle_adjuster(ba_config);
+    summary = bundle_adjuster.Solve(problem);
+  }
+
+  BAResult result;
+  result.initial_rms_error = summary.initial_rms_error;
+  result.final_rms_error = summary.final_rms_error;
+  result.num_iterations = summary.num_iterations;
+  result.num_observations = (int)problem.v_observations.size();
+  std::cout << "[LOG] Native BA : RMS error " << result.initial_rms_error
+            << " -> " << result.final_rms_error << " pixel in "
+            << result.num_iterations << " iterations" << std::endl;
+  return result;
+}
+
+BAResult BundleAdjustmentG2O(BAProblem& problem, const Optimizer::OptimizerConfig& config)
+{
+  g2o::SparseOptimizer optimizer;
+  optimizer.setVerbose(config.verbose);
+  LinearSolverSelector solver_selector(optimizer);
+  solver_selector.Use(config.linear_solver);
+
+  const int num_cameras = (int)problem.v_cameras.size();
+  for(int i = 0; i < num_cameras; ++i) {
+    const BAProblem::CameraParam& cam = problem.v_cameras[i];
+    g2o::VertexSE3Expmap* vertex_se3 = new g2o::VertexSE3Expmap();
+    vertex_se3->setId(i);
+    vertex_se3->setFixed(cam.fixed);
+    vertex_se3->setEstimate(g2o::SE3Quat(Eigen::Quaterniond(cam.R), cam.t));
+    optimizer.addVertex(vertex_se3);
+  }
+  for(int j = 0; j < (int)problem.v_points.size(); ++j) {
+    g2o::VertexSBAPointXYZ* v_p = new g2o::VertexSBAPointXYZ();
+    v_p->setId(num_cameras + j);
+    v_p->setFixed(problem.vb_fixed_points[j] != 0);
+    v_p->setMarginalized(problem.vb_fixed_points[j] == 0);
+    v_p->setEstimate(problem.v_points[j]);
+    optimizer.addVertex(v_p);
+  }
+  for(const BAProblem::Observation& obs : problem.v_observations) {
+    const BAProblem::CameraParam& cam = problem.v_cameras[obs.camera_idx];
+    g2o::EdgeSE3ProjectXYZ* edge = new g2o::EdgeSE3ProjectXYZ();
+    edge->setVertex(0, optimizer.vertex(num_cameras + obs.point_idx));
+    edge->setVertex(1, optimizer.vertex(obs.camera_idx));
+    edge->setMeasurement(obs.uv);
+    edge->setInformation(Eigen::Matrix2d::Identity());
+    g2o::RobustKernelHuber* r_k = new g2o::RobustKernelHuber;
+    r_k->setDelta(config.huber_delta);
+    edge->setRobustKernel(r_k);
+    edge->fx = cam.fx;
+    edge->fy = cam.fy;
+    edge->cx = cam.cx;
+    edge->cy = cam.cy;
+    optimizer.addEdge(edge);
+  }
+
+  if(config.linear_solver == Optimizer::Auto) {
+    g2o::HyperGraph::EdgeSet edge_set = optimizer.edges();
+    solver_selector.Benchmark(edge_set, 2);
+  }
+  optimizer.initializeOptimization();
+  BAResult result = Optimize(optimizer, 50, config);
+  std::cout << "[LOG] BA : RMS error " << result.initial_rms_error
+            << " -> " << result.final_rms_error << " pixel in "
+            << result.num_iterations << " iterations" << std::endl;
+
+  for(int i = 0; i < num_cameras; ++i) {
+    const g2o::SE3Quat& cTw = static_cast<const g2o::VertexSE3Expmap*>(optimizer.vertex(i))->estimate();
+    problem.v_cameras[i].R = cTw.rotation().toRotationMatrix();
+    problem.v_cameras[i].t = cTw.translation();
+  }
+  for(int j = 0; j < (int)problem.v_points.size(); ++j) {
+    problem.v_points[j] = static_cast<const g2o::VertexSBAPointXYZ*>(optimizer.vertex(num_cameras + j))->estimate();
+  }
   return result;
 }
 
@@ -0,0 +1,192 @@
+#include "PoseOptimizer.h"
+#include "ConfigLoader.h"
+#include "Frame.h"
+#include "MapPoint.h"
+#include "Solver.h"
+
+#include <Eigen/Cholesky>
+#include <Eigen/Geometry>
+
+#include <cmath>
+
+namespace TS_SfM {
+
+  PoseOptimizer::PoseOptimizerConfig PoseOptimizer::DefaultConfig() {
+    // 5.991 is chi2 of 2 DoF at 95%
+    return PoseOptimizerConfig{4, 10, 5.991f, 1e-8f};
+  }
+
+  // Robust cost and normal equations of the inliers at (R, t).
+  static double Linearize(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs, const int num,
+                          const double fx, const double fy, const double cx, const double cy,
+                          const Eigen::Matrix3d& R, const Eigen::Vector3d& t, const char* pb_inliers,
+                          const double delta,
+                          Eigen::Matrix<double,6,6>& H, Eigen::Matrix<double,6,1>& b)
+  {
+    double cost = 0.0;
+    H.setZero();
+    b.setZero();
+    for(int n = 0; n < num; ++n) {
+      if(!pb_inliers[n]) {
+        continue;
+      }
+      const Eigen::Vector3d pt_c = R * p_pts_w[n] + t;
+      if(pt_c.z() <= 1e-10) {
+        // behind the camera, the same penalty as a large outlier
+        cost += delta*delta;
+        continue;
+      }
+      const double inv_z = 1.0/pt_c.z();
+      const double u = fx*pt_c.x()*inv_z + cx;
+      const double v = fy*pt_c.y()*inv_z + cy;
+      const Eigen::Vector2d r(u - p_obs[n].x(), v - p_obs[n].y());
+      const double sq_error = r.squaredNorm();
+
+      double weight = 1.0;
+      if(sq_error > delta*delta) {
+        const double error = std::sqrt(sq_error);
+        weight = delta/error;
+        cost += 2.0*delta*error - delta*delta;
+      }
+      else {
+        cost += sq_error;
+      }
+
+      // d(u,v)/d(w,v) with pt_c' = exp(w)pt_c + v
+      const double x = pt_c.x()*inv_z, y = pt_c.y()*inv_z;
+      const double ju[6] = {-fx*x*y, fx*(1.0 + x*x), -fx*y, fx*inv_z, 0.0, -fx*x*inv_z};
+      const double jv[6] = {-fy*(1.0 + y*y), fy*x*y, fy*x, 0.0, fy*inv_z, -fy*y*inv_z};
+      const double wru = weight*r.x(), wrv = weight*r.y();
+      // upper triangle only, mirrored at the end
+      for(int i = 0; i < 6; ++i) {
+        const double wju = weight*ju[i], wjv = weight*jv[i];
+        for(int j = i; j < 6; ++j) {
+          H(i,j) += wju*ju[j] + wjv*jv[j];
+        }
+        b(i) += ju[i]*wru + jv[i]*wrv;
+      }
+    }
+    H.triangularView<Eigen::StrictlyLower>() = H.transpose();
+    return cost;
+  }
+
+  int PoseOptimizer::Optimize(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs, const int num,
+                              const double fx, const double fy, const double cx, const double cy,
+                              Eigen::Matrix3d& R, Eigen::Vector3d& t, char* pb_inliers) const
+  {
+    const double chi2_threshold = m_config.chi2_threshold;
+    const double delta = std::sqrt(chi2_threshold);
+    Eigen::Matrix<double,6,6> H, H_new, H_damped;
+    Eigen::Matrix<double,6,1> b, b_new, dx;
+
+    int num_inliers = 0;
+    for(int round = 0; round < m_config.num_rounds; ++round) {
+      num_inliers = 0;
+      for(int n = 0; n < num; ++n) {
+        num_inliers += pb_inliers[n] ? 1 : 0;
+      }
+      if(num_inliers < 3) {
+        break;
+      }
+
+      double cost = Linearize(p_pts_w, p_obs, num, fx, fy, cx, cy, R, t, pb_inliers, delta, H, b);
+      double lambda = 1e-5 * H.diagonal().maxCoeff();
+      for(int iter = 0; iter < m_config.max_iteration; ++iter) {
+        // Levenberg-Marquardt on 6x6. The candidate is linearized at once, so
+        // an accepted step costs a single pass over the correspondences.
+        bool b_accepted = false;
+        double new_cost = cost;
+        for(int trial = 0; trial < 10 && !b_accepted; ++trial) {
+          H_damped = H;
+          H_damped.diagonal().array() += lambda;
+          dx = H_damped.ldlt().solve(-b);
+
+          const Eigen::Vector3d w = dx.head<3>();
+          const double angle = w.norm();
+          const Eigen::Matrix3d dR = angle > 1e-12 ? Eigen::AngleAxisd(angle, w/angle).toRotationMatrix()
+                                                   : Eigen::Matrix3d::Identity();
+          const Eigen::Matrix3d R_new = dR * R;
+          const Eigen::Vector3d t_new = dR * t + dx.tail<3>();
+          new_cost = Linearize(p_pts_w, p_obs, num, fx, fy, cx, cy, R_new, t_new, pb_inliers,
+                               delta, H_new, b_new);
+          if(new_cost < cost) {
+            b_accepted = true;
+            lambda = std::max(lambda*0.1, 1e-12);
+            R = R_new;
+            t = t_new;
+            H = H_new;
+            b = b_new;
+          }
+          else {
+            lambda *= 10.0;
+          }
+        }
+        if(!b_accepted) {
+          break;
+        }
+        const double decrease = cost - new_cost;
+        cost = new_cost;
+        if(dx.squaredNorm() < (double)m_config.min_step * m_config.min_step || decrease < 1e-6*cost) {
+          break;
+        }
+      }
+
+      // re-classify all correspondences with the refined pose
+      num_inliers = 0;
+      for(int n = 0; n < num; ++n) {
+        const Eigen::Vector3d pt_c = R * p_pts_w[n] + t;
+        bool b_inlier = false;
+        if(pt_c.z() > 1e-10) {
+          const double du = fx*pt_c.x()/pt_c.z() + cx - p_obs[n].x();
+          const double dv = fy*pt_c.y()/pt_c.z() + cy - p_obs[n].y();
+          b_inlier = du*du + dv*dv < chi2_threshold;
+        }
+        pb_inliers[n] = b_inlier ? 1 : 0;
+        num_inliers += b_inlier ? 1 : 0;
+      }
+    }
+
+    return num_inliers;
+  }
+
+  int PoseOptimizer::Optimize(Frame& frame, const std::vector<MapPoint>& v_mappoints,
+                              const std::vector<MatchObsAndLdmk>& v_matches, const Camera& cam,
+                              std::vector<bool>& vb_inliers) const
+  {
+    const int num = (int)v_matches.size();
+    const std::vector<cv::KeyPoint> v_kpts = frame.GetUndistortedKeyPoints();
+    std::vector<Eigen::Vector3d> v_pts_w(num);
+    std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> v_obs(num);
+    std::vector<char> vb_work(num, 1);
+    for(int n = 0; n < num; ++n) {
+      const cv::Point3f pos = v_mappoints[v_matches[n].ldmk_id].GetPosition();
+      const cv::Point2f& pt = v_kpts[v_matches[n].obs_id].pt;
+      v_pts_w[n] = Eigen::Vector3d(pos.x, pos.y, pos.z);
+      v_obs[n] = Eigen::Vector2d(pt.x, pt.y);
+      if(vb_inliers.size() == v_matches.size()) {
+        vb_work[n] = vb_inliers[n] ? 1 : 0;
+      }
+    }
+
+    Eigen::Matrix<float,3,4> cTw;
+    cv2eigen(frame.GetPose(), cTw);
+    Eigen::Matrix3d R = cTw.leftCols<3>().cast<double>();
+    Eigen::Vector3d t = cTw.col(3).cast<double>();
+
+    const int num_inliers = Optimize(v_pts_w.data(), v_obs.data(), num,
+                                     cam.f_fx, cam.f_fy, cam.f_cx, cam.f_cy, R, t, vb_work.data());
+
+    vb_inliers.assign(num, false);
+    for(int n = 0; n < num; ++n) {
+      vb_inliers[n] = vb_work[n] != 0;
+    }
+    cTw.leftCols<3>() = R.cast<float>();
+    cTw.col(3) = t.cast<float>();
+    cv::Mat pose(3, 4, CV_32FC1);
+    eigen2cv(cTw, pose);
+    frame.SetPose(pose);
+
+    return num_inliers;
+  }
+
+} // namespace
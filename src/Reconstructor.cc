@@ -20,4 +20,12 @@ namespace TS_SfM {
     return;
   }
 
+  std::vector<uint32_t> Reconstructor::MaintainMap(const Camera& cam) {
+    std::lock_guard<std::mutex> lock(m_p_map->m_update_mtx);
+    std::vector<uint32_t> v_changed_ids;
+    m_p_mapper->MaintainMap(*m_p_map, cam, v_changed_ids);
+    m_p_map->PublishSnapshot();
+    return v_changed_ids;
+  }
+
 }
@@ -1,6 +1,8 @@
 #include "Solver.h"
 #include <random>
 
+#include "Matcher.h"
+#include "MapPoint.h"
 #include "Utils.h"
 
 namespace TS_SfM {
@@ -10,82 +12,65 @@ namespace Solver {
                      const std::vector<cv::KeyPoint>& v_pts1,
                      const std::vector<cv::DMatch>& v_matches_01,
                      const cv::Mat& K,
-                     const cv::Mat& E)
+                     const cv::Mat& E,
+                     const CheiralityCheck check_type)
   {
     cv::Mat T_01 = cv::Mat::eye(3,4,CV_32FC1);
-    using SvdInDecompE
-      = Eigen::JacobiSVD<Eigen::Matrix<float,3,3>,Eigen::ColPivHouseholderQRPreconditioner>;
-    Eigen::Matrix<float, 3, 3> _E;
+    Matrix33f _E;
     cv2eigen(E, _E);
-    SvdInDecompE svd(_E, Eigen::ComputeFullU | Eigen::ComputeFullV);
-    Eigen::MatrixXf U = svd.matrixU();
-    Eigen::MatrixXf Vt = svd.matrixV().transpose();
-
-    Eigen::Matrix<float,3,3> W;
-    W << 0.0, -1.0, 0.0,
-         1.0,  0.0, 0.0,
-         0.0,  0.0, 1.0;
 
     Matrix33f eK;
     cv2eigen(K, eK);
 
-    std::vector< Matrix34f > v_eig_T;
-    v_eig_T.reserve(4);
-    Matrix34f eig_T;
+    // 4 candidates of [R|t] in normalized camera coordinates
+    Matrix34f v_eig_T[4];
+    DecomposeEssential<float>(_E, v_eig_T);
 
-    eig_T.block(0,0,3,3) = U * W * Vt;
-    if(eig_T.block(0,0,3,3).determinant() < 0.0) {
-      eig_T.block(0,0,3,3) *= -1.0;
-    }
-    eig_T.col(3) = U.col(2)/U.col(2).norm();
-    v_eig_T.push_back(eK*eig_T);
-    
-    eig_T.block(0,0,3,3) = U * W * Vt;
-    eig_T.col(3) = -U.col(2)/U.col(2).norm();
-    if(eig_T.block(0,0,3,3).determinant() < 0.0) {
-      eig_T.block(0,0,3,3) *= -1.0;
+    int correct_solution_idx = -1;
+    if(check_type == FastCheck) {
+      correct_solution_idx = SelectPoseByFastCheirality(v_pts0, v_pts1, v_matches_01, eK, v_eig_T);
     }
-    v_eig_T.push_back(eK*eig_T);
-    
-    eig_T.block(0,0,3,3) = U * W.transpose() * Vt;
-    eig_T.col(3) = U.col(2)/U.col(2).norm();
-    if(eig_T.block(0,0,3,3).determinant() < 0.0) {
-      eig_T.block(0,0,3,3) *= -1.0;
+    else {
+      correct_solution_idx = SelectPoseByFullCheirality(v_pts0, v_pts1, v_matches_01, eK, v_eig_T);
     }
-    v_eig_T.push_back(eK*eig_T);
-    
-    eig_T.block(0,0,3,3) = U * W.transpose() * Vt;
-    eig_T.col(3) = -U.col(2)/U.col(2).norm();
-    if(eig_T.block(0,0,3,3).determinant() < 0.0) {
-      eig_T.block(0,0,3,3) *= -1.0;
+
+    if(correct_solution_idx < 0) {
+      std::cout << "[Warning] DecomposeE couldn't find a pose in front of cameras.\n";
+      return T_01;
     }
-    v_eig_T.push_back(eK*eig_T);
 
+    Matrix34f eT = v_eig_T[correct_solution_idx];
+    eigen2cv(eT, T_01);
+
+    return T_01;
+  }
+
+  int SelectPoseByFullCheirality(const std::vector<cv::KeyPoint>& v_pts0,
+                                 const std::vector<cv::KeyPoint>& v_pts1,
+                                 const std::vector<cv::DMatch>& v_matches_01,
+                                 const Matrix33f& eK,
+                                 const Matrix34f v_eig_T[4])
+  {
     Matrix34f P;
     P << 1.0, 0.0, 0.0, 0.0,
          0.0, 1.0, 0.0, 0.0,
          0.0, 0.0, 1.0, 0.0;
     P = eK * P;
-    
+
     int correct_solution_idx = -1;
     int reconst_num_in_front_cam = 0;
     for(int i = 0; i < 4; ++i) {
+      const Matrix34f KT = eK * v_eig_T[i];
       int count = 0;
       for(size_t n = 0; n < v_matches_01.size(); ++n) {
-        const float x0 = v_pts0[v_matches_01[n].queryIdx].pt.x;
-        const float y0 = v_pts0[v_matches_01[n].queryIdx].pt.y;
-        const float x1 = v_pts1[v_matches_01[n].trainIdx].pt.x;
-        const float y1 = v_pts1[v_matches_01[n].trainIdx].pt.y;
-        Matrix44f A = Eigen::MatrixXf::Zero(4, 4);
-        A.row(0) = x0*P.row(2) - P.row(0);
-        A.row(1) = y0*P.row(2) - P.row(1);
-        A.row(2) = x1*v_eig_T[i].row(2) - v_eig_T[i].row(0);
-        A.row(3) = y1*v_eig_T[i].row(2) - v_eig_T[i].row(1);
-
-        SvdInTri svd(A, Eigen::ComputeFullV);
-        Eigen::MatrixXf pt4D_0 = svd.matrixV().col(3)/svd.matrixV()(3,3);
-        Eigen::MatrixXf pt4D_1 = v_eig_T[i]*pt4D_0;
-        if(pt4D_0(2) > 0.0 && pt4D_1(2) > 0.0) {
+        const cv::Point2f& pt0 = v_pts0[v_matches_01[n].queryIdx].pt;
+        const cv::Point2f& pt1 = v_pts1[v_matches_01[n].trainIdx].pt;
+        Eigen::Vector3f pt3D_0;
+        if(!TriangulateDLT<float>(P, KT, Eigen::Vector2f(pt0.x, pt0.y), Eigen::Vector2f(pt1.x, pt1.y), pt3D_0)) {
+          continue;
+        }
+        const Eigen::Vector3f pt3D_1 = KT.block<3,3>(0,0)*pt3D_0 + KT.col(3);
+        if(pt3D_0(2) > 0.0 && pt3D_1(2) > 0.0) {
           ++count;
         }
       }
@@ -95,11 +80,80 @@ namespace Solver {
         correct_solution_idx = i;
       }
     }
-    
-    Matrix34f eT = eK.inverse()*v_eig_T[correct_solution_idx]; 
-    eigen2cv(eT, T_01);
 
-    return T_01;
+    return correct_solution_idx;
+  }
+
+  int SelectPoseByFastCheirality(const std::vector<cv::KeyPoint>& v_pts0,
+                                 const std::vector<cv::KeyPoint>& v_pts1,
+                                 const std::vector<cv::DMatch>& v_matches_01,
+                                 const Matrix33f& eK,
+                                 const Matrix34f v_eig_T[4],
+                                 const int max_samples, const int min_samples)
+  {
+    const int num_matches = (int)v_matches_01.size();
+    if(num_matches == 0) {
+      return -1;
+    }
+
+    const Matrix33f eK_inv = eK.inverse();
+    Matrix33f v_R[4];
+    Eigen::Vector3f v_t[4];
+    for(int i = 0; i < 4; ++i) {
+      v_R[i] = v_eig_T[i].block<3,3>(0,0);
+      v_t[i] = v_eig_T[i].col(3);
+    }
+
+    // Use every match if there are only a few, otherwise draw a random subset.
+    const bool use_all = num_matches <= max_samples;
+    const int num_samples = use_all ? num_matches : max_samples;
+    std::mt19937 mt(std::random_device{}());
+    std::uniform_int_distribution<int> dist(0, num_matches-1);
+
+    int v_count[4] = {0, 0, 0, 0};
+    for(int n = 0; n < num_samples; ++n) {
+      const cv::DMatch& m = v_matches_01[use_all ? n : dist(mt)];
+      const Eigen::Vector3f x0 = eK_inv * Eigen::Vector3f(v_pts0[m.queryIdx].pt.x, v_pts0[m.queryIdx].pt.y, 1.0);
+      const Eigen::Vector3f x1 = eK_inv * Eigen::Vector3f(v_pts1[m.trainIdx].pt.x, v_pts1[m.trainIdx].pt.y, 1.0);
+
+      for(int i = 0; i < 4; ++i) {
+        float d0, d1;
+        if(DepthsByCrossProduct<float>(v_R[i], v_t[i], x0, x1, d0, d1) && d0 > 0.0 && d1 > 0.0) {
+          ++v_count[i];
+        }
+      }
+
+      // Early termination once a candidate can't be overtaken or clearly dominates.
+      int best = 0, second = 0;
+      for(int i = 0; i < 4; ++i) {
+        if(v_count[i] > best) {
+          second = best;
+          best = v_count[i];
+        }
+        else if(v_count[i] > second) {
+          second = v_count[i];
+        }
+      }
+      const int processed = n + 1;
+      const int remaining = num_samples - processed;
+      if(best - second > remaining) {
+        break;
+      }
+      if(processed >= min_samples && 4*best >= 3*processed && 4*second < processed) {
+        break;
+      }
+    }
+
+    int correct_solution_idx = -1;
+    int reconst_num_in_front_cam = 0;
+    for(int i = 0; i < 4; ++i) {
+      if(v_count[i] > reconst_num_in_front_cam) {
+        reconst_num_in_front_cam = v_count[i];
+        correct_solution_idx = i;
+      }
+    }
+
+    return correct_solution_idx;
   }
 
 
@@ -129,77 +183,59 @@ namespace Solver {
         }
       }
 
+      // Points are converted once for the inner loop
+      std::vector<Eigen::Vector2f> v_pts0(v_matches.size()), v_pts1(v_matches.size());
+      for(size_t i = 0; i < v_matches.size(); ++i) {
+        const cv::Point2f& pt0 = pair_vv_kpts.first[v_matches[i].queryIdx].pt;
+        const cv::Point2f& pt1 = pair_vv_kpts.second[v_matches[i].trainIdx].pt;
+        v_pts0[i] = Eigen::Vector2f(pt0.x, pt0.y);
+        v_pts1[i] = Eigen::Vector2f(pt1.x, pt1.y);
+      }
+
       int best_iter = -1;
       int best_score_inliers = -1;
-      cv::Mat best_F;
+      Matrix33f best_F = Matrix33f::Zero();
       std::vector<bool> best_mask(v_matches.size(), false);
+      std::vector<bool> current_mask(v_matches.size(), false);
+      Eigen::Vector2f x0[8], x1[8];
       for(int ransac_iter = 0; ransac_iter < max_iteration; ransac_iter++) {
         int current_score_inliers = 0;
-        cv::Mat current_F;
-        std::vector<bool> current_mask(v_matches.size(), false);
 
-        std::vector<cv::DMatch> v_matches_01_ransac;
-        std::vector<cv::Point2f> v_pts0, v_pts1;
-        v_pts0.reserve(8);
-        v_pts1.reserve(8);
         for(int i=0; i<8;i++) {
-          v_pts0.push_back(cv::Point2f(
-            pair_vv_kpts.first[v_matches[vv_sample_idx[ransac_iter][i]].queryIdx].pt.x,
-            pair_vv_kpts.first[v_matches[vv_sample_idx[ransac_iter][i]].queryIdx].pt.y)); 
-          v_pts1.push_back(cv::Point2f(
-            pair_vv_kpts.second[v_matches[vv_sample_idx[ransac_iter][i]].trainIdx].pt.x,
-            pair_vv_kpts.second[v_matches[vv_sample_idx[ransac_iter][i]].trainIdx].pt.y)); 
-          v_matches_01_ransac.push_back(v_matches[vv_sample_idx[ransac_iter][i]]);
+          x0[i] = v_pts0[vv_sample_idx[ransac_iter][i]];
+          x1[i] = v_pts1[vv_sample_idx[ransac_iter][i]];
         }
 
-        float score_8 = ComputeEightPointsAlgorithm(v_pts0, v_pts1, current_F);
+        const Matrix33f current_F = EightPoint<float>(x0, x1);
+
+        float score_8 = 0.0;
+        for(int i = 0; i < 8; ++i) {
+          score_8 += EpipolarDistance<float>(current_F, x0[i], x1[i]);
+        }
+        score_8 /= 8.0;
 
         if(score_8 > 1.5) {
-#if 0
-          cv::Mat m_output;
-          cv::drawMatches(image0, pair_vv_kpts.first,
-                          image1, pair_vv_kpts.second,
-                          v_matches_01_ransac, m_output);
-
-          cv::imshow("viewer-matches-ransac", m_output);
-          cv::waitKey(0);
-#endif
           continue; 
         }
 
-        std::vector<float> vf_ditances = ComputeEpipolarDistances(pair_vv_kpts.first,
-                                                                  pair_vv_kpts.second,
-                                                                  v_matches, current_F); 
-
         // Decision part 
-        int mask_idx = 0;
-        for(float d : vf_ditances) {
-          if(d < threshold) {
-            ++current_score_inliers; 
-            current_mask[mask_idx] = true;
-          } 
-          ++mask_idx;
+        for(size_t i = 0; i < v_matches.size(); ++i) {
+          const bool is_inlier = EpipolarDistance<float>(current_F, v_pts0[i], v_pts1[i]) < threshold;
+          current_mask[i] = is_inlier;
+          current_score_inliers += is_inlier ? 1 : 0;
         }
 
         if(current_score_inliers > best_score_inliers) {
           best_score_inliers = current_score_inliers;
           best_iter = ransac_iter;
-          best_F = current_F.clone();
+          best_F = current_F;
           best_mask = current_mask;
           is_solved = true;
-#if 0
-          cv::Mat m_output;
-          cv::drawMatches(image0, pair_vv_kpts.first,
-                          image1, pair_vv_kpts.second,
-                          v_matches_01_ransac, m_output);
-
-          cv::imshow("viewer-matches-ransac", m_output);
-          cv::waitKey(0);
-#endif
         }
       }
 
-      F = best_F.clone();
+      F = cv::Mat::zeros(3,3,CV_32F);
+      eigen2cv(best_F, F);
       vb_mask = best_mask;
       score = best_score_inliers;
       // std::cout << "Score = " << best_score_inliers 
@@ -233,30 +269,19 @@ namespace Solver {
     
     int reconst_num_in_front_cam = 0;
 
-    std::vector<Eigen::Vector3d> vd_points;
     int count = 0;
     for(size_t n = 0; n < v_matches_01.size(); ++n) {
-      const float x0 = v_pts0[v_matches_01[n].queryIdx].pt.x;
-      const float y0 = v_pts0[v_matches_01[n].queryIdx].pt.y;
-      const float x1 = v_pts1[v_matches_01[n].trainIdx].pt.x;
-      const float y1 = v_pts1[v_matches_01[n].trainIdx].pt.y;
-
-      Matrix44f A = Eigen::MatrixXf::Zero(4, 4);
-      A.row(0) = x0*P.row(2) - P.row(0);
-      A.row(1) = y0*P.row(2) - P.row(1);
-      A.row(2) = x1*eT_01.row(2) - eT_01.row(0);
-      A.row(3) = y1*eT_01.row(2) - eT_01.row(1);
-  
-      SvdInTri svd(A, Eigen::ComputeFullV);
-      Eigen::MatrixXf pt4D_0 = svd.matrixV().col(3)/svd.matrixV()(3,3);
-      Eigen::MatrixXf pt4D_1 = eT_01*pt4D_0;
+      const cv::Point2f& pt0 = v_pts0[v_matches_01[n].queryIdx].pt;
+      const cv::Point2f& pt1 = v_pts1[v_matches_01[n].trainIdx].pt;
+      Eigen::Vector3f pt3D_0;
+      if(!TriangulateDLT<float>(P, eT_01, Eigen::Vector2f(pt0.x, pt0.y), Eigen::Vector2f(pt1.x, pt1.y), pt3D_0)) {
+        continue;
+      }
+      const Eigen::Vector3f pt3D_1 = eT_01.block<3,3>(0,0)*pt3D_0 + eT_01.col(3);
 
-      if(pt4D_0(2) > 0.0 && pt4D_1(2) > 0.0) {
+      if(pt3D_0(2) > 0.0 && pt3D_1(2) > 0.0) {
         ++count;
-        Eigen::Vector3d vec3{static_cast<double>(pt4D_0(0)), 
-                             static_cast<double>(pt4D_0(1)),
-                             static_cast<double>(pt4D_0(2))};
-        vd_points.push_back(vec3);
+        v_pt3D.push_back(cv::Point3f(pt3D_0(0), pt3D_0(1), pt3D_0(2)));
       }
     }
   
@@ -264,11 +289,134 @@ namespace Solver {
       reconst_num_in_front_cam = count;
     }
 
-    for(auto pt : vd_points) {
-      v_pt3D.push_back(cv::Point3f((float)pt.x(), (float)pt.y(), (float)pt.z()));
+    return v_pt3D;
+  }
+
+  TriangulationResult TriangulateTracks(const std::vector<std::vector<MatchInfo>>& vv_tracks,
+                                        const std::vector<std::vector<cv::KeyPoint>>& vv_kpts,
+                                        const std::vector<cv::Mat>& v_poses,
+                                        const cv::Mat& K,
+                                        const TriangulatorConfig& config)
+  {
+    const int num_tracks = (int)vv_tracks.size();
+    TriangulationResult result;
+    result.v_pts_3d.assign(num_tracks, cv::Point3f(0.0, 0.0, 0.0));
+    result.vb_valid.assign(num_tracks, 0);
+    result.v_parallax_deg.assign(num_tracks, 0.0);
+    result.v_reproj_error.assign(num_tracks, -1.0);
+
+    Eigen::Matrix3d eK;
+    for(int i = 0; i < 3; ++i) {
+      for(int j = 0; j < 3; ++j) {
+        eK(i,j) = (K.type() == CV_64F) ? K.at<double>(i,j) : (double)K.at<float>(i,j);
+      }
+    }
+    const Eigen::Matrix3d eK_inv = eK.inverse();
+
+    // Poses are converted once, frames without pose are left as zero.
+    std::vector<Eigen::Matrix3d> v_R(v_poses.size(), Eigen::Matrix3d::Zero());
+    std::vector<Eigen::Vector3d> v_t(v_poses.size(), Eigen::Vector3d::Zero());
+    for(size_t f = 0; f < v_poses.size(); ++f) {
+      if(v_poses[f].empty()) {
+        continue;
+      }
+      for(int i = 0; i < 3; ++i) {
+        for(int j = 0; j < 3; ++j) {
+          v_R[f](i,j) = (v_poses[f].type() == CV_64F) ? v_poses[f].at<double>(i,j) : (double)v_poses[f].at<float>(i,j);
+        }
+        v_t[f](i) = (v_poses[f].type() == CV_64F) ? v_poses[f].at<double>(i,3) : (double)v_poses[f].at<float>(i,3);
+      }
     }
 
-    return v_pt3D;
+    ParallelFor(0, num_tracks, [&](const int idx) {
+      const std::vector<MatchInfo>& v_track = vv_tracks[idx];
+      Eigen::Vector3d pt_3d;
+      float parallax_deg = 0.0, reproj_error = -1.0;
+      const bool is_valid = TriangulateTrack(v_track.data(), (int)v_track.size(), vv_kpts,
+                                             v_R, v_t, eK, eK_inv, config,
+                                             pt_3d, parallax_deg, reproj_error);
+      result.v_pts_3d[idx] = cv::Point3f((float)pt_3d.x(), (float)pt_3d.y(), (float)pt_3d.z());
+      result.vb_valid[idx] = is_valid ? 1 : 0;
+      result.v_parallax_deg[idx] = parallax_deg;
+      result.v_reproj_error[idx] = reproj_error;
+    }, config.num_threads);
+
+    return result;
+  }
+
+  bool TriangulateTrack(const MatchInfo* p_obs, const int num_obs,
+                        const std::vector<std::vector<cv::KeyPoint>>& vv_kpts,
+                        const std::vector<Eigen::Matrix3d>& v_R,
+                        const std::vector<Eigen::Vector3d>& v_t,
+                        const Eigen::Matrix3d& K, const Eigen::Matrix3d& K_inv,
+                        const TriangulatorConfig& config,
+                        Eigen::Vector3d& pt_3d, float& parallax_deg, float& reproj_error)
+  {
+    pt_3d.setZero();
+    parallax_deg = 0.0;
+    reproj_error = -1.0;
+    if(num_obs < 2) {
+      return false;
+    }
+
+    // Minimize the sum of squared distances to all rays:
+    //   sum_i (I - f_i*f_i^T) X = sum_i (I - f_i*f_i^T) C_i
+    // where f_i is the unit bearing in world and C_i is the camera center.
+    Eigen::Matrix3d A = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d b = Eigen::Vector3d::Zero();
+    for(int n = 0; n < num_obs; ++n) {
+      const int f = p_obs[n].frame_id;
+      const cv::Point2f& pt = vv_kpts[f][p_obs[n].kpt_id].pt;
+      const Eigen::Vector3d f_w = (v_R[f].transpose() * (K_inv * Eigen::Vector3d(pt.x, pt.y, 1.0))).normalized();
+      const Eigen::Vector3d C = -v_R[f].transpose() * v_t[f];
+      AccumulateRay<double>(f_w, C, A, b);
+    }
+
+    Eigen::Matrix3d A_inv;
+    bool is_invertible = false;
+    double det = 0.0;
+    A.computeInverseAndDetWithCheck(A_inv, det, is_invertible, 1e-12);
+    if(!is_invertible) {
+      return false;
+    }
+    pt_3d = A_inv * b;
+
+    // Cheirality and reprojection error
+    bool is_valid = true;
+    double sum_sq_error = 0.0;
+    for(int n = 0; n < num_obs; ++n) {
+      const int f = p_obs[n].frame_id;
+      const cv::Point2f& pt = vv_kpts[f][p_obs[n].kpt_id].pt;
+      Eigen::Vector2d uv;
+      if(!Project<double>(K, v_R[f], v_t[f], pt_3d, uv)) {
+        is_valid = false;
+        continue;
+      }
+      sum_sq_error += (uv.x()-pt.x)*(uv.x()-pt.x) + (uv.y()-pt.y)*(uv.y()-pt.y);
+    }
+    reproj_error = (float)std::sqrt(sum_sq_error / num_obs);
+
+    // Largest angle between rays from camera centers to the point
+    double min_cos = 1.0;
+    for(int n = 0; n < num_obs; ++n) {
+      const int f0 = p_obs[n].frame_id;
+      const Eigen::Vector3d r0 = (pt_3d + v_R[f0].transpose() * v_t[f0]).normalized();
+      for(int m = n+1; m < num_obs; ++m) {
+        const int f1 = p_obs[m].frame_id;
+        const Eigen::Vector3d r1 = (pt_3d + v_R[f1].transpose() * v_t[f1]).normalized();
+        min_cos = std::min(min_cos, r0.dot(r1));
+      }
+    }
+    parallax_deg = (float)(std::acos(std::max(-1.0, std::min(1.0, min_cos))) * 180.0/M_PI);
+
+    if(parallax_deg < config.min_parallax_deg) {
+      is_valid = false;
+    }
+    if(config.max_reproj_error > 0.0 && reproj_error > config.max_reproj_error) {
+      is_valid = false;
+    }
+
+    return is_valid;
   }
 
   float
@@ -280,39 +428,13 @@ namespace Solver {
 
     float score = -1.0; 
     F = cv::Mat::zeros(3,3,CV_32F);
-    
-    Eigen::MatrixXf Af = Eigen::MatrixXf::Zero(8, 9);
-    // Eigen::Matrix<float, Eigen::Dynamic, 9> Ad(8, 9);
+
+    Eigen::Vector2f x0[8], x1[8];
     for(int i = 0; i < 8; i++) {
-      const float x0 = pts0[i].x;
-      const float y0 = pts0[i].y;
-      const float x1 = pts1[i].x;
-      const float y1 = pts1[i].y;
-
-      Af(i, 0) = x1 * x0; 
-      Af(i, 1) = x1 * y0; 
-      Af(i, 2) = x1; 
-      Af(i, 3) = y1 * x0; 
-      Af(i, 4) = y1 * y0; 
-      Af(i, 5) = y1; 
-      Af(i, 6) = x0; 
-      Af(i, 7) = y0; 
-      Af(i, 8) = 1.0; 
-    }
-
-    SvdInEight1st svd_1st(Af, Eigen::ComputeFullU | Eigen::ComputeFullV);
-
-    Eigen::MatrixXf V = svd_1st.matrixV();
-    Eigen::Matrix<float, 3, 3> m;
-    m << V(0,8), V(1,8), V(2,8),
-         V(3,8), V(4,8), V(5,8),
-         V(6,8), V(7,8), V(8,8);
-    
-    SvdInEight2nd svd_2nd(m, Eigen::ComputeFullU | Eigen::ComputeFullV);
-    
-    Eigen::MatrixXf diag = svd_2nd.singularValues().asDiagonal();
-    diag(2,2) = 0.0;
-    Eigen::Matrix<float, 3, 3> _F = svd_2nd.matrixU() * diag * svd_2nd.matrixV().transpose();
+      x0[i] = Eigen::Vector2f(pts0[i].x, pts0[i].y);
+      x1[i] = Eigen::Vector2f(pts1[i].x, pts1[i].y);
+    }
+    const Matrix33f _F = EightPoint<float>(x0, x1);
 
     eigen2cv(_F, F);
 
@@ -325,9 +447,36 @@ namespace Solver {
                    const std::vector<cv::Point2f>& v_obs_pts_c,
                    const cv::Mat& K) {
     cv::Mat cTw;
+    const int num = (int)std::min(v_landmarks_w.size(), v_obs_pts_c.size());
+    if(num < 6) {
+      return cTw;
+    }
 
+    Matrix33f eK;
+    cv2eigen(K, eK);
+    const Eigen::Matrix3d K_inv = eK.cast<double>().inverse();
+
+    std::vector<Eigen::Vector3d> v_pts_w(num);
+    std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> v_obs_n(num);
+    std::vector<int> v_idx(num);
+    for(int n = 0; n < num; ++n) {
+      v_pts_w[n] = Eigen::Vector3d(v_landmarks_w[n].x, v_landmarks_w[n].y, v_landmarks_w[n].z);
+      v_obs_n[n] = (K_inv * Eigen::Vector3d(v_obs_pts_c[n].x, v_obs_pts_c[n].y, 1.0)).head<2>();
+      v_idx[n] = n;
+    }
 
+    Eigen::Matrix3d R;
+    Eigen::Vector3d t;
+    if(!SolvePnPDLT(v_pts_w.data(), v_obs_n.data(), v_idx.data(), num, R, t)) {
+      return cTw;
+    }
+    RefinePoseGaussNewton(v_pts_w.data(), v_obs_n.data(), v_idx.data(), num, R, t);
 
+    Matrix34f eT;
+    eT.block<3,3>(0,0) = R.cast<float>();
+    eT.col(3) = t.cast<float>();
+    cTw = cv::Mat::eye(3,4,CV_32FC1);
+    eigen2cv(eT, cTw);
 
     return cTw;
   }
@@ -335,13 +484,362 @@ namespace Solver {
   cv::Mat SolvePnPRANSAC(const std::vector<cv::KeyPoint>& v_keypoints,
                          const std::vector<MapPoint>& v_mappoints,
                          const std::vector<MatchObsAndLdmk>& v_matches,
-                         std::vector<bool> vb_inliers) 
+                         const cv::Mat& K,
+                         std::vector<bool>& vb_inliers,
+                         int max_iteration, float threshold) 
   {
     cv::Mat cTw;
+    const int num = (int)v_matches.size();
+    vb_inliers.assign(num, false);
+
+    // P3P needs 3 points, DLT needs 6 points. Keep margin for safety.
+    const int min_num_matches = 12;
+    if(num < min_num_matches) {
+      return cTw;
+    }
+
+    Matrix33f eK;
+    cv2eigen(K, eK);
+    const Eigen::Matrix3d K_inv = eK.cast<double>().inverse();
+    const double fx = eK(0,0), fy = eK(1,1);
+    const double sq_threshold = (double)threshold*threshold;
+
+    // Everything used in the RANSAC loop is converted once here.
+    std::vector<Eigen::Vector3d> v_pts_w(num);
+    std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> v_obs_n(num);
+    for(int n = 0; n < num; ++n) {
+      const cv::Point3f pos = v_mappoints[v_matches[n].ldmk_id].GetPosition();
+      const cv::Point2f& pt = v_keypoints[v_matches[n].obs_id].pt;
+      v_pts_w[n] = Eigen::Vector3d(pos.x, pos.y, pos.z);
+      v_obs_n[n] = (K_inv * Eigen::Vector3d(pt.x, pt.y, 1.0)).head<2>();
+    }
+
+    std::mt19937 mt(std::random_device{}());
+    std::uniform_int_distribution<int> dist(0, num-1);
+
+    int best_score_inliers = -1;
+    Eigen::Matrix3d best_R = Eigen::Matrix3d::Identity();
+    Eigen::Vector3d best_t = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d v_R[4];
+    Eigen::Vector3d v_t[4];
+    Eigen::Matrix3d F, P_w;
+
+    int num_iteration = max_iteration;
+    for(int ransac_iter = 0; ransac_iter < num_iteration; ransac_iter++) {
+      int sample_idx[3];
+      sample_idx[0] = dist(mt);
+      do { sample_idx[1] = dist(mt); } while(sample_idx[1] == sample_idx[0]);
+      do { sample_idx[2] = dist(mt); } while(sample_idx[2] == sample_idx[0] || sample_idx[2] == sample_idx[1]);
+
+      for(int i = 0; i < 3; ++i) {
+        F.col(i) = Eigen::Vector3d(v_obs_n[sample_idx[i]].x(), v_obs_n[sample_idx[i]].y(), 1.0);
+        P_w.col(i) = v_pts_w[sample_idx[i]];
+      }
+
+      const int num_solutions = SolveP3P(F, P_w, v_R, v_t);
+      for(int s = 0; s < num_solutions; ++s) {
+        const int current_score_inliers
+          = CountPnPInliers(v_pts_w.data(), v_obs_n.data(), num, v_R[s], v_t[s], fx, fy, sq_threshold);
+        if(current_score_inliers > best_score_inliers) {
+          best_score_inliers = current_score_inliers;
+          best_R = v_R[s];
+          best_t = v_t[s];
+
+          // Adaptive number of iterations for 99% confidence
+          const double inlier_ratio = (double)best_score_inliers/num;
+          const double p_fail = 1.0 - inlier_ratio*inlier_ratio*inlier_ratio;
+          if(p_fail <= 1e-12) {
+            num_iteration = 0;
+          }
+          else {
+            const double needed = std::log(0.01)/std::log(p_fail);
+            num_iteration = std::min(max_iteration, (int)std::ceil(needed));
+          }
+        }
+      }
+    }
 
+    if(best_score_inliers < min_num_matches) {
+      return cTw;
+    }
+
+    // DLT on the inlier set, then nonlinear refinement
+    std::vector<bool> vb_best_inliers;
+    CountPnPInliers(v_pts_w.data(), v_obs_n.data(), num, best_R, best_t, fx, fy, sq_threshold, &vb_best_inliers);
+    std::vector<int> v_inlier_idx;
+    v_inlier_idx.reserve(best_score_inliers);
+    for(int n = 0; n < num; ++n) {
+      if(vb_best_inliers[n]) {
+        v_inlier_idx.push_back(n);
+      }
+    }
+
+    Eigen::Matrix3d R_dlt;
+    Eigen::Vector3d t_dlt;
+    if(SolvePnPDLT(v_pts_w.data(), v_obs_n.data(), v_inlier_idx.data(), (int)v_inlier_idx.size(), R_dlt, t_dlt)) {
+      const int dlt_score_inliers
+        = CountPnPInliers(v_pts_w.data(), v_obs_n.data(), num, R_dlt, t_dlt, fx, fy, sq_threshold);
+      if(dlt_score_inliers >= best_score_inliers) {
+        best_R = R_dlt;
+        best_t = t_dlt;
+      }
+    }
+
+    RefinePoseGaussNewton(v_pts_w.data(), v_obs_n.data(), v_inlier_idx.data(), (int)v_inlier_idx.size(),
+                          best_R, best_t);
+
+    CountPnPInliers(v_pts_w.data(), v_obs_n.data(), num, best_R, best_t, fx, fy, sq_threshold, &vb_inliers);
+
+    Matrix34f eT;
+    eT.block<3,3>(0,0) = best_R.cast<float>();
+    eT.col(3) = best_t.cast<float>();
+    cTw = cv::Mat::eye(3,4,CV_32FC1);
+    eigen2cv(eT, cTw);
 
     return cTw;
   }
 
+  int CountPnPInliers(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs_n, const int num,
+                      const Eigen::Matrix3d& R, const Eigen::Vector3d& t,
+                      const double fx, const double fy, const double sq_threshold,
+                      std::vector<bool>* p_vb_inliers)
+  {
+    if(p_vb_inliers) {
+      p_vb_inliers->assign(num, false);
+    }
+
+    int count = 0;
+    for(int n = 0; n < num; ++n) {
+      const Eigen::Vector3d pt_c = R * p_pts_w[n] + t;
+      if(pt_c.z() <= 0.0) {
+        continue;
+      }
+      const double du = fx*(pt_c.x()/pt_c.z() - p_obs_n[n].x());
+      const double dv = fy*(pt_c.y()/pt_c.z() - p_obs_n[n].y());
+      if(du*du + dv*dv < sq_threshold) {
+        ++count;
+        if(p_vb_inliers) {
+          (*p_vb_inliers)[n] = true;
+        }
+      }
+    }
+
+    return count;
+  }
+
+  int SolveP3P(const Eigen::Matrix3d& F, const Eigen::Matrix3d& P_w,
+               Eigen::Matrix3d v_R[4], Eigen::Vector3d v_t[4])
+  {
+    // Grunert's solution, notation follows Haralick et al. 1994.
+    // s2 = u*s1, s3 = v*s1 and v is a root of a quartic.
+    const Eigen::Vector3d f1 = F.col(0).normalized();
+    const Eigen::Vector3d f2 = F.col(1).normalized();
+    const Eigen::Vector3d f3 = F.col(2).normalized();
+    const double cos_alpha = f2.dot(f3);
+    const double cos_beta = f1.dot(f3);
+    const double cos_gamma = f1.dot(f2);
+
+    const double a2 = (P_w.col(1) - P_w.col(2)).squaredNorm();
+    const double b2 = (P_w.col(0) - P_w.col(2)).squaredNorm();
+    const double c2 = (P_w.col(0) - P_w.col(1)).squaredNorm();
+    if(a2 < 1e-12 || b2 < 1e-12 || c2 < 1e-12) {
+      return 0;
+    }
+
+    const double amc = (a2 - c2)/b2, apc = (a2 + c2)/b2;
+    const double bmc = (b2 - c2)/b2, bma = (b2 - a2)/b2;
+    const double ca2 = cos_alpha*cos_alpha, cb2 = cos_beta*cos_beta, cg2 = cos_gamma*cos_gamma;
+
+    double A[5];
+    A[4] = (amc - 1.0)*(amc - 1.0) - 4.0*c2/b2*ca2;
+    A[3] = 4.0*(amc*(1.0 - amc)*cos_beta - (1.0 - apc)*cos_alpha*cos_gamma + 2.0*c2/b2*ca2*cos_beta);
+    A[2] = 2.0*(amc*amc - 1.0 + 2.0*amc*amc*cb2 + 2.0*bmc*ca2
+                - 4.0*apc*cos_alpha*cos_beta*cos_gamma + 2.0*bma*cg2);
+    A[1] = 4.0*(-amc*(1.0 + amc)*cos_beta + 2.0*a2/b2*cg2*cos_beta - (1.0 - apc)*cos_alpha*cos_gamma);
+    A[0] = (1.0 + amc)*(1.0 + amc) - 4.0*a2/b2*cg2;
+    if(std::abs(A[4]) < 1e-12) {
+      return 0;
+    }
+
+    // Roots as eigenvalues of the companion matrix (fixed size, no allocation)
+    Eigen::Matrix4d C = Eigen::Matrix4d::Zero();
+    for(int i = 0; i < 4; ++i) {
+      C(0,i) = -A[3-i]/A[4];
+    }
+    C(1,0) = 1.0;
+    C(2,1) = 1.0;
+    C(3,2) = 1.0;
+    Eigen::EigenSolver<Eigen::Matrix4d> es(C, false);
+
+    int num_solutions = 0;
+    for(int k = 0; k < 4; ++k) {
+      const std::complex<double> root = es.eigenvalues()(k);
+      if(std::abs(root.imag()) > 1e-6*std::max(1.0, std::abs(root.real()))) {
+        continue;
+      }
+
+      // Polish by Newton steps
+      double v = root.real();
+      for(int it = 0; it < 3; ++it) {
+        const double p = (((A[4]*v + A[3])*v + A[2])*v + A[1])*v + A[0];
+        const double dp = ((4.0*A[4]*v + 3.0*A[3])*v + 2.0*A[2])*v + A[1];
+        if(std::abs(dp) < 1e-14) {
+          break;
+        }
+        v -= p/dp;
+      }
+      if(v <= 0.0) {
+        continue;
+      }
+
+      const double denom = 2.0*(cos_gamma - v*cos_alpha);
+      if(std::abs(denom) < 1e-12) {
+        continue;
+      }
+      const double u = ((-1.0 + amc)*v*v - 2.0*amc*cos_beta*v + 1.0 + amc)/denom;
+      if(u <= 0.0) {
+        continue;
+      }
+      const double s1_sq = c2/(1.0 + u*u - 2.0*u*cos_gamma);
+      if(s1_sq <= 0.0) {
+        continue;
+      }
+      const double s1 = std::sqrt(s1_sq);
+
+      Eigen::Matrix3d P_c;
+      P_c.col(0) = s1*f1;
+      P_c.col(1) = u*s1*f2;
+      P_c.col(2) = v*s1*f3;
+      AlignPoints3(P_w, P_c, v_R[num_solutions], v_t[num_solutions]);
+      ++num_solutions;
+    }
+
+    return num_solutions;
+  }
+
+  void AlignPoints3(const Eigen::Matrix3d& P_w, const Eigen::Matrix3d& P_c,
+                    Eigen::Matrix3d& R, Eigen::Vector3d& t)
+  {
+    const Eigen::Vector3d mean_w = P_w.rowwise().mean();
+    const Eigen::Vector3d mean_c = P_c.rowwise().mean();
+    const Eigen::Matrix3d H = (P_c.colwise() - mean_c) * (P_w.colwise() - mean_w).transpose();
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(H, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3d S = Eigen::Matrix3d::Identity();
+    if((svd.matrixU() * svd.matrixV().transpose()).determinant() < 0.0) {
+      S(2,2) = -1.0;
+    }
+    R = svd.matrixU() * S * svd.matrixV().transpose();
+    t = mean_c - R * mean_w;
+    return;
+  }
+
+  bool SolvePnPDLT(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs_n,
+                   const int* p_idx, const int num,
+                   Eigen::Matrix3d& R, Eigen::Vector3d& t)
+  {
+    if(num < 6) {
+      return false;
+    }
+
+    // Points are centered and scaled for conditioning.
+    Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+    for(int n = 0; n < num; ++n) {
+      mean += p_pts_w[p_idx[n]];
+    }
+    mean /= num;
+    double scale = 0.0;
+    for(int n = 0; n < num; ++n) {
+      scale += (p_pts_w[p_idx[n]] - mean).norm();
+    }
+    scale = (scale > 0.0) ? scale/num : 1.0;
+
+    // Accumulate A^T*A (12x12) instead of A (2N x 12)
+    Eigen::Matrix<double,12,12> M = Eigen::Matrix<double,12,12>::Zero();
+    Eigen::Matrix<double,12,1> a0, a1;
+    for(int n = 0; n < num; ++n) {
+      const Eigen::Vector3d X = (p_pts_w[p_idx[n]] - mean)/scale;
+      const double x = p_obs_n[p_idx[n]].x();
+      const double y = p_obs_n[p_idx[n]].y();
+      a0 << X.x(), X.y(), X.z(), 1.0, 0.0, 0.0, 0.0, 0.0, -x*X.x(), -x*X.y(), -x*X.z(), -x;
+      a1 << 0.0, 0.0, 0.0, 0.0, X.x(), X.y(), X.z(), 1.0, -y*X.x(), -y*X.y(), -y*X.z(), -y;
+      M.selfadjointView<Eigen::Lower>().rankUpdate(a0);
+      M.selfadjointView<Eigen::Lower>().rankUpdate(a1);
+    }
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double,12,12>> es(M.selfadjointView<Eigen::Lower>());
+    const Eigen::Matrix<double,12,1> p = es.eigenvectors().col(0);
+
+    Eigen::Matrix<double,3,4> P;
+    P << p(0), p(1), p(2),  p(3),
+         p(4), p(5), p(6),  p(7),
+         p(8), p(9), p(10), p(11);
+    if(P.block<3,3>(0,0).determinant() < 0.0) {
+      P *= -1.0;
+    }
+
+    // Project to SO(3) and recover the scale
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(P.block<3,3>(0,0), Eigen::ComputeFullU | Eigen::ComputeFullV);
+    R = svd.matrixU() * svd.matrixV().transpose();
+    const double lambda = svd.singularValues().mean()/scale;
+    if(lambda < 1e-12) {
+      return false;
+    }
+    t = P.col(3)/lambda - R*mean;
+
+    return true;
+  }
+
+  void RefinePoseGaussNewton(const Eigen::Vector3d* p_pts_w, const Eigen::Vector2d* p_obs_n,
+                             const int* p_idx, const int num,
+                             Eigen::Matrix3d& R, Eigen::Vector3d& t, const int max_iteration)
+  {
+    using Matrix66d = Eigen::Matrix<double,6,6>;
+    using Vector6d = Eigen::Matrix<double,6,1>;
+
+    for(int iter = 0; iter < max_iteration; ++iter) {
+      Matrix66d H = Matrix66d::Zero();
+      Vector6d g = Vector6d::Zero();
+      for(int n = 0; n < num; ++n) {
+        const Eigen::Vector3d RX = R * p_pts_w[p_idx[n]];
+        const Eigen::Vector3d pt_c = RX + t;
+        if(pt_c.z() <= 1e-9) {
+          continue;
+        }
+        const double inv_z = 1.0/pt_c.z();
+        const Eigen::Vector2d r(pt_c.x()*inv_z - p_obs_n[p_idx[n]].x(),
+                                pt_c.y()*inv_z - p_obs_n[p_idx[n]].y());
+
+        // Update is R <- exp(w)*R, t <- t + v, so the rotation block rotates RX only
+        Eigen::Matrix<double,2,3> J_proj;
+        J_proj << inv_z, 0.0, -pt_c.x()*inv_z*inv_z,
+                  0.0, inv_z, -pt_c.y()*inv_z*inv_z;
+        Eigen::Matrix3d skew_RX;
+        skew_RX <<     0.0, -RX.z(),  RX.y(),
+                    RX.z(),     0.0, -RX.x(),
+                   -RX.y(),  RX.x(),     0.0;
+        Eigen::Matrix<double,2,6> J;
+        J.block<2,3>(0,0) = -J_proj * skew_RX;
+        J.block<2,3>(0,3) = J_proj;
+
+        H.noalias() += J.transpose() * J;
+        g.noalias() += J.transpose() * r;
+      }
+
+      const Vector6d delta = H.ldlt().solve(-g);
+      const double theta = delta.head<3>().norm();
+      Eigen::Matrix3d dR = Eigen::Matrix3d::Identity();
+      if(theta > 1e-12) {
+        dR = Eigen::AngleAxisd(theta, delta.head<3>()/theta).toRotationMatrix();
+      }
+      R = dR * R;
+      t += delta.tail<3>();
+
+      if(delta.norm() < 1e-10) {
+        break;
+      }
+    }
+
+    return;
+  }
+
 }; // Solver
 }; // TS_SfM
@@ -2,10 +2,13 @@
 
 #include "Frame.h"
 #include "KPExtractor.h"
+#include "Undistorter.h"
 
 #include "Matcher.h"
 #include "Solver.h"
 #include "Optimizer.h"
+#include "PoseOptimizer.h"
+#include "LoopClosure.h"
 
 #include "Reconstructor.h"
 #include "Map.h"
@@ -15,15 +18,21 @@
 
 #include "Utils.h"
 
+#include <algorithm>
 #include <functional>
+#include <numeric>
+#include <tuple>
 
 namespace TS_SfM {
-  System::System(const std::string& str_config_file) : m_config_file(str_config_file) {
+  System::System(const std::string& str_config_file, const bool b_resume)
+    : m_config_file(str_config_file), m_b_resume(b_resume)
+  {
     std::pair<SystemConfig, Camera> _pair_config = ConfigLoader::LoadConfig(str_config_file);  
     m_config = _pair_config.first;
     m_camera = _pair_config.second;
 
     ConfigLoader::LoadInitializerConfig(m_initializer_config.num_frames, m_initializer_config.connect_distance, str_config_file);
+    m_triangulator_config = ConfigLoader::LoadTriangulatorConfig(str_config_file);
     
     m_vstr_image_names = ConfigLoader::ReadImagesInDir(m_config.str_path_to_images);
     const cv::Mat m_image = ConfigLoader::LoadImage(m_vstr_image_names[0]);
@@ -37,6 +46,13 @@ namespace TS_SfM {
 
     m_image_width = m_image.cols;
     m_image_height = m_image.rows;
+    m_p_undistorter.reset(new Undistorter(m_camera, m_image_width, m_image_height));
+    m_optimizer_config = ConfigLoader::LoadOptimizerConfig(str_config_file);
+    m_p_optimizer.reset(new Optimizer(m_optimizer_config, m_camera));
+    m_loop_config = ConfigLoader::LoadLoopConfig(str_config_file);
+    m_p_loop_closure.reset(new LoopClosure(m_loop_config, m_camera));
+    m_checkpoint_config = ConfigLoader::LoadCheckpointConfig(str_config_file);
+    m_p_checkpointer.reset(new Checkpointer(m_checkpoint_config, m_camera));
 
     ShowConfig();
     m_v_frames.reserve((int)m_vstr_image_names.size()); 
@@ -46,13 +62,15 @@ namespace TS_SfM {
       m_v_frames.push_back(frame);
     }
 
-    // Matcher::MatcherConfig m_matcher_config = ConfigLoader::LoadMatcherConfig(str_config_file);  
+    m_matcher_config = ConfigLoader::LoadMatcherConfig(str_config_file);
     m_p_extractor.reset(new KPExtractor(m_image_width, m_image_height,
                         ConfigLoader::LoadExtractorConfig(str_config_file)));
 
     m_p_map = std::make_shared<Map>();
     m_p_reconstructor.reset(new Reconstructor(str_config_file));
+    m_p_reconstructor->SetMap(m_p_map);
     m_p_viewer.reset(new Viewer());
+    m_p_viewer->SetMap(m_p_map);
   }
 
   System::~System() {
@@ -100,6 +118,7 @@ namespace TS_SfM {
     for (int i = 0; i < num_frames_in_initial_map; i++) {
       bool isOK = false;
       m_p_extractor = v_frames[i].Initialize(std::move(m_p_extractor), isOK);
+      v_frames[i].UndistortKeyPoints(*m_p_undistorter);
     }
     std::cout << " Done. " << std::endl;
 
@@ -120,6 +139,17 @@ namespace TS_SfM {
     return;
   }
 
+  void System::RestoreFrames(std::vector<Frame>& v_frames, const Checkpointer::Caches& caches)
+  {
+    for(size_t i = 0; i < caches.vv_kpts.size() && i < v_frames.size(); ++i) {
+      v_frames[i].RestoreFeatures(caches.vv_kpts[i], caches.v_descriptors[i]);
+      v_frames[i].UndistortKeyPoints(*m_p_undistorter);
+    }
+    std::cout << "[LOG] "
+              << "Features of " << caches.vv_kpts.size() << " frames are restored" << std::endl;
+    return;
+  }
+
   // Initialization is done in 3-view geometry
   int System::InitializeGlobalMap(std::vector<std::reference_wrapper<Frame>>& v_frames) {
     int num_map_points = -1; 
@@ -145,7 +175,7 @@ namespace TS_SfM {
     std::vector<bool> vb_mask;
     int score;
     Solver::SolveEpipolarConstraintRANSAC(frame_1st.GetImage(), frame_2nd.GetImage(),  
-                                          std::make_pair(frame_1st.GetKeyPoints(),frame_2nd.GetKeyPoints()),
+                                          std::make_pair(frame_1st.GetUndistortedKeyPoints(),frame_2nd.GetUndistortedKeyPoints()),
                                           v_matches_12, mF, vb_mask, score);
 
     // remain only inlier matches
@@ -164,7 +194,7 @@ namespace TS_SfM {
 
     // decompose E
     cv::Mat mE = mK.t() * mF * mK;
-    cv::Mat T_01 = Solver::DecomposeE(frame_1st.GetKeyPoints(), frame_2nd.GetKeyPoints(), v_matches_12, mK, mE);
+    cv::Mat T_01 = Solver::DecomposeE(frame_1st.GetUndistortedKeyPoints(), frame_2nd.GetUndistortedKeyPoints(), v_matches_12, mK, mE);
 
     // Triangulation
 
@@ -173,7 +203,8 @@ namespace TS_SfM {
     return num_map_points;
   }
 
-  System::InitialReconstruction System::FlexibleInitializeGlobalMap(std::vector<std::reference_wrapper<Frame>>& v_frames) {
+  System::InitialReconstruction System::FlexibleInitializeGlobalMap(std::vector<std::reference_wrapper<Frame>>& v_frames,
+                                                                    const Checkpointer::State* p_resume_state) {
     InitialReconstruction result;
     int num_map_points = -1; 
 
@@ -186,16 +217,78 @@ namespace TS_SfM {
       vvv_matches[i].resize(num_pair_frame);
     }
 
-    for(int i = 0; i < (int)vvv_matches.size()-1; ++i) {
-      for(int j = i; j < (int)vvv_matches[i].size(); ++j) {
-        if(i == j) continue;
-        std::vector<cv::DMatch> v_matches_ij = matcher.GetMatches(v_frames[i],v_frames[j]);
-        vvv_matches[i][j] = v_matches_ij;
-        std::vector<cv::DMatch> v_matches_ji = matcher.Inverse(v_matches_ij);
-        vvv_matches[j][i] = v_matches_ji;
+    if(p_resume_state) {
+      vvv_matches = p_resume_state->p_caches->vvv_matches;
+    }
+    else {
+      for(int i = 0; i < (int)vvv_matches.size()-1; ++i) {
+        for(int j = i; j < (int)vvv_matches[i].size(); ++j) {
+          if(i == j) continue;
+          std::vector<cv::DMatch> v_matches_ij = matcher.GetMatches(v_frames[i],v_frames[j]);
+
+          // only epipolar inliers feed the tracks, pairs that can't be verified are dropped
+          cv::Mat mF;
+          std::vector<bool> vb_mask;
+          int score;
+          std::vector<cv::DMatch> v_inlier_matches_ij;
+          if(Solver::SolveEpipolarConstraintRANSAC(v_frames[i].get().GetImage(), v_frames[j].get().GetImage(),
+                                                   std::make_pair(v_frames[i].get().GetUndistortedKeyPoints(),v_frames[j].get().GetUndistortedKeyPoints()),
+                                                   v_matches_ij, mF, vb_mask, score)) {
+            for(size_t k = 0; k < v_matches_ij.size(); ++k) {
+              if(vb_mask[k]) {
+                v_inlier_matches_ij.push_back(v_matches_ij[k]);
+              }
+            }
+          }
+          v_matches_ij.swap(v_inlier_matches_ij);
+          vvv_matches[i][j] = v_matches_ij;
+          std::vector<cv::DMatch> v_matches_ji = matcher.Inverse(v_matches_ij);
+          vvv_matches[j][i] = v_matches_ji;
+        }
       }
     }
 
+    // Features and matches are fixed from here, checkpoints share them.
+    std::shared_ptr<const Checkpointer::Caches> p_caches;
+    if(p_resume_state) {
+      p_caches = p_resume_state->p_caches;
+    }
+    else if(m_p_checkpointer->IsEnabled()) {
+      std::shared_ptr<Checkpointer::Caches> p_new_caches = std::make_shared<Checkpointer::Caches>();
+      for(int i = 0; i < num_pair_frame; ++i) {
+        p_new_caches->vv_kpts.push_back(v_frames[i].get().GetKeyPoints());
+        p_new_caches->v_descriptors.push_back(v_frames[i].get().GetDescriptors());
+      }
+      p_new_caches->vvv_matches = vvv_matches;
+      p_caches = p_new_caches;
+    }
+
+    // Feature tracks over all frames, recomputed from the matches on resume.
+    FeatureTracks feature_tracks;
+    feature_tracks.vv_kpts.resize(num_pair_frame);
+    std::vector<int> v_num_kpts(num_pair_frame);
+    for(int i = 0; i < num_pair_frame; ++i) {
+      feature_tracks.vv_kpts[i] = v_frames[i].get().GetUndistortedKeyPoints();
+      v_num_kpts[i] = (int)feature_tracks.vv_kpts[i].size();
+    }
+    TrackBuilder track_builder(v_num_kpts, m_triangulator_config.num_threads);
+    track_builder.AddMatches(vvv_matches);
+    feature_tracks.tracks = track_builder.Build();
+    const TrackBuilder::Tracks& tracks = feature_tracks.tracks;
+    std::vector<std::vector<int>>& vv_track_of_kpt = feature_tracks.vv_track_of_kpt;
+    vv_track_of_kpt.resize(num_pair_frame);
+    for(int i = 0; i < num_pair_frame; ++i) {
+      vv_track_of_kpt[i].assign(v_num_kpts[i], -1);
+    }
+    for(int track_id = 0; track_id < tracks.GetNumTracks(); ++track_id) {
+      const MatchInfo* p_track = tracks.GetTrack(track_id);
+      for(int n = 0; n < tracks.GetTrackLength(track_id); ++n) {
+        vv_track_of_kpt[p_track[n].frame_id][p_track[n].kpt_id] = track_id;
+      }
+    }
+    std::cout << "[LOG] " << tracks.GetNumTracks() << " tracks ("
+              << tracks.num_rejected << " inconsistent rejected)" << std::endl;
+
     // Compute Fundamental Matrix
     cv::Mat mK = (cv::Mat_<float>(3,3) << m_camera.f_fx, 0.0, m_camera.f_cx,
                                           0.0, m_camera.f_fy, m_camera.f_cy,
@@ -208,7 +301,16 @@ namespace TS_SfM {
 
     // Initialization using 2 views geometry
     // This is initializatio in initialization.
-    {
+    if(p_resume_state) {
+      // Registered keyframes and mappoints of the checkpoint, the local BA graph is rebuilt from them.
+      v_keyframes = p_resume_state->v_keyframes;
+      v_keyframes.resize(v_frames.size());
+      v_mappoints = p_resume_state->v_mappoints;
+      std::vector<std::reference_wrapper<KeyFrame>> ref_v_keyframes(v_keyframes.begin(), v_keyframes.end());
+      std::vector<std::reference_wrapper<MapPoint>> ref_v_mappoints(v_mappoints.begin(), v_mappoints.end());
+      m_p_optimizer->SetData(ref_v_keyframes, ref_v_mappoints);
+    }
+    else {
       const int src_frame_idx = center_frame_idx;
       const int dst_frame_idx = center_frame_idx + 1;
       Frame& src_frame = v_frames[src_frame_idx].get();
@@ -219,7 +321,7 @@ namespace TS_SfM {
       std::vector<bool> vb_mask;
       int score;
       Solver::SolveEpipolarConstraintRANSAC(src_frame.GetImage(), dst_frame.GetImage(),  
-                                            std::make_pair(src_frame.GetKeyPoints(),dst_frame.GetKeyPoints()),
+                                            std::make_pair(src_frame.GetUndistortedKeyPoints(),dst_frame.GetUndistortedKeyPoints()),
                                             v_matches, mF, vb_mask, score);
 
       std::vector<cv::DMatch> _v_matches = v_matches;
@@ -237,32 +339,44 @@ namespace TS_SfM {
 
       // decompose E
       cv::Mat mE = mK.t() * mF * mK;
-      cv::Mat T_01 = Solver::DecomposeE(src_frame.GetKeyPoints(), dst_frame.GetKeyPoints(), v_matches, mK, mE);
+      cv::Mat T_01 = Solver::DecomposeE(src_frame.GetUndistortedKeyPoints(), dst_frame.GetUndistortedKeyPoints(), v_matches, mK, mE);
       src_frame.SetMatchesToNew(v_matches);
       dst_frame.SetMatchesToOld(v_matches);
 
-      // Triangulation
-      std::vector<cv::Point3f> v_pts_3d = Solver::Triangulate(src_frame.GetKeyPoints(),
-                                                              dst_frame.GetKeyPoints(),
-                                                              v_matches, mK, T_01); 
-
       src_frame.SetPose(cv::Mat::eye(3,4,CV_32FC1));
       dst_frame.SetPose(T_01);
 
-      int _i = 0;
-      for(auto pt_3d : v_pts_3d) {
-        // std::cout << _i << "L"<< v_pts_3d.size() <<std::endl;
+      // Triangulation
+      // Tracks joining an inlier pair of src and dst, reduced to those 2 views since
+      // the other frames have no pose yet.
+      std::vector<std::vector<MatchInfo>> vv_tracks;
+      for(const cv::DMatch& match : v_matches) {
+        const int track_id = vv_track_of_kpt[src_frame_idx][match.queryIdx];
+        if(track_id < 0 || vv_track_of_kpt[dst_frame_idx][match.trainIdx] != track_id) {
+          continue;
+        }
+        vv_tracks.push_back({MatchInfo{src_frame.m_id, match.queryIdx}, MatchInfo{dst_frame.m_id, match.trainIdx}});
+      }
+      std::vector<cv::Mat> v_poses(num_pair_frame);
+      v_poses[src_frame_idx] = src_frame.GetPose();
+      v_poses[dst_frame_idx] = dst_frame.GetPose();
+      Solver::TriangulationResult triangulated
+        = Solver::TriangulateTracks(vv_tracks, feature_tracks.vv_kpts, v_poses, mK, m_triangulator_config);
+
+      for(size_t _i = 0; _i < vv_tracks.size(); ++_i) {
+        if(!triangulated.vb_valid[_i]) {
+          continue;
+        }
+        const cv::Point3f& pt_3d = triangulated.v_pts_3d[_i];
         MapPoint mappoint(pt_3d); 
-        cv::Mat desc = ChooseDescriptor(src_frame, dst_frame, pt_3d, v_matches[_i]);
+        const cv::DMatch match(vv_tracks[_i][0].kpt_id, vv_tracks[_i][1].kpt_id, 0.0);
+        cv::Mat desc = ChooseDescriptor(src_frame, dst_frame, pt_3d, match);
         mappoint.SetDescriptor(desc);
-        std::vector<MatchInfo> v_match_info(2);
-        v_match_info[0] = MatchInfo{src_frame.m_id, v_matches[_i].queryIdx};
-        v_match_info[1] = MatchInfo{dst_frame.m_id, v_matches[_i].trainIdx};
-        mappoint.SetMatchInfo(v_match_info);
+        mappoint.SetMatchInfo(vv_tracks[_i]);
         if(mappoint.Activate()) {
+          mappoint.m_id = (int)v_mappoints.size();
           v_mappoints.push_back(mappoint);
         }
-        _i++;
       }
 
       v_keyframes[src_frame_idx] = KeyFrame(src_frame);
@@ -271,16 +385,38 @@ namespace TS_SfM {
       {
         std::vector<std::reference_wrapper<KeyFrame>> ref_v_keyframes(v_keyframes.begin(), v_keyframes.end());
         std::vector<std::reference_wrapper<MapPoint>> ref_v_mappoints(v_mappoints.begin(), v_mappoints.end());
-         BAResult result = BundleAdjustmentBeta(ref_v_keyframes, ref_v_mappoints, m_camera);
+         if(m_optimizer_config.engine != Optimizer::G2O) {
+           BundleAdjustmentNative(ref_v_keyframes, ref_v_mappoints, m_camera, m_optimizer_config);
+         }
+         else {
+           BundleAdjustmentBeta(ref_v_keyframes, ref_v_mappoints, m_camera, m_optimizer_config);
+         }
+         // Later frames are optimized locally on this persistent graph.
+         m_p_optimizer->SetData(ref_v_keyframes, ref_v_mappoints);
       }
     }
 
+    // The map follows the registration from here, readers see it by snapshots.
+    {
+      std::lock_guard<std::mutex> lock(m_p_map->m_update_mtx);
+      m_p_map->Initialize(v_keyframes, v_mappoints);
+      m_p_map->PublishSnapshot();
+    }
+
     // Do initialization using Map build in 2-view reconstruction.
     {
       bool is_done = false;
-      for(int dist_from_center_to_src = 0; !is_done ;dist_from_center_to_src++) {
+      int num_registered = 0;
+      const int start_dist = p_resume_state ? p_resume_state->cursor_distance : 0;
+      for(int dist_from_center_to_src = start_dist; !is_done ;dist_from_center_to_src++) {
         const std::vector<int> v_direction = {1,-1}; // forward and backward
-        for(int direction : v_direction) {
+        for(int direction_idx = 0; direction_idx < (int)v_direction.size(); ++direction_idx) {
+          const int direction = v_direction[direction_idx];
+          // steps up to the cursor of the checkpoint are done
+          if(p_resume_state && dist_from_center_to_src == p_resume_state->cursor_distance
+             && direction_idx <= p_resume_state->cursor_direction) {
+            continue;
+          }
           int src_frame_idx = direction*dist_from_center_to_src + center_frame_idx;
           int dst_frame_idx = src_frame_idx + direction;
           std::cout << src_frame_idx << ":" << dst_frame_idx << std::endl;
@@ -296,15 +432,66 @@ namespace TS_SfM {
             continue;
           }
           ///////////////////////////////////////////////////////////////////
-          std::vector<std::vector<cv::DMatch>> v_matches_src_to_map;
+          // Register the frame which doesn't have pose yet.
+          const int new_frame_idx = v_keyframes[src_frame_idx].IsActivated() ? dst_frame_idx : src_frame_idx;
+          std::vector<std::vector<cv::DMatch>> v_matches_new_to_map;
           for(size_t idx_kf = 0; idx_kf < v_keyframes.size(); idx_kf++) {
             if (v_keyframes[idx_kf].IsActivated()) {
-              v_matches_src_to_map.push_back(vvv_matches[src_frame_idx][idx_kf]);
+              v_matches_new_to_map.push_back(vvv_matches[new_frame_idx][idx_kf]);
             }
           }
 
-          IncrementalSfM(v_keyframes, v_mappoints, v_frames[src_frame_idx], v_matches_src_to_map, m_initializer_config);
+          IncrementalSfM(v_keyframes, v_mappoints, v_frames[new_frame_idx], v_matches_new_to_map,
+                         feature_tracks, m_initializer_config);
 
+          // Fusion and culling on the map, mappoints and the local BA graph take the result.
+          for(const uint32_t mappoint_id : m_p_reconstructor->MaintainMap(m_camera)) {
+            if(mappoint_id >= v_mappoints.size()) {
+              continue;
+            }
+            m_p_optimizer->RemoveMapPoint((int)mappoint_id);
+            if(m_p_map->GetMapPoints().Contains(mappoint_id)) {
+              v_mappoints[mappoint_id] = m_p_map->GetMapPoint(mappoint_id);
+              m_p_optimizer->AddMapPoint(v_mappoints[mappoint_id], v_keyframes);
+            }
+            else {
+              // a removed id stays as an inactive point
+              MapPoint hole(cv::Point3f(0.0f, 0.0f, 0.0f));
+              hole.m_id = (int)mappoint_id;
+              v_mappoints[mappoint_id] = hole;
+            }
+          }
+
+          // The given loop is closed as soon as its second keyframe is registered.
+          const int loop_kf_idx = new_frame_idx == m_loop_config.end_id ? m_loop_config.start_id
+                                : new_frame_idx == m_loop_config.start_id ? m_loop_config.end_id : -1;
+          if(loop_kf_idx >= 0 && m_p_loop_closure->Close(v_keyframes, v_mappoints, *m_p_map,
+                                                         loop_kf_idx, new_frame_idx)) {
+            // Local BA continues from the corrected estimates.
+            std::vector<int> v_mappoint_ids(v_mappoints.size());
+            std::iota(v_mappoint_ids.begin(), v_mappoint_ids.end(), 0);
+            m_p_optimizer->SetKeyFrameEstimates(v_keyframes);
+            m_p_optimizer->SetMapPointEstimates(v_mappoints, v_mappoint_ids);
+
+            std::lock_guard<std::mutex> lock(m_p_map->m_update_mtx);
+            for(const KeyFrame& keyframe : v_keyframes) {
+              if(keyframe.IsActivated()) {
+                m_p_map->SetKeyFramePose(keyframe.m_id, keyframe.GetPose());
+              }
+            }
+            for(const MapPoint& mappoint : v_mappoints) {
+              if(m_p_map->GetMapPoints().Contains(mappoint.m_id)) {
+                m_p_map->SetMapPointPosition(mappoint.m_id, mappoint.GetPosition());
+              }
+            }
+            m_p_map->PublishSnapshot();
+          }
+
+          // The copy is the only cost for this thread, files are written in background.
+          if(m_p_checkpointer->IsDue(++num_registered)) {
+            m_p_checkpointer->Submit(std::unique_ptr<Checkpointer::State>(
+              new Checkpointer::State{dist_from_center_to_src, direction_idx, v_keyframes, v_mappoints, p_caches}));
+          }
         }
       }
     }
@@ -490,22 +677,208 @@ namespace TS_SfM {
                      std::vector<MapPoint>& v_mappoints, 
                      Frame& f,
                      const std::vector<std::vector<cv::DMatch>>& v_matches,
+                     const FeatureTracks& feature_tracks,
                      const InitializerConfig _config) {
 
     //1. Get matches between map and input frame using matches of keyframes
+    // Mappoint of a keyframe keypoint is looked up in the keypoint index of the map,
+    // whose ids are indices of v_mappoints.
+
+    const std::vector<cv::KeyPoint> v_kpts = f.GetUndistortedKeyPoints();
+    std::vector<bool> vb_assigned(v_kpts.size(), false);
+    std::vector<MatchObsAndLdmk> v_matches_to_map;
+    // candidates (distance, keypoint, mappoint) through every connected keyframe
+    std::vector<std::tuple<float, int, int>> v_candidates;
+    int match_idx = 0;
     for(size_t kf_idx = 0; kf_idx < v_keyframes.size(); kf_idx++) {
-      if(std::abs((int)kf_idx - f.m_id) == 0 && std::abs((int)kf_idx - f.m_id) > _config.connect_distance) {
+      if(!v_keyframes[kf_idx].IsActivated()) {
+        continue;
+      }
+      const std::vector<cv::DMatch>& v_matches_to_kf = v_matches[match_idx++];
+      if(std::abs(v_keyframes[kf_idx].m_id - f.m_id) > _config.connect_distance) {
+        continue;
+      }
+
+      for(const cv::DMatch& m : v_matches_to_kf) {
+        const uint32_t mappoint_id = m_p_map->GetMapPointObservedBy(v_keyframes[kf_idx].m_id, m.trainIdx);
+        if(mappoint_id < v_mappoints.size()) {
+          v_candidates.push_back(std::make_tuple(m.distance, m.queryIdx, (int)mappoint_id));
+        }
+      }
+    }
+    // one match per keypoint and per mappoint, the closest descriptors first
+    std::sort(v_candidates.begin(), v_candidates.end());
+    std::vector<bool> vb_mappoint_assigned(v_mappoints.size(), false);
+    for(const std::tuple<float, int, int>& candidate : v_candidates) {
+      const int kpt_id = std::get<1>(candidate);
+      const int mappoint_id = std::get<2>(candidate);
+      if(vb_assigned[kpt_id] || vb_mappoint_assigned[mappoint_id]) {
         continue;
       }
+      vb_assigned[kpt_id] = true;
+      vb_mappoint_assigned[mappoint_id] = true;
+      v_matches_to_map.push_back(MatchObsAndLdmk{kpt_id, mappoint_id});
     }
 
     //2. SolvePnP
+    cv::Mat mK = (cv::Mat_<float>(3,3) << m_camera.f_fx, 0.0, m_camera.f_cx,
+                                          0.0, m_camera.f_fy, m_camera.f_cy,
+                                          0.0,           0.0,           1.0);
+    std::vector<bool> vb_inliers;
+    cv::Mat cTw = Solver::SolvePnPRANSAC(v_kpts, v_mappoints, v_matches_to_map, mK, vb_inliers);
+    if(cTw.empty()) {
+      std::cout << "[Warning] Frame " << f.m_id << " couldn't be registered ("
+                << v_matches_to_map.size() << " matches to map).\n";
+      return 0;
+    }
+    f.SetPose(cTw);
+    // refine in pixel space against fixed mappoints, inliers are re-classified
+    PoseOptimizer(PoseOptimizer::DefaultConfig()).Optimize(f, v_mappoints, v_matches_to_map, m_camera, vb_inliers);
+
+    //Input frame is registered as keyframe and mappoints are inserted to map
+    v_keyframes[f.m_id] = KeyFrame(f);
+    m_p_optimizer->AddKeyFrame(v_keyframes[f.m_id]);
+
+    // Mappoints not matched through the keyframes are searched around their projection,
+    // candidates are taken from the voxels in the frustum
+    {
+      std::vector<bool> vb_matched(v_mappoints.size(), false);
+      for(const MatchObsAndLdmk& m : v_matches_to_map) {
+        vb_matched[m.ldmk_id] = true;
+      }
+      std::vector<uint32_t> v_projected_ids;
+      std::vector<cv::Point2f> v_projected_uvs;
+      m_p_map->GetMapPointsInFrustum(f.GetPose(), m_camera, m_image_width, m_image_height,
+                                     m_matcher_config.projection_max_depth, v_projected_ids, v_projected_uvs);
+      std::vector<uint32_t> v_candidate_ids;
+      std::vector<cv::Point2f> v_candidate_uvs;
+      for(size_t i = 0; i < v_projected_ids.size(); ++i) {
+        if(v_projected_ids[i] < vb_matched.size() && !vb_matched[v_projected_ids[i]]) {
+          v_candidate_ids.push_back(v_projected_ids[i]);
+          v_candidate_uvs.push_back(v_projected_uvs[i]);
+        }
+      }
+      const std::vector<MatchObsAndLdmk> v_projection_matches
+        = Matcher(m_matcher_config).SearchByProjection(m_p_map->GetMapPoints(), v_keyframes[f.m_id],
+                                                       v_candidate_ids, v_candidate_uvs, vb_assigned);
+      v_matches_to_map.insert(v_matches_to_map.end(), v_projection_matches.begin(), v_projection_matches.end());
+      vb_inliers.resize(v_matches_to_map.size(), true);
+      std::cout << "[LOG] " << v_projection_matches.size() << " matches by projection" << std::endl;
+    }
+
+    int num_inliers = 0;
+    std::vector<int> v_observed_mappoint_ids;
+    for(size_t i = 0; i < v_matches_to_map.size(); ++i) {
+      if(vb_inliers[i]) {
+        v_mappoints[v_matches_to_map[i].ldmk_id].SetMatchInfo(MatchInfo{f.m_id, v_matches_to_map[i].obs_id});
+        m_p_optimizer->AddObservation(v_matches_to_map[i].ldmk_id, v_keyframes[f.m_id], v_matches_to_map[i].obs_id);
+        v_observed_mappoint_ids.push_back(v_matches_to_map[i].ldmk_id);
+        ++num_inliers;
+      }
+    }
+    std::cout << "[LOG] Frame " << f.m_id << " is registered with "
+              << num_inliers << " / " << v_matches_to_map.size() << " inliers" << std::endl;
+
+    //3. Triangulate tracks of the new frame which have no mappoint yet, over the registered keyframes
+    std::vector<std::vector<MatchInfo>> vv_new_tracks;
+    std::vector<int> v_new_kpt_ids;
+    if(f.m_id < (int)feature_tracks.vv_track_of_kpt.size()) {
+      const std::vector<int>& v_track_of_kpt = feature_tracks.vv_track_of_kpt[f.m_id];
+      for(size_t kpt_id = 0; kpt_id < v_track_of_kpt.size(); ++kpt_id) {
+        const int track_id = v_track_of_kpt[kpt_id];
+        if(track_id < 0 || vb_assigned[kpt_id]) {
+          continue;
+        }
+        const MatchInfo* p_track = feature_tracks.tracks.GetTrack(track_id);
+        std::vector<MatchInfo> v_track;
+        bool has_mappoint = false;
+        for(int n = 0; n < feature_tracks.tracks.GetTrackLength(track_id) && !has_mappoint; ++n) {
+          const MatchInfo& m = p_track[n];
+          has_mappoint = m_p_map->GetMapPointObservedBy(m.frame_id, m.kpt_id) != MapPointArena::INVALID_ID;
+          if(m.frame_id < (int)v_keyframes.size() && v_keyframes[m.frame_id].IsActivated()) {
+            v_track.push_back(m);
+          }
+        }
+        if(!has_mappoint && v_track.size() >= 2) {
+          vv_new_tracks.push_back(v_track);
+          v_new_kpt_ids.push_back((int)kpt_id);
+        }
+      }
+    }
+
+    std::vector<cv::Mat> v_poses(v_keyframes.size());
+    for(size_t kf_idx = 0; kf_idx < v_keyframes.size(); ++kf_idx) {
+      if(v_keyframes[kf_idx].IsActivated()) {
+        v_poses[kf_idx] = v_keyframes[kf_idx].GetPose();
+      }
+    }
+    const Solver::TriangulationResult triangulated
+      = Solver::TriangulateTracks(vv_new_tracks, feature_tracks.vv_kpts, v_poses, mK, m_triangulator_config);
+    std::vector<int> v_new_mappoint_ids;
+    for(size_t i = 0; i < vv_new_tracks.size(); ++i) {
+      if(!triangulated.vb_valid[i]) {
+        continue;
+      }
+      MapPoint mappoint(triangulated.v_pts_3d[i]);
+      mappoint.SetDescriptor(f.GetDescriptors().row(v_new_kpt_ids[i]));
+      mappoint.SetMatchInfo(vv_new_tracks[i]);
+      if(mappoint.Activate()) {
+        mappoint.m_id = (int)v_mappoints.size();
+        v_mappoints.push_back(mappoint);
+        m_p_optimizer->AddMapPoint(v_mappoints.back(), v_keyframes);
+        v_observed_mappoint_ids.push_back(mappoint.m_id);
+        v_new_mappoint_ids.push_back(mappoint.m_id);
+      }
+    }
+    std::cout << "[LOG] " << v_new_mappoint_ids.size() << " / " << vv_new_tracks.size()
+              << " new tracks are triangulated" << std::endl;
 
-    //3. Perform BundleAdjustment
+    //4. The map takes the new keyframe, its observations and the new mappoints
+    {
+      std::lock_guard<std::mutex> lock(m_p_map->m_update_mtx);
+      m_p_map->AddKeyFrame(v_keyframes[f.m_id]);
+      for(size_t i = 0; i < v_matches_to_map.size(); ++i) {
+        if(vb_inliers[i]) {
+          m_p_map->AddObservation(v_matches_to_map[i].ldmk_id, MatchInfo{f.m_id, v_matches_to_map[i].obs_id});
+        }
+      }
+      for(const int mappoint_id : v_new_mappoint_ids) {
+        m_p_map->AddMapPoint(v_mappoints[mappoint_id]);
+      }
+    }
 
-    //Finally, input frame is registered as keyframe and mappoints are inserted to map
+    //5. Refine points seen from the new frame with fixed poses, then local BundleAdjustment
+    // over the new keyframe and its best covisible keyframes
+    RefineStructure(v_keyframes, v_mappoints, v_observed_mappoint_ids, m_camera, m_optimizer_config);
+    m_p_optimizer->SetMapPointEstimates(v_mappoints, v_observed_mappoint_ids);
+
+    std::vector<int> v_window_kf_ids
+      = m_p_map->GetCovisibilityGraph().GetBestCovisibleKeyFrames(f.m_id, m_optimizer_config.window_size - 1);
+    v_window_kf_ids.push_back(f.m_id);
+    m_p_optimizer->SetWindow(v_window_kf_ids);
+    const BAResult ba_result = m_p_optimizer->Run();
+    m_p_optimizer->UpdateData(v_keyframes, v_mappoints);
+    std::cout << "[LOG] Local BA : RMS error " << ba_result.initial_rms_error
+              << " -> " << ba_result.final_rms_error << " pixel" << std::endl;
+
+    //6. Estimates are applied to the map and published per registered frame
+    {
+      std::lock_guard<std::mutex> lock(m_p_map->m_update_mtx);
+      for(const int keyframe_id : m_p_optimizer->GetLocalKeyFrameIds()) {
+        m_p_map->SetKeyFramePose(keyframe_id, v_keyframes[keyframe_id].GetPose());
+      }
+      // points refined by RefineStructure only are not in the window
+      std::vector<int> v_moved_mappoint_ids = m_p_optimizer->GetLocalMapPointIds();
+      v_moved_mappoint_ids.insert(v_moved_mappoint_ids.end(), v_observed_mappoint_ids.begin(), v_observed_mappoint_ids.end());
+      for(const int mappoint_id : v_moved_mappoint_ids) {
+        if(m_p_map->GetMapPoints().Contains(mappoint_id)) {
+          m_p_map->SetMapPointPosition(mappoint_id, v_mappoints[mappoint_id].GetPosition());
+        }
+      }
+      m_p_map->PublishSnapshot();
+    }
 
-    return 0;
+    return num_inliers;
   }
 
   void System::Run() {
@@ -514,7 +887,29 @@ namespace TS_SfM {
               << std::endl;
 
 
-    InitializeFrames(m_v_frames, m_initializer_config.num_frames);
+    std::unique_ptr<Checkpointer::State> p_resume_state;
+    if(m_b_resume) {
+      p_resume_state.reset(new Checkpointer::State);
+      if(!Checkpointer::Load(m_checkpoint_config.directory, *p_resume_state)) {
+        std::cout << "[Warning] " << "Checkpoint cannot be resumed, processing starts over" << std::endl;
+        p_resume_state.reset();
+      }
+      // The checkpoint must be of the same frames as this run.
+      else if((int)p_resume_state->v_keyframes.size() != m_initializer_config.num_frames ||
+              m_initializer_config.num_frames > (int)m_v_frames.size())
+      {
+        std::cout << "[Warning] " << "Checkpoint has " << p_resume_state->v_keyframes.size() << " frames but "
+                  << m_initializer_config.num_frames << " are processed, processing starts over" << std::endl;
+        p_resume_state.reset();
+      }
+    }
+
+    if(p_resume_state) {
+      RestoreFrames(m_v_frames, *p_resume_state->p_caches);
+    }
+    else {
+      InitializeFrames(m_v_frames, m_initializer_config.num_frames);
+    }
 
     std::vector<Frame> v_ini_frames; v_ini_frames.reserve(m_initializer_config.num_frames);
     for(int i = 0; i < m_initializer_config.num_frames; ++i) {
@@ -524,10 +919,21 @@ namespace TS_SfM {
     InitializeGlobalMap(v_ini_frames);
 #else
     std::vector<std::reference_wrapper<Frame>> ref_v_ini_frames(v_ini_frames.begin(), v_ini_frames.end());
-    InitialReconstruction result = FlexibleInitializeGlobalMap(ref_v_ini_frames);
-    // Map is initialized here.
-    m_p_map->Initialize(result.v_keyframes, result.v_mappoints);
+    // Map is built and published along the reconstruction.
+    FlexibleInitializeGlobalMap(ref_v_ini_frames, p_resume_state.get());
+    // the last submitted checkpoint is complete before the map is packed and saved
+    m_p_checkpointer->Flush();
+    if(m_config.b_pack_keyframes) {
+      std::lock_guard<std::mutex> lock(m_p_map->m_update_mtx);
+      m_p_map->PackKeyFrames();
+    }
 
+    if(!m_config.str_map_file.empty()) {
+      std::lock_guard<std::mutex> lock(m_p_map->m_update_mtx);
+      if(m_p_map->Save(m_config.str_map_file, m_camera)) {
+        std::cout << "[LOG] " << "Map is saved to " << m_config.str_map_file << std::endl;
+      }
+    }
 #endif
 
     std::cout << "=============================" << std::endl;
@@ -0,0 +1,183 @@
+#include "TrackBuilder.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace TS_SfM {
+
+namespace {
+  // matches per task of the parallel union
+  const int MATCH_BLOCK_SIZE = 1 << 14;
+}
+
+  std::vector<std::vector<MatchInfo>> TrackBuilder::Tracks::ToVectors() const {
+    std::vector<std::vector<MatchInfo>> vv_tracks(GetNumTracks());
+    for(int i = 0; i < GetNumTracks(); ++i) {
+      vv_tracks[i].assign(GetTrack(i), GetTrack(i) + GetTrackLength(i));
+    }
+    return vv_tracks;
+  }
+
+  TrackBuilder::TrackBuilder(const std::vector<int>& v_num_keypoints, const int num_threads)
+    : m_num_threads(num_threads)
+  {
+    m_v_offsets.resize(v_num_keypoints.size() + 1);
+    m_v_offsets[0] = 0;
+    for(size_t i = 0; i < v_num_keypoints.size(); ++i) {
+      m_v_offsets[i+1] = m_v_offsets[i] + (uint32_t)std::max(0, v_num_keypoints[i]);
+    }
+
+    const uint32_t num_nodes = m_v_offsets.back();
+    m_p_parents.reset(new std::atomic<uint32_t>[num_nodes]);
+    ParallelFor(0, (int)num_nodes, [&](const int node) {
+      m_p_parents[node].store((uint32_t)node, std::memory_order_relaxed);
+    }, m_num_threads);
+  }
+
+  void TrackBuilder::AddMatches(const int frame_id_0, const int frame_id_1, const std::vector<cv::DMatch>& v_matches) {
+    if(frame_id_0 == frame_id_1 || frame_id_0 < 0 || frame_id_1 < 0 ||
+       frame_id_0 >= GetNumFrames() || frame_id_1 >= GetNumFrames()) {
+      return;
+    }
+    const uint32_t offset_0 = m_v_offsets[frame_id_0], num_kpts_0 = m_v_offsets[frame_id_0+1] - offset_0;
+    const uint32_t offset_1 = m_v_offsets[frame_id_1], num_kpts_1 = m_v_offsets[frame_id_1+1] - offset_1;
+    for(const cv::DMatch& match : v_matches) {
+      if((uint32_t)match.queryIdx >= num_kpts_0 || (uint32_t)match.trainIdx >= num_kpts_1) {
+        continue;
+      }
+      Union(offset_0 + match.queryIdx, offset_1 + match.trainIdx);
+    }
+  }
+
+  void TrackBuilder::AddMatches(const std::vector<std::vector<std::vector<cv::DMatch>>>& vvv_matches) {
+    // Pairs are concatenated and cut into blocks of equal size, so a few large pairs
+    // don't leave the other threads idle.
+    std::vector<std::pair<int, int>> v_pairs;
+    std::vector<long long> v_pair_offsets(1, 0);
+    for(int i = 0; i < (int)vvv_matches.size(); ++i) {
+      for(int j = 0; j < (int)vvv_matches[i].size(); ++j) {
+        if(i == j || vvv_matches[i][j].empty()) {
+          continue;
+        }
+        v_pairs.push_back(std::make_pair(i, j));
+        v_pair_offsets.push_back(v_pair_offsets.back() + (long long)vvv_matches[i][j].size());
+      }
+    }
+
+    const long long num_matches = v_pair_offsets.back();
+    const int num_blocks = (int)((num_matches + MATCH_BLOCK_SIZE - 1) / MATCH_BLOCK_SIZE);
+    ParallelFor(0, num_blocks, [&](const int block) {
+      const long long begin = (long long)block * MATCH_BLOCK_SIZE;
+      const long long end = std::min(num_matches, begin + MATCH_BLOCK_SIZE);
+      int pair_idx = (int)(std::upper_bound(v_pair_offsets.begin(), v_pair_offsets.end(), begin) - v_pair_offsets.begin()) - 1;
+      for(long long idx = begin; idx < end; ++pair_idx) {
+        const int frame_id_0 = v_pairs[pair_idx].first, frame_id_1 = v_pairs[pair_idx].second;
+        if(frame_id_0 >= GetNumFrames() || frame_id_1 >= GetNumFrames()) {
+          idx = std::min(end, v_pair_offsets[pair_idx+1]);
+          continue;
+        }
+        const std::vector<cv::DMatch>& v_matches = vvv_matches[frame_id_0][frame_id_1];
+        const uint32_t offset_0 = m_v_offsets[frame_id_0], num_kpts_0 = m_v_offsets[frame_id_0+1] - offset_0;
+        const uint32_t offset_1 = m_v_offsets[frame_id_1], num_kpts_1 = m_v_offsets[frame_id_1+1] - offset_1;
+        const long long pair_end = std::min(end, v_pair_offsets[pair_idx+1]);
+        for(; idx < pair_end; ++idx) {
+          const cv::DMatch& match = v_matches[idx - v_pair_offsets[pair_idx]];
+          if((uint32_t)match.queryIdx >= num_kpts_0 || (uint32_t)match.trainIdx >= num_kpts_1) {
+            continue;
+          }
+          Union(offset_0 + match.queryIdx, offset_1 + match.trainIdx);
+        }
+      }
+    }, m_num_threads);
+  }
+
+  TrackBuilder::Tracks TrackBuilder::Build(const int min_track_length) {
+    const int num_nodes = GetNumNodes();
+    const int num_frames = GetNumFrames();
+
+    std::vector<uint32_t> v_roots(num_nodes);
+    ParallelFor(0, num_nodes, [&](const int node) {
+      v_roots[node] = Find((uint32_t)node);
+    }, m_num_threads);
+
+    // Size of each component and whether a frame appears twice in it.
+    // Nodes are visited in ascending order of frame_id, so a repeated frame is always the last one seen.
+    std::vector<int> v_sizes(num_nodes, 0);
+    std::vector<int> v_last_frame(num_nodes, -1);
+    std::vector<char> vb_inconsistent(num_nodes, 0);
+    for(int frame_id = 0; frame_id < num_frames; ++frame_id) {
+      for(uint32_t node = m_v_offsets[frame_id]; node < m_v_offsets[frame_id+1]; ++node) {
+        const uint32_t root = v_roots[node];
+        ++v_sizes[root];
+        if(v_last_frame[root] == frame_id) {
+          vb_inconsistent[root] = 1;
+        }
+        v_last_frame[root] = frame_id;
+      }
+    }
+
+    // v_last_frame is reused as the write position of each emitted track
+    Tracks tracks;
+    tracks.v_offsets.push_back(0);
+    std::vector<int>& v_write_pos = v_last_frame;
+    for(int node = 0; node < num_nodes; ++node) {
+      v_write_pos[node] = -1;
+      if(v_roots[node] != (uint32_t)node || v_sizes[node] < std::max(2, min_track_length)) {
+        continue;
+      }
+      if(vb_inconsistent[node]) {
+        ++tracks.num_rejected;
+        continue;
+      }
+      v_write_pos[node] = tracks.v_offsets.back();
+      tracks.v_offsets.push_back(tracks.v_offsets.back() + v_sizes[node]);
+    }
+
+    tracks.v_observations.resize(tracks.v_offsets.back());
+    for(int frame_id = 0; frame_id < num_frames; ++frame_id) {
+      for(uint32_t node = m_v_offsets[frame_id]; node < m_v_offsets[frame_id+1]; ++node) {
+        int& write_pos = v_write_pos[v_roots[node]];
+        if(write_pos >= 0) {
+          tracks.v_observations[write_pos++] = MatchInfo{frame_id, (int)(node - m_v_offsets[frame_id])};
+        }
+      }
+    }
+
+    return tracks;
+  }
+
+  uint32_t TrackBuilder::Find(uint32_t node) {
+    while(true) {
+      uint32_t parent = m_p_parents[node].load(std::memory_order_relaxed);
+      if(parent == node) {
+        return node;
+      }
+      const uint32_t grand_parent = m_p_parents[parent].load(std::memory_order_relaxed);
+      if(parent != grand_parent) {
+        // path halving, it is fine to lose this race since the parent only moves closer to the root
+        m_p_parents[node].compare_exchange_weak(parent, grand_parent, std::memory_order_relaxed);
+      }
+      node = grand_parent;
+    }
+  }
+
+  void TrackBuilder::Union(uint32_t node_0, uint32_t node_1) {
+    while(true) {
+      node_0 = Find(node_0);
+      node_1 = Find(node_1);
+      if(node_0 == node_1) {
+        return;
+      }
+      // the larger root is linked under the smaller one
+      if(node_0 < node_1) {
+        std::swap(node_0, node_1);
+      }
+      uint32_t expected = node_0;
+      if(m_p_parents[node_0].compare_exchange_strong(expected, node_1)) {
+        return;
+      }
+    }
+  }
+
+} // namespace
@@ -0,0 +1,121 @@
+#include "Undistorter.h"
+
+#include <cmath>
+
+namespace TS_SfM {
+  Undistorter::Undistorter(const Camera& cam,
+                           const unsigned int image_width,
+                           const unsigned int image_height,
+                           const int step)
+    : m_camera(cam), m_step(std::max(1, step))
+  {
+    m_has_distortion = (cam.f_k1 != 0.0 || cam.f_k2 != 0.0 || cam.f_p1 != 0.0 ||
+                        cam.f_p2 != 0.0 || cam.f_k3 != 0.0);
+
+    m_lut_width = (int)image_width/m_step + 2;
+    m_lut_height = (int)image_height/m_step + 2;
+    if(!m_has_distortion) {
+      // (u - cx)/fx is used directly.
+      return;
+    }
+
+    m_v_lut_x.resize(m_lut_width * m_lut_height);
+    m_v_lut_y.resize(m_lut_width * m_lut_height);
+    for(int r = 0; r < m_lut_height; ++r) {
+      for(int c = 0; c < m_lut_width; ++c) {
+        const cv::Point2f pt_n = UndistortIteratively(m_camera, cv::Point2f((float)(c*m_step), (float)(r*m_step)));
+        m_v_lut_x[r*m_lut_width + c] = pt_n.x;
+        m_v_lut_y[r*m_lut_width + c] = pt_n.y;
+      }
+    }
+  }
+
+  static void Distort(const Camera& cam, const double x, const double y, double& xd, double& yd)
+  {
+    const double r2 = x*x + y*y;
+    const double radial = 1.0 + ((cam.f_k3*r2 + cam.f_k2)*r2 + cam.f_k1)*r2;
+    xd = x*radial + 2.0*cam.f_p1*x*y + cam.f_p2*(r2 + 2.0*x*x);
+    yd = y*radial + cam.f_p1*(r2 + 2.0*y*y) + 2.0*cam.f_p2*x*y;
+    return;
+  }
+
+  cv::Point2f Undistorter::UndistortIteratively(const Camera& cam, const cv::Point2f& pt,
+                                                const int max_iteration)
+  {
+    const double x0 = (pt.x - cam.f_cx)/cam.f_fx;
+    const double y0 = (pt.y - cam.f_cy)/cam.f_fy;
+
+    // Fixed point iteration (same as cv::undistortPoints) for initial guess
+    double x = x0, y = y0;
+    for(int i = 0; i < max_iteration; ++i) {
+      const double r2 = x*x + y*y;
+      const double icdist = 1.0/(1.0 + ((cam.f_k3*r2 + cam.f_k2)*r2 + cam.f_k1)*r2);
+      const double dx = 2.0*cam.f_p1*x*y + cam.f_p2*(r2 + 2.0*x*x);
+      const double dy = cam.f_p1*(r2 + 2.0*y*y) + 2.0*cam.f_p2*x*y;
+      x = (x0 - dx)*icdist;
+      y = (y0 - dy)*icdist;
+    }
+
+    // It converges slowly on the border with strong distortion, so polish by Newton steps.
+    // This runs only while building the table.
+    const double eps = 1e-6;
+    for(int i = 0; i < 5; ++i) {
+      double xd, yd, xd_x, yd_x, xd_y, yd_y;
+      Distort(cam, x, y, xd, yd);
+      Distort(cam, x + eps, y, xd_x, yd_x);
+      Distort(cam, x, y + eps, xd_y, yd_y);
+      const double j00 = (xd_x - xd)/eps, j01 = (xd_y - xd)/eps;
+      const double j10 = (yd_x - yd)/eps, j11 = (yd_y - yd)/eps;
+      const double det = j00*j11 - j01*j10;
+      if(std::abs(det) < 1e-12) {
+        break;
+      }
+      const double ex = xd - x0, ey = yd - y0;
+      x -= ( j11*ex - j01*ey)/det;
+      y -= (-j10*ex + j00*ey)/det;
+    }
+
+    return cv::Point2f((float)x, (float)y);
+  }
+
+  cv::Point2f Undistorter::UndistortToNormalized(const cv::Point2f& pt) const
+  {
+    if(!m_has_distortion) {
+      return cv::Point2f((pt.x - m_camera.f_cx)/m_camera.f_fx, (pt.y - m_camera.f_cy)/m_camera.f_fy);
+    }
+
+    const float gx = std::min(std::max(pt.x/m_step, 0.0f), (float)(m_lut_width - 1) - 1e-3f);
+    const float gy = std::min(std::max(pt.y/m_step, 0.0f), (float)(m_lut_height - 1) - 1e-3f);
+    const int c = (int)gx;
+    const int r = (int)gy;
+    const float ax = gx - c;
+    const float ay = gy - r;
+
+    const int i00 = r*m_lut_width + c;
+    const int i01 = i00 + 1;
+    const int i10 = i00 + m_lut_width;
+    const int i11 = i10 + 1;
+    const float x = (1.0f-ay)*((1.0f-ax)*m_v_lut_x[i00] + ax*m_v_lut_x[i01])
+                  + ay*((1.0f-ax)*m_v_lut_x[i10] + ax*m_v_lut_x[i11]);
+    const float y = (1.0f-ay)*((1.0f-ax)*m_v_lut_y[i00] + ax*m_v_lut_y[i01])
+                  + ay*((1.0f-ax)*m_v_lut_y[i10] + ax*m_v_lut_y[i11]);
+
+    return cv::Point2f(x, y);
+  }
+
+  void Undistorter::UndistortKeyPoints(const std::vector<cv::KeyPoint>& v_kpts,
+                                       std::vector<cv::Point2f>& v_normalized_pts,
+                                       std::vector<cv::KeyPoint>& v_undist_kpts) const
+  {
+    v_normalized_pts.resize(v_kpts.size());
+    v_undist_kpts = v_kpts;
+    for(size_t i = 0; i < v_kpts.size(); ++i) {
+      const cv::Point2f pt_n = UndistortToNormalized(v_kpts[i].pt);
+      v_normalized_pts[i] = pt_n;
+      v_undist_kpts[i].pt = cv::Point2f(m_camera.f_fx*pt_n.x + m_camera.f_cx,
+                                        m_camera.f_fy*pt_n.y + m_camera.f_cy);
+    }
+    return;
+  }
+
+} // namespace
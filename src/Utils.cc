@@ -52,16 +52,40 @@ namespace TS_SfM {
   }
 
   Eigen::Vector2d ProjectToImage(const cv::Mat& K, const cv::Mat& cTw, const cv::Point3f& pt) {
-    Eigen::Vector2d projected_point;
-    
-    cv::Mat _pt_on_map = (cv::Mat_<double>(4,1) << pt.x, pt.y, pt.z, 1.0);
-    cv::Mat _pt = K * cTw.rowRange(0,3) * _pt_on_map;
+    const cv::Matx33d K_d = K;
+    const cv::Matx34d cTw_d = cTw.rowRange(0,3);
+    const cv::Vec3d pt_img = K_d * (cTw_d * cv::Vec4d(pt.x, pt.y, pt.z, 1.0));
 
-    projected_point(0) = _pt_on_map.at<double>(0)/_pt_on_map.at<double>(3);
-    projected_point(1) = _pt_on_map.at<double>(1)/_pt_on_map.at<double>(3);
-    projected_point(2) = _pt_on_map.at<double>(2)/_pt_on_map.at<double>(3);
+    return Eigen::Vector2d(pt_img[0]/pt_img[2], pt_img[1]/pt_img[2]);
+  }
 
-    return projected_point;
+  int ProjectPoints(const Eigen::Matrix<float,3,4>& cTw, const float fx, const float fy, const float cx, const float cy,
+                    const int width, const int height, const float min_depth, const float max_depth,
+                    const int num_points,
+                    const float* p_x, const float* p_y, const float* p_z,
+                    float* p_u, float* p_v, unsigned char* pb_visible)
+  {
+    const float r00 = cTw(0,0), r01 = cTw(0,1), r02 = cTw(0,2), t0 = cTw(0,3);
+    const float r10 = cTw(1,0), r11 = cTw(1,1), r12 = cTw(1,2), t1 = cTw(1,3);
+    const float r20 = cTw(2,0), r21 = cTw(2,1), r22 = cTw(2,2), t2 = cTw(2,3);
+    const float f_width = (float)width, f_height = (float)height;
+
+    // branch free, so the loop is vectorized
+    int num_visible = 0;
+    for(int i = 0; i < num_points; ++i) {
+      const float x = r00*p_x[i] + r01*p_y[i] + r02*p_z[i] + t0;
+      const float y = r10*p_x[i] + r11*p_y[i] + r12*p_z[i] + t1;
+      const float z = r20*p_x[i] + r21*p_y[i] + r22*p_z[i] + t2;
+      const float inv_z = 1.0f / (z > min_depth ? z : 1.0f);
+      const float u = fx*x*inv_z + cx;
+      const float v = fy*y*inv_z + cy;
+      const unsigned char b_visible = (z > min_depth) & (z <= max_depth) & (u >= 0.0f) & (u < f_width) & (v >= 0.0f) & (v < f_height);
+      p_u[i] = u;
+      p_v[i] = v;
+      pb_visible[i] = b_visible;
+      num_visible += b_visible;
+    }
+    return num_visible;
   }
 
   cv::Mat Inverse3x4(const cv::Mat& _pose) {
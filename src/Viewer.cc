@@ -1,4 +1,5 @@
 #include "Viewer.h"
+#include "Map.h"
 
 namespace TS_SfM {
 
@@ -60,6 +61,16 @@ namespace TS_SfM {
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        if(m_p_map) {
+          // one consistent version per frame
+          const std::shared_ptr<const MapSnapshot> p_snapshot = m_p_map->GetSnapshot();
+          ImGui::Begin("Map");
+          ImGui::Text("version %llu", (unsigned long long)p_snapshot->version);
+          ImGui::Text("keyframes %d", (int)p_snapshot->p_keyframes->size());
+          ImGui::Text("mappoints %d", p_snapshot->num_mappoints);
+          ImGui::End();
+        }
+
         // Rendering
         ImGui::Render();
         int display_w, display_h;
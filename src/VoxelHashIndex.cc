@@ -0,0 +1,210 @@
+#include "VoxelHashIndex.h"
+
+#include <Eigen/Geometry>
+
+#include <algorithm>
+#include <cmath>
+
+namespace TS_SfM {
+
+namespace {
+  // 21 bits per axis
+  const int COORD_BITS = 21;
+  const int COORD_OFFSET = 1 << (COORD_BITS - 1);
+  const long long COORD_MASK = (1LL << COORD_BITS) - 1;
+}
+
+  const VoxelHashIndex::VoxelKey VoxelHashIndex::INVALID_KEY;
+
+  VoxelHashIndex::VoxelHashIndex(const float voxel_size)
+    : m_voxel_size(voxel_size), m_num_points(0)
+  {
+  }
+
+  void VoxelHashIndex::Insert(const uint32_t id, const float x, const float y, const float z) {
+    if(id < m_v_id_to_key.size() && m_v_id_to_key[id] != INVALID_KEY) {
+      Update(id, x, y, z);
+      return;
+    }
+    if(id >= m_v_id_to_key.size()) {
+      m_v_id_to_key.resize(id + 1, INVALID_KEY);
+    }
+    const VoxelKey key = ToKey(x, y, z);
+    m_map_voxels[key].push_back(Entry{id, x, y, z});
+    m_v_id_to_key[id] = key;
+    ++m_num_points;
+  }
+
+  void VoxelHashIndex::Build(const std::vector<Entry>& v_entries) {
+    Clear();
+    uint32_t max_id = 0;
+    for(const Entry& entry : v_entries) {
+      max_id = std::max(max_id, entry.id);
+    }
+    if(!v_entries.empty()) {
+      m_v_id_to_key.assign(max_id + 1, INVALID_KEY);
+    }
+    // at most one voxel per point, so the table is never rehashed
+    m_map_voxels.reserve(v_entries.size());
+    for(const Entry& entry : v_entries) {
+      const VoxelKey key = ToKey(entry.x, entry.y, entry.z);
+      m_map_voxels[key].push_back(entry);
+      m_v_id_to_key[entry.id] = key;
+    }
+    m_num_points = (int)v_entries.size();
+  }
+
+  bool VoxelHashIndex::Remove(const uint32_t id) {
+    if(id >= m_v_id_to_key.size() || m_v_id_to_key[id] == INVALID_KEY) {
+      return false;
+    }
+    auto itr = m_map_voxels.find(m_v_id_to_key[id]);
+    std::vector<Entry>& v_entries = itr->second;
+    for(size_t i = 0; i < v_entries.size(); ++i) {
+      if(v_entries[i].id == id) {
+        v_entries[i] = v_entries.back();
+        v_entries.pop_back();
+        break;
+      }
+    }
+    if(v_entries.empty()) {
+      m_map_voxels.erase(itr);
+    }
+    m_v_id_to_key[id] = INVALID_KEY;
+    --m_num_points;
+    return true;
+  }
+
+  void VoxelHashIndex::Update(const uint32_t id, const float x, const float y, const float z) {
+    if(id >= m_v_id_to_key.size() || m_v_id_to_key[id] == INVALID_KEY) {
+      Insert(id, x, y, z);
+      return;
+    }
+    const VoxelKey key = ToKey(x, y, z);
+    if(key != m_v_id_to_key[id]) {
+      Remove(id);
+      Insert(id, x, y, z);
+      return;
+    }
+    for(Entry& entry : m_map_voxels[key]) {
+      if(entry.id == id) {
+        entry = Entry{id, x, y, z};
+        break;
+      }
+    }
+  }
+
+  void VoxelHashIndex::Clear() {
+    m_map_voxels.clear();
+    m_v_id_to_key.clear();
+    m_num_points = 0;
+  }
+
+  void VoxelHashIndex::QueryRadius(const Eigen::Vector3f& center, const float radius,
+                                   std::vector<Entry>& v_entries) const
+  {
+    v_entries.clear();
+    const Eigen::Vector3i min_coord(ToIndex(center.x() - radius), ToIndex(center.y() - radius), ToIndex(center.z() - radius));
+    const Eigen::Vector3i max_coord(ToIndex(center.x() + radius), ToIndex(center.y() + radius), ToIndex(center.z() + radius));
+    const float sq_radius = radius * radius;
+    ForEachVoxel(min_coord, max_coord, [&](const VoxelKey, const std::vector<Entry>& v_voxel_entries) {
+      for(const Entry& entry : v_voxel_entries) {
+        const float dx = entry.x - center.x(), dy = entry.y - center.y(), dz = entry.z - center.z();
+        if(dx*dx + dy*dy + dz*dz <= sq_radius) {
+          v_entries.push_back(entry);
+        }
+      }
+    });
+  }
+
+  void VoxelHashIndex::QueryFrustum(const Frustum& frustum, std::vector<Entry>& v_entries) const {
+    v_entries.clear();
+
+    // Inward normals of the side planes through the camera center, in camera frame.
+    const float u_min = -frustum.cx / frustum.fx, u_max = (frustum.width - frustum.cx) / frustum.fx;
+    const float v_min = -frustum.cy / frustum.fy, v_max = (frustum.height - frustum.cy) / frustum.fy;
+    const Eigen::Vector3f v_corner_rays[4] = {Eigen::Vector3f(u_min, v_min, 1.0f), Eigen::Vector3f(u_max, v_min, 1.0f),
+                                              Eigen::Vector3f(u_max, v_max, 1.0f), Eigen::Vector3f(u_min, v_max, 1.0f)};
+    Eigen::Vector3f v_normals[4];
+    for(int i = 0; i < 4; ++i) {
+      v_normals[i] = v_corner_rays[i].cross(v_corner_rays[(i+1)%4]).normalized();
+    }
+
+    // Bounding box of the frustum in world frame
+    const Eigen::Matrix3f Rt = frustum.R.transpose();
+    const Eigen::Vector3f camera_center = -Rt * frustum.t;
+    Eigen::Vector3f min_pt = camera_center, max_pt = camera_center;
+    for(const Eigen::Vector3f& ray : v_corner_rays) {
+      const Eigen::Vector3f far_corner = Rt * (frustum.max_depth * ray) + camera_center;
+      min_pt = min_pt.cwiseMin(far_corner);
+      max_pt = max_pt.cwiseMax(far_corner);
+    }
+    const Eigen::Vector3i min_coord(ToIndex(min_pt.x()), ToIndex(min_pt.y()), ToIndex(min_pt.z()));
+    const Eigen::Vector3i max_coord(ToIndex(max_pt.x()), ToIndex(max_pt.y()), ToIndex(max_pt.z()));
+
+    // A voxel is kept if its bounding sphere touches the frustum.
+    const float margin = 0.5f * std::sqrt(3.0f) * m_voxel_size;
+    ForEachVoxel(min_coord, max_coord, [&](const VoxelKey key, const std::vector<Entry>& v_voxel_entries) {
+      const Eigen::Vector3f center_w = (ToCoord(key).cast<float>() + Eigen::Vector3f::Constant(0.5f)) * m_voxel_size;
+      const Eigen::Vector3f center_c = frustum.R * center_w + frustum.t;
+      if(center_c.z() < frustum.min_depth - margin || center_c.z() > frustum.max_depth + margin) {
+        return;
+      }
+      for(int i = 0; i < 4; ++i) {
+        if(v_normals[i].dot(center_c) < -margin) {
+          return;
+        }
+      }
+      v_entries.insert(v_entries.end(), v_voxel_entries.begin(), v_voxel_entries.end());
+    });
+  }
+
+  template<typename Func>
+  void VoxelHashIndex::ForEachVoxel(const Eigen::Vector3i& min_coord, const Eigen::Vector3i& max_coord, Func func) const {
+    const Eigen::Vector3i extent = max_coord - min_coord + Eigen::Vector3i::Ones();
+    const double num_box_voxels = (double)extent.x() * extent.y() * extent.z();
+    // Large boxes are cheaper to answer by visiting the occupied voxels.
+    if(num_box_voxels > (double)m_map_voxels.size()) {
+      for(const auto& voxel : m_map_voxels) {
+        const Eigen::Vector3i coord = ToCoord(voxel.first);
+        if((coord.array() >= min_coord.array()).all() && (coord.array() <= max_coord.array()).all()) {
+          func(voxel.first, voxel.second);
+        }
+      }
+      return;
+    }
+    for(int ix = min_coord.x(); ix <= max_coord.x(); ++ix) {
+      for(int iy = min_coord.y(); iy <= max_coord.y(); ++iy) {
+        for(int iz = min_coord.z(); iz <= max_coord.z(); ++iz) {
+          const VoxelKey key = ToKey(ix, iy, iz);
+          auto itr = m_map_voxels.find(key);
+          if(itr != m_map_voxels.end()) {
+            func(key, itr->second);
+          }
+        }
+      }
+    }
+  }
+
+  VoxelHashIndex::VoxelKey VoxelHashIndex::ToKey(const int ix, const int iy, const int iz) const {
+    return (((long long)(ix + COORD_OFFSET) & COORD_MASK) << (2*COORD_BITS)) |
+           (((long long)(iy + COORD_OFFSET) & COORD_MASK) << COORD_BITS) |
+           ((long long)(iz + COORD_OFFSET) & COORD_MASK);
+  }
+
+  VoxelHashIndex::VoxelKey VoxelHashIndex::ToKey(const float x, const float y, const float z) const {
+    return ToKey(ToIndex(x), ToIndex(y), ToIndex(z));
+  }
+
+  Eigen::Vector3i VoxelHashIndex::ToCoord(const VoxelKey key) const {
+    return Eigen::Vector3i((int)((key >> (2*COORD_BITS)) & COORD_MASK) - COORD_OFFSET,
+                           (int)((key >> COORD_BITS) & COORD_MASK) - COORD_OFFSET,
+                           (int)(key & COORD_MASK) - COORD_OFFSET);
+  }
+
+  int VoxelHashIndex::ToIndex(const float v) const {
+    const float index = std::floor(v / m_voxel_size);
+    return (int)std::max(-(float)COORD_OFFSET, std::min((float)(COORD_OFFSET - 1), index));
+  }
+
+} // namespace